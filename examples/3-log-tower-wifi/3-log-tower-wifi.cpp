@@ -19,8 +19,9 @@ void setup() {
 void loop() {
     delay(20000);
     
+    // Reuses the last scan if it is recent enough, such as one made for the loc event
     LocationFusionRK::WAPList aps;
-    aps.scan();
+    LocationFusionRK::instance().getRecentScan(aps, 30s);
     Variant apVariant;
     aps.toVariant(apVariant);
 
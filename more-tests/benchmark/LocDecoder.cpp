@@ -0,0 +1,156 @@
+#include "LocDecoder.h"
+
+// Compact record sizes, see LocationFusionRK::PayloadEncoding
+static const size_t WAP_RECORD_SIZE = 8;
+static const size_t TOWER_RECORD_SIZE = 20;
+
+bool LocDecoder::decodeBase64(const char *str, std::vector<uint8_t> &data) {
+    data.clear();
+
+    uint32_t value = 0;
+    int bits = 0;
+    size_t padding = 0;
+    size_t len = strlen(str);
+    if (len % 4) {
+        return false;
+    }
+
+    for(size_t ii = 0; ii < len; ii++) {
+        char c = str[ii];
+        int sextet;
+        if (c >= 'A' && c <= 'Z') {
+            sextet = c - 'A';
+        }
+        else
+        if (c >= 'a' && c <= 'z') {
+            sextet = c - 'a' + 26;
+        }
+        else
+        if (c >= '0' && c <= '9') {
+            sextet = c - '0' + 52;
+        }
+        else
+        if (c == '+') {
+            sextet = 62;
+        }
+        else
+        if (c == '/') {
+            sextet = 63;
+        }
+        else
+        if (c == '=' && ii >= len - 2) {
+            padding++;
+            sextet = 0;
+        }
+        else {
+            return false;
+        }
+
+        value = (value << 6) | sextet;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            data.push_back((uint8_t)(value >> bits));
+        }
+    }
+
+    data.resize(data.size() - padding);
+    return true;
+}
+
+static bool decodeWps(const char *str, Variant &arrayVariant) {
+    std::vector<uint8_t> data;
+    if (!LocDecoder::decodeBase64(str, data) || data.size() % WAP_RECORD_SIZE) {
+        return false;
+    }
+
+    for(size_t offset = 0; offset < data.size(); offset += WAP_RECORD_SIZE) {
+        const uint8_t *record = &data[offset];
+
+        char bssid[18];
+        snprintf(bssid, sizeof(bssid), "%02x:%02x:%02x:%02x:%02x:%02x", record[0], record[1], record[2], record[3], record[4], record[5]);
+
+        Variant wapVariant;
+        wapVariant.set("bssid", bssid);
+        wapVariant.set("ch", (int)record[6]);
+        wapVariant.set("str", (int)(int8_t)record[7]);
+        arrayVariant.append(wapVariant);
+    }
+    return true;
+}
+
+static unsigned getU32(const uint8_t *p) {
+    return (unsigned)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static bool decodeTowers(const char *str, Variant &arrayVariant) {
+    std::vector<uint8_t> data;
+    if (!LocDecoder::decodeBase64(str, data) || data.size() % TOWER_RECORD_SIZE) {
+        return false;
+    }
+
+    for(size_t offset = 0; offset < data.size(); offset += TOWER_RECORD_SIZE) {
+        const uint8_t *record = &data[offset];
+
+        Variant towerVariant;
+        towerVariant.set("rat", "lte");
+        towerVariant.set("mcc", (int)(record[0] | (record[1] << 8)));
+        towerVariant.set("mnc", (int)(record[2] | (record[3] << 8)));
+        towerVariant.set("lac", getU32(&record[4]));
+
+        // Unknown values (0 for cid, rsrp, and rsrq, all ones for earfcn and pci) are omitted
+        uint32_t cid = getU32(&record[8]);
+        if (cid != 0) {
+            towerVariant.set("cid", cid);
+        }
+        uint16_t pci = (uint16_t)(record[16] | (record[17] << 8));
+        if (pci != 0xffff) {
+            towerVariant.set("nid", (int)pci);
+        }
+        uint32_t earfcn = getU32(&record[12]);
+        if (earfcn != 0xffffffff) {
+            towerVariant.set("ch", earfcn);
+        }
+        if (record[18] != 0) {
+            towerVariant.set("rsrp", -(int)record[18]);
+        }
+        if (record[19] != 0) {
+            towerVariant.set("rsrq", (int)(int8_t)record[19]);
+        }
+        arrayVariant.append(towerVariant);
+    }
+    return true;
+}
+
+bool LocDecoder::decodeLoc(const Variant &in, Variant &out) {
+    if (!in.isMap() || in.get("enc").toInt() != 1) {
+        out = in;
+        return true;
+    }
+
+    out = Variant();
+    for(const auto &kv : in.asMapRef()) {
+        if (kv.first == "enc") {
+            continue;
+        }
+        if (kv.first == "wpsb") {
+            Variant arrayVariant;
+            if (!decodeWps(kv.second.toString().c_str(), arrayVariant)) {
+                return false;
+            }
+            out.set("wps", arrayVariant);
+        }
+        else
+        if (kv.first == "towersb") {
+            Variant arrayVariant;
+            if (!decodeTowers(kv.second.toString().c_str(), arrayVariant)) {
+                return false;
+            }
+            out.set("towers", arrayVariant);
+        }
+        else {
+            out.set(kv.first.c_str(), kv.second);
+        }
+    }
+    return true;
+}
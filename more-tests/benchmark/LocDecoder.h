@@ -0,0 +1,36 @@
+#ifndef __LOCDECODER_H
+#define __LOCDECODER_H
+
+#include "Particle.h"
+
+#include <vector>
+
+/**
+ * @brief Reference decoder for the compact loc event payload encoding
+ *
+ * A cloud side service (or a local stand-in cloud) receiving loc events with "enc":1 converts them back
+ * to the JSON format expected by location fusion before forwarding them. This is the reference 
+ * implementation used by the host benchmark to check the round trip.
+ */
+namespace LocDecoder {
+    /**
+     * @brief Decode a base64 string
+     * 
+     * @param str base64 encoded data, with padding
+     * @param data Filled in with the decoded bytes
+     * @return true if str was valid base64
+     */
+    bool decodeBase64(const char *str, std::vector<uint8_t> &data);
+
+    /**
+     * @brief Convert a loc event to the JSON encoding
+     * 
+     * @param in loc event data. If it does not have "enc":1 it is copied unchanged.
+     * @param out Filled in with the loc event using wps and towers arrays instead of wpsb and towersb, and without enc. 
+     * Keys are in the same order as in.
+     * @return true on success, false if the compact data is invalid
+     */
+    bool decodeLoc(const Variant &in, Variant &out);
+};
+
+#endif /* __LOCDECODER_H */
@@ -0,0 +1,924 @@
+// Host stand-in implementation of the Particle Device OS API subset in Particle.h
+
+#include "Particle.h"
+
+#include <limits.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+
+CloudClass Particle;
+TimeClass Time;
+SystemClass System;
+WiFiClass WiFi;
+CellularClass Cellular;
+const Logger Log("app");
+
+//
+// Heap accounting. All C++ allocations in this process go through these replacements,
+// which includes String and Variant in this stand-in.
+//
+static std::atomic<size_t> heapAllocCount(0);
+static std::atomic<size_t> heapBytesInUse(0);
+static std::atomic<size_t> heapPeakBytes(0);
+
+static void *countedAlloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    size_t usable = malloc_usable_size(p);
+    heapAllocCount++;
+    size_t inUse = (heapBytesInUse += usable);
+    size_t peak = heapPeakBytes.load();
+    while(inUse > peak && !heapPeakBytes.compare_exchange_weak(peak, inUse)) {
+    }
+    return p;
+}
+
+static void countedFree(void *p) {
+    if (p) {
+        heapBytesInUse -= malloc_usable_size(p);
+        free(p);
+    }
+}
+
+void *operator new(size_t size) { return countedAlloc(size); }
+void *operator new[](size_t size) { return countedAlloc(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { try { return countedAlloc(size); } catch(...) { return nullptr; } }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { try { return countedAlloc(size); } catch(...) { return nullptr; } }
+void operator delete(void *p) noexcept { countedFree(p); }
+void operator delete[](void *p) noexcept { countedFree(p); }
+void operator delete(void *p, size_t) noexcept { countedFree(p); }
+void operator delete[](void *p, size_t) noexcept { countedFree(p); }
+
+//
+// Simulation state
+//
+namespace {
+    struct SimState {
+        bool connected = true;
+        bool timeValid = true;
+        time_t timeBase = 1760000000;
+        std::vector<WiFiAccessPoint> aps;
+        std::mutex apsMutex;
+        unsigned long scanDurationMs = 0;
+        unsigned long towerDurationMs = 0;
+        CellularGlobalIdentity cgi = {};
+        cellular_result_t cgiResult = 0;
+        CellularSignal signal;
+        bool publishSucceeds = true;
+        size_t publishCount = 0;
+        String lastPublishName;
+        String lastPublishData;
+        std::vector<std::pair<String, user_function_int_str_t>> functions;
+        std::vector<void (*)(system_event_t, int)> cloudStatusHandlers;
+        std::atomic<unsigned long> clockOffsetMs{0};
+    };
+
+    SimState &sim() {
+        static SimState *state = new SimState();
+        return *state;
+    }
+
+    const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    uint64_t elapsedMicros() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count() + (uint64_t)sim().clockOffsetMs.load() * 1000;
+    }
+}
+
+//
+// String
+//
+void String::assign(const char *s, size_t n) {
+    if (buf && n <= capacity) {
+        // Like Device OS String::copy(), reuse the buffer if it is large enough
+        memmove(buf, s, n);
+        buf[n] = 0;
+        len = n;
+        return;
+    }
+    char *newBuf = new char[n + 1];
+    if (n) {
+        memcpy(newBuf, s, n);
+    }
+    newBuf[n] = 0;
+    delete[] buf;
+    buf = newBuf;
+    len = capacity = n;
+}
+
+String &String::concat(const char *s, size_t n) {
+    if (len + n > capacity) {
+        // Grow geometrically like the Device OS String reserve() does when appending
+        size_t newCapacity = (len + n < 16) ? 16 : (len + n) * 3 / 2;
+        char *newBuf = new char[newCapacity + 1];
+        if (len) {
+            memcpy(newBuf, buf, len);
+        }
+        delete[] buf;
+        buf = newBuf;
+        capacity = newCapacity;
+    }
+    memcpy(buf + len, s, n);
+    len += n;
+    buf[len] = 0;
+    return *this;
+}
+
+// [static]
+String String::format(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(nullptr, 0, fmt, ap);
+    va_end(ap);
+
+    String result;
+    result.buf = new char[n + 1];
+    result.len = result.capacity = n;
+    va_start(ap, fmt);
+    vsnprintf(result.buf, n + 1, fmt, ap);
+    va_end(ap);
+    return result;
+}
+
+//
+// JSONWriter
+//
+JSONWriter &JSONWriter::name(const char *name) {
+    value(name);
+    write(':');
+    first = true;
+    return *this;
+}
+
+JSONWriter &JSONWriter::value(const char *val) {
+    return value(val, strlen(val));
+}
+
+JSONWriter &JSONWriter::value(const char *val, size_t size) {
+    writeSeparator();
+    write('"');
+    for(size_t ii = 0; ii < size; ii++) {
+        char c = val[ii];
+        if (c == '"' || c == '\\') {
+            write('\\');
+            write(c);
+        }
+        else if ((unsigned char)c < 0x20) {
+            char tmp[8];
+            snprintf(tmp, sizeof(tmp), "\\u%04x", (unsigned char)c);
+            write(tmp);
+        }
+        else {
+            write(c);
+        }
+    }
+    write('"');
+    return *this;
+}
+
+JSONWriter &JSONWriter::printf(const char *fmt, ...) {
+    writeSeparator();
+    char tmp[64];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    write(tmp);
+    return *this;
+}
+
+namespace {
+    class JSONStringWriter : public JSONWriter {
+    public:
+        String str;
+    protected:
+        virtual void write(const char *data, size_t size) override { str.concat(data, size); }
+    };
+}
+
+//
+// Variant
+//
+void Variant::reset() {
+    delete str;
+    delete arr;
+    delete map;
+    str = nullptr;
+    arr = nullptr;
+    map = nullptr;
+    type = NULL_;
+}
+
+void Variant::copyFrom(const Variant &other) {
+    type = other.type;
+    u = other.u;
+    if (other.str) {
+        str = new String(*other.str);
+    }
+    if (other.arr) {
+        arr = new VariantArray(*other.arr);
+    }
+    if (other.map) {
+        map = new VariantMap(*other.map);
+    }
+}
+
+void Variant::moveFrom(Variant &other) {
+    type = other.type;
+    u = other.u;
+    str = other.str;
+    arr = other.arr;
+    map = other.map;
+    other.str = nullptr;
+    other.arr = nullptr;
+    other.map = nullptr;
+    other.type = NULL_;
+}
+
+bool Variant::toBool() const {
+    switch(type) {
+        case BOOL: return u.b;
+        case STRING: return *str == "true";
+        case NULL_: case ARRAY: case MAP: return false;
+        default: return toDouble() != 0;
+    }
+}
+
+int64_t Variant::toInt64() const {
+    switch(type) {
+        case BOOL: return u.b;
+        case INT: return u.i;
+        case UINT: return u.u;
+        case INT64: return u.i64;
+        case UINT64: return (int64_t)u.u64;
+        case DOUBLE: return (int64_t)u.d;
+        case STRING: return strtoll(str->c_str(), nullptr, 10);
+        default: return 0;
+    }
+}
+
+double Variant::toDouble() const {
+    switch(type) {
+        case DOUBLE: return u.d;
+        case STRING: return strtod(str->c_str(), nullptr);
+        default: return (double)toInt64();
+    }
+}
+
+String Variant::toString() const {
+    if (type == STRING) {
+        return *str;
+    }
+    if (type == NULL_) {
+        return String();
+    }
+    return toJSON();
+}
+
+bool Variant::append(Variant val) {
+    if (type != ARRAY) {
+        reset();
+        type = ARRAY;
+        arr = new VariantArray();
+    }
+    arr->push_back(std::move(val));
+    return true;
+}
+
+Variant Variant::at(int index) const {
+    if (type == ARRAY && index >= 0 && index < (int)arr->size()) {
+        return (*arr)[index];
+    }
+    return Variant();
+}
+
+int Variant::size() const {
+    if (type == ARRAY) {
+        return (int)arr->size();
+    }
+    if (type == MAP) {
+        return (int)map->size();
+    }
+    if (type == STRING) {
+        return (int)str->length();
+    }
+    return 0;
+}
+
+bool Variant::set(const char *key, Variant val) {
+    if (type != MAP) {
+        reset();
+        type = MAP;
+        map = new VariantMap();
+    }
+    for(auto &kv : *map) {
+        if (kv.first == key) {
+            kv.second = std::move(val);
+            return true;
+        }
+    }
+    map->emplace_back(String(key), std::move(val));
+    return true;
+}
+
+Variant Variant::get(const char *key) const {
+    if (type == MAP) {
+        for(const auto &kv : *map) {
+            if (kv.first == key) {
+                return kv.second;
+            }
+        }
+    }
+    return Variant();
+}
+
+bool Variant::has(const char *key) const {
+    if (type == MAP) {
+        for(const auto &kv : *map) {
+            if (kv.first == key) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool Variant::remove(const char *key) {
+    if (type == MAP) {
+        for(auto it = map->begin(); it != map->end(); ++it) {
+            if (it->first == key) {
+                map->erase(it);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+const VariantArray &Variant::asArrayRef() const {
+    static const VariantArray empty;
+    return (type == ARRAY) ? *arr : empty;
+}
+
+const VariantMap &Variant::asMapRef() const {
+    static const VariantMap empty;
+    return (type == MAP) ? *map : empty;
+}
+
+void Variant::toJsonWriter(JSONWriter &writer) const {
+    switch(type) {
+        case NULL_: writer.nullValue(); break;
+        case BOOL: writer.value(u.b); break;
+        case INT: writer.value(u.i); break;
+        case UINT: writer.value(u.u); break;
+        case INT64: writer.value((long long)u.i64); break;
+        case UINT64: writer.value((unsigned long long)u.u64); break;
+        case DOUBLE: writer.value(u.d, 8); break;
+        case STRING: writer.value(*str); break;
+        case ARRAY:
+            writer.beginArray();
+            for(const auto &v : *arr) {
+                v.toJsonWriter(writer);
+            }
+            writer.endArray();
+            break;
+        case MAP:
+            writer.beginObject();
+            for(const auto &kv : *map) {
+                writer.name(kv.first.c_str());
+                kv.second.toJsonWriter(writer);
+            }
+            writer.endObject();
+            break;
+    }
+}
+
+String Variant::toJSON() const {
+    JSONStringWriter writer;
+    toJsonWriter(writer);
+    return writer.str;
+}
+
+// [static]
+Variant Variant::parse(const char *&p) {
+    while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    if (*p == '{') {
+        Variant result;
+        result.type = MAP;
+        result.map = new VariantMap();
+        p++;
+        while(*p) {
+            while(*p == ' ' || *p == ',' || *p == '\n' || *p == '\r' || *p == '\t') {
+                p++;
+            }
+            if (*p == '}') {
+                p++;
+                break;
+            }
+            Variant key = parse(p);
+            while(*p == ' ' || *p == ':') {
+                p++;
+            }
+            Variant val = parse(p);
+            result.set(key.toString().c_str(), val);
+        }
+        return result;
+    }
+    if (*p == '[') {
+        Variant result;
+        result.type = ARRAY;
+        result.arr = new VariantArray();
+        p++;
+        while(*p) {
+            while(*p == ' ' || *p == ',' || *p == '\n' || *p == '\r' || *p == '\t') {
+                p++;
+            }
+            if (*p == ']') {
+                p++;
+                break;
+            }
+            result.append(parse(p));
+        }
+        return result;
+    }
+    if (*p == '"') {
+        p++;
+        String s;
+        while(*p && *p != '"') {
+            if (*p == '\\' && p[1]) {
+                p++;
+            }
+            s += *p++;
+        }
+        if (*p == '"') {
+            p++;
+        }
+        return Variant(s);
+    }
+    if (!strncmp(p, "true", 4)) {
+        p += 4;
+        return Variant(true);
+    }
+    if (!strncmp(p, "false", 5)) {
+        p += 5;
+        return Variant(false);
+    }
+    if (!strncmp(p, "null", 4)) {
+        p += 4;
+        return Variant();
+    }
+    char *end;
+    const char *start = p;
+    long long ll = strtoll(start, &end, 10);
+    if (*end == '.' || *end == 'e' || *end == 'E') {
+        double d = strtod(start, &end);
+        p = end;
+        return Variant(d);
+    }
+    if (end == start) {
+        // Not valid JSON; skip a character so parsing always terminates
+        if (*p) {
+            p++;
+        }
+        return Variant();
+    }
+    p = end;
+    if (ll >= INT32_MIN && ll <= INT32_MAX) {
+        return Variant((int)ll);
+    }
+    return Variant(ll);
+}
+
+// [static]
+Variant Variant::fromJSON(const char *json) {
+    const char *p = json;
+    return parse(p);
+}
+
+//
+// CloudEvent
+//
+CloudEvent &CloudEvent::data(const Variant &data) {
+    d->eventData = data.toJSON();
+    d->eventContentType = ContentType::JSON;
+    return *this;
+}
+
+CloudEvent &CloudEvent::data(const char *data, size_t size, ContentType type) {
+    // The event keeps its own copy of the data
+    d->eventData = String(data, size);
+    d->eventContentType = type;
+    return *this;
+}
+
+void CloudEvent::clear() {
+    d->eventName = "";
+    d->eventData = "";
+    d->eventContentType = ContentType::TEXT;
+    d->eventStatus = NEW;
+    d->eventError = 0;
+    d->statusChange = nullptr;
+}
+
+void CloudEvent::setStatus(Status status, int error) {
+    d->eventStatus = status;
+    d->eventError = error;
+    if (d->statusChange) {
+        d->statusChange(*this);
+    }
+}
+
+//
+// Cloud
+//
+bool CloudClass::connected() const {
+    return sim().connected;
+}
+
+bool CloudClass::publish(CloudEvent &event) {
+    sim().publishCount++;
+    sim().lastPublishName = event.name();
+    sim().lastPublishData = event.dataString();
+    if (sim().publishSucceeds) {
+        event.setStatus(CloudEvent::SENT);
+    }
+    else {
+        event.setStatus(CloudEvent::FAILED, SYSTEM_ERROR_TIMEOUT);
+    }
+    return sim().publishSucceeds;
+}
+
+bool CloudClass::function(const char *name, int (*fn)(String)) {
+    return function(name, user_function_int_str_t(fn));
+}
+
+bool CloudClass::function(const char *name, user_function_int_str_t fn) {
+    sim().functions.emplace_back(String(name), fn);
+    return true;
+}
+
+//
+// Time, System, delay
+//
+unsigned long millis() {
+    return (unsigned long)(elapsedMicros() / 1000);
+}
+
+unsigned long micros() {
+    return (unsigned long)elapsedMicros();
+}
+
+void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+bool TimeClass::isValid() const {
+    return sim().timeValid;
+}
+
+time_t TimeClass::now() const {
+    return sim().timeBase + (time_t)(elapsedMicros() / 1000000);
+}
+
+uint64_t SystemClass::millis() const {
+    return elapsedMicros() / 1000;
+}
+
+uint32_t SystemClass::freeMemory() const {
+    const size_t simulatedHeap = 256 * 1024;
+    size_t inUse = heapBytesInUse.load();
+    return (inUse < simulatedHeap) ? (uint32_t)(simulatedHeap - inUse) : 0;
+}
+
+bool SystemClass::on(system_event_t events, void (*handler)(system_event_t, int)) {
+    if (events & cloud_status) {
+        sim().cloudStatusHandlers.push_back(handler);
+    }
+    return true;
+}
+
+//
+// Logging
+//
+void Logger::log(const char *level, const char *fmt, va_list ap) const {
+    if (!getenv("LOCF_LOG")) {
+        return;
+    }
+    char buf[512];
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    fprintf(stderr, "[%s] %s: %s\n", name, level, buf);
+}
+
+void Logger::trace(const char *fmt, ...) const { va_list ap; va_start(ap, fmt); log("TRACE", fmt, ap); va_end(ap); }
+void Logger::info(const char *fmt, ...) const { va_list ap; va_start(ap, fmt); log("INFO", fmt, ap); va_end(ap); }
+void Logger::warn(const char *fmt, ...) const { va_list ap; va_start(ap, fmt); log("WARN", fmt, ap); va_end(ap); }
+void Logger::error(const char *fmt, ...) const { va_list ap; va_start(ap, fmt); log("ERROR", fmt, ap); va_end(ap); }
+
+//
+// Threads, mutexes, and queues
+//
+int os_mutex_create(os_mutex_t *mutex) {
+    *mutex = new std::mutex();
+    return 0;
+}
+
+int os_mutex_destroy(os_mutex_t mutex) {
+    delete (std::mutex *)mutex;
+    return 0;
+}
+
+int os_mutex_lock(os_mutex_t mutex) {
+    ((std::mutex *)mutex)->lock();
+    return 0;
+}
+
+bool os_mutex_trylock(os_mutex_t mutex) {
+    // Matches Device OS: returns 0 (false) on success
+    return !((std::mutex *)mutex)->try_lock();
+}
+
+int os_mutex_unlock(os_mutex_t mutex) {
+    ((std::mutex *)mutex)->unlock();
+    return 0;
+}
+
+namespace {
+    struct SimQueue {
+        size_t itemSize;
+        size_t length;
+        std::deque<std::vector<uint8_t>> items;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+}
+
+int os_queue_create(os_queue_t *queue, size_t itemSize, size_t length, void *reserved) {
+    SimQueue *q = new SimQueue();
+    q->itemSize = itemSize;
+    q->length = length;
+    *queue = q;
+    return 0;
+}
+
+int os_queue_destroy(os_queue_t queue, void *reserved) {
+    delete (SimQueue *)queue;
+    return 0;
+}
+
+int os_queue_put(os_queue_t queue, const void *item, system_tick_t delayMs, void *reserved) {
+    SimQueue *q = (SimQueue *)queue;
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (q->items.size() >= q->length) {
+        return 1;
+    }
+    q->items.emplace_back((const uint8_t *)item, (const uint8_t *)item + q->itemSize);
+    q->cv.notify_one();
+    return 0;
+}
+
+int os_queue_take(os_queue_t queue, void *item, system_tick_t delayMs, void *reserved) {
+    SimQueue *q = (SimQueue *)queue;
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (q->items.empty()) {
+        if (delayMs == CONCURRENT_WAIT_FOREVER) {
+            q->cv.wait(lock, [q]() { return !q->items.empty(); });
+        }
+        else if (delayMs > 0) {
+            q->cv.wait_for(lock, std::chrono::milliseconds(delayMs), [q]() { return !q->items.empty(); });
+        }
+    }
+    if (q->items.empty()) {
+        return 1;
+    }
+    memcpy(item, q->items.front().data(), q->itemSize);
+    q->items.pop_front();
+    return 0;
+}
+
+namespace {
+struct ThreadImpl {
+    wiring_thread_fn_t function;
+    const char *name;
+    os_thread_prio_t priority;
+    void *stack;
+    size_t stackSize;
+    pthread_t thread;
+};
+
+std::mutex threadsMutex;
+std::vector<ThreadImpl *> threads;
+
+void *threadStart(void *arg) {
+    ((ThreadImpl *)arg)->function();
+    return nullptr;
+}
+}
+
+os_thread_t os_thread_current(void *reserved) {
+    return (os_thread_t)pthread_self();
+}
+
+os_result_t os_thread_dump(os_thread_t thread, os_thread_dump_callback_t callback, void *ptr) {
+    std::lock_guard<std::mutex> lock(threadsMutex);
+    for(ThreadImpl *t : threads) {
+        if (pthread_equal(t->thread, (pthread_t)thread)) {
+            os_thread_dump_info_t info = {};
+            info.size = sizeof(info);
+            info.thread = thread;
+            info.name = t->name;
+            info.priority = t->priority;
+            info.stack_base = t->stack;
+            info.stack_size = t->stackSize;
+            return callback(&info, ptr);
+        }
+    }
+    return -1;
+}
+
+Thread::Thread(const char *name, wiring_thread_fn_t function, os_thread_prio_t priority, size_t stackSize) {
+    // The thread runs on a known buffer, like a Device OS thread, so os_thread_dump() can report its bounds. 
+    // glibc keeps the thread descriptor and TLS at the top of the buffer, and host stack frames are larger 
+    // than on the device, so extra space is added.
+    ThreadImpl *t = new ThreadImpl();
+    t->function = function;
+    t->name = name;
+    t->priority = priority;
+    t->stackSize = std::max(stackSize, (size_t)PTHREAD_STACK_MIN) + 32768;
+    t->stack = aligned_alloc(4096, t->stackSize);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, t->stack, t->stackSize);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    {
+        // Registered before the thread runs so it can find itself
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        pthread_create(&t->thread, &attr, threadStart, t);
+        threads.push_back(t);
+    }
+    pthread_attr_destroy(&attr);
+    impl = t;
+}
+
+Thread::~Thread() {
+    // Threads run until the process exits, so the stack is not freed
+}
+
+//
+// Wi-Fi
+//
+int WiFiClass::scan(wlan_scan_result_t callback, void *cookie) {
+    if (sim().scanDurationMs) {
+        delay(sim().scanDurationMs);
+    }
+    // Copy so a setAccessPoints() during the scan, including from the callback, does not invalidate the iteration.
+    // The copy uses malloc so it is not counted as heap usage, as Device OS delivers results from its own buffers.
+    size_t count;
+    WiFiAccessPoint *aps;
+    {
+        std::lock_guard<std::mutex> lock(sim().apsMutex);
+        count = sim().aps.size();
+        aps = (WiFiAccessPoint *)malloc((count ? count : 1) * sizeof(WiFiAccessPoint));
+        if (!aps) {
+            return -1;
+        }
+        if (count) {
+            memcpy(aps, sim().aps.data(), count * sizeof(WiFiAccessPoint));
+        }
+    }
+    for(size_t ii = 0; ii < count; ii++) {
+        callback(&aps[ii], cookie);
+    }
+    free(aps);
+    return (int)count;
+}
+
+//
+// Cellular
+//
+cellular_result_t cellular_global_identity(CellularGlobalIdentity *cgi, void *reserved) {
+    if (sim().towerDurationMs) {
+        delay(sim().towerDurationMs);
+    }
+    if (sim().cgiResult == 0) {
+        uint16_t size = cgi->size;
+        uint16_t version = cgi->version;
+        *cgi = sim().cgi;
+        cgi->size = size;
+        cgi->version = version;
+    }
+    return sim().cgiResult;
+}
+
+CellularSignal CellularClass::RSSI() {
+    return sim().signal;
+}
+
+//
+// Simulation controls
+//
+namespace ParticleSim {
+
+HeapStats getHeapStats() {
+    HeapStats stats;
+    stats.allocCount = heapAllocCount.load();
+    stats.bytesInUse = heapBytesInUse.load();
+    stats.peakBytes = heapPeakBytes.load();
+    return stats;
+}
+
+void resetHeapPeak() {
+    heapPeakBytes = heapBytesInUse.load();
+}
+
+void setConnected(bool connected) {
+    if (sim().connected != connected) {
+        sim().connected = connected;
+        for(auto handler : sim().cloudStatusHandlers) {
+            handler(cloud_status, connected ? cloud_status_connected : cloud_status_disconnected);
+        }
+    }
+}
+
+void setTimeValid(bool valid) {
+    sim().timeValid = valid;
+}
+
+void setAccessPoints(const std::vector<WiFiAccessPoint> &aps) {
+    std::lock_guard<std::mutex> lock(sim().apsMutex);
+    sim().aps = aps;
+}
+
+WiFiAccessPoint makeAccessPoint(const uint8_t bssid[6], uint8_t channel, int rssi) {
+    WiFiAccessPoint ap = {};
+    ap.size = sizeof(WiFiAccessPoint);
+    memcpy(ap.bssid, bssid, sizeof(ap.bssid));
+    ap.channel = channel;
+    ap.rssi = rssi;
+    return ap;
+}
+
+void setScanDurationMs(unsigned long ms) {
+    sim().scanDurationMs = ms;
+}
+
+void setTower(const CellularGlobalIdentity &cgi, cellular_result_t result) {
+    sim().cgi = cgi;
+    sim().cgiResult = result;
+}
+
+void setTowerDurationMs(unsigned long ms) {
+    sim().towerDurationMs = ms;
+}
+
+void setCellularSignal(float rsrp, float rsrq) {
+    sim().signal.strength = rsrp;
+    sim().signal.quality = rsrq;
+}
+
+void setPublishResult(bool succeed) {
+    sim().publishSucceeds = succeed;
+}
+
+size_t getPublishCount() {
+    return sim().publishCount;
+}
+
+const String &getLastPublishName() {
+    return sim().lastPublishName;
+}
+
+const String &getLastPublishData() {
+    return sim().lastPublishData;
+}
+
+int callFunction(const char *name, const char *arg) {
+    for(auto &fn : sim().functions) {
+        if (fn.first == name) {
+            return fn.second(String(arg));
+        }
+    }
+    return -1;
+}
+
+void advanceMs(unsigned long ms) {
+    sim().clockOffsetMs += ms;
+}
+
+void setTime(time_t t) {
+    sim().timeBase = t;
+}
+
+} // namespace ParticleSim
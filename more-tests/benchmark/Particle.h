@@ -0,0 +1,526 @@
+#ifndef __PARTICLE_H
+#define __PARTICLE_H
+
+// Host stand-in for the subset of the Particle Device OS API used by LocationFusionRK.
+//
+// This is not a full emulation. It provides just enough of Variant, CloudEvent, JSONWriter,
+// WiFi.scan, cellular_global_identity, Thread, os_mutex, and os_queue to compile
+// src/LocationFusionRK.cpp on Linux and drive its state machine with scripted data.
+// Scripted data and counters are controlled using the ParticleSim namespace at the bottom
+// of this file.
+
+#include <math.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+#define SYSTEM_VERSION_v620 0x06020000
+#define Wiring_WiFi 1
+#define Wiring_Cellular 1
+
+#define SYSTEM_ERROR_NONE 0
+#define SYSTEM_ERROR_UNKNOWN -100
+#define SYSTEM_ERROR_BUSY -110
+#define SYSTEM_ERROR_NOT_SUPPORTED -120
+#define SYSTEM_ERROR_TIMEOUT -160
+#define SYSTEM_ERROR_INVALID_ARGUMENT -270
+#define SYSTEM_ERROR_NO_MEMORY -260
+#define SYSTEM_ERROR_NOT_FOUND -280
+
+//
+// String
+//
+class String {
+public:
+    String() {}
+    String(const char *s) { assign(s, s ? strlen(s) : 0); }
+    String(const char *s, size_t len) { assign(s, len); }
+    String(const String &other) { assign(other.buf, other.len); }
+    String(String &&other) : buf(other.buf), len(other.len), capacity(other.capacity) { other.buf = nullptr; other.len = other.capacity = 0; }
+    explicit String(int value) { char tmp[16]; snprintf(tmp, sizeof(tmp), "%d", value); assign(tmp, strlen(tmp)); }
+    ~String() { delete[] buf; }
+
+    String &operator=(const String &other) { if (this != &other) { assign(other.buf, other.len); } return *this; }
+    String &operator=(String &&other) { if (this != &other) { delete[] buf; buf = other.buf; len = other.len; capacity = other.capacity; other.buf = nullptr; other.len = other.capacity = 0; } return *this; }
+    String &operator=(const char *s) { assign(s, s ? strlen(s) : 0); return *this; }
+
+    String &concat(const char *s, size_t n);
+    String &operator+=(const char *s) { return concat(s, strlen(s)); }
+    String &operator+=(const String &s) { return concat(s.c_str(), s.length()); }
+    String &operator+=(char c) { return concat(&c, 1); }
+
+    bool operator==(const String &other) const { return len == other.len && memcmp(c_str(), other.c_str(), len) == 0; }
+    bool operator==(const char *s) const { return strcmp(c_str(), s ? s : "") == 0; }
+    bool operator!=(const String &other) const { return !(*this == other); }
+    bool operator<(const String &other) const { return strcmp(c_str(), other.c_str()) < 0; }
+    bool equals(const char *s) const { return *this == s; }
+
+    const char *c_str() const { return buf ? buf : ""; }
+    size_t length() const { return len; }
+    char charAt(size_t index) const { return (index < len) ? buf[index] : 0; }
+
+    static String format(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+protected:
+    void assign(const char *s, size_t n);
+
+    char *buf = nullptr;
+    size_t len = 0;
+    size_t capacity = 0;
+};
+
+//
+// JSONWriter
+//
+class JSONWriter {
+public:
+    virtual ~JSONWriter() {}
+
+    JSONWriter &beginArray() { writeSeparator(); write('['); first = true; return *this; }
+    JSONWriter &endArray() { write(']'); first = false; return *this; }
+    JSONWriter &beginObject() { writeSeparator(); write('{'); first = true; return *this; }
+    JSONWriter &endObject() { write('}'); first = false; return *this; }
+    JSONWriter &name(const char *name);
+    JSONWriter &value(bool val) { writeSeparator(); write(val ? "true" : "false"); return *this; }
+    JSONWriter &value(int val) { return printf("%d", val); }
+    JSONWriter &value(unsigned val) { return printf("%u", val); }
+    JSONWriter &value(long val) { return printf("%ld", val); }
+    JSONWriter &value(unsigned long val) { return printf("%lu", val); }
+    JSONWriter &value(long long val) { return printf("%lld", val); }
+    JSONWriter &value(unsigned long long val) { return printf("%llu", val); }
+    JSONWriter &value(double val, int precision) { writeSeparator(); char tmp[48]; snprintf(tmp, sizeof(tmp), "%.*f", precision, val); write(tmp); return *this; }
+    JSONWriter &value(double val) { writeSeparator(); char tmp[48]; snprintf(tmp, sizeof(tmp), "%g", val); write(tmp); return *this; }
+    JSONWriter &value(const char *val);
+    JSONWriter &value(const char *val, size_t size);
+    JSONWriter &value(const String &val) { return value(val.c_str(), val.length()); }
+    JSONWriter &nullValue() { writeSeparator(); write("null"); return *this; }
+
+protected:
+    virtual void write(const char *data, size_t size) = 0;
+
+    void write(char c) { write(&c, 1); }
+    void write(const char *s) { write(s, strlen(s)); }
+    JSONWriter &printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+    void writeSeparator() { if (!first) { write(','); } first = false; }
+
+    bool first = true;
+};
+
+class JSONBufferWriter : public JSONWriter {
+public:
+    JSONBufferWriter(char *buf, size_t size) : buf(buf), bufSize(size) {}
+
+    char *buffer() const { return buf; }
+    size_t bufferSize() const { return bufSize; }
+    size_t dataSize() const { return n; }
+
+protected:
+    virtual void write(const char *data, size_t size) override {
+        if (n < bufSize) {
+            size_t count = (size < bufSize - n) ? size : (bufSize - n);
+            memcpy(buf + n, data, count);
+        }
+        n += size;
+    }
+
+    char *buf;
+    size_t bufSize;
+    size_t n = 0;
+};
+
+//
+// Variant
+//
+class Variant;
+typedef std::vector<Variant> VariantArray;
+// Device OS VariantMap is a Map<String, Variant>, whose entries() are key and value pairs
+class VariantMap : public std::vector<std::pair<String, Variant>> {
+public:
+    const std::vector<std::pair<String, Variant>> &entries() const { return *this; }
+};
+
+class Variant {
+public:
+    enum Type { NULL_, BOOL, INT, UINT, INT64, UINT64, DOUBLE, STRING, ARRAY, MAP };
+
+    Variant() {}
+    Variant(bool val) : type(BOOL) { u.b = val; }
+    Variant(int val) : type(INT) { u.i = val; }
+    Variant(unsigned val) : type(UINT) { u.u = val; }
+    Variant(long val) : type(INT64) { u.i64 = val; }
+    Variant(unsigned long val) : type(UINT64) { u.u64 = val; }
+    Variant(long long val) : type(INT64) { u.i64 = val; }
+    Variant(unsigned long long val) : type(UINT64) { u.u64 = val; }
+    Variant(double val) : type(DOUBLE) { u.d = val; }
+    Variant(const char *val) : type(STRING), str(new String(val)) {}
+    Variant(const String &val) : type(STRING), str(new String(val)) {}
+    Variant(const Variant &other) { copyFrom(other); }
+    Variant(Variant &&other) { moveFrom(other); }
+    ~Variant() { reset(); }
+
+    Variant &operator=(const Variant &other) { if (this != &other) { reset(); copyFrom(other); } return *this; }
+    Variant &operator=(Variant &&other) { if (this != &other) { reset(); moveFrom(other); } return *this; }
+
+    Type typeOf() const { return type; }
+    bool isNull() const { return type == NULL_; }
+    bool isBool() const { return type == BOOL; }
+    bool isNumber() const { return type >= INT && type <= DOUBLE; }
+    bool isString() const { return type == STRING; }
+    bool isArray() const { return type == ARRAY; }
+    bool isMap() const { return type == MAP; }
+
+    bool toBool() const;
+    int toInt() const { return (int)toInt64(); }
+    unsigned toUInt() const { return (unsigned)toInt64(); }
+    int64_t toInt64() const;
+    uint64_t toUInt64() const { return (uint64_t)toInt64(); }
+    double toDouble() const;
+    String toString() const;
+
+    int asInt() const { return toInt(); }
+    unsigned asUInt() const { return toUInt(); }
+    double asDouble() const { return toDouble(); }
+    bool asBool() const { return toBool(); }
+    String asString() const { return toString(); }
+
+    bool append(Variant val);
+    Variant at(int index) const;
+    int size() const;
+
+    bool set(const char *key, Variant val);
+    Variant get(const char *key) const;
+    bool has(const char *key) const;
+    bool remove(const char *key);
+
+    const VariantArray &asArrayRef() const;
+    const VariantMap &asMapRef() const;
+    VariantMap toMap() const { return asMapRef(); }
+
+    String toJSON() const;
+    static Variant fromJSON(const char *json);
+
+protected:
+    void reset();
+    void copyFrom(const Variant &other);
+    void moveFrom(Variant &other);
+    void toJsonWriter(JSONWriter &writer) const;
+    static Variant parse(const char *&p);
+
+    Type type = NULL_;
+    union {
+        bool b;
+        int i;
+        unsigned u;
+        int64_t i64;
+        uint64_t u64;
+        double d;
+    } u = {};
+    String *str = nullptr;
+    VariantArray *arr = nullptr;
+    VariantMap *map = nullptr;
+};
+
+//
+// CloudEvent
+//
+enum class ContentType {
+    TEXT = 0,
+    JSON = 50,
+    BINARY = 42
+};
+
+// Like Device OS, copies of a CloudEvent refer to the same event, so the copy passed to the status change
+// callback does not copy the name or data
+class CloudEvent {
+public:
+    enum Status {
+        NEW,
+        SENDING,
+        SENT,
+        FAILED
+    };
+
+    typedef std::function<void(CloudEvent event)> OnStatusChange;
+
+    CloudEvent() : d(std::make_shared<Data>()) {}
+
+    CloudEvent &name(const char *name) { d->eventName = name; return *this; }
+    const char *name() const { return d->eventName.c_str(); }
+    CloudEvent &data(const Variant &data);
+    CloudEvent &data(const char *data) { return this->data(data, strlen(data), ContentType::TEXT); }
+    CloudEvent &data(const char *data, size_t size, ContentType type);
+    CloudEvent &contentType(ContentType type) { d->eventContentType = type; return *this; }
+    CloudEvent &onStatusChange(OnStatusChange callback) { d->statusChange = callback; return *this; }
+
+    ContentType contentType() const { return d->eventContentType; }
+    const String &dataString() const { return d->eventData; }
+    size_t size() const { return d->eventData.length(); }
+    Status status() const { return d->eventStatus; }
+    bool isNew() const { return d->eventStatus == NEW; }
+    bool isSending() const { return d->eventStatus == SENDING; }
+    bool isSent() const { return d->eventStatus == SENT; }
+    bool isOk() const { return d->eventError == 0; }
+    int error() const { return d->eventError; }
+    void clear();
+
+    void setStatus(Status status, int error = 0);
+
+protected:
+    struct Data {
+        String eventName;
+        String eventData;
+        ContentType eventContentType = ContentType::TEXT;
+        Status eventStatus = NEW;
+        int eventError = 0;
+        OnStatusChange statusChange;
+    };
+    std::shared_ptr<Data> d;
+};
+
+//
+// Cloud
+//
+typedef std::function<int(String)> user_function_int_str_t;
+
+class CloudClass {
+public:
+    bool connected() const;
+    bool publish(CloudEvent &event);
+    bool function(const char *name, int (*fn)(String));
+    bool function(const char *name, user_function_int_str_t fn);
+};
+extern CloudClass Particle;
+
+//
+// Time, System, delay
+//
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+class TimeClass {
+public:
+    bool isValid() const;
+    time_t now() const;
+};
+extern TimeClass Time;
+
+typedef uint64_t system_event_t;
+#define cloud_status ((system_event_t)1 << 6)
+#define cloud_status_disconnected 0
+#define cloud_status_connecting 1
+#define cloud_status_connected 8
+#define cloud_status_disconnecting 9
+
+/**
+ * @brief Subset of SystemSleepConfiguration. Only the timer duration is kept.
+ */
+class SystemSleepConfiguration {
+public:
+    SystemSleepConfiguration &duration(uint32_t ms) { durationMs = ms; return *this; }
+    SystemSleepConfiguration &duration(std::chrono::milliseconds ms) { durationMs = (uint32_t)ms.count(); return *this; }
+
+    /**
+     * @brief Duration set using duration(), or 0 if not set (not part of the Device OS API)
+     */
+    uint32_t getDurationMs() const { return durationMs; }
+
+protected:
+    uint32_t durationMs = 0;
+};
+
+class SystemClass {
+public:
+    uint64_t millis() const;
+    uint32_t freeMemory() const;
+    bool on(system_event_t events, void (*handler)(system_event_t, int));
+};
+extern SystemClass System;
+
+//
+// Logging
+//
+class Logger {
+public:
+    explicit Logger(const char *name = "app") : name(name) {}
+    void trace(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+    void info(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+    void warn(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+    void error(const char *fmt, ...) const __attribute__((format(printf, 2, 3)));
+
+protected:
+    void log(const char *level, const char *fmt, va_list ap) const;
+    const char *name;
+};
+extern const Logger Log;
+
+//
+// Threads, mutexes, and queues
+//
+typedef void os_thread_return_t;
+typedef void *os_mutex_t;
+typedef void *os_queue_t;
+typedef uint8_t os_thread_prio_t;
+typedef uint32_t system_tick_t;
+const os_thread_prio_t OS_THREAD_PRIORITY_DEFAULT = 2;
+const system_tick_t CONCURRENT_WAIT_FOREVER = (system_tick_t)-1;
+
+int os_mutex_create(os_mutex_t *mutex);
+int os_mutex_destroy(os_mutex_t mutex);
+int os_mutex_lock(os_mutex_t mutex);
+bool os_mutex_trylock(os_mutex_t mutex);
+int os_mutex_unlock(os_mutex_t mutex);
+
+int os_queue_create(os_queue_t *queue, size_t itemSize, size_t length, void *reserved);
+int os_queue_destroy(os_queue_t queue, void *reserved);
+int os_queue_put(os_queue_t queue, const void *item, system_tick_t delay, void *reserved);
+int os_queue_take(os_queue_t queue, void *item, system_tick_t delay, void *reserved);
+
+typedef void *os_thread_t;
+typedef int os_result_t;
+
+typedef struct os_thread_dump_info_t {
+    size_t size;
+    os_thread_t thread;
+    const char *name;
+    os_thread_prio_t priority;
+    void *stack_base; //!< Lowest address of the stack
+    size_t stack_size;
+} os_thread_dump_info_t;
+
+typedef os_result_t (*os_thread_dump_callback_t)(os_thread_dump_info_t *info, void *ptr);
+
+os_thread_t os_thread_current(void *reserved);
+
+// Only threads created with Thread are known, not the main thread
+os_result_t os_thread_dump(os_thread_t thread, os_thread_dump_callback_t callback, void *ptr);
+
+typedef std::function<os_thread_return_t(void)> wiring_thread_fn_t;
+
+class Thread {
+public:
+    Thread(const char *name, wiring_thread_fn_t function, os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT, size_t stackSize = 3072);
+    ~Thread();
+
+protected:
+    void *impl;
+};
+
+//
+// Wi-Fi
+//
+typedef struct WiFiAccessPoint {
+    size_t size;
+    char ssid[33];
+    uint8_t ssidLength;
+    uint8_t bssid[6];
+    int security;
+    int cipher;
+    uint8_t channel;
+    int maxDataRate;
+    int rssi;
+} WiFiAccessPoint;
+
+typedef void (*wlan_scan_result_t)(WiFiAccessPoint *ap, void *cookie);
+
+class WiFiClass {
+public:
+    int scan(wlan_scan_result_t callback, void *cookie);
+};
+extern WiFiClass WiFi;
+
+//
+// Cellular
+//
+typedef int cellular_result_t;
+#define CGI_VERSION_1 1
+#define CGI_VERSION_LATEST CGI_VERSION_1
+
+typedef struct __attribute__((__packed__)) {
+    uint16_t size;
+    uint16_t version;
+    uint16_t mobile_country_code;
+    uint16_t mobile_network_code;
+    uint16_t location_area_code;
+    uint32_t cell_id;
+} CellularGlobalIdentity;
+
+cellular_result_t cellular_global_identity(CellularGlobalIdentity *cgi, void *reserved);
+
+class CellularSignal {
+public:
+    float getStrengthValue() const { return strength; }
+    float getQualityValue() const { return quality; }
+
+    float strength = 0.0f;
+    float quality = 0.0f;
+};
+
+class CellularClass {
+public:
+    CellularSignal RSSI();
+};
+extern CellularClass Cellular;
+
+
+//
+// Simulation controls (not part of the Device OS API)
+//
+namespace ParticleSim {
+    /**
+     * @brief Heap statistics collected by the global operator new/delete replacements
+     */
+    struct HeapStats {
+        size_t allocCount; //!< Number of allocations
+        size_t bytesInUse; //!< Bytes currently allocated
+        size_t peakBytes; //!< Peak of bytesInUse since resetPeak()
+    };
+
+    HeapStats getHeapStats();
+    void resetHeapPeak();
+
+    void setConnected(bool connected);
+    void setTimeValid(bool valid);
+    void setAccessPoints(const std::vector<WiFiAccessPoint> &aps);
+    WiFiAccessPoint makeAccessPoint(const uint8_t bssid[6], uint8_t channel, int rssi);
+    void setScanDurationMs(unsigned long ms);
+    void setTower(const CellularGlobalIdentity &cgi, cellular_result_t result = 0);
+    void setTowerDurationMs(unsigned long ms);
+    void setCellularSignal(float rsrp, float rsrq);
+
+    /**
+     * @brief Controls what happens to events passed to Particle.publish
+     *
+     * @param succeed true to mark the event as sent, false to mark it as failed
+     */
+    void setPublishResult(bool succeed);
+    size_t getPublishCount();
+    const String &getLastPublishName();
+    const String &getLastPublishData();
+
+    /**
+     * @brief Invoke a Particle.function as if called from the cloud
+     */
+    int callFunction(const char *name, const char *arg);
+
+    /**
+     * @brief Advance the simulated clock used by millis(), micros(), and System.millis()
+     *
+     * The simulated clock only moves when advanced, or by delay() in the calling thread.
+     */
+    void advanceMs(unsigned long ms);
+    void setTime(time_t t);
+};
+
+#endif /* __PARTICLE_H */
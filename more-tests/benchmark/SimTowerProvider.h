@@ -0,0 +1,59 @@
+#ifndef __SIMTOWERPROVIDER_H
+#define __SIMTOWERPROVIDER_H
+
+#include "Particle.h"
+#include "LocationFusionRK.h"
+
+#include <vector>
+
+/**
+ * @brief Simulated modem tower provider for host tests
+ *
+ * Reports a scripted list of serving and neighbor cells, in the order given, the way a modem-specific provider
+ * would after parsing the neighbor cell AT command response. Duplicates and more cells than the TowerList 
+ * capacity can be included to exercise merging and top-K selection.
+ */
+class SimTowerProvider : public LocationFusionRK::TowerProvider {
+public:
+    /**
+     * @brief Set the towers to report
+     */
+    SimTowerProvider &withTowers(const std::vector<LocationFusionRK::TowerEntry> &towers) { this->towers = towers; return *this; };
+
+    /**
+     * @brief Set the result code returned from getTowers(). Default is 0 (success).
+     */
+    SimTowerProvider &withResult(int result) { this->result = result; return *this; };
+
+    virtual int getTowers(LocationFusionRK::TowerList &towerList) override {
+        if (result == 0) {
+            for(const auto &entry : towers) {
+                towerList.addEntry(entry);
+            }
+        }
+        return result;
+    }
+
+    /**
+     * @brief Make a tower entry. Neighbor cells typically have no cid, only earfcn and pci.
+     */
+    static LocationFusionRK::TowerEntry makeTower(bool serving, uint32_t cid, uint32_t earfcn, uint16_t pci, int rsrp, int rsrq) {
+        LocationFusionRK::TowerEntry entry;
+        entry.mcc = 310;
+        entry.mnc = 410;
+        entry.lac = 0x2a0b;
+        entry.cid = cid;
+        entry.earfcn = earfcn;
+        entry.pci = pci;
+        entry.rsrp = (int16_t)rsrp;
+        entry.rsrq = (int8_t)rsrq;
+        entry.serving = serving;
+        return entry;
+    }
+
+protected:
+    std::vector<LocationFusionRK::TowerEntry> towers;
+    int result = 0;
+};
+
+#endif /* __SIMTOWERPROVIDER_H */
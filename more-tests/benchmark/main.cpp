@@ -0,0 +1,1624 @@
+// Host benchmark for LocationFusionRK
+//
+// Measures wall time, heap allocation count, and peak heap for one full
+// stateBuildPublish -> statePublishWait cycle with scripted Wi-Fi access points
+// and serving tower data from the Particle.h stand-in. Also measures worker thread
+// wakeups and publish latency using the singleton with its worker threads.
+//
+// Build and run:
+//   cd more-tests/benchmark
+//   make run
+
+#include "Particle.h"
+#include "LocationFusionRK.h"
+#include "LocDecoder.h"
+#include "SimTowerProvider.h"
+
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Test harness that exposes the protected state handlers of LocationFusionRK
+ *
+ * The constructor of LocationFusionRK is protected so the harness can create its own
+ * instance instead of using the singleton. setup() is not called so the worker thread
+ * is not started and the state handlers are called synchronously.
+ */
+class LocationFusionBench : public LocationFusionRK {
+public:
+    /**
+     * @brief Creates the mutex, which is normally created by setup()
+     */
+    LocationFusionBench() {
+        os_mutex_create(&mutex);
+    }
+
+    /**
+     * @brief Run a single stateBuildPublish -> statePublishWait cycle
+     */
+    void runCycle() {
+        stateBuildPublish();
+        stateAcquireWait();
+        statePublishWait();
+    }
+
+    /**
+     * @brief Build and publish a sample, stopping before the worker thread sees the publish complete
+     */
+    void runAcquire() {
+        stateBuildPublish();
+        stateAcquireWait();
+    }
+
+    /**
+     * @brief Scan for Wi-Fi access points without building a publish
+     */
+    void scanWiFi() {
+        wapList.scan();
+        wapListValid = true;
+    }
+
+    /**
+     * @brief Receive a loc-enhanced response. The cmd handler that calls this is registered by setup().
+     */
+    void receiveLocEnhanced(const char *json) {
+        locEnhanced(Variant::fromJSON(json));
+    }
+
+    /**
+     * @brief Process received loc-enhanced responses, as the worker thread does
+     */
+    void processResponses() {
+        processLocRequests();
+    }
+
+    /**
+     * @brief Run the connected idle state handler once, as the worker thread does between publishes
+     */
+    void runIdle() {
+        stateConnected();
+    }
+
+    /**
+     * @brief Paint the stack of the current thread as the worker thread does when it starts
+     */
+    void paintStack() {
+        workerStackMonitor.paint();
+    }
+
+    /**
+     * @brief Run the disconnected idle state handler once
+     */
+    void runDisconnected() {
+        stateIdle();
+    }
+
+    /**
+     * @brief Run the publish wait state handler once, to complete a publish started by runIdle()
+     */
+    void runPublishWait() {
+        statePublishWait();
+    }
+
+    /**
+     * @brief Run the current state handler once, as one iteration of the worker thread loop does
+     * 
+     * @return uint64_t Time the state handler asked the worker thread to wait, or 0 to run again immediately
+     */
+    uint64_t runWorkerIteration() {
+        waitMs = 0;
+        stateHandler(*this);
+        return waitMs;
+    }
+
+    /**
+     * @brief Get the time the last state handler asked the worker thread to wait, or 0 to run again immediately
+     */
+    uint64_t getWaitMs() const {
+        return waitMs;
+    }
+
+    /**
+     * @brief Get when the next periodic publish or retry is scheduled, set by the PublishScheduler
+     */
+    uint64_t getNextPublishMs() const {
+        return nextPublishMs;
+    }
+
+    /**
+     * @brief Encode the last acquired sample as an offline queue record
+     */
+    size_t encodeRecord(uint8_t *buf, size_t bufSize) const {
+        return encodeOfflineRecord(buf, bufSize);
+    }
+
+    /**
+     * @brief Acquire a sample and encode it as an offline queue record, before the event is built, as the worker 
+     * thread does while disconnected
+     */
+    size_t acquireRecord(uint8_t *buf, size_t bufSize) {
+        stateBuildPublish();
+        return encodeOfflineRecord(buf, bufSize);
+    }
+
+    /**
+     * @brief Decode an offline queue record
+     */
+    bool decodeRecord(const uint8_t *buf, size_t size, Variant &sample) const {
+        return decodeOfflineRecord(buf, size, 1, sample);
+    }
+
+    /**
+     * @brief Dispatch a cmd function call as if it came from the cloud
+     */
+    int dispatchCmd(const char *json) {
+        return functionHandler(json);
+    }
+};
+
+/**
+ * @brief Measure wall time and heap allocations per cmd function dispatch
+ */
+static void runCmdBenchmark(LocationFusionBench &bench, const char *label, const char *json, size_t iterations) {
+    ParticleSim::HeapStats before = ParticleSim::getHeapStats();
+    auto start = std::chrono::steady_clock::now();
+    for(size_t ii = 0; ii < iterations; ii++) {
+        bench.dispatchCmd(json);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    ParticleSim::HeapStats after = ParticleSim::getHeapStats();
+
+    printf("%-32s %12.2f %12.1f\n", label, (double)elapsed.count() / 1000.0 / iterations, (double)(after.allocCount - before.allocCount) / iterations);
+}
+
+/**
+ * @brief Check that a batch is not published again until the retry time after a failed publish
+ */
+static bool checkBatchRetry() {
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withBatch(2);
+
+    bench->runCycle();
+    ParticleSim::setPublishResult(false);
+    size_t publishCount = ParticleSim::getPublishCount();
+    bench->runCycle();
+    ParticleSim::setPublishResult(true);
+    bool failedOk = ParticleSim::getPublishCount() == publishCount + 1 && bench->getConsecutiveFailures() == 1;
+
+    // The retry waits for the default publishFailureRetry of 1 minute
+    bench->runIdle();
+    uint64_t retryWaitMs = bench->getWaitMs();
+    bool waitOk = ParticleSim::getPublishCount() == publishCount + 1 && retryWaitMs > 55000 && retryWaitMs <= 60000;
+
+    ParticleSim::advanceMs(60000);
+    bench->runIdle();
+    bench->runPublishWait();
+    Variant retryPublish = Variant::fromJSON(ParticleSim::getLastPublishData().c_str());
+    bool retryOk = ParticleSim::getPublishCount() == publishCount + 2 && retryPublish.size() == 2 && bench->getConsecutiveFailures() == 0;
+
+    bool ok = failedOk && waitOk && retryOk;
+    printf("batch retry after failure: waits %u ms, then %d samples published: %s\n", (unsigned)retryWaitMs, retryPublish.size(), ok ? "ok" : "FAILED");
+    delete bench;
+    return ok;
+}
+
+/**
+ * @brief Check that a device that is disconnected when a periodic publish is due can still sleep until the retry time
+ */
+static bool checkSleepDisconnected() {
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withPublishPeriodic(10min);
+    bench->runCycle();
+
+    ParticleSim::setConnected(false);
+    ParticleSim::advanceMs(11 * 60 * 1000);
+    bench->runIdle();
+    bench->runDisconnected();
+    SystemSleepConfiguration sleepConfig;
+    bool sleepOk = bench->prepareSleep(sleepConfig);
+    uint32_t sleepMs = sleepConfig.getDurationMs();
+    ParticleSim::setConnected(true);
+
+    bool ok = sleepOk && sleepMs > 55000 && sleepMs <= 60000;
+    printf("sleep while disconnected with a publish due: %s for %u ms: %s\n", sleepOk ? "sleeps" : "awake", (unsigned)sleepMs, ok ? "ok" : "FAILED");
+    delete bench;
+    return ok;
+}
+
+/**
+ * @brief Publish a sample and answer it with a loc-enhanced response at lat, lon
+ */
+static void publishAndRespond(LocationFusionBench &bench, double lat, double lon) {
+    bench.runCycle();
+    Variant published = Variant::fromJSON(ParticleSim::getLastPublishData().c_str());
+    char json[160];
+    snprintf(json, sizeof(json), "{\"cmd\":\"loc-enhanced\",\"loc-enhanced\":{\"lat\":%.7f,\"lon\":%.7f,\"h_acc\":30},\"req_id\":%d}", 
+        lat, lon, published.get("req_id").toInt());
+    bench.receiveLocEnhanced(json);
+    bench.processResponses();
+}
+
+/**
+ * @brief Count worker thread wakeups over a simulated minute while idle between periodic publishes
+ * 
+ * @param polling true to run the loop used prior to 0.0.5, which ran the state handler then delay(1), or false
+ * to block for the time the state handler asks for, as the worker thread does now
+ */
+static uint32_t countIdleWakeups(bool polling) {
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withAddTower(true).withPublishPeriodic(5min);
+    publishAndRespond(*bench, 42.3601, -71.0589);
+
+    // Only the simulated time is counted, as the host clock also includes the time taken to run the loop
+    const uint64_t minuteMs = 60000;
+    uint64_t elapsedMs = 0;
+    uint32_t wakeups = 0;
+    for(int ii = 0; ii < 100000 && elapsedMs < minuteMs; ii++) {
+        uint64_t waitMs = bench->runWorkerIteration();
+        if (polling) {
+            waitMs = 1;
+        }
+        if (waitMs) {
+            waitMs = std::min(waitMs, minuteMs - elapsedMs);
+            ParticleSim::advanceMs((unsigned long)waitMs);
+            elapsedMs += waitMs;
+            wakeups++;
+        }
+    }
+    delete bench;
+    return wakeups;
+}
+
+/**
+ * @brief Check that the measured stack size is not saved until a loc-enhanced cache hit has been measured, as 
+ * the cache is enabled. Runs on a Thread so the stack can be painted.
+ */
+static bool checkAutoStackSize() {
+    const char *path = "/tmp/locfstack-bench.dat";
+    unlink(path);
+
+    static LocationFusionBench *bench;
+    static std::atomic<int> step;
+    static bool savedAfterMiss, savedAfterHit, painted;
+    bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withLocCache(4).withAutoThreadStackSize(path);
+    step = 0;
+    Thread *thread = new Thread("stackTest", []() {
+        bench->paintStack();
+        painted = bench->getStackHighWaterMark() > 0;
+
+        // Published and answered, but not served from the cache yet
+        publishAndRespond(*bench, 42.3601, -71.0589);
+        bench->runIdle();
+        savedAfterMiss = access("/tmp/locfstack-bench.dat", F_OK) == 0;
+
+        // Same access points, so served from the cache
+        bench->runCycle();
+        bench->runIdle();
+        savedAfterHit = access("/tmp/locfstack-bench.dat", F_OK) == 0;
+        step = 1;
+    }, OS_THREAD_PRIORITY_DEFAULT, 6144);
+    while(step == 0) {
+        delay(1);
+    }
+
+    bool ok = painted && !savedAfterMiss && savedAfterHit;
+    printf("auto stack size: %s after a cache miss, %s after a cache hit: %s\n", savedAfterMiss ? "saved" : "not saved", 
+        savedAfterHit ? "saved" : "not saved", ok ? "ok" : "FAILED");
+    unlink(path);
+    delete bench;
+    delete thread;
+    return ok;
+}
+
+/**
+ * @brief Check that a response that arrives before the worker thread sees the publish complete is matched, and
+ * that the request is removed if the publish fails
+ */
+static bool checkEarlyLocResponse() {
+    LocationFusionBench *bench = new LocationFusionBench();
+    static std::vector<LocationFusionRK::LocEnhancedResult> results;
+    results.clear();
+    bench->withLocEnhancedResultHandler([](const LocationFusionRK::LocEnhancedResult &result) {
+        results.push_back(result);
+    });
+
+    bench->runAcquire();
+    Variant published = Variant::fromJSON(ParticleSim::getLastPublishData().c_str());
+    char json[160];
+    snprintf(json, sizeof(json), "{\"cmd\":\"loc-enhanced\",\"loc-enhanced\":{\"lat\":42.3601,\"lon\":-71.0589,\"h_acc\":30},\"req_id\":%d}", 
+        published.get("req_id").toInt());
+    bench->receiveLocEnhanced(json);
+    bench->runPublishWait();
+    bench->processResponses();
+    bool earlyOk = results.size() == 1 && results[0].received && bench->getLocRequestsInFlight() == 0;
+
+    ParticleSim::setPublishResult(false);
+    bench->runAcquire();
+    size_t inFlightPublishing = bench->getLocRequestsInFlight();
+    bench->runPublishWait();
+    ParticleSim::setPublishResult(true);
+    bool failedOk = inFlightPublishing == 1 && bench->getLocRequestsInFlight() == 0;
+
+    bool ok = earlyOk && failedOk;
+    printf("loc-enhanced before publish completes: %s, failed publish leaves %u in flight: %s\n", earlyOk ? "matched" : "not matched", 
+        (unsigned)bench->getLocRequestsInFlight(), ok ? "ok" : "FAILED");
+    delete bench;
+    return ok;
+}
+
+/**
+ * @brief Check that samples without Wi-Fi or a tower are not cached, as they would all have the same key
+ */
+static bool checkLocCacheEmptyFingerprint() {
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withLocCache(4);
+
+    size_t publishCount = ParticleSim::getPublishCount();
+    publishAndRespond(*bench, 42.3601, -71.0589);
+    publishAndRespond(*bench, 40.7128, -74.0060);
+    const LocationFusionRK::LocCache &cache = bench->getLocCache();
+    bool ok = ParticleSim::getPublishCount() == publishCount + 2 && cache.size() == 0 && cache.getHits() == 0;
+    printf("loc cache without Wi-Fi or tower: %u published, %u cached, %u hits: %s\n", 
+        (unsigned)(ParticleSim::getPublishCount() - publishCount), (unsigned)cache.size(), (unsigned)cache.getHits(), ok ? "ok" : "FAILED");
+    delete bench;
+    return ok;
+}
+
+/**
+ * @brief Check offline queue records in small buffers with several towers, and decoding version 1 records
+ */
+static bool checkOfflineRecords() {
+    SimTowerProvider towerProvider;
+    towerProvider.withTowers({
+        SimTowerProvider::makeTower(true, 0x0c8a1f03, LocationFusionRK::TowerEntry::UNKNOWN_EARFCN, LocationFusionRK::TowerEntry::UNKNOWN_PCI, -97, -11),
+        SimTowerProvider::makeTower(false, 0, 5230, 142, -112, -14),
+        SimTowerProvider::makeTower(false, 0, 5230, 301, -95, -9),
+    });
+    std::vector<WiFiAccessPoint> aps;
+    for(int ii = 0; ii < 10; ii++) {
+        uint8_t bssid[6] = { 0x00, 0x11, 0x22, 0x33, 0x44, (uint8_t)ii };
+        aps.push_back(ParticleSim::makeAccessPoint(bssid, 6, -50 - ii));
+    }
+    ParticleSim::setAccessPoints(aps);
+
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withAddTower(true).withTowerProvider(&towerProvider);
+    bench->runCycle();
+
+    // Records that fit fewer than all of the towers must not write past the end of the buffer
+    const size_t guardSize = 64;
+    bool sizesOk = true;
+    for(size_t bufSize = 32; bufSize <= 128; bufSize++) {
+        std::vector<uint8_t> buf(bufSize + guardSize, 0xa5);
+        size_t size = bench->encodeRecord(buf.data(), bufSize);
+        bool guardOk = std::all_of(buf.begin() + bufSize, buf.end(), [](uint8_t value) { return value == 0xa5; });
+        Variant sample;
+        if (!guardOk || size > bufSize || (size && !bench->decodeRecord(buf.data(), size, sample)) || (bufSize >= 52 && !size)) {
+            sizesOk = false;
+        }
+    }
+
+    // Version 1: time, serving tower (mcc, mnc, lac, cid), no access points, empty custom data
+    const uint8_t version1[] = { 1, 0x03, 0, 0, 0x00, 0x5e, 0xd0, 0xb2, 0x36, 0x01, 0x9a, 0x01, 0x0b, 0x2a, 0x00, 0x00, 0x03, 0x1f, 0x8a, 0x0c, 0, 0, 0, 0 };
+    Variant sample;
+    bool version1Ok = bench->decodeRecord(version1, sizeof(version1), sample) && sample.get("towers").size() == 1 &&
+        sample.get("towers").at(0).get("cid").toUInt() == 0x0c8a1f03 && sample.get("towers").at(0).get("mcc").toInt() == 310 && sample.has("time");
+
+    bool ok = sizesOk && version1Ok;
+    printf("offline records: 32 to 128 byte buffers with 3 towers %s, version 1 record %s: %s\n", sizesOk ? "fit" : "overflow", 
+        version1Ok ? "decoded" : "not decoded", ok ? "ok" : "FAILED");
+    delete bench;
+    return ok;
+}
+
+/**
+ * @brief Get the values of the records in an offline queue, reopening it first. Each record is filled with its value,
+ * and unreadable records are -1.
+ */
+static std::vector<int> reopenOfflineQueue(LocationFusionRK::OfflineQueue &queue) {
+    std::vector<int> values;
+    if (!queue.open()) {
+        return values;
+    }
+    uint8_t data[32];
+    for(size_t ii = 0; ii < queue.size(); ii++) {
+        size_t size = queue.read(ii, data);
+        values.push_back(size ? data[0] : -1);
+    }
+    return values;
+}
+
+/**
+ * @brief Overwrite part of the slot containing the record with sequence number seq, as a torn or corrupted write would
+ */
+static void damageOfflineSlot(const char *path, size_t recordSize, size_t maxRecords, uint32_t seq, size_t offset, const void *data, size_t size) {
+    int fd = open(path, O_RDWR);
+    for(size_t slot = 0; slot < maxRecords; slot++) {
+        LocationFusionRK::OfflineQueue::RecordHeader header;
+        if (pread(fd, &header, sizeof(header), slot * recordSize) == sizeof(header) && header.seq == seq) {
+            (void)!pwrite(fd, data, size, slot * recordSize + offset);
+        }
+    }
+    close(fd);
+}
+
+/**
+ * @brief Check the offline queue file after wrapping around, consuming, and damaged records
+ */
+static bool checkOfflineQueue() {
+    const char *path = "/tmp/locfqueue-bench.dat";
+    const size_t maxRecords = 4, recordSize = 32;
+    unlink(path);
+
+    LocationFusionRK::OfflineQueue queue;
+    queue.withPath(path).withRecords(maxRecords, recordSize);
+    queue.open();
+    auto append = [&queue](int value) {
+        uint8_t data[10];
+        memset(data, value, sizeof(data));
+        return queue.append(data, sizeof(data));
+    };
+
+    // Full: records 0 and 1 are overwritten
+    bool appendOk = true;
+    for(int value = 0; value < 6; value++) {
+        appendOk = appendOk && append(value);
+    }
+    bool fullOk = appendOk && queue.getDroppedCount() == 2 && reopenOfflineQueue(queue) == std::vector<int>({ 2, 3, 4, 5 });
+
+    // Consumed records are not found after reopening, and appending wraps around the end of the file
+    queue.consume(2);
+    bool consumeOk = reopenOfflineQueue(queue) == std::vector<int>({ 4, 5 });
+    append(6);
+    append(7);
+    append(8);
+    bool wrapOk = reopenOfflineQueue(queue) == std::vector<int>({ 5, 6, 7, 8 });
+
+    // A record with a bad CRC in the middle is returned as unreadable, and the records after it are kept. 
+    // The sequence number of each record is its value + 1.
+    uint8_t garbage[4] = { 0xde, 0xad, 0xbe, 0xef };
+    damageOfflineSlot(path, recordSize, maxRecords, 8, sizeof(LocationFusionRK::OfflineQueue::RecordHeader) + 2, garbage, sizeof(garbage));
+    bool crcOk = reopenOfflineQueue(queue) == std::vector<int>({ 5, 6, -1, 8 });
+
+    // Power lost while overwriting the oldest record: the new header was written, but not the data
+    LocationFusionRK::OfflineQueue::RecordHeader tornHeader = {};
+    tornHeader.seq = 10;
+    tornHeader.size = 10;
+    tornHeader.crc = 0x12345678;
+    damageOfflineSlot(path, recordSize, maxRecords, 6, 0, &tornHeader, sizeof(tornHeader));
+    bool tornOk = reopenOfflineQueue(queue) == std::vector<int>({ 6, -1, 8 });
+    append(9);
+    bool afterTornOk = reopenOfflineQueue(queue) == std::vector<int>({ 6, -1, 8, 9 });
+
+    queue.close();
+    unlink(path);
+
+    bool ok = fullOk && consumeOk && wrapOk && crcOk && tornOk && afterTornOk;
+    printf("offline queue file: full %s, consume %s, wrap %s, bad CRC %s, torn write %s, append after torn %s: %s\n", 
+        fullOk ? "ok" : "bad", consumeOk ? "ok" : "bad", wrapOk ? "ok" : "bad", crcOk ? "ok" : "bad", tornOk ? "ok" : "bad", 
+        afterTornOk ? "ok" : "bad", ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/**
+ * @brief Check that keys from add to event handlers, which run while the scan is in progress, replace the library's
+ * keys of the same name in the published event and offline records, and that the library's other keys are kept
+ */
+static bool checkAddToEventOrder() {
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withAddTower(true).withAddToEventHandler([](Variant &eventData, Variant &locVariant) {
+        eventData.set("time", 1234);
+        eventData.set("batt", 87);
+        locVariant.set("lck", 1);
+        locVariant.set("lat", 42.3601);
+        locVariant.set("lon", -71.0589);
+    });
+    bench->runCycle();
+    Variant published = Variant::fromJSON(ParticleSim::getLastPublishData().c_str());
+    bool publishOk = published.get("wps").size() == 10 && published.has("towers") && published.get("cmd").toString() == "loc" &&
+        published.get("time").toInt() == 1234 && published.get("batt").toInt() == 87 && published.get("loc").get("lck").toInt() == 1;
+
+    uint8_t buf[512];
+    Variant sample;
+    size_t size = bench->acquireRecord(buf, sizeof(buf));
+    bool recordOk = size && bench->decodeRecord(buf, size, sample) && sample.get("wps").size() == published.get("wps").size() &&
+        sample.has("towers") && sample.get("time").toInt() == 1234 && sample.get("batt").toInt() == 87 && 
+        sample.get("loc").get("lck").toInt() == 1;
+
+    bool ok = publishOk && recordOk;
+    printf("add to event handler keys replace library keys: %s in event, %s in offline record: %s\n", 
+        publishOk ? "ok" : "bad", recordOk ? "ok" : "bad", ok ? "ok" : "FAILED");
+    delete bench;
+    return ok;
+}
+
+/**
+ * @brief Measure on-device Wi-Fi positioning with an access point index of numEntries entries
+ *
+ * The access points are on a grid 40 meters apart, each learned from 3 noisy fixes. Each estimate uses a 
+ * scan of the 12 closest access points plus 4 that are not in the index, with RSSI decreasing with distance.
+ */
+static void runWiFiPositionBenchmark(size_t numEntries, size_t iterations) {
+    const char *path = "/tmp/locfwifi-bench.dat";
+    unlink(path);
+
+    const size_t side = (size_t)sqrt((double)numEntries);
+    const int32_t spacingE7 = 3600; // about 40 meters
+    const int32_t lat0E7 = 423601000, lon0E7 = -710589000;
+    auto apKey = [](size_t ii) {
+        // Spread the BSSIDs over the key space like real vendor OUIs
+        return ((uint64_t)ii * 0x9e3779b97f4aULL) & 0xfcffffffffffULL;
+    };
+
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withWiFiPositioning(path, 3, true);
+    LocationFusionRK::WiFiPositionIndex &index = bench->getWiFiPositionIndex();
+    index.withMaxPending(numEntries * 3 + 1);
+    index.open();
+
+    auto buildStart = std::chrono::steady_clock::now();
+    for(int pass = 0; pass < 3; pass++) {
+        for(size_t ii = 0; ii < numEntries; ii++) {
+            int32_t noise = (int32_t)((ii * 7919 + pass * 104729) % 1000) - 500;
+            index.learn(apKey(ii), lat0E7 + (int32_t)(ii % side) * spacingE7 + noise, lon0E7 + (int32_t)(ii / side) * spacingE7 - noise);
+        }
+    }
+    index.flush();
+    auto buildElapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - buildStart);
+
+    std::chrono::nanoseconds totalTime(0);
+    uint32_t totalReads = 0;
+    size_t numFixes = 0;
+    double totalError = 0.0;
+    for(size_t iter = 0; iter < iterations; iter++) {
+        // True position somewhere inside the grid
+        size_t row = 2 + (iter * 13) % (side - 4), col = 2 + (iter * 29) % (side - 4);
+        double trueLat = (lat0E7 + (double)row * spacingE7 + 1200) / 10000000.0;
+        double trueLon = (lon0E7 + (double)col * spacingE7 + 800) / 10000000.0;
+
+        std::vector<WiFiAccessPoint> aps;
+        for(int dr = -1; dr <= 2; dr++) {
+            for(int dc = -1; dc <= 1; dc++) {
+                uint64_t key = apKey((col + dc) * side + row + dr);
+                uint8_t bssid[6];
+                LocationFusionRK::WiFiPositionIndex::keyToBssid(key, bssid);
+                aps.push_back(ParticleSim::makeAccessPoint(bssid, 6, -50 - 6 * (abs(dr) + abs(dc))));
+            }
+        }
+        for(int ii = 0; ii < 4; ii++) {
+            uint8_t bssid[6] = { 0x02, 0x11, 0x22, 0x33, (uint8_t)iter, (uint8_t)ii };
+            aps.push_back(ParticleSim::makeAccessPoint(bssid, 1, -60 - ii));
+        }
+        ParticleSim::setAccessPoints(aps);
+        bench->scanWiFi();
+
+        double lat, lon;
+        int hAcc;
+        uint32_t readsBefore = index.getReadCount();
+        auto start = std::chrono::steady_clock::now();
+        bool fix = bench->estimateWiFiPosition(lat, lon, hAcc);
+        totalTime += std::chrono::steady_clock::now() - start;
+        totalReads += index.getReadCount() - readsBefore;
+
+        if (fix) {
+            numFixes++;
+            double dy = (lat - trueLat) * 111320.0;
+            double dx = (lon - trueLon) * 111320.0 * cos(trueLat * M_PI / 180.0);
+            totalError += sqrt(dx * dx + dy * dy);
+        }
+    }
+
+    printf("%8zu %12lld %12.2f %12.1f %12zu %12.1f\n", index.size(), (long long)buildElapsed.count(),
+        (double)std::chrono::duration_cast<std::chrono::nanoseconds>(totalTime).count() / 1000.0 / iterations,
+        (double)totalReads / iterations, numFixes, numFixes ? totalError / numFixes : 0.0);
+
+    delete bench;
+    unlink(path);
+}
+
+/**
+ * @brief Measure fusion filter update time and accuracy with noisy Wi-Fi locations and occasional GNSS fixes
+ *
+ * A stationary device gets a Wi-Fi location (30 m accuracy, with up to about 30 m of error) every 10 seconds
+ * and a GNSS fix (5 m accuracy) every 10th update.
+ */
+static void runFusionBenchmark(size_t iterations) {
+    const double trueLat = 42.3601, trueLon = -71.0589;
+    auto errorMeters = [&](double lat, double lon) {
+        double dy = (lat - trueLat) * 111320.0;
+        double dx = (lon - trueLon) * 111320.0 * cos(trueLat * M_PI / 180.0);
+        return sqrt(dx * dx + dy * dy);
+    };
+
+    LocationFusionRK::FusionFilter filter;
+    filter.withSpeed(0.1f);
+
+    uint32_t seed = 12345;
+    auto noise = [&]() {
+        // Sum of uniform values, roughly normal with a standard deviation of 1
+        float sum = 0.0f;
+        for(int ii = 0; ii < 4; ii++) {
+            seed = seed * 1103515245 + 12345;
+            sum += (float)((seed >> 8) & 0xffff) / 65535.0f - 0.5f;
+        }
+        return sum * 1.732f;
+    };
+
+    std::vector<double> lats, lons;
+    std::vector<float> accs;
+    for(size_t ii = 0; ii < iterations; ii++) {
+        bool gnss = (ii % 10) == 9;
+        float acc = gnss ? 5.0f : 30.0f;
+        lats.push_back(trueLat + noise() * acc / 111320.0);
+        lons.push_back(trueLon + noise() * acc / (111320.0 * cos(trueLat * M_PI / 180.0)));
+        accs.push_back(acc);
+    }
+
+    double rawError = 0.0, fusedError = 0.0;
+    std::chrono::nanoseconds totalTime(0);
+    LocationFusionRK::FusedLocation location;
+    for(size_t ii = 0; ii < iterations; ii++) {
+        auto start = std::chrono::steady_clock::now();
+        filter.update(lats[ii], lons[ii], accs[ii], (uint64_t)ii * 10000, (accs[ii] < 10.0f) ? LocationFusionRK::FusionSource::gnss : LocationFusionRK::FusionSource::local);
+        totalTime += std::chrono::steady_clock::now() - start;
+
+        filter.getLocation(location);
+        if (ii >= 10) {
+            rawError += errorMeters(lats[ii], lons[ii]);
+            fusedError += errorMeters(location.lat, location.lon);
+        }
+    }
+    size_t count = (iterations > 10) ? iterations - 10 : 1;
+
+    printf("fusion filter: %.3f us/update, mean error raw %.1f m, fused %.1f m, estimated accuracy %.1f m\n", 
+        (double)std::chrono::duration_cast<std::chrono::nanoseconds>(totalTime).count() / 1000.0 / iterations,
+        rawError / count, fusedError / count, location.hAcc);
+}
+
+/**
+ * @brief Exposes a brute force evaluation of Geofences for comparison with the grid index
+ */
+class GeofencesBench : public LocationFusionRK::Geofences {
+public:
+    /**
+     * @brief Test every fence. Returns the number of fences containing the location.
+     */
+    size_t bruteForce(double lat, double lon, std::vector<uint32_t> &ids) const {
+        int32_t latE7 = (int32_t)(lat * 10000000.0), lonE7 = (int32_t)(lon * 10000000.0);
+        ids.clear();
+        for(const auto &fence : fences) {
+            if (contains(fence, latE7, lonE7)) {
+                ids.push_back(fence.id);
+            }
+        }
+        return ids.size();
+    }
+
+    /**
+     * @brief Number of fences the last evaluated location was inside
+     */
+    size_t insideCount() const {
+        return inside.size();
+    }
+};
+
+/**
+ * @brief Measure geofence evaluation with numFences fences, half circles and half 8-sided polygons, 50 to 300 meters
+ * across, at the same density as 1000 fences in a 20 km square. The locations are a random walk of 20 meter steps.
+ */
+static void runGeofenceBenchmark(size_t numFences, size_t iterations) {
+    const double lat0 = 42.30, lon0 = -71.15;
+    const double degPerMeterLat = 1.0 / 111320.0, degPerMeterLon = degPerMeterLat / cos(lat0 * M_PI / 180.0);
+    const double side = 20000.0 * sqrt((double)numFences / 1000.0);
+
+    uint32_t seed = 1;
+    auto random = [&]() {
+        seed = seed * 1103515245 + 12345;
+        return (double)((seed >> 8) & 0xffff) / 65536.0;
+    };
+
+    GeofencesBench geofences;
+    for(size_t ii = 0; ii < numFences; ii++) {
+        double lat = lat0 + random() * side * degPerMeterLat;
+        double lon = lon0 + random() * side * degPerMeterLon;
+        double radius = 50.0 + random() * 250.0;
+        if (ii % 2) {
+            geofences.addCircle((uint32_t)ii, lat, lon, (float)radius);
+        }
+        else {
+            double latLon[16];
+            for(int vv = 0; vv < 8; vv++) {
+                double angle = vv * M_PI / 4.0;
+                double r = radius * (0.6 + 0.4 * random());
+                latLon[vv * 2] = lat + sin(angle) * r * degPerMeterLat;
+                latLon[vv * 2 + 1] = lon + cos(angle) * r * degPerMeterLon;
+            }
+            geofences.addPolygon((uint32_t)ii, latLon, 8);
+        }
+    }
+
+    // Random walk, starting in the middle of the area
+    std::vector<std::pair<double, double>> path;
+    double lat = lat0 + side / 2 * degPerMeterLat, lon = lon0 + side / 2 * degPerMeterLon;
+    for(size_t ii = 0; ii < iterations; ii++) {
+        double angle = random() * 2.0 * M_PI;
+        lat += sin(angle) * 20.0 * degPerMeterLat;
+        lon += cos(angle) * 20.0 * degPerMeterLon;
+        path.push_back(std::make_pair(lat, lon));
+    }
+
+    std::vector<LocationFusionRK::Geofences::Event> events;
+    events.reserve(64);
+    geofences.evaluate(lat0, lon0, events); // Builds the index
+    events.clear();
+
+    size_t totalCandidates = 0, transitions = 0, mismatches = 0;
+    std::chrono::nanoseconds indexTime(0), bruteTime(0);
+    std::vector<uint32_t> ids;
+    for(const auto &point : path) {
+        auto start = std::chrono::steady_clock::now();
+        transitions += geofences.evaluate(point.first, point.second, events);
+        indexTime += std::chrono::steady_clock::now() - start;
+        totalCandidates += geofences.getLastCandidateCount();
+        events.clear();
+
+        start = std::chrono::steady_clock::now();
+        geofences.bruteForce(point.first, point.second, ids);
+        bruteTime += std::chrono::steady_clock::now() - start;
+
+        for(uint32_t id : ids) {
+            if (!geofences.isInside(id)) {
+                mismatches++;
+            }
+        }
+        if (geofences.insideCount() != ids.size()) {
+            mismatches++;
+        }
+    }
+
+    printf("%8zu %12.3f %12.3f %12.1f %12zu %12zu\n", numFences,
+        (double)indexTime.count() / 1000.0 / iterations, (double)bruteTime.count() / 1000.0 / iterations,
+        (double)totalCandidates / iterations, transitions, mismatches);
+}
+
+/**
+ * @brief Check geofences on both sides of the globe, whose longitudes span more than an int32_t in degrees * 10^7
+ */
+static bool checkGeofencesWorldwide() {
+    struct Place {
+        uint32_t id;
+        double lat;
+        double lon;
+    };
+    // San Francisco, Boston, London, Tokyo, Auckland: 297 degrees of longitude
+    const Place places[] = { { 1, 37.7749, -122.4194 }, { 2, 42.3601, -71.0589 }, { 3, 51.5074, -0.1278 }, 
+        { 4, 35.6762, 139.6503 }, { 5, -36.8485, 174.7633 } };
+
+    GeofencesBench geofences;
+    for(const Place &place : places) {
+        geofences.addCircle(place.id, place.lat, place.lon, 500.0f);
+    }
+    // A polygon around Tokyo, so the last column of the grid has two fences
+    const double tokyo[] = { 35.66, 139.63, 35.66, 139.67, 35.70, 139.67, 35.70, 139.63 };
+    geofences.addPolygon(6, tokyo, 4);
+
+    std::vector<LocationFusionRK::Geofences::Event> events;
+    std::vector<uint32_t> ids;
+    size_t mismatches = 0, enters = 0;
+    for(const Place &place : places) {
+        events.clear();
+        geofences.evaluate(place.lat, place.lon, events);
+        geofences.bruteForce(place.lat, place.lon, ids);
+        size_t expected = (place.id == 4) ? 2 : 1;
+        if (!geofences.isInside(place.id) || geofences.insideCount() != expected || ids.size() != expected) {
+            mismatches++;
+        }
+        for(const auto &event : events) {
+            if (event.transition == LocationFusionRK::Geofences::Transition::enter) {
+                enters++;
+            }
+        }
+    }
+    events.clear();
+    geofences.evaluate(0.0, 0.0, events);
+    // Auckland is exited
+    bool outsideOk = geofences.insideCount() == 0 && events.size() == 1;
+
+    bool ok = mismatches == 0 && enters == 6 && outsideOk;
+    printf("geofences spanning 297 degrees of longitude: %u mismatches, %u enters, %s outside all: %s\n", 
+        (unsigned)mismatches, (unsigned)enters, outsideOk ? "ok" : "bad", ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/**
+ * @brief Results from one benchmark row
+ */
+struct BenchResult {
+    size_t numAPs; //!< Number of access points returned by the simulated WiFi.scan()
+    double usPerCycle; //!< Mean wall time per cycle in microseconds
+    double allocsPerCycle; //!< Mean heap allocations per cycle
+    size_t peakHeap; //!< Largest peak heap growth during any single cycle in bytes
+    size_t payloadSize; //!< Size of the loc event payload in bytes
+};
+
+static std::vector<WiFiAccessPoint> makeAccessPoints(size_t count) {
+    std::vector<WiFiAccessPoint> aps;
+    for(size_t ii = 0; ii < count; ii++) {
+        uint8_t bssid[6] = { 0x3c, 0x37, 0x86, (uint8_t)(ii >> 8), (uint8_t)ii, (uint8_t)(ii * 37) };
+        // Scripted RSSI values that are not already sorted
+        int rssi = -40 - (int)((ii * 29) % 55);
+        aps.push_back(ParticleSim::makeAccessPoint(bssid, (uint8_t)(1 + (ii % 11)), rssi));
+    }
+    return aps;
+}
+
+/**
+ * @brief Compare two Variants, ignoring the order of keys in maps
+ */
+static bool variantEquals(const Variant &a, const Variant &b) {
+    if (a.isMap() && b.isMap()) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for(const auto &kv : a.asMapRef()) {
+            if (!b.has(kv.first.c_str()) || !variantEquals(kv.second, b.get(kv.first.c_str()))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (a.isArray() && b.isArray()) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for(int ii = 0; ii < a.size(); ii++) {
+            if (!variantEquals(a.at(ii), b.at(ii))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return a.toJSON() == b.toJSON();
+}
+
+/**
+ * @brief Check that the compact encoding decodes to the same loc event as the JSON encoding
+ */
+static bool checkCompactRoundTrip(LocationFusionBench &bench) {
+    Variant events[2];
+    for(int ii = 0; ii < 2; ii++) {
+        bench.withPayloadEncoding(ii ? LocationFusionRK::PayloadEncoding::compact : LocationFusionRK::PayloadEncoding::json);
+        bench.runCycle();
+
+        LocDecoder::decodeLoc(Variant::fromJSON(ParticleSim::getLastPublishData().c_str()), events[ii]);
+
+        // req_id is different for each publish
+        events[ii].set("req_id", 0);
+    }
+    return variantEquals(events[0], events[1]);
+}
+
+/**
+ * @brief Check that change detection suppresses periodic publishes until the access points change, the last publish
+ * is too old, or a publish is requested
+ */
+static bool checkChangeDetection() {
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withPublishPeriodic(10min).withChangeDetection(0.8, 1h);
+    ParticleSim::setAccessPoints(makeAccessPoints(10));
+
+    // Each step is: 1 if published, 0 if suppressed
+    std::vector<int> published;
+    auto step = [bench, &published]() {
+        size_t publishCount = ParticleSim::getPublishCount();
+        bench->runCycle();
+        published.push_back((int)(ParticleSim::getPublishCount() - publishCount));
+    };
+
+    step(); // first sample
+    step(); // same access points
+    ParticleSim::setAccessPoints(makeAccessPoints(30));
+    step(); // 20 new access points
+    step(); // same again
+    ParticleSim::advanceMs(61 * 60 * 1000);
+    step(); // last publish more than 1 hour ago
+    bench->requestPublish();
+    step(); // requested
+    ParticleSim::setAccessPoints(makeAccessPoints(10));
+
+    bool ok = published == std::vector<int>({ 1, 0, 1, 0, 1, 1 }) && bench->getPublishSuppressedCount() == 2;
+    printf("change detection: published %d %d %d %d %d %d (new, same, changed, same, stale, requested), %d suppressed: %s\n", 
+        published[0], published[1], published[2], published[3], published[4], published[5], bench->getPublishSuppressedCount(), ok ? "ok" : "FAILED");
+    delete bench;
+    return ok;
+}
+
+/**
+ * @brief Check loc-enhanced cache hits, misses, and least recently used eviction with a 2 entry cache
+ */
+static bool checkLocCache() {
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withLocCache(2);
+
+    // Three locations, each with its own 8 access points
+    auto setLocation = [](uint8_t location) {
+        std::vector<WiFiAccessPoint> aps;
+        for(int ii = 0; ii < 8; ii++) {
+            uint8_t bssid[6] = { 0x3c, 0x37, 0x86, location, (uint8_t)ii, 0x01 };
+            aps.push_back(ParticleSim::makeAccessPoint(bssid, 6, -45 - ii * 5));
+        }
+        ParticleSim::setAccessPoints(aps);
+    };
+
+    // Each step is: 1 if published (a cache miss), 0 if served from the cache
+    std::vector<int> published;
+    auto step = [bench, &published](bool respond) {
+        size_t publishCount = ParticleSim::getPublishCount();
+        if (respond) {
+            publishAndRespond(*bench, 42.3601, -71.0589);
+        }
+        else {
+            bench->runCycle();
+        }
+        published.push_back((int)(ParticleSim::getPublishCount() - publishCount));
+    };
+
+    setLocation(1);
+    step(true); // A: miss, cached
+    step(false); // A: hit
+    setLocation(2);
+    step(true); // B: miss, cached
+    setLocation(3);
+    step(true); // C: miss, cached, A is least recently used and is removed
+    setLocation(2);
+    step(false); // B: hit
+    setLocation(1);
+    step(true); // A: miss
+    ParticleSim::setAccessPoints(makeAccessPoints(10));
+
+    const LocationFusionRK::LocCache &cache = bench->getLocCache();
+    bool ok = published == std::vector<int>({ 1, 0, 1, 1, 0, 1 }) && cache.getHits() == 2 && cache.getMisses() == 4 && cache.size() == 2;
+    printf("loc cache: published %d %d %d %d %d %d (A, A, B, C, B, A), %u hits, %u misses, %u entries: %s\n", 
+        published[0], published[1], published[2], published[3], published[4], published[5], 
+        (unsigned)cache.getHits(), (unsigned)cache.getMisses(), (unsigned)cache.size(), ok ? "ok" : "FAILED");
+    delete bench;
+    return ok;
+}
+
+/**
+ * @brief Check that loc cache lookups return the right entry when the use counter overflows, and that saves to
+ * the persist path are limited by the save interval
+ */
+static bool checkLocCacheCounterAndSave() {
+    // Key 1 is used repeatedly so the renumbering at overflow moves it from the first slot
+    LocationFusionRK::LocCache cache;
+    cache.withMaxEntries(4);
+    for(uint32_t key = 1; key <= 4; key++) {
+        cache.insert(key, (double)key, 0.0, 10);
+    }
+    int wrongEntries = 0;
+    for(int ii = 0; ii < 70000; ii++) {
+        LocationFusionRK::LocCache::Entry entry;
+        if (!cache.lookup(1, entry) || entry.key != 1 || entry.latE7 != 10000000) {
+            wrongEntries++;
+        }
+    }
+    // Key 2 is now the least recently used
+    cache.insert(5, 5.0, 0.0, 10);
+    LocationFusionRK::LocCache::Entry entry;
+    bool evictedOk = !cache.lookup(2, entry) && cache.lookup(1, entry) && cache.lookup(3, entry) && cache.lookup(5, entry);
+
+    // The first insert saves, the second waits for the save interval
+    const char *path = "/tmp/locfcache-bench.dat";
+    unlink(path);
+    auto savedEntries = [path]() {
+        struct stat sb;
+        return (stat(path, &sb) == 0) ? (int)((sb.st_size - 8) / sizeof(LocationFusionRK::LocCache::Entry)) : -1;
+    };
+    LocationFusionRK::LocCache persisted;
+    persisted.withMaxEntries(4).withPersistPath(path).withSaveInterval(10min);
+    persisted.insert(1, 1.0, 0.0, 10);
+    int firstSaved = savedEntries();
+    persisted.insert(2, 2.0, 0.0, 10);
+    int secondSaved = savedEntries();
+    uint64_t dueWaitMs = persisted.getSaveDueMs() - System.millis();
+    ParticleSim::advanceMs(10 * 60000);
+    persisted.saveIfDirty();
+    int intervalSaved = savedEntries();
+    unlink(path);
+
+    bool ok = wrongEntries == 0 && evictedOk && firstSaved == 1 && secondSaved == 1 && intervalSaved == 2 && 
+        dueWaitMs > 599000 && dueWaitMs <= 600000 && persisted.getSaveDueMs() == LocationFusionRK::NO_WAKE_MS;
+    printf("loc cache counter overflow: %d wrong entries in 70000 lookups, eviction %s; saved %d, %d, then %d entries after %u ms: %s\n", 
+        wrongEntries, evictedOk ? "ok" : "bad", firstSaved, secondSaved, intervalSaved, (unsigned)dueWaitMs, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/**
+ * @brief Check that samples are batched into a single event when the batch is full, and that a partial batch is 
+ * published when the oldest sample reaches the maximum age
+ */
+static bool checkBatch() {
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withBatch(3, 5min);
+    ParticleSim::setAccessPoints(makeAccessPoints(10));
+
+    size_t publishCount = ParticleSim::getPublishCount();
+    bench->runAcquire();
+    bench->runAcquire();
+    bool heldOk = ParticleSim::getPublishCount() == publishCount;
+    bench->runAcquire();
+    bench->runPublishWait();
+    Variant fullBatch = Variant::fromJSON(ParticleSim::getLastPublishData().c_str());
+    bool fullOk = heldOk && ParticleSim::getPublishCount() == publishCount + 1 && fullBatch.size() == 3 && 
+        fullBatch.at(0).get("wps").size() == 10 && fullBatch.at(0).get("req_id").toInt() != fullBatch.at(2).get("req_id").toInt();
+
+    // A single sample is held until it is 5 minutes old, which is when the library next needs to run
+    bench->runAcquire();
+    bench->runIdle();
+    uint64_t flushInMs = bench->getNextWakeMs() - System.millis();
+    bool waitOk = ParticleSim::getPublishCount() == publishCount + 1 && flushInMs > 295000 && flushInMs <= 300000;
+    ParticleSim::advanceMs(300000);
+    bench->runIdle();
+    bench->runPublishWait();
+    Variant ageBatch = Variant::fromJSON(ParticleSim::getLastPublishData().c_str());
+    bool ageOk = waitOk && ParticleSim::getPublishCount() == publishCount + 2 && ageBatch.size() == 1;
+
+    bool ok = fullOk && ageOk;
+    printf("batch: %d samples in the full batch, partial batch flushed after %u ms with %d sample: %s\n", 
+        fullBatch.size(), (unsigned)flushInMs, ageBatch.size(), ok ? "ok" : "FAILED");
+    delete bench;
+    return ok;
+}
+
+/**
+ * @brief Check that every sample in a batch gets its own loc-enhanced request with the default maxLocRequests of 1
+ */
+static bool checkBatchLocRequests() {
+    static std::vector<LocationFusionRK::LocEnhancedResult> results;
+    results.clear();
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withBatch(3).withLocEnhancedResultHandler([](const LocationFusionRK::LocEnhancedResult &result) {
+        results.push_back(result);
+    });
+    ParticleSim::setAccessPoints(makeAccessPoints(10));
+
+    bench->runAcquire();
+    bench->runAcquire();
+    bench->runAcquire();
+    bench->runPublishWait();
+    size_t inFlight = bench->getLocRequestsInFlight();
+
+    // Respond to each sample, last first
+    Variant batch = Variant::fromJSON(ParticleSim::getLastPublishData().c_str());
+    std::vector<int> reqIds;
+    for(int ii = batch.size() - 1; ii >= 0; ii--) {
+        int reqId = batch.at(ii).get("req_id").toInt();
+        char json[160];
+        snprintf(json, sizeof(json), "{\"cmd\":\"loc-enhanced\",\"loc-enhanced\":{\"lat\":42.36%02d,\"lon\":-71.0589,\"h_acc\":30},\"req_id\":%d}", 
+            ii, reqId);
+        bench->receiveLocEnhanced(json);
+        reqIds.push_back(reqId);
+    }
+    bench->processResponses();
+
+    size_t matched = 0;
+    for(const auto &result : results) {
+        if (result.received && std::find(reqIds.begin(), reqIds.end(), result.reqId) != reqIds.end()) {
+            matched++;
+        }
+    }
+    bool ok = batch.size() == 3 && inFlight == 3 && matched == 3 && results.size() == 3 && bench->getLocRequestsInFlight() == 0;
+    printf("batch loc-enhanced: %u requests in flight, %u of %d samples matched: %s\n", 
+        (unsigned)inFlight, (unsigned)matched, batch.size(), ok ? "ok" : "FAILED");
+    delete bench;
+    return ok;
+}
+
+/**
+ * @brief Check the delays from the default, backoff, and movement publish schedulers, and that the library uses
+ * the delay after a sample
+ */
+static bool checkSchedulers() {
+    LocationFusionRK::ScheduleInfo info = {};
+    info.publishPeriod = 10min;
+    info.publishFailureRetry = 1min;
+    info.similarity = -1.0;
+
+    // Default: the period after a publish, the retry time after each failure
+    LocationFusionRK::PublishScheduler defaultScheduler;
+    info.event = LocationFusionRK::ScheduleEvent::published;
+    bool defaultOk = defaultScheduler.getNextPublishDelay(info) == 10min;
+    info.event = LocationFusionRK::ScheduleEvent::publishFailed;
+    info.consecutiveFailures = 3;
+    defaultOk = defaultOk && defaultScheduler.getNextPublishDelay(info) == 1min;
+
+    // Backoff without jitter doubles up to the maximum
+    LocationFusionRK::BackoffPublishScheduler backoff;
+    backoff.withBackoff(10min, 0.0);
+    std::vector<long long> backoffMinutes;
+    for(uint32_t failures = 1; failures <= 6; failures++) {
+        info.consecutiveFailures = failures;
+        backoffMinutes.push_back(std::chrono::duration_cast<std::chrono::minutes>(backoff.getNextPublishDelay(info)).count());
+    }
+    bool backoffOk = backoffMinutes == std::vector<long long>({ 1, 2, 4, 8, 10, 10 });
+
+    // Jitter of 0.5 subtracts up to half of the delay
+    backoff.withBackoff(10min, 0.5);
+    info.consecutiveFailures = 4;
+    bool jitterOk = true;
+    for(int ii = 0; ii < 100; ii++) {
+        std::chrono::milliseconds delay = backoff.getNextPublishDelay(info);
+        jitterOk = jitterOk && delay >= 4min && delay <= 8min;
+    }
+
+    // Movement: the stationary interval only when similar to the previous sample, backoff after failures
+    LocationFusionRK::MovementPublishScheduler movement;
+    movement.withIntervals(1min, 30min, 0.5).withBackoff(1h, 0.0);
+    info.event = LocationFusionRK::ScheduleEvent::published;
+    info.similarity = 0.9;
+    bool movementOk = movement.getNextPublishDelay(info) == 30min;
+    info.similarity = 0.2;
+    movementOk = movementOk && movement.getNextPublishDelay(info) == 1min;
+    info.similarity = -1.0;
+    movementOk = movementOk && movement.getNextPublishDelay(info) == 1min;
+    info.event = LocationFusionRK::ScheduleEvent::publishFailed;
+    info.consecutiveFailures = 3;
+    movementOk = movementOk && movement.getNextPublishDelay(info) == 4min;
+
+    // The library schedules the next publish using the similarity of each sample to the previous one
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withPublishPeriodic(10min).withPublishScheduler(&movement);
+    ParticleSim::setAccessPoints(makeAccessPoints(10));
+    bench->runCycle();
+    uint64_t firstDelayMs = bench->getNextPublishMs() - System.millis();
+    bench->runCycle();
+    uint64_t sameDelayMs = bench->getNextPublishMs() - System.millis();
+    bool libraryOk = firstDelayMs == 60000 && sameDelayMs == 30 * 60000;
+    delete bench;
+
+    bool ok = defaultOk && backoffOk && jitterOk && movementOk && libraryOk;
+    printf("publish schedulers: default %s, backoff %lld %lld %lld %lld %lld %lld min, jitter %s, movement %s, library %u then %u ms: %s\n", 
+        defaultOk ? "ok" : "bad", backoffMinutes[0], backoffMinutes[1], backoffMinutes[2], backoffMinutes[3], backoffMinutes[4], backoffMinutes[5], 
+        jitterOk ? "ok" : "bad", movementOk ? "ok" : "bad", (unsigned)firstDelayMs, (unsigned)sameDelayMs, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/**
+ * @brief Check that a full status queue keeps the oldest status changes, counts the discarded ones, and accepts
+ * changes again once read
+ */
+static bool checkStatusQueueOverflow() {
+    static std::vector<LocationFusionRK::Status> handled;
+    auto handler = [](LocationFusionRK::Status status) {
+        handled.push_back(status);
+    };
+
+    // The status changes for 3 cycles and then 1 more, from handlers called on the worker thread
+    handled.clear();
+    LocationFusionBench *reference = new LocationFusionBench();
+    reference->withStatusHandler("", handler);
+    for(int ii = 0; ii < 3; ii++) {
+        reference->runCycle();
+    }
+    std::vector<LocationFusionRK::Status> expected = handled;
+    reference->runCycle();
+    size_t lastCycleChanges = handled.size() - expected.size();
+    delete reference;
+
+    // Queue of 3, rounded up to 4. Nothing is read during the cycles.
+    handled.clear();
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withStatusQueue(3).withStatusHandler("", handler);
+    for(int ii = 0; ii < 3; ii++) {
+        bench->runCycle();
+    }
+    bool notCalledOk = handled.empty();
+    size_t processed = bench->processStatusQueue();
+    bool oldestOk = expected.size() > 4 && processed == 4 && std::equal(handled.begin(), handled.end(), expected.begin());
+    uint32_t overflow = bench->getStatusQueueOverflowCount();
+    bool overflowOk = overflow == expected.size() - 4;
+
+    // After reading, new changes are queued again
+    bench->runCycle();
+    LocationFusionRK::Status status;
+    size_t afterRead = 0;
+    while(bench->getStatusEvent(status)) {
+        afterRead++;
+    }
+    bool resumedOk = lastCycleChanges <= 4 && afterRead == lastCycleChanges && bench->getStatusQueueOverflowCount() == overflow;
+    delete bench;
+
+    bool ok = notCalledOk && oldestOk && overflowOk && resumedOk;
+    printf("status queue overflow: %u changes, %u kept, %u discarded, %u queued after reading: %s\n", (unsigned)expected.size(), 
+        (unsigned)processed, (unsigned)overflow, (unsigned)afterRead, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+/**
+ * @brief Check that the stand-in WiFi.scan() delivers the results present when the scan started, even if the
+ * access points are replaced from the scan callback, which the previous results buffer would not survive
+ */
+static bool checkScanResultsCopied() {
+    struct ScanState {
+        std::vector<WiFiAccessPoint> received;
+        bool replaced = false;
+    } state;
+    ParticleSim::setAccessPoints(makeAccessPoints(10));
+    int result = WiFi.scan([](WiFiAccessPoint *wap, void *cookie) {
+        ScanState *state = (ScanState *)cookie;
+        if (!state->replaced) {
+            // Replacing with a larger list reallocates the simulation's vector
+            ParticleSim::setAccessPoints(makeAccessPoints(64));
+            state->replaced = true;
+        }
+        state->received.push_back(*wap);
+    }, &state);
+
+    std::vector<WiFiAccessPoint> expected = makeAccessPoints(10);
+    bool ok = result == 10 && state.received.size() == expected.size();
+    for(size_t ii = 0; ok && ii < expected.size(); ii++) {
+        ok = memcmp(state.received[ii].bssid, expected[ii].bssid, sizeof(expected[ii].bssid)) == 0 && 
+            state.received[ii].rssi == expected[ii].rssi;
+    }
+    // Restore the 10 access points the previous checks left
+    ParticleSim::setAccessPoints(expected);
+    printf("scan results with access points replaced during the scan: %d returned, %u received: %s\n", 
+        result, (unsigned)state.received.size(), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static BenchResult runBenchmark(LocationFusionBench &bench, size_t numAPs, size_t iterations) {
+    BenchResult result = {};
+    result.numAPs = numAPs;
+
+    ParticleSim::setAccessPoints(makeAccessPoints(numAPs));
+
+    // Warm up so one-time allocations are not counted
+    for(size_t ii = 0; ii < 10; ii++) {
+        bench.runCycle();
+    }
+
+    size_t totalAllocs = 0;
+    std::chrono::nanoseconds totalTime(0);
+
+    for(size_t ii = 0; ii < iterations; ii++) {
+        ParticleSim::HeapStats before = ParticleSim::getHeapStats();
+        ParticleSim::resetHeapPeak();
+
+        auto start = std::chrono::steady_clock::now();
+        bench.runCycle();
+        totalTime += std::chrono::steady_clock::now() - start;
+
+        ParticleSim::HeapStats after = ParticleSim::getHeapStats();
+        totalAllocs += after.allocCount - before.allocCount;
+        if (after.peakBytes - before.bytesInUse > result.peakHeap) {
+            result.peakHeap = after.peakBytes - before.bytesInUse;
+        }
+    }
+
+    result.usPerCycle = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(totalTime).count() / 1000.0 / iterations;
+    result.allocsPerCycle = (double)totalAllocs / iterations;
+    result.payloadSize = ParticleSim::getLastPublishData().length();
+
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    size_t iterations = 2000;
+    if (argc > 1) {
+        iterations = (size_t)atoi(argv[1]);
+    }
+
+    CellularGlobalIdentity cgi = {};
+    cgi.mobile_country_code = 310;
+    cgi.mobile_network_code = 410;
+    cgi.location_area_code = 0x2a0b;
+    cgi.cell_id = 0x0c8a1f03;
+    ParticleSim::setTower(cgi);
+    ParticleSim::setConnected(true);
+
+    LocationFusionBench *bench = new LocationFusionBench();
+    bench->withAddWiFi(true).withAddTower(true);
+
+    const size_t apCounts[] = { 0, 10, 30, 64 };
+
+    // Mode 0: Variant encoder, 1: streaming encoder, 2: streaming encoder with the strongest 10 access points,
+    // 3: streaming encoder with compact payload encoding
+    for(int mode = 0; mode < 4; mode++) {
+        bench->withStreamingEncoder(mode != 0, 4096);
+        bench->withMaxWiFiAccessPoints((mode == 2) ? 10 : 0);
+        bench->withPayloadEncoding((mode == 3) ? LocationFusionRK::PayloadEncoding::compact : LocationFusionRK::PayloadEncoding::json);
+
+        const char *modeNames[] = { "Variant encoder", "streaming encoder", "streaming encoder, max 10 APs", "streaming encoder, compact encoding" };
+        printf("stateBuildPublish -> statePublishWait, %s, %zu iterations per row\n", modeNames[mode], iterations);
+        printf("%8s %12s %12s %12s %12s\n", "APs", "us/cycle", "allocs", "peak heap", "payload");
+
+        bool allocsOk = true;
+        for(size_t numAPs : apCounts) {
+            BenchResult result = runBenchmark(*bench, numAPs, iterations);
+            printf("%8zu %12.2f %12.1f %12zu %12zu\n", result.numAPs, result.usPerCycle, result.allocsPerCycle, result.peakHeap, result.payloadSize);
+            allocsOk = allocsOk && result.allocsPerCycle == 1.0;
+        }
+        if (mode != 0) {
+            // The only allocation is the copy of the event data that CloudEvent::data() keeps
+            printf("1 allocation per cycle, the event data copy in CloudEvent: %s\n", allocsOk ? "ok" : "FAILED");
+        }
+        printf("\n");
+    }
+
+    // Compact encoding round trip through the reference decoder, for both encoders
+    bool roundTripOk = true;
+    for(int streaming = 0; streaming < 2; streaming++) {
+        bench->withStreamingEncoder(streaming != 0, 4096);
+        for(size_t numAPs : apCounts) {
+            ParticleSim::setAccessPoints(makeAccessPoints(numAPs));
+            if (!checkCompactRoundTrip(*bench)) {
+                printf("compact round trip FAILED, %s encoder, %zu APs\n", streaming ? "streaming" : "Variant", numAPs);
+                roundTripOk = false;
+            }
+        }
+    }
+    bench->withPayloadEncoding(LocationFusionRK::PayloadEncoding::json);
+    printf("compact encoding round trip: %s\n\n", roundTripOk ? "ok" : "FAILED");
+
+    // Neighbor cells from a simulated modem provider. The serving cell is also reported in the neighbor list
+    // (without cid) and there are more neighbors than the default capacity of 6.
+    SimTowerProvider simTowerProvider;
+    simTowerProvider.withTowers({
+        SimTowerProvider::makeTower(true, 0x0c8a1f03, LocationFusionRK::TowerEntry::UNKNOWN_EARFCN, LocationFusionRK::TowerEntry::UNKNOWN_PCI, -97, -11),
+        SimTowerProvider::makeTower(false, 0, 5230, 142, -112, -14),
+        SimTowerProvider::makeTower(false, 0, 5230, 301, -95, -9),
+        SimTowerProvider::makeTower(false, 0x0c8a1f03, 2000, 77, -91, -8),
+        SimTowerProvider::makeTower(false, 0, 5230, 88, -120, -18),
+        SimTowerProvider::makeTower(false, 0, 2000, 12, -104, -12),
+        SimTowerProvider::makeTower(false, 0, 66486, 410, -108, -13),
+        SimTowerProvider::makeTower(false, 0, 66486, 411, -101, -10),
+        SimTowerProvider::makeTower(false, 0, 2000, 77, -93, -9),
+    });
+    bench->withTowerProvider(&simTowerProvider);
+    ParticleSim::setAccessPoints(makeAccessPoints(10));
+
+    bench->runCycle();
+    const LocationFusionRK::TowerList &towerList = bench->getTowerList();
+    bool towersOk = towerList.size() == LocationFusionRK::TowerList::DEFAULT_MAX_ENTRIES && 
+        towerList.getEntry(0).serving && towerList.getEntry(0).pci == 77 && towerList.getEntry(0).rsrp == -91;
+    for(size_t ii = 2; ii < towerList.size(); ii++) {
+        if (towerList.getEntry(ii).rsrp > towerList.getEntry(ii - 1).rsrp) {
+            towersOk = false;
+        }
+    }
+    printf("neighbor towers: %zu reported, %zu kept, %zu dropped: %s\n", (size_t)9, towerList.size(), towerList.getDroppedCount(), towersOk ? "ok" : "FAILED");
+
+    size_t towerPayloadSize[2];
+    for(int streaming = 0; streaming < 2; streaming++) {
+        bench->withStreamingEncoder(streaming != 0, 4096);
+        if (!checkCompactRoundTrip(*bench)) {
+            printf("compact round trip with neighbor towers FAILED, %s encoder\n", streaming ? "streaming" : "Variant");
+            roundTripOk = false;
+        }
+    }
+    for(int compact = 0; compact < 2; compact++) {
+        bench->withPayloadEncoding(compact ? LocationFusionRK::PayloadEncoding::compact : LocationFusionRK::PayloadEncoding::json);
+        bench->runCycle();
+        towerPayloadSize[compact] = ParticleSim::getLastPublishData().length();
+    }
+    printf("10 APs and 6 towers payload: JSON %zu bytes, compact %zu bytes\n\n", towerPayloadSize[0], towerPayloadSize[1]);
+    bench->withPayloadEncoding(LocationFusionRK::PayloadEncoding::json);
+    bench->withTowerProvider(nullptr);
+
+    // Pipelined loc-enhanced requests. The responses arrive in the reverse order and are matched by req_id.
+    const size_t numRequests = 4;
+    static std::vector<int> resultReqIds;
+    bench->withMaxLocRequests(numRequests).withLocEnhancedResultHandler([](const LocationFusionRK::LocEnhancedResult &result) {
+        if (result.received && result.hAcc == 30) {
+            resultReqIds.push_back(result.reqId);
+        }
+    });
+    std::vector<int> reqIds;
+    for(size_t ii = 0; ii < numRequests; ii++) {
+        bench->runCycle();
+        reqIds.push_back(Variant::fromJSON(ParticleSim::getLastPublishData().c_str()).get("req_id").toInt());
+    }
+    size_t inFlight = bench->getLocRequestsInFlight();
+    for(auto it = reqIds.rbegin(); it != reqIds.rend(); it++) {
+        char json[128];
+        snprintf(json, sizeof(json), "{\"cmd\":\"loc-enhanced\",\"loc-enhanced\":{\"lat\":42.3601,\"lon\":-71.0589,\"h_acc\":30},\"req_id\":%d}", *it);
+        bench->receiveLocEnhanced(json);
+    }
+    bench->processResponses();
+    bool pipelineOk = inFlight == numRequests && bench->getLocRequestsInFlight() == 0 && 
+        resultReqIds.size() == numRequests && std::is_permutation(resultReqIds.begin(), resultReqIds.end(), reqIds.begin());
+    printf("pipelined loc-enhanced: %zu requests in flight, %zu responses matched out of order: %s\n\n", inFlight, resultReqIds.size(), pipelineOk ? "ok" : "FAILED");
+
+    // Runtime reconfiguration using the same update as the loc-config cmd, applied before the next sample
+    LocationFusionRK::Config savedConfig = bench->getConfig();
+    LocationFusionRK::Config config = savedConfig;
+    config.updateFromVariant(Variant::fromJSON("{\"cmd\":\"loc-config\",\"period\":600,\"tower\":false,\"max_aps\":3}"));
+    bench->withConfig(config);
+    bench->runCycle();
+    Variant configPublish = Variant::fromJSON(ParticleSim::getLastPublishData().c_str());
+    bool configOk = configPublish.get("wps").size() == 3 && !configPublish.has("towers") &&
+        bench->getPublishFrequency() == LocationFusionRK::PublishFrequency::periodic && bench->getConfig().publishPeriod == 600s;
+    printf("loc-config: %d APs, towers %s: %s\n\n", configPublish.get("wps").size(), configPublish.has("towers") ? "included" : "removed", configOk ? "ok" : "FAILED");
+    bench->withConfig(savedConfig);
+
+    // An application scan is reused by the next loc event within the max age, then the loc event scans again.
+    // The clock is advanced first so the scans from the earlier cycles are too old.
+    ParticleSim::advanceMs(61000);
+    LocationFusionRK::ScanStats scanStatsBefore = bench->getScanStats();
+    LocationFusionRK::WAPList appList;
+    bench->withScanMaxAge(60s);
+    bench->getRecentScan(appList, 60s);
+    bench->runCycle();
+    ParticleSim::advanceMs(61000);
+    bench->runCycle();
+    bench->withScanMaxAge(0ms);
+    LocationFusionRK::ScanStats scanStatsAfter = bench->getScanStats();
+    uint32_t scansMade = scanStatsAfter.scans - scanStatsBefore.scans;
+    uint32_t scansReused = scanStatsAfter.reused - scanStatsBefore.reused;
+    bool scanCacheOk = scansMade == 2 && scansReused == 1 && appList.size() > 0;
+    printf("scan reuse: %u scans, %u reused, %u ms scanning in total: %s\n", (unsigned)scansMade, (unsigned)scansReused, (unsigned)scanStatsAfter.scanMs, scanCacheOk ? "ok" : "FAILED");
+
+    // Each list's limits apply to a reused scan: a loc event limited to 3 access points does not limit the
+    // application's list, and an application list limited to 5 does not limit the loc event
+    ParticleSim::advanceMs(61000);
+    bench->withMaxWiFiAccessPoints(3).withScanMaxAge(60s);
+    bench->runCycle();
+    size_t eventAPs = Variant::fromJSON(ParticleSim::getLastPublishData().c_str()).get("wps").size();
+    LocationFusionRK::WAPList fullList, limitedList;
+    limitedList.withMaxEntries(5);
+    bool reusedFull = bench->getRecentScan(fullList, 60s);
+    bool reusedLimited = bench->getRecentScan(limitedList, 60s);
+    bench->withMaxWiFiAccessPoints(0);
+    bench->runCycle();
+    size_t unlimitedEventAPs = Variant::fromJSON(ParticleSim::getLastPublishData().c_str()).get("wps").size();
+    bench->withScanMaxAge(0ms);
+    bool scanLimitsOk = reusedFull && reusedLimited && eventAPs == 3 && fullList.size() == 10 && limitedList.size() == 5 && unlimitedEventAPs == 10;
+    printf("scan reuse with different limits: event %u, application %u, limited application %u, unlimited event %u: %s\n\n", 
+        (unsigned)eventAPs, (unsigned)fullList.size(), (unsigned)limitedList.size(), (unsigned)unlimitedEventAPs, scanLimitsOk ? "ok" : "FAILED");
+
+    // Sleep scheduling: after a periodic publish, the next wake is the loc-enhanced timeout, then after it
+    // times out, the next publish. A requested publish prevents sleeping.
+    bench->withPublishPeriodic(10min);
+    bench->runCycle();
+    bench->runIdle();
+    SystemSleepConfiguration sleepConfig;
+    bool sleepOk = bench->prepareSleep(sleepConfig);
+    uint32_t locTimeoutSleepMs = sleepConfig.getDurationMs();
+    ParticleSim::advanceMs(61000);
+    bench->runIdle();
+    sleepOk = sleepOk && bench->prepareSleep(sleepConfig);
+    uint32_t publishSleepMs = sleepConfig.getDurationMs();
+    bench->requestPublish();
+    bool sleepBlocked = !bench->prepareSleep(sleepConfig);
+    bench->runCycle();
+    bench->processResponses();
+    bench->withConfig(savedConfig);
+    bool sleepScheduleOk = sleepOk && sleepBlocked && locTimeoutSleepMs > 55000 && locTimeoutSleepMs <= 60000 && 
+        publishSleepMs > 534000 && publishSleepMs <= 539000;
+    printf("sleep scheduling: %u ms until loc-enhanced timeout, %u ms until publish, %s after requestPublish: %s\n\n", 
+        (unsigned)locTimeoutSleepMs, (unsigned)publishSleepMs, sleepBlocked ? "awake" : "asleep", sleepScheduleOk ? "ok" : "FAILED");
+
+    // Behavior checks using separate instances
+    checkBatchRetry();
+    checkLocCacheEmptyFingerprint();
+    checkOfflineRecords();
+    checkEarlyLocResponse();
+    checkAddToEventOrder();
+    checkOfflineQueue();
+    checkSleepDisconnected();
+    checkAutoStackSize();
+    checkChangeDetection();
+    checkLocCache();
+    checkLocCacheCounterAndSave();
+    checkBatch();
+    checkBatchLocRequests();
+    checkSchedulers();
+    checkStatusQueueOverflow();
+    checkScanResultsCopied();
+    checkGeofencesWorldwide();
+    printf("\n");
+
+    // On-device Wi-Fi positioning from a flash resident index. Reads are file reads of 16 bytes, except the last
+    // of each lookup, which reads up to a 256 byte block.
+    printf("on-device Wi-Fi positioning, 16 APs per scan, %zu iterations per row\n", iterations);
+    printf("%8s %12s %12s %12s %12s %12s\n", "entries", "build ms", "us/estimate", "reads", "fixes", "error m");
+    for(size_t numEntries : { 1000, 10000, 50000 }) {
+        runWiFiPositionBenchmark(numEntries, iterations);
+    }
+    printf("\n");
+
+    runFusionBenchmark(iterations);
+    printf("\n");
+
+    // Geofence evaluation cost with the grid index compared to testing every fence
+    printf("geofence evaluation, random walk of %zu locations\n", iterations);
+    printf("%8s %12s %12s %12s %12s %12s\n", "fences", "us/eval", "brute us", "candidates", "transitions", "mismatches");
+    for(size_t numFences : { 10, 100, 1000, 10000 }) {
+        runGeofenceBenchmark(numFences, iterations);
+    }
+    printf("\n");
+
+    // cmd function dispatch. Only the matched cmd is parsed into a Variant.
+    const char *cmdNames[] = { "loc-enhanced", "loc-stats", "loc-config", "reboot", "set-mode", "get-config", "ping", "led" };
+    for(const char *cmdName : cmdNames) {
+        bench->withCmdHandler(cmdName, [](const Variant &data) {});
+    }
+    printf("cmd function dispatch, %zu iterations per row\n", iterations);
+    printf("%-32s %12s %12s\n", "cmd", "us/call", "allocs");
+    runCmdBenchmark(*bench, "matched loc-enhanced", 
+        "{\"cmd\":\"loc-enhanced\",\"loc-enhanced\":{\"lat\":42.3601,\"lon\":-71.0589,\"h_acc\":30},\"req_id\":12}", iterations);
+    runCmdBenchmark(*bench, "unmatched cmd", 
+        "{\"cmd\":\"other-app\",\"data\":{\"a\":[1,2,3,4,5,6,7,8],\"b\":\"some longer string value\"},\"req_id\":12}", iterations);
+    printf("\n");
+
+    // Worker thread wakeups while idle between periodic publishes, over a simulated minute on both code paths
+    uint32_t blockingWakeups = countIdleWakeups(false);
+    uint32_t pollingWakeups = countIdleWakeups(true);
+    bool wakeupsOk = blockingWakeups >= 1 && blockingWakeups <= 2 && pollingWakeups == 60000;
+    printf("worker thread idle for a simulated minute: %u wakeups blocking, %u wakeups polling every 1 ms: %s\n", 
+        (unsigned)blockingWakeups, (unsigned)pollingWakeups, wakeupsOk ? "ok" : "FAILED");
+
+    static unsigned long handlerDelayMs = 0;
+    LocationFusionRK::instance()
+        .withAddWiFi(true)
+        .withAddTower(true)
+        .withPublishPeriodic(5min)
+        .withAddToEventHandler([](Variant &eventData, Variant &locVariant) {
+            // Simulates a slow data source, such as GNSS
+            delay(handlerDelayMs);
+        })
+        .setup();
+    delay(100);
+
+    // Latency from requestPublish() to the publish, which requires waking the worker thread
+    size_t publishCount = ParticleSim::getPublishCount();
+    auto start = std::chrono::steady_clock::now();
+    LocationFusionRK::instance().requestPublish();
+    while(ParticleSim::getPublishCount() == publishCount) {
+        delay(0);
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    printf("requestPublish to publish: %lld us\n", (long long)elapsed.count());
+
+    // Latency from requestPublish() to the publish with slow data sources. The Wi-Fi scan runs concurrently 
+    // with the tower and then the add to event handler, so this should be close to the slower of the scan and
+    // the tower plus the handler (300 ms), instead of the sum of all three (550 ms).
+    const unsigned long scanMs = 300, towerMs = 100;
+    handlerDelayMs = 150;
+    ParticleSim::setScanDurationMs(scanMs);
+    ParticleSim::setTowerDurationMs(towerMs);
+    delay(10);
+
+    publishCount = ParticleSim::getPublishCount();
+    start = std::chrono::steady_clock::now();
+    LocationFusionRK::instance().requestPublish();
+    while(ParticleSim::getPublishCount() == publishCount) {
+        delay(1);
+    }
+    elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+    long long elapsedMs = (long long)elapsed.count() / 1000;
+    bool concurrentOk = elapsedMs >= (long long)scanMs && elapsedMs < (long long)(scanMs + towerMs);
+    printf("requestPublish to publish with scan %lu ms, tower %lu ms, handler %lu ms: %lld ms: %s\n", 
+        scanMs, towerMs, handlerDelayMs, elapsedMs, concurrentOk ? "ok" : "FAILED");
+
+    // Per-stage latency histograms collected by the library during the singleton publishes
+    char statsBuf[512];
+    JSONBufferWriter statsWriter(statsBuf, sizeof(statsBuf) - 1);
+    LocationFusionRK::instance().writeLatencyStats(statsWriter);
+    statsBuf[std::min(statsWriter.dataSize(), sizeof(statsBuf) - 1)] = 0;
+    printf("latency stats (us): %s\n", statsBuf);
+
+    // Stack high water marks (host stacks are larger, so these are only comparable between host runs) and heap usage
+    JSONBufferWriter resWriter(statsBuf, sizeof(statsBuf) - 1);
+    LocationFusionRK::instance().writeResourceStats(resWriter);
+    statsBuf[std::min(resWriter.dataSize(), sizeof(statsBuf) - 1)] = 0;
+    printf("resource stats (bytes): %s\n", statsBuf);
+
+    return 0;
+}
@@ -1,5 +1,8 @@
 #include "LocationFusionRK.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 static Logger _locfLog("app.locf");
 
 LocationFusionRK *LocationFusionRK::_instance;
@@ -12,7 +15,10 @@ LocationFusionRK &LocationFusionRK::instance() {
     return *_instance;
 }
 
-LocationFusionRK::LocationFusionRK() {
+LocationFusionRK::LocationFusionRK() : statusQueueHead(0), statusQueueTail(0), statusQueueOverflow(0) {
+#if Wiring_WiFi 
+    os_mutex_create(&scanMutex);
+#endif // Wiring_WiFi 
 }
 
 LocationFusionRK::~LocationFusionRK() {
@@ -23,14 +29,109 @@ LocationFusionRK &LocationFusionRK::withCmdHandler(const char *cmd, std::functio
     cmdHandler.cmd = cmd;
     cmdHandler.handler = handler;
 
-    commandHandlers.push_back(cmdHandler);
+    // Keep sorted by cmd for findCmdHandlers(). Handlers for the same cmd are called in the order they were added.
+    commandHandlers.update([&cmdHandler](std::vector<CmdHandler> &handlers) {
+        auto it = std::upper_bound(handlers.begin(), handlers.end(), cmdHandler, [](const CmdHandler &a, const CmdHandler &b) {
+            return strcmp(a.cmd.c_str(), b.cmd.c_str()) < 0;
+        });
+        handlers.insert(it, std::move(cmdHandler));
+    });
+    return *this;
+}
+
+LocationFusionRK &LocationFusionRK::updateConfig(std::function<void(Config &config)> fn) {
+    // The mutex does not exist before setup(), but then the worker thread is not running either
+    if (mutex) {
+        lock();
+    }
+    fn(config);
+    configChanged = true;
+    if (mutex) {
+        unlock();
+    }
+    wake();
     return *this;
 }
 
+LocationFusionRK::Config LocationFusionRK::getConfig() {
+    if (!mutex) {
+        return config;
+    }
+    lock();
+    Config result = config;
+    unlock();
+    return result;
+}
+
+void LocationFusionRK::applyConfig() {
+    if (!configChanged) {
+        return;
+    }
+#if Wiring_WiFi
+    if (scanBusy) {
+        // The scan thread is filling wapList, apply after it completes
+        return;
+    }
+#endif // Wiring_WiFi
+
+    std::chrono::milliseconds previousPeriod = activeConfig.publishPeriod;
+
+    if (mutex) {
+        lock();
+    }
+    activeConfig = config;
+    configChanged = false;
+    if (mutex) {
+        unlock();
+    }
+
+#if Wiring_WiFi
+    wapList.withMaxEntries(activeConfig.maxWiFiAccessPoints).withFilterLocallyAdministered(activeConfig.filterLocallyAdministered);
+    scanThreadList.withMaxEntries(activeConfig.maxWiFiAccessPoints).withFilterLocallyAdministered(activeConfig.filterLocallyAdministered);
+#endif // Wiring_WiFi
+    towerList.withMaxEntries(activeConfig.maxTowers);
+
+    if (activeConfig.publishFrequency == PublishFrequency::periodic && activeConfig.publishPeriod < previousPeriod) {
+        // A shorter period takes effect now, a longer one after the next publish
+        nextPublishMs = std::min(nextPublishMs, System.millis() + activeConfig.publishPeriod.count());
+    }
+    _locfLog.trace("config applied");
+}
+
 
 void LocationFusionRK::setup() {
     os_mutex_create(&mutex);
 
+    applyConfig();
+
+    loadStackSize();
+
+    locCache.load();
+
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+    wifiPositionIndex.open();
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+
+    if (offlineQueue.isEnabled() && offlineQueue.open()) {
+        offlineBuffer = new uint8_t[offlineQueue.getMaxDataSize()];
+        _locfLog.info("offline queue has %u samples", (unsigned)offlineQueue.size());
+    }
+
+    if (streamingEncoder && !streamingBuffer) {
+        streamingBuffer = new char[streamingBufferSize];
+    }
+
+    // Only one wake request needs to be queued, but allow a few so wake() never blocks
+    os_queue_create(&wakeQueue, sizeof(uint8_t), 4, 0);
+    System.on(cloud_status, cloudStatusHandlerStatic);
+
+#if Wiring_WiFi 
+    if (activeConfig.addWiFi) {
+        os_queue_create(&scanQueue, sizeof(uint8_t), 1, 0);
+        scanThread = new Thread("LocationFusionScan", [this]() { return scanThreadFunction(); }, OS_THREAD_PRIORITY_DEFAULT, scanThreadStackSize);
+    }
+#endif // Wiring_WiFi 
+
     thread = new Thread("LocationFusionRK", [this]() { return threadFunction(); }, OS_THREAD_PRIORITY_DEFAULT, threadStackSize);
 
     if (enableCmdFunction) {
@@ -38,6 +139,30 @@ void LocationFusionRK::setup() {
 
         
         withCmdHandler("loc-enhanced", locEnhancedStatic);
+
+        if (encodingCmd) {
+            withCmdHandler("loc-enc", [this](const Variant &data) {
+                payloadEncoding = (data.get("enc").toInt() == (int)PayloadEncoding::compact) ? PayloadEncoding::compact : PayloadEncoding::json;
+                _locfLog.info("payload encoding set to %d", (int)payloadEncoding);
+            });
+        }
+
+        if (statsCmd) {
+            withCmdHandler("loc-stats", [this](const Variant &data) {
+                statsClearRequested = data.get("clear").toBool();
+                statsRequested = true;
+                wake();
+            });
+        }
+
+        if (configCmd) {
+            withCmdHandler("loc-config", [this](const Variant &data) {
+                updateConfig([&data](Config &config) {
+                    config.updateFromVariant(data);
+                });
+                _locfLog.info("config updated by loc-config");
+            });
+        }
     }
 }
 
@@ -45,61 +170,363 @@ void LocationFusionRK::updateStatus(Status status) {
     if (this->status != status) {
         this->status = status;
 
-        for(auto it = statusHandlers.begin(); it != statusHandlers.end(); it++) {
-            auto handler = *it;
+        if (statusQueue) {
+            // Never blocks or calls user code; the reader calls the handlers
+            uint32_t head = statusQueueHead.load(std::memory_order_relaxed);
+            uint32_t tail = statusQueueTail.load(std::memory_order_acquire);
+            if (head - tail >= statusQueueSize) {
+                statusQueueOverflow.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            statusQueue[head & (statusQueueSize - 1)] = status;
+            statusQueueHead.store(head + 1, std::memory_order_release);
+            return;
+        }
+
+        auto handlers = statusHandlers.get();
+        for(const auto &handler : *handlers) {
+            handler(status);
+        }
+    }
+}
+
+LocationFusionRK &LocationFusionRK::withStatusQueue(size_t size) {
+    delete[] statusQueue;
+    statusQueue = nullptr;
+    statusQueueSize = 0;
+
+    if (size) {
+        // Power of 2 so the indexes can wrap around
+        statusQueueSize = 1;
+        while(statusQueueSize < size) {
+            statusQueueSize <<= 1;
+        }
+        statusQueue = new Status[statusQueueSize];
+    }
+    return *this;
+}
+
+bool LocationFusionRK::getStatusEvent(Status &status) {
+    if (!statusQueue) {
+        return false;
+    }
+
+    uint32_t tail = statusQueueTail.load(std::memory_order_relaxed);
+    uint32_t head = statusQueueHead.load(std::memory_order_acquire);
+    if (tail == head) {
+        return false;
+    }
+    status = statusQueue[tail & (statusQueueSize - 1)];
+    statusQueueTail.store(tail + 1, std::memory_order_release);
+    return true;
+}
 
+size_t LocationFusionRK::processStatusQueue() {
+    size_t count = 0;
+    Status status;
+    while(getStatusEvent(status)) {
+        auto handlers = statusHandlers.get();
+        for(const auto &handler : *handlers) {
             handler(status);
         }
+        count++;
     }
+    return count;
 }
 
 
 
 os_thread_return_t LocationFusionRK::threadFunction(void) {
+    workerStackMonitor.paint();
+
     while(true) {
-        // Put your code to run in the worker thread here
+        waitMs = 0;
         stateHandler(*this);
-        delay(1);
+
+        if (waitMs) {
+            // Block until woken by wake() or the timeout set by the state handler
+            uint8_t item;
+            os_queue_take(wakeQueue, &item, (system_tick_t)waitMs, 0);
+            wakeCount++;
+        }
     }
 }
 
+#if Wiring_WiFi 
+os_thread_return_t LocationFusionRK::scanThreadFunction(void) {
+    scanStackMonitor.paint();
+
+    while(true) {
+        uint8_t item;
+        if (os_queue_take(scanQueue, &item, CONCURRENT_WAIT_FOREVER, 0) == 0) {
+            scanForEvent(scanThreadList);
+            scanBusy = false;
+            wake();
+        }
+    }
+}
+
+void LocationFusionRK::scanForEvent(WAPList &list) {
+    unsigned long startUs = micros();
+    if (!getRecentScan(list, activeConfig.scanMaxAge)) {
+        recordLatency(LatencyStage::wifiScan, startUs);
+    }
+}
+
+bool LocationFusionRK::getRecentScan(WAPList &list, std::chrono::milliseconds maxAge) {
+    bool reused = false;
+
+    // Held while scanning so a caller on another thread waits for the scan and can then reuse it
+    os_mutex_lock(scanMutex);
+    uint64_t startMs = System.millis();
+    if (maxAge.count() > 0 && scanCacheMs && (startMs - scanCacheMs) <= (uint64_t)maxAge.count()) {
+        scanStats.reused++;
+        reused = true;
+    }
+    else {
+        // The cache has no limits or filter so each caller's list settings can be applied when copying
+        scanCache.scan();
+        scanCacheMs = startMs;
+        scanStats.scans++;
+        scanStats.scanMs += (uint32_t)(System.millis() - startMs);
+    }
+    list.copyFrom(scanCache);
+    os_mutex_unlock(scanMutex);
+
+    _locfLog.trace("getRecentScan %s %u access points", reused ? "reused" : "scanned", (unsigned)list.size());
+    return reused;
+}
+
+LocationFusionRK::ScanStats LocationFusionRK::getScanStats() const {
+    os_mutex_lock(scanMutex);
+    ScanStats result = scanStats;
+    os_mutex_unlock(scanMutex);
+    return result;
+}
+#endif // Wiring_WiFi 
+
+void LocationFusionRK::wake() {
+    if (wakeQueue) {
+        uint8_t item = 0;
+        os_queue_put(wakeQueue, &item, 0, 0);
+    }
+}
+
+void LocationFusionRK::waitFor(uint64_t ms) {
+    // The worker thread is about to block, so this is the time it must run again for sleep scheduling
+    uint64_t wakeMs = calculateNextWakeMs();
+    lock();
+    nextWakeMs = wakeMs;
+    unlock();
+
+    if (locRequestsInFlight) {
+        // Wake up to time out the next loc-enhanced request
+        uint64_t now = System.millis();
+        uint64_t deadlineWaitMs = (nextLocDeadlineMs > now) ? (nextLocDeadlineMs - now) : 1;
+        if (deadlineWaitMs < ms) {
+            ms = deadlineWaitMs;
+        }
+    }
+    if (ms == 0) {
+        ms = 1;
+    }
+    if (ms > maxWaitMs) {
+        ms = maxWaitMs;
+    }
+    waitMs = ms;
+}
+
+// [static]
+void LocationFusionRK::cloudStatusHandlerStatic(system_event_t event, int param) {
+    if (_instance) {
+        _instance->wake();
+    }
+}
+
+// [static]
+void LocationFusionRK::eventStatusChangeStatic(CloudEvent event) {
+    if (_instance) {
+        _instance->wake();
+    }
+}
+
+uint64_t LocationFusionRK::calculateNextWakeMs() const {
+    if (status != Status::idle || statsRequested) {
+        return 0;
+    }
+
+    // Same order of checks as stateIdle and stateConnected
+    uint64_t result = NO_WAKE_MS;
+    bool publishDue = manualPublishRequested || (activeConfig.publishFrequency == PublishFrequency::once && publishCount == 0);
+    bool offlinePending = offlineQueue.size() && offlineBuffer;
+    if (!Particle.connected()) {
+        // Only samples for the offline queue are taken while disconnected. Everything else waits for the cloud
+        // connection, which may be overdue, so wake after the retry time to allow the device to reconnect.
+        bool periodic = activeConfig.publishFrequency == PublishFrequency::periodic;
+        if (offlineBuffer && periodic) {
+            result = nextPublishMs;
+        }
+        if (publishDue || (periodic && !offlineBuffer) || !batchSamples.empty() || offlinePending) {
+            result = std::min(result, System.millis() + publishFailureRetry.count());
+        }
+    }
+    else
+    if (consecutiveFailures && !priorityPublishRequested) {
+        // After a failure, publishes, batches, and the offline queue wait for the retry time
+        if (publishDue || activeConfig.publishFrequency == PublishFrequency::periodic || !batchSamples.empty() || offlinePending) {
+            result = nextPublishMs;
+        }
+    }
+    else {
+        if (publishDue || isBatchReady()) {
+            return 0;
+        }
+        if (activeConfig.publishFrequency == PublishFrequency::periodic) {
+            result = nextPublishMs;
+        }
+        if (!batchSamples.empty() && batchMaxAge.count()) {
+            result = std::min(result, batchSamples.front().sampleMs + batchMaxAge.count());
+        }
+        if (offlinePending) {
+            result = std::min(result, nextDrainMs);
+        }
+    }
+
+    if (locRequestsInFlight) {
+        result = std::min(result, nextLocDeadlineMs);
+    }
+    result = std::min(result, locCache.getSaveDueMs());
+    return result;
+}
+
+uint64_t LocationFusionRK::getNextWakeMs() {
+    if (manualPublishRequested || configChanged || status != Status::idle || !mutex) {
+        // Not handled by the worker thread yet
+        return 0;
+    }
+    lock();
+    uint64_t result = nextWakeMs;
+    unlock();
+    return result;
+}
+
+bool LocationFusionRK::prepareSleep(SystemSleepConfiguration &config, std::chrono::milliseconds minDuration) {
+    uint64_t wakeMs = getNextWakeMs();
+    if (wakeMs == NO_WAKE_MS) {
+        return true;
+    }
+
+    uint64_t now = System.millis();
+    if (wakeMs <= now || (wakeMs - now) < (uint64_t)minDuration.count()) {
+        return false;
+    }
+    config.duration(std::chrono::milliseconds(wakeMs - now));
+    _locfLog.trace("prepareSleep %lu ms", (unsigned long)(wakeMs - now));
+    return true;
+}
+
 void LocationFusionRK::stateIdle() {
+    applyConfig();
+    processLocRequests();
+    locCache.saveIfDirty();
     updateStatus(Status::idle);
 
+    if (cycleStartFreeMemory) {
+        sampleHeap(true);
+        saveStackSize();
+    }
+
     if (Particle.connected()) {
         stateHandler = &LocationFusionRK::stateConnected;
         return;
     }
+
+    if (offlineBuffer && activeConfig.publishFrequency == PublishFrequency::periodic) {
+        // Keep taking samples to save in the offline queue
+        uint64_t now = System.millis();
+        if (now >= nextPublishMs) {
+            stateHandler = &LocationFusionRK::stateBuildPublish;
+            return;
+        }
+        waitFor(nextPublishMs - now);
+        return;
+    }
+
+    // Woken by cloudStatusHandlerStatic when the connection status changes
+    waitFor(maxWaitMs);
 }
 
 void LocationFusionRK::stateConnected() {
+    applyConfig();
+    processLocRequests();
+    locCache.saveIfDirty();
     updateStatus(Status::idle);
 
+    if (cycleStartFreeMemory) {
+        sampleHeap(true);
+        saveStackSize();
+    }
+
     if (!Particle.connected()) {
         stateHandler = &LocationFusionRK::stateIdle;
         return;
     }
 
+    if (statsRequested) {
+        publishStats();
+    }
+
+    if (consecutiveFailures && !priorityPublishRequested) {
+        // After a failure, wait for the time set by the scheduler even if a publish was requested, unless
+        // it's high priority. This also applies to batches and the offline queue, which are kept after a failure.
+        uint64_t now = System.millis();
+        if (now < nextPublishMs) {
+            waitFor(nextPublishMs - now);
+            return;
+        }
+    }
+
+    if (offlineQueue.size() && offlineBuffer && System.millis() >= nextDrainMs) {
+        publishOfflineQueue();
+        return;
+    }
+
+    if (isBatchReady()) {
+        // Publish the batched samples without taking a new sample
+        publishBatch();
+        return;
+    }
+
     if (!manualPublishRequested) {
-        switch(publishFrequency) {
+        switch(activeConfig.publishFrequency) {
             case PublishFrequency::manual:
                 // If we get here, manual publish mode and publish not requested
+                // requestPublish() wakes the thread
+                waitFor(limitWaitForOfflineQueue(maxWaitMs));
                 return;
 
             case PublishFrequency::once: 
                 if (publishCount > 0) {
                     // Already published and not manually requested
+                    waitFor(limitWaitForOfflineQueue(maxWaitMs));
                     return;
                 }
                 break;   
                 
-            case PublishFrequency::periodic:
+            case PublishFrequency::periodic: {
                 // nextPublishMs is a uint64_t, so it's safe to compare this way as it never wraps
-                if (System.millis() < nextPublishMs) {
+                uint64_t now = System.millis();
+                if (now < nextPublishMs) {
                     // Not time to publish
+                    uint64_t wakeMs = nextPublishMs;
+                    if (!batchSamples.empty() && batchMaxAge.count()) {
+                        wakeMs = std::min(wakeMs, batchSamples.front().sampleMs + batchMaxAge.count());
+                    }
+                    waitFor(limitWaitForOfflineQueue((wakeMs > now) ? (wakeMs - now) : 1));
                     return;
                 }
                 break;
+            }
         }
 
     }
@@ -108,314 +535,3381 @@ void LocationFusionRK::stateConnected() {
     stateHandler = &LocationFusionRK::stateBuildPublish;
 }
 
-void LocationFusionRK::stateBuildPublish() {
-    updateStatus(Status::publishing);
-    eventData = Variant();
-    locEnhancedReceived = false;
-
-    eventData.set("cmd", Variant("loc"));
-    if (Time.isValid()) {
-        eventData.set("time", Time.now());
-    }
-
-    if (locEnhancedHandlers.size() > 0) {
-        eventData.set("loc_cb", 1);
+void LocationFusionRK::clearLatencyStats() {
+    for(auto &histogram : latencyHistograms) {
+        histogram.clear();
     }
+}
 
-    Variant locVariant;
-    locVariant.set("lck", 0);
-
-#if Wiring_WiFi 
-    if (addWiFi) {
-        LocationFusionRK::WAPList wapList;
-
-        wapList.scan();
-        if (wapList.size()) {
-            Variant arrayVariant;
+void LocationFusionRK::writeLatencyStats(JSONWriter &writer) const {
+    writer.beginObject();
+    writeLatencyStatsKeys(writer);
+    writer.endObject();
+}
 
-            wapList.toVariant(arrayVariant);
-            
-            eventData.set("wps", arrayVariant);
-        }
+void LocationFusionRK::writeLatencyStatsKeys(JSONWriter &writer) const {
+    // Same order as LatencyStage
+    const char *names[(size_t)LatencyStage::count] = { "scan", "tower", "handler", "build", "publish", "loc_enhanced" };
 
+    for(size_t ii = 0; ii < (size_t)LatencyStage::count; ii++) {
+        writer.name(names[ii]);
+        latencyHistograms[ii].toJsonWriter(writer);
     }
-#endif // Wiring_WiFi 
-
-#if Wiring_Cellular
-    if (addTower) {
-        LocationFusionRK::ServingTower servingTower;
-        if (servingTower.get() == SYSTEM_ERROR_NONE) {
-            Variant servingTowerVariant;
-            servingTower.toVariant(servingTowerVariant);
+}
 
-            Variant arrayVariant;
-            arrayVariant.append(servingTowerVariant);
+void LocationFusionRK::writeResourceStats(JSONWriter &writer) const {
+    writer.beginObject();
+    writer.name("stack").value((unsigned)threadStackSize);
+    writer.name("stack_hwm").value((unsigned)getStackHighWaterMark());
+    writer.name("stack_rec").value((unsigned)getRecommendedStackSize());
+    writer.name("scan_stack_hwm").value((unsigned)getScanStackHighWaterMark());
+    writer.name("heap_growth").value((int)lastCycleHeapGrowth);
+    writer.name("heap_max").value((unsigned)maxCycleHeapUsage);
+#if Wiring_WiFi 
+    ScanStats stats = getScanStats();
+    writer.name("scans").value((unsigned)stats.scans);
+    writer.name("scan_reused").value((unsigned)stats.reused);
+    writer.name("scan_ms").value((unsigned)stats.scanMs);
+#endif // Wiring_WiFi 
+    writer.endObject();
+}
 
-            eventData.set("towers", arrayVariant);
-        }
+void LocationFusionRK::sampleHeap(bool endOfCycle) {
+    if (!cycleStartFreeMemory) {
+        return;
     }
-#endif // Wiring_Cellular
-
-    // Call handlers to add custom data (such as GNSS). GNSS gets added to an inner loc key.
-    for(auto it = addToEventHandlers.begin(); it != addToEventHandlers.end(); it++) {
-        auto handler = *it;
 
-        handler(eventData, locVariant);
+    uint32_t freeMemory = System.freeMemory();
+    if (freeMemory < cycleMinFreeMemory) {
+        cycleMinFreeMemory = freeMemory;
+    }
+    if (cycleStartFreeMemory - cycleMinFreeMemory > maxCycleHeapUsage) {
+        maxCycleHeapUsage = cycleStartFreeMemory - cycleMinFreeMemory;
     }
-    eventData.set("loc", locVariant);
 
-    eventData.set("req_id", locRequestId++);
+    if (endOfCycle) {
+        lastCycleHeapGrowth = (int32_t)cycleStartFreeMemory - (int32_t)freeMemory;
+        cycleStartFreeMemory = 0;
+    }
+}
 
-    Log.info("Publishing loc event...");
-    event.name("loc");
-    event.data(eventData);
-    Particle.publish(event);
+uint32_t LocationFusionRK::getStackConfigHash() const {
+    // Changing any of these options invalidates the saved stack measurements
+    uint32_t values[] = {
+        activeConfig.addWiFi, activeConfig.addTower, (uint32_t)addToEventHandlers.size(), (uint32_t)addToJsonWriterHandlers.size(),
+        (uint32_t)locEnhancedHandlers.size(), (uint32_t)statusHandlers.size(), (uint32_t)(statusQueue != nullptr),
+        streamingEncoder, (uint32_t)batchMaxSamples, offlineQueue.isEnabled(), locCache.isEnabled(), wantLocEnhanced()
+    };
+    return OfflineQueue::crc32(0, values, sizeof(values));
+}
 
-    stateHandler = &LocationFusionRK::statePublishWait;
+uint32_t LocationFusionRK::getRequiredStackPaths() const {
+    uint32_t required = STACK_PATH_PUBLISH;
+#if Wiring_WiFi 
+    if (activeConfig.addWiFi) {
+        required |= STACK_PATH_WIFI;
+    }
+#endif // Wiring_WiFi 
+    if (locCache.isEnabled()) {
+        required |= STACK_PATH_LOC_CACHE;
+    }
+    if (batchMaxSamples > 1) {
+        required |= STACK_PATH_BATCH;
+    }
+    return required;
 }
 
+// File format: magic (4 bytes), config hash (4 bytes), worker thread high water mark (4 bytes)
+static const uint32_t STACK_SIZE_MAGIC = 0x4c465331; // LFS1
 
+void LocationFusionRK::loadStackSize() {
+    if (!stackPersistPath) {
+        return;
+    }
 
-void LocationFusionRK::statePublishWait() {
-    if (event.isSent()) {
-        updateStatus(Status::publishSuccess);
-        _locfLog.info("publish succeeded");
-        event.clear();
+    int fd = open(stackPersistPath, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
 
-        if (locEnhancedHandlers.size()) {
-            stateTime = millis();
-            stateHandler = &LocationFusionRK::stateLocEnhancedWait;
+    uint32_t data[3];
+    if (read(fd, data, sizeof(data)) == sizeof(data) && data[0] == STACK_SIZE_MAGIC) {
+        if (data[1] == getStackConfigHash() && data[2]) {
+            savedStackHighWaterMark = data[2];
+            threadStackSize = StackMonitor::getRecommendedSize(data[2]);
+            _locfLog.info("using stack size %u from measured %u", (unsigned)threadStackSize, (unsigned)data[2]);
         }
         else {
-            stateHandler = &LocationFusionRK::stateConnected;
+            _locfLog.info("configuration changed, not using measured stack size");
         }
-
-        manualPublishRequested = false;
-        publishCount++;
-
-        nextPublishMs = System.millis() + publishPeriod.count();
     }
-    else 
-    if (!event.isOk()) {
-        updateStatus(Status::publishFail);
-        _locfLog.info("publish failed error=%d", event.error());
-        event.clear();
-        stateHandler = &LocationFusionRK::stateConnected;
-        
-        nextPublishMs = System.millis() + publishFailureRetry.count();
-    }
-
+    close(fd);
 }
 
-void LocationFusionRK::stateLocEnhancedWait() {
-    updateStatus(Status::locEnhancedWait);
+void LocationFusionRK::saveStackSize() {
+    if (!stackPersistPath) {
+        return;
+    }
 
-    if (locEnhancedReceived) {
-        updateStatus(Status::locEnhancedSuccess);
-        stateHandler = &LocationFusionRK::stateConnected;
+    size_t highWaterMark = getStackHighWaterMark();
+    if (highWaterMark <= savedStackHighWaterMark) {
         return;
     }
-    if (millis() - stateTime >= locEnhancedTimeout.count()) {
-        updateStatus(Status::locEnhancedFail);
-        stateHandler = &LocationFusionRK::stateConnected;
+
+    // A saved measurement from a previous boot already covers every path, and a larger one is always safe to save
+    uint32_t required = getRequiredStackPaths();
+    if (!savedStackHighWaterMark && (stackPathsRun & required) != required) {
         return;
     }
-}
+    savedStackHighWaterMark = highWaterMark;
 
+    // Write to a temporary file and rename so a power loss does not leave a partial file
+    char tempPath[128];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", stackPersistPath);
 
-int LocationFusionRK::functionHandler(const Variant &eventData) {
-     _locfLog.trace("cmd function %s", eventData.toJSON().c_str());
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        _locfLog.error("could not open %s", tempPath);
+        return;
+    }
 
-     String cmd = eventData.get("cmd").toString();
+    uint32_t data[3] = { STACK_SIZE_MAGIC, getStackConfigHash(), (uint32_t)highWaterMark };
+    bool success = (write(fd, data, sizeof(data)) == sizeof(data));
+    close(fd);
 
-    for(auto it = commandHandlers.begin(); it != commandHandlers.end(); it++) {
-        CmdHandler cmdHandler = *it;
-        
-        if (cmd == cmdHandler.cmd) {
-            cmdHandler.handler(eventData);
-        }
+    if (success) {
+        rename(tempPath, stackPersistPath);
+    }
+    else {
+        unlink(tempPath);
     }
-    return 0;
 }
 
+void LocationFusionRK::publishStats() {
+    if (statsEvent.isSending()) {
+        // Still publishing the previous request
+        return;
+    }
+    statsRequested = false;
+
+    char buf[768];
+    JSONBufferWriter writer(buf, sizeof(buf));
+    writer.beginObject();
+    writeLatencyStatsKeys(writer);
+    writer.name("res");
+    writeResourceStats(writer);
+    writer.endObject();
+    if (writer.dataSize() > writer.bufferSize()) {
+        _locfLog.error("loc-stats does not fit in buffer");
+        return;
+    }
 
-// [static]
-int LocationFusionRK::functionHandlerStatic(String cmd) {
-
-    Variant eventData = Variant::fromJSON(cmd.c_str());
-
-    return instance().functionHandler(eventData);
-}
+    statsEvent.clear();
+    statsEvent.name("loc-stats");
+    statsEvent.data(buf, writer.dataSize(), ContentType::JSON);
+    Particle.publish(statsEvent);
 
-void LocationFusionRK::locEnhanced(const Variant &eventData) {
-    locEnhancedReceived = true;
-    for(auto it = locEnhancedHandlers.begin(); it != locEnhancedHandlers.end(); it++) {
-        (*it)(eventData);
+    if (statsClearRequested) {
+        clearLatencyStats();
     }
 }
 
+void LocationFusionRK::stateBuildPublish() {
+    // Usually already applied by stateConnected or stateIdle
+    applyConfig();
 
-// [static] 
-void LocationFusionRK::locEnhancedStatic(const Variant &eventData) {
-    instance().locEnhanced(eventData);
-}
-
+    cycleStartFreeMemory = cycleMinFreeMemory = System.freeMemory();
 
+    updateStatus(Status::publishing);
+    acquireStartMs = System.millis();
 
 #if Wiring_WiFi 
-
-//
-// WAPEntry
-//
+    wapListValid = false;
+    if (activeConfig.addWiFi) {
+        if (scanThread) {
+            // If a scan from a previous publish is still running, its results are used instead of starting another
+            if (!scanBusy) {
+                scanBusy = true;
+                uint8_t item = 0;
+                os_queue_put(scanQueue, &item, 0, 0);
+            }
+        }
+        else {
+            scanForEvent(wapList);
+            wapListValid = true;
+        }
+    }
+#endif // Wiring_WiFi 
+
+    // The tower and add to event handlers run on this thread while the Wi-Fi scan runs on the scan thread
+    if (activeConfig.addTower) {
+        TowerProvider *provider = towerProvider;
+#if Wiring_Cellular
+        if (!provider) {
+            provider = &servingTowerProvider;
+        }
+#endif // Wiring_Cellular
+        towerList.clear();
+        if (provider) {
+            unsigned long startUs = micros();
+            towerResult = provider->getTowers(towerList);
+            recordLatency(LatencyStage::tower, startUs);
+        }
+    }
+
+    eventData = Variant();
+    locVariant = Variant();
+
+    // Call handlers to add custom data (such as GNSS). GNSS gets added to an inner loc key. The library's data
+    // is not available yet; buildEventVariant() adds it and the handlers' keys replace keys of the same name.
+    auto handlers = addToEventHandlers.get();
+    for(const auto &handler : *handlers) {
+        unsigned long startUs = micros();
+        handler(eventData, locVariant);
+        recordLatency(LatencyStage::addToEventHandler, startUs);
+    }
+
+    processGnssLocation();
+
+    sampleHeap();
+    stateHandler = &LocationFusionRK::stateAcquireWait;
+}
+
+void LocationFusionRK::stateAcquireWait() {
+#if Wiring_WiFi 
+    if (activeConfig.addWiFi && scanThread) {
+        if (scanBusy) {
+            uint64_t elapsed = System.millis() - acquireStartMs;
+            if (elapsed < (uint64_t)acquisitionTimeout.count()) {
+                // Woken by the scan thread when the scan completes
+                waitFor(acquisitionTimeout.count() - elapsed);
+                return;
+            }
+            _locfLog.info("Wi-Fi scan did not complete in time, publishing without Wi-Fi");
+        }
+        else {
+            wapList.copyFrom(scanThreadList);
+            wapListValid = true;
+        }
+    }
+    if (wapListValid) {
+        stackPathsRun |= STACK_PATH_WIFI;
+    }
+#endif // Wiring_WiFi 
+
+    buildFingerprint(pendingFingerprint);
+
+    // Used by publish schedulers that depend on movement
+    sampleSimilarity = -1.0;
+    if (!pendingFingerprint.isEmpty() && !previousFingerprint.isEmpty()) {
+        sampleSimilarity = pendingFingerprint.similarity(previousFingerprint);
+    }
+    previousFingerprint = pendingFingerprint;
+
+    if (shouldSuppressPublish()) {
+        publishSuppressedCount++;
+        _locfLog.info("publish suppressed, similarity=%d%%", (int)(lastSimilarity * 100));
+        updateStatus(Status::publishSuppressed);
+
+        schedulePublish(ScheduleEvent::suppressed);
+        stateHandler = &LocationFusionRK::stateConnected;
+        return;
+    }
+
+    if (offlineBuffer && !Particle.connected()) {
+        queueOfflineSample();
+        return;
+    }
+
+    int reqId = locRequestId++;
+
+    bool servedLocally = false;
+    bool skipCloud = false;
+    pendingCacheKeyValid = false;
+    if (locCache.isEnabled()) {
+        RadioFingerprint keyFingerprint;
+        buildFingerprint(keyFingerprint, locCacheKeyBssids);
+        pendingCacheKey = keyFingerprint.hash();
+        pendingCacheKeyValid = !keyFingerprint.isEmpty();
+
+        if (pendingCacheKeyValid && serveFromLocCache(reqId)) {
+            _locfLog.info("location found in cache");
+            stackPathsRun |= STACK_PATH_LOC_CACHE;
+            servedLocally = true;
+            skipCloud = locCacheSkipCloud;
+        }
+    }
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+    if (!servedLocally && wifiPositionIndex.isEnabled() && serveFromWiFiPosition(reqId)) {
+        _locfLog.info("location estimated on-device");
+        servedLocally = true;
+        skipCloud = wifiPositionSkipCloud;
+    }
+#else
+    (void)servedLocally;
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+    if (skipCloud) {
+        _locfLog.info("not publishing");
+        recordPublishSuccess();
+        updateStatus(Status::locEnhancedSuccess);
+        stateHandler = &LocationFusionRK::stateConnected;
+        return;
+    }
+
+    initPendingLocRequest(reqId);
+
+    unsigned long buildStartUs = micros();
+    size_t streamingSize = 0;
+    if (streamingEncoder && addToEventHandlers.empty()) {
+        streamingSize = buildEventStreaming(reqId);
+        if (!streamingSize) {
+            _locfLog.info("loc event does not fit in streaming buffer (%u bytes), using Variant", (unsigned)streamingBufferSize);
+        }
+    }
+    if (!streamingSize) {
+        buildEventVariant(reqId);
+    }
+
+    if (batchMaxSamples > 1) {
+        BatchSample sample;
+        sample.reqId = reqId;
+        sample.sampleMs = System.millis();
+        if (streamingSize) {
+            sample.json = String(streamingBuffer, streamingSize);
+        }
+        else {
+            sample.json = eventData.toJSON();
+        }
+        sample.locRequest = pendingLocRequest;
+        batchSamples.push_back(sample);
+        recordLatency(LatencyStage::build, buildStartUs);
+
+        if (!isBatchReady()) {
+            _locfLog.trace("added sample to batch, %u samples", (unsigned)batchSamples.size());
+            manualPublishRequested = false;
+            schedulePublish(ScheduleEvent::sampled);
+            updateStatus(Status::idle);
+            stateHandler = &LocationFusionRK::stateConnected;
+            return;
+        }
+        publishBatch();
+        return;
+    }
+
+    event.name("loc");
+    if (streamingSize) {
+        event.data(streamingBuffer, streamingSize, ContentType::JSON);
+    }
+    else {
+        event.data(eventData);
+    }
+    recordLatency(LatencyStage::build, buildStartUs);
+
+    if (wantLocEnhanced()) {
+        addLocRequest(pendingLocRequest);
+    }
+
+    Log.info("Publishing loc event...");
+    publishEvent();
+}
+
+void LocationFusionRK::publishEvent() {
+    sampleHeap();
+    stackPathsRun |= STACK_PATH_PUBLISH;
+
+    event.onStatusChange(eventStatusChangeStatic);
+    publishStartUs = micros();
+    Particle.publish(event);
+
+    stateHandler = &LocationFusionRK::statePublishWait;
+}
+
+bool LocationFusionRK::isBatchReady() const {
+    if (batchSamples.empty()) {
+        return false;
+    }
+    if (manualPublishRequested || batchSamples.size() >= batchMaxSamples) {
+        return true;
+    }
+    if (batchMaxAge.count() && System.millis() - batchSamples.front().sampleMs >= (uint64_t)batchMaxAge.count()) {
+        return true;
+    }
+
+    // Ready if the samples no longer fit in a single event
+    size_t size = 1;
+    for(const auto &sample : batchSamples) {
+        size += sample.json.length() + 1;
+    }
+    return size > maxEventSize;
+}
+
+void LocationFusionRK::publishBatch() {
+    // Include as many samples as fit in a single event, but always at least one
+    size_t size = 1;
+    batchInFlight = 0;
+    for(const auto &sample : batchSamples) {
+        if (batchInFlight && size + sample.json.length() + 1 > maxEventSize) {
+            break;
+        }
+        size += sample.json.length() + 1;
+        batchInFlight++;
+    }
+
+    batchData = "[";
+    for(size_t ii = 0; ii < batchInFlight; ii++) {
+        if (ii) {
+            batchData += ",";
+        }
+        batchData += batchSamples[ii].json;
+    }
+    batchData += "]";
+
+    updateStatus(Status::publishing);
+    event.name("loc");
+    event.data(batchData.c_str(), batchData.length(), ContentType::JSON);
+
+    if (wantLocEnhanced()) {
+        for(size_t ii = 0; ii < batchInFlight; ii++) {
+            addLocRequest(batchSamples[ii].locRequest);
+        }
+    }
+
+    _locfLog.info("Publishing loc event with %u samples...", (unsigned)batchInFlight);
+    stackPathsRun |= STACK_PATH_BATCH;
+    publishEvent();
+}
+
+void LocationFusionRK::queueOfflineSample() {
+    size_t size = encodeOfflineRecord(offlineBuffer, offlineQueue.getMaxDataSize());
+    if (offlineQueue.append(offlineBuffer, size)) {
+        _locfLog.info("saved sample to offline queue, %u samples", (unsigned)offlineQueue.size());
+        updateStatus(Status::sampleQueued);
+
+        // Change detection compares against the last sample saved
+        publishedFingerprint = pendingFingerprint;
+        lastPublishMs = System.millis();
+    }
+    else {
+        _locfLog.error("could not save sample to offline queue");
+    }
+
+    manualPublishRequested = false;
+    priorityPublishRequested = false;
+    schedulePublish(ScheduleEvent::sampled);
+    stateHandler = &LocationFusionRK::stateIdle;
+}
+
+void LocationFusionRK::publishOfflineQueue() {
+    size_t size = 1;
+    size_t numSamples = 0;
+    offlineInFlight = 0;
+
+    batchData = "[";
+    for(size_t ii = 0; ii < offlineQueue.size(); ii++) {
+        Variant sample;
+        size_t recordSize = offlineQueue.read(ii, offlineBuffer);
+        if (!recordSize || !decodeOfflineRecord(offlineBuffer, recordSize, locRequestId, sample)) {
+            // Corrupted records are removed along with the ones that are published
+            _locfLog.info("discarding invalid offline queue record");
+            offlineInFlight++;
+            continue;
+        }
+
+        String json = sample.toJSON();
+        if (numSamples && size + json.length() + 1 > maxEventSize) {
+            break;
+        }
+        if (numSamples) {
+            batchData += ",";
+        }
+        batchData += json;
+        size += json.length() + 1;
+        locRequestId++;
+        numSamples++;
+        offlineInFlight++;
+    }
+    batchData += "]";
+
+    if (!numSamples) {
+        offlineQueue.consume(offlineInFlight);
+        offlineInFlight = 0;
+        return;
+    }
+
+    updateStatus(Status::publishing);
+    event.name("loc");
+    event.data(batchData.c_str(), batchData.length(), ContentType::JSON);
+
+    _locfLog.info("Publishing loc event with %u offline samples...", (unsigned)numSamples);
+    publishEvent();
+}
+
+uint64_t LocationFusionRK::limitWaitForOfflineQueue(uint64_t ms) const {
+    if (offlineQueue.size() && offlineBuffer) {
+        uint64_t now = System.millis();
+        uint64_t drainWaitMs = (nextDrainMs > now) ? (nextDrainMs - now) : 1;
+        if (drainWaitMs < ms) {
+            return drainWaitMs;
+        }
+    }
+    return ms;
+}
+
+// Offline queue record format, see encodeOfflineRecord() in LocationFusionRK.h
+static const uint8_t OFFLINE_RECORD_VERSION = 2;
+static const uint8_t OFFLINE_FLAG_TIME = 0x01;
+
+// Version 1 records have a 12-byte serving tower (mcc, mnc, lac, cid) instead of TowerEntry records. They can
+// still be in the queue after updating.
+static const uint8_t OFFLINE_RECORD_VERSION_1 = 1;
+static const uint8_t OFFLINE_FLAG_V1_TOWER = 0x02;
+static const size_t OFFLINE_V1_TOWER_SIZE = 12;
+static const size_t OFFLINE_HEADER_SIZE = 8;
+
+static void putU16(uint8_t *p, uint16_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void putU32(uint8_t *p, uint32_t value) {
+    putU16(p, (uint16_t)value);
+    putU16(p + 2, (uint16_t)(value >> 16));
+}
+
+static uint16_t getU16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t getU32(const uint8_t *p) {
+    return (uint32_t)getU16(p) | ((uint32_t)getU16(p + 2) << 16);
+}
+
+size_t LocationFusionRK::encodeOfflineRecord(uint8_t *buf, size_t bufSize) const {
+    if (bufSize < OFFLINE_HEADER_SIZE + TowerEntry::COMPACT_RECORD_SIZE + 4) {
+        return 0;
+    }
+
+    uint8_t flags = 0;
+    size_t offset = OFFLINE_HEADER_SIZE;
+
+    uint32_t time = 0;
+    if (Time.isValid()) {
+        time = (uint32_t)Time.now();
+        flags |= OFFLINE_FLAG_TIME;
+    }
+
+    // The serving tower always fits. Neighbors are limited so at least half of the record is left for the 
+    // access points and custom data.
+    size_t numTowers = 0;
+    if (isTowerListValid()) {
+        numTowers = 1 + (bufSize / 2) / TowerEntry::COMPACT_RECORD_SIZE;
+        if (numTowers > towerList.size()) {
+            numTowers = towerList.size();
+        }
+        // Small records may only have room for the serving tower and the two custom data lengths
+        size_t maxTowers = (bufSize - offset - 4) / TowerEntry::COMPACT_RECORD_SIZE;
+        if (numTowers > maxTowers) {
+            numTowers = maxTowers;
+        }
+        if (numTowers > 255) {
+            numTowers = 255;
+        }
+        for(size_t ii = 0; ii < numTowers; ii++) {
+            towerList.getEntry(ii).toCompactRecord(&buf[offset]);
+            offset += TowerEntry::COMPACT_RECORD_SIZE;
+        }
+    }
+
+    // Custom data takes priority over access points, which are dropped (weakest first) to make it fit.
+    // eventData and locVariant only contain the data from the add to event handlers at this point.
+    String customJson[2];
+    size_t customSize = 4;
+    const Variant *customData[2] = { &eventData, &locVariant };
+    for(size_t ii = 0; ii < 2; ii++) {
+        if (customData[ii]->isMap() && customData[ii]->size()) {
+            customJson[ii] = customData[ii]->toJSON();
+            customSize += customJson[ii].length();
+        }
+    }
+    if (offset + customSize > bufSize) {
+        _locfLog.info("add to event handler data does not fit in offline queue record, not saved");
+        customJson[0] = customJson[1] = "";
+        customSize = 4;
+    }
+
+    size_t numWap = 0;
+#if Wiring_WiFi 
+    if (wapListValid && offset + customSize < bufSize) {
+        numWap = (bufSize - offset - customSize) / sizeof(WAPEntry);
+        if (numWap > wapList.size()) {
+            numWap = wapList.size();
+        }
+        if (numWap > 255) {
+            numWap = 255;
+        }
+        for(size_t ii = 0; ii < numWap; ii++) {
+            memcpy(&buf[offset], &wapList.getEntry(ii), sizeof(WAPEntry));
+            offset += sizeof(WAPEntry);
+        }
+    }
+#endif // Wiring_WiFi 
+
+    for(size_t ii = 0; ii < 2; ii++) {
+        putU16(&buf[offset], (uint16_t)customJson[ii].length());
+        memcpy(&buf[offset + 2], customJson[ii].c_str(), customJson[ii].length());
+        offset += 2 + customJson[ii].length();
+    }
+
+    buf[0] = OFFLINE_RECORD_VERSION;
+    buf[1] = flags;
+    buf[2] = (uint8_t)numWap;
+    buf[3] = (uint8_t)numTowers;
+    putU32(&buf[4], time);
+
+    return offset;
+}
+
+bool LocationFusionRK::decodeOfflineRecord(const uint8_t *buf, size_t size, int reqId, Variant &sample) const {
+    if (size < OFFLINE_HEADER_SIZE || (buf[0] != OFFLINE_RECORD_VERSION && buf[0] != OFFLINE_RECORD_VERSION_1)) {
+        return false;
+    }
+    bool version1 = (buf[0] == OFFLINE_RECORD_VERSION_1);
+    uint8_t flags = buf[1];
+    size_t numWap = buf[2];
+    size_t numTowers = version1 ? 0 : buf[3];
+    size_t offset = OFFLINE_HEADER_SIZE;
+
+    TowerEntry version1Tower;
+    if (version1 && (flags & OFFLINE_FLAG_V1_TOWER)) {
+        if (offset + OFFLINE_V1_TOWER_SIZE > size) {
+            return false;
+        }
+        version1Tower.mcc = getU16(&buf[offset]);
+        version1Tower.mnc = getU16(&buf[offset + 2]);
+        version1Tower.lac = getU32(&buf[offset + 4]);
+        version1Tower.cid = getU32(&buf[offset + 8]);
+        version1Tower.serving = true;
+        offset += OFFLINE_V1_TOWER_SIZE;
+        numTowers = 1;
+    }
+
+    const uint8_t *towerData = &buf[offset];
+    if (!version1) {
+        offset += numTowers * TowerEntry::COMPACT_RECORD_SIZE;
+    }
+
+#if Wiring_WiFi 
+    const uint8_t *wapData = &buf[offset];
+    offset += numWap * sizeof(WAPEntry);
+#else
+    // Devices without Wi-Fi never save access points
+    if (numWap) {
+        return false;
+    }
+#endif // Wiring_WiFi 
+
+    Variant custom[2];
+    for(size_t ii = 0; ii < 2; ii++) {
+        if (offset + 2 > size) {
+            return false;
+        }
+        size_t len = getU16(&buf[offset]);
+        offset += 2;
+        if (offset + len > size) {
+            return false;
+        }
+        if (len) {
+            String json((const char *)&buf[offset], len);
+            custom[ii] = Variant::fromJSON(json.c_str());
+        }
+        offset += len;
+    }
+
+    // Same keys as buildEventVariant(). Custom data from the add to event handlers takes precedence.
+    sample = custom[0].isMap() ? custom[0] : Variant();
+    Variant locVariant = custom[1].isMap() ? custom[1] : Variant();
+
+    sample.set("cmd", Variant("loc"));
+    if ((flags & OFFLINE_FLAG_TIME) && !sample.has("time")) {
+        sample.set("time", getU32(&buf[4]));
+    }
+
+#if Wiring_WiFi 
+    if (numWap && !sample.has("wps")) {
+        Variant arrayVariant;
+        for(size_t ii = 0; ii < numWap; ii++) {
+            WAPEntry entry;
+            memcpy(&entry, &wapData[ii * sizeof(WAPEntry)], sizeof(WAPEntry));
+
+            Variant entryVariant;
+            entry.toVariant(entryVariant);
+            arrayVariant.append(entryVariant);
+        }
+        sample.set("wps", arrayVariant);
+    }
+#endif // Wiring_WiFi 
+
+    if (numTowers && !sample.has("towers")) {
+        Variant arrayVariant;
+        for(size_t ii = 0; ii < numTowers; ii++) {
+            TowerEntry entry = version1Tower;
+            if (!version1) {
+                entry.fromCompactRecord(&towerData[ii * TowerEntry::COMPACT_RECORD_SIZE]);
+            }
+
+            Variant entryVariant;
+            entry.toVariant(entryVariant);
+            arrayVariant.append(entryVariant);
+        }
+        sample.set("towers", arrayVariant);
+    }
+
+    if (!locVariant.has("lck")) {
+        locVariant.set("lck", 0);
+    }
+    sample.set("loc", locVariant);
+    sample.set("req_id", reqId);
+
+    return true;
+}
+
+/**
+ * @brief Set each key of the map src in dest, replacing keys of the same name
+ */
+static void mergeVariantMap(Variant &dest, const Variant &src) {
+    if (!src.isMap()) {
+        return;
+    }
+    // toMap() returns a copy, which must outlive the loop over its entries
+    VariantMap map = src.toMap();
+    for(const auto &entry : map.entries()) {
+        dest.set(entry.first.c_str(), entry.second);
+    }
+}
+
+void LocationFusionRK::buildEventVariant(int reqId) {
+    // eventData and locVariant contain the data from the add to event handlers, which ran while the Wi-Fi scan was
+    // in progress. The library's keys are added first and the handlers' keys replace them, so a handler that adds 
+    // "time" or neighbor "towers" takes precedence.
+    Variant handlerData, handlerLocVariant;
+    std::swap(handlerData, eventData);
+    std::swap(handlerLocVariant, locVariant);
+
+    addEventKeys();
+    mergeVariantMap(eventData, handlerData);
+    mergeVariantMap(locVariant, handlerLocVariant);
+
+    eventData.set("loc", locVariant);
+
+    eventData.set("req_id", reqId);
+}
+
+void LocationFusionRK::addEventKeys() {
+    eventData.set("cmd", Variant("loc"));
+    if (Time.isValid()) {
+        eventData.set("time", Time.now());
+    }
+
+    if (wantLocEnhanced()) {
+        eventData.set("loc_cb", 1);
+    }
+
+    locVariant.set("lck", 0);
+
+    bool compact = (payloadEncoding == PayloadEncoding::compact);
+    if (compact) {
+        eventData.set("enc", (int)PayloadEncoding::compact);
+    }
+
+#if Wiring_WiFi 
+    if (wapListValid && wapList.size()) {
+        if (compact) {
+            compactString = "";
+            wapList.toCompact(compactString);
+            eventData.set("wpsb", compactString);
+        }
+        else {
+            Variant arrayVariant;
+
+            wapList.toVariant(arrayVariant);
+            
+            eventData.set("wps", arrayVariant);
+        }
+    }
+#endif // Wiring_WiFi 
+
+    if (isTowerListValid()) {
+        if (compact) {
+            compactString = "";
+            towerList.toCompact(compactString);
+            eventData.set("towersb", compactString);
+        }
+        else {
+            Variant arrayVariant;
+
+            towerList.toVariant(arrayVariant);
+
+            eventData.set("towers", arrayVariant);
+        }
+    }
+}
+
+void LocationFusionRK::buildFingerprint(RadioFingerprint &fingerprint, size_t maxBssids) const {
+    fingerprint.clear();
+
+#if Wiring_WiFi 
+    // wapList is sorted by RSSI so this uses the strongest access points
+    for(size_t ii = 0; wapListValid && ii < wapList.size() && ii < maxBssids; ii++) {
+        fingerprint.addBssid(wapList.getEntry(ii).bssidKey());
+    }
+#endif // Wiring_WiFi 
+
+    // Only the first tower (the serving tower, when known) is used. Neighbor cells come and go too often to be 
+    // useful for detecting movement.
+    if (isTowerListValid()) {
+        const TowerEntry &entry = towerList.getEntry(0);
+        fingerprint.setTower(entry.mcc, entry.mnc, entry.lac, entry.cid);
+    }
+}
+
+void LocationFusionRK::recordPublishSuccess() {
+    manualPublishRequested = false;
+    priorityPublishRequested = false;
+    publishCount++;
+
+    publishedFingerprint = pendingFingerprint;
+    lastPublishMs = System.millis();
+
+    schedulePublish(ScheduleEvent::published);
+}
+
+void LocationFusionRK::schedulePublish(ScheduleEvent event) {
+    if (event == ScheduleEvent::publishFailed) {
+        consecutiveFailures++;
+    }
+    else
+    if (event == ScheduleEvent::published) {
+        consecutiveFailures = 0;
+    }
+
+    ScheduleInfo info;
+    info.event = event;
+    info.publishPeriod = activeConfig.publishPeriod;
+    info.publishFailureRetry = publishFailureRetry;
+    info.consecutiveFailures = consecutiveFailures;
+    info.similarity = sampleSimilarity;
+
+    std::chrono::milliseconds delay = publishScheduler->getNextPublishDelay(info);
+    _locfLog.trace("next publish in %lu ms", (unsigned long)delay.count());
+
+    nextPublishMs = System.millis() + delay.count();
+}
+
+bool LocationFusionRK::wantLocEnhanced() const {
+    if (locEnhancedHandlers.size() > 0 || locEnhancedResultHandlers.size() > 0 || locCache.isEnabled() || wantLocations()) {
+        return true;
+    }
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+    if (wifiPositionIndex.isEnabled()) {
+        return true;
+    }
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+    return false;
+}
+
+bool LocationFusionRK::wantLocations() const {
+#if LOCATIONFUSIONRK_FUSION
+    if (fusionEnabled) {
+        return true;
+    }
+#endif // LOCATIONFUSIONRK_FUSION
+#if LOCATIONFUSIONRK_GEOFENCES
+    if (geofencesEnabled) {
+        return true;
+    }
+#endif // LOCATIONFUSIONRK_GEOFENCES
+    return false;
+}
+
+bool LocationFusionRK::serveFromLocCache(int reqId) {
+    LocCache::Entry entry;
+    if (!locCache.lookup(pendingCacheKey, entry)) {
+        return false;
+    }
+
+    double lat = (double)entry.latE7 / 10000000.0;
+    double lon = (double)entry.lonE7 / 10000000.0;
+    callLocEnhancedHandlers(lat, lon, (int)entry.hAcc, reqId, "cached");
+    processLocation(lat, lon, (float)entry.hAcc, FusionSource::cached);
+    return true;
+}
+
+void LocationFusionRK::callLocEnhancedHandlers(double lat, double lon, int hAcc, int reqId, const char *sourceKey) {
+    if (locEnhancedHandlers.empty()) {
+        return;
+    }
+
+    // Same structure as the loc-enhanced cmd from the cloud
+    Variant locVariant;
+    locVariant.set("lat", lat);
+    locVariant.set("lon", lon);
+    locVariant.set("h_acc", hAcc);
+
+    Variant data;
+    data.set("cmd", Variant("loc-enhanced"));
+    data.set("loc-enhanced", locVariant);
+    data.set("req_id", reqId);
+    data.set(sourceKey, true);
+
+    auto handlers = locEnhancedHandlers.get();
+    for(const auto &handler : *handlers) {
+        handler(data);
+    }
+}
+
+// Meters per 10^-7 degree of latitude
+static const float METERS_PER_E7 = 0.011132f;
+
+// Wrap a longitude difference in degrees * 10^7 to -180 to +180 degrees
+static inline int32_t wrapLonE7(int64_t dLonE7) {
+    if (dLonE7 > 1800000000LL) {
+        dLonE7 -= 3600000000LL;
+    }
+    else
+    if (dLonE7 < -1800000000LL) {
+        dLonE7 += 3600000000LL;
+    }
+    return (int32_t)dLonE7;
+}
+
+void LocationFusionRK::processLocation(double lat, double lon, float hAcc, FusionSource source) {
+#if LOCATIONFUSIONRK_FUSION
+    if (fusionEnabled) {
+        FusedLocation location;
+        lock();
+        fusionFilter.update(lat, lon, hAcc, System.millis(), source);
+        fusionFilter.getLocation(location);
+        unlock();
+
+        auto handlers = fusedLocationHandlers.get();
+        for(const auto &handler : *handlers) {
+            handler(location);
+        }
+    }
+#endif // LOCATIONFUSIONRK_FUSION
+
+#if LOCATIONFUSIONRK_GEOFENCES
+    if (geofencesEnabled && hAcc <= (float)geofenceMaxAccuracy) {
+        // The handlers are called after unlocking so they can use the library
+        geofenceEvents.clear();
+        lock();
+        geofences.evaluate(lat, lon, geofenceEvents);
+        unlock();
+
+        auto handlers = geofenceHandlers.get();
+        for(const auto &event : geofenceEvents) {
+            _locfLog.info("geofence %lu %s", (unsigned long)event.id, (event.transition == Geofences::Transition::enter) ? "enter" : "exit");
+            for(const auto &handler : *handlers) {
+                handler(event, lat, lon);
+            }
+        }
+        if (geofenceEvents.size() && geofencePublish) {
+            requestPublish(true);
+        }
+    }
+#endif // LOCATIONFUSIONRK_GEOFENCES
+}
+
+void LocationFusionRK::processGnssLocation() {
+    sampleHasGnss = false;
+    if (!wantLocations() || locVariant.get("lck").toInt() != 1 || !locVariant.has("lat") || !locVariant.has("lon")) {
+        return;
+    }
+    sampleHasGnss = true;
+
+    // GNSS modules that do not report accuracy are typically accurate to a few meters with a lock
+    float hAcc = locVariant.has("h_acc") ? (float)locVariant.get("h_acc").asDouble() : 10.0f;
+    processLocation(locVariant.get("lat").asDouble(), locVariant.get("lon").asDouble(), hAcc, FusionSource::gnss);
+}
+
+#if LOCATIONFUSIONRK_FUSION
+bool LocationFusionRK::getLastFusedLocation(FusedLocation &location) {
+    if (!mutex) {
+        // Not set up yet, so nothing has been fused
+        location = FusedLocation();
+        return false;
+    }
+
+    lock();
+    bool result = fusionFilter.getLocation(location);
+    unlock();
+    return result;
+}
+#endif // LOCATIONFUSIONRK_FUSION
+
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+bool LocationFusionRK::serveFromWiFiPosition(int reqId) {
+    double lat, lon;
+    int hAcc;
+    if (!estimateWiFiPosition(lat, lon, hAcc)) {
+        return false;
+    }
+
+    callLocEnhancedHandlers(lat, lon, hAcc, reqId, "local");
+    processLocation(lat, lon, (float)hAcc, FusionSource::local);
+    return true;
+}
+
+// Added to the spread of the access points to estimate the accuracy, in meters
+static const float WIFI_POSITION_BASE_ACCURACY = 25.0f;
+
+bool LocationFusionRK::estimateWiFiPosition(double &lat, double &lon, int &hAcc) {
+    if (!wapListValid || !wifiPositionIndex.isEnabled()) {
+        return false;
+    }
+
+    struct Match {
+        uint64_t key;
+        int32_t weight;
+        WiFiPositionIndex::Entry entry;
+    };
+    Match matches[WiFiPositionIndex::MAX_SCAN_ENTRIES];
+
+    // wapList is sorted by RSSI so this uses the strongest access points. Weight is by signal (stronger is
+    // closer) and by how many times the access point has been observed, up to 4.
+    size_t numAps = 0;
+    for(; numAps < wapList.size() && numAps < WiFiPositionIndex::MAX_SCAN_ENTRIES; numAps++) {
+        const WAPEntry &wap = wapList.getEntry(numAps);
+        int signal = wap.rssi + 100;
+        if (signal < 1) {
+            signal = 1;
+        }
+        else
+        if (signal > 60) {
+            signal = 60;
+        }
+        matches[numAps].key = wap.bssidKey();
+        matches[numAps].weight = signal * signal;
+    }
+
+    // Look up in BSSID order so each search only covers the part of the index after the previous one
+    std::sort(matches, matches + numAps, [](const Match &a, const Match &b) {
+        return a.key < b.key;
+    });
+    size_t numMatches = 0;
+    size_t start = 0;
+    for(size_t ii = 0; ii < numAps; ii++) {
+        if (wifiPositionIndex.lookup(matches[ii].key, matches[ii].entry, start)) {
+            matches[ii].weight *= (matches[ii].entry.weight < 4) ? matches[ii].entry.weight : 4;
+            matches[numMatches++] = matches[ii];
+        }
+    }
+    if (numMatches == 0 || numMatches < wifiPositionMinMatches) {
+        _locfLog.trace("wifi position %u of %u access points in index", (unsigned)numMatches, (unsigned)numAps);
+        return false;
+    }
+
+    // Weighted centroid, relative to the first match so longitude wraps correctly
+    const WiFiPositionIndex::Entry &ref = matches[0].entry;
+    int64_t sumWeight = 0, sumLat = 0, sumLon = 0;
+    for(size_t ii = 0; ii < numMatches; ii++) {
+        sumWeight += matches[ii].weight;
+        sumLat += (int64_t)matches[ii].weight * (matches[ii].entry.latE7 - ref.latE7);
+        sumLon += (int64_t)matches[ii].weight * wrapLonE7((int64_t)matches[ii].entry.lonE7 - ref.lonE7);
+    }
+    int32_t latE7 = ref.latE7 + (int32_t)(sumLat / sumWeight);
+    int32_t lonE7 = wrapLonE7((int64_t)ref.lonE7 + sumLon / sumWeight);
+
+    // Accuracy from the weighted RMS distance of the access points from the centroid
+    float cosLat = cosf((float)latE7 * (float)(M_PI / 1800000000.0));
+    float sumSq = 0.0f;
+    for(size_t ii = 0; ii < numMatches; ii++) {
+        float dy = (float)(matches[ii].entry.latE7 - latE7) * METERS_PER_E7;
+        float dx = (float)wrapLonE7((int64_t)matches[ii].entry.lonE7 - lonE7) * METERS_PER_E7 * cosLat;
+        sumSq += (float)matches[ii].weight * (dx * dx + dy * dy);
+    }
+    float accuracy = sqrtf(sumSq / (float)sumWeight) + WIFI_POSITION_BASE_ACCURACY;
+
+    _locfLog.trace("wifi position %u of %u access points in index, accuracy %d m", (unsigned)numMatches, (unsigned)numAps, (int)accuracy);
+    if (accuracy > (float)wifiPositionMaxAccuracy) {
+        return false;
+    }
+
+    lat = (double)latE7 / 10000000.0;
+    lon = (double)lonE7 / 10000000.0;
+    hAcc = (int)accuracy;
+    return true;
+}
+
+void LocationFusionRK::learnWiFiPosition(const LocRequest &request) {
+    if (request.hAcc < 0 || request.hAcc > wifiPositionLearnAccuracy) {
+        return;
+    }
+
+    int32_t latE7 = (int32_t)(request.lat * 10000000.0);
+    int32_t lonE7 = (int32_t)(request.lon * 10000000.0);
+    for(size_t ii = 0; ii < request.numBssids; ii++) {
+        wifiPositionIndex.learn(request.bssidKeys[ii], latE7, lonE7);
+    }
+}
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+
+bool LocationFusionRK::shouldSuppressPublish() {
+    lastSimilarity = 0.0;
+
+    if (changeThreshold <= 0.0 || manualPublishRequested || activeConfig.publishFrequency != PublishFrequency::periodic) {
+        return false;
+    }
+    if (publishedFingerprint.isEmpty() || pendingFingerprint.isEmpty()) {
+        return false;
+    }
+
+    lastSimilarity = pendingFingerprint.similarity(publishedFingerprint);
+
+    if (System.millis() - lastPublishMs >= (uint64_t)changeMaxStaleness.count()) {
+        // Published too long ago, publish even if the location has not changed
+        return false;
+    }
+
+    return lastSimilarity >= changeThreshold;
+}
+
+size_t LocationFusionRK::buildEventStreaming(int reqId) {
+    if (!streamingBuffer) {
+        streamingBuffer = new char[streamingBufferSize];
+    }
+
+    JSONBufferWriter writer(streamingBuffer, streamingBufferSize);
+
+    writer.beginObject();
+    writer.name("cmd").value("loc");
+    if (Time.isValid()) {
+        writer.name("time").value((unsigned)Time.now());
+    }
+
+    if (wantLocEnhanced()) {
+        writer.name("loc_cb").value(1);
+    }
+
+    bool compact = (payloadEncoding == PayloadEncoding::compact);
+    if (compact) {
+        writer.name("enc").value((int)PayloadEncoding::compact);
+    }
+
+#if Wiring_WiFi 
+    if (wapListValid && wapList.size()) {
+        if (compact) {
+            compactString = "";
+            wapList.toCompact(compactString);
+            writer.name("wpsb").value(compactString);
+        }
+        else {
+            writer.name("wps");
+            wapList.toJsonWriter(writer);
+        }
+    }
+#endif // Wiring_WiFi 
+
+    if (isTowerListValid()) {
+        if (compact) {
+            compactString = "";
+            towerList.toCompact(compactString);
+            writer.name("towersb").value(compactString);
+        }
+        else {
+            writer.name("towers");
+            towerList.toJsonWriter(writer);
+        }
+    }
+
+    auto handlers = addToJsonWriterHandlers.get();
+    for(const auto &handler : *handlers) {
+        handler(writer, false);
+    }
+
+    writer.name("loc").beginObject();
+    writer.name("lck").value(0);
+    for(const auto &handler : *handlers) {
+        handler(writer, true);
+    }
+    writer.endObject();
+
+    writer.name("req_id").value(reqId);
+    writer.endObject();
+
+    // dataSize() is the size that would have been written, even if the buffer is too small
+    if (writer.dataSize() > writer.bufferSize()) {
+        return 0;
+    }
+    return writer.dataSize();
+}
+
+
+
+void LocationFusionRK::statePublishWait() {
+    if (event.isSent()) {
+        recordLatency(LatencyStage::publish, publishStartUs);
+    }
+
+    if (event.isSent() && offlineInFlight) {
+        updateStatus(Status::publishSuccess);
+        _locfLog.info("offline queue publish succeeded");
+        event.clear();
+
+        offlineQueue.consume(offlineInFlight);
+        offlineInFlight = 0;
+        consecutiveFailures = 0;
+
+        nextDrainMs = System.millis() + offlineDrainInterval.count();
+        stateHandler = &LocationFusionRK::stateConnected;
+    }
+    else
+    if (event.isSent()) {
+        updateStatus(Status::publishSuccess);
+        _locfLog.info("publish succeeded");
+        event.clear();
+
+        endLocRequestPublish(true);
+        if (wantLocEnhanced()) {
+            stateHandler = &LocationFusionRK::stateLocEnhancedWait;
+        }
+        else {
+            stateHandler = &LocationFusionRK::stateConnected;
+        }
+
+        if (batchInFlight) {
+            batchSamples.erase(batchSamples.begin(), batchSamples.begin() + batchInFlight);
+            batchInFlight = 0;
+        }
+
+        recordPublishSuccess();
+    }
+    else 
+    if (!event.isOk()) {
+        updateStatus(Status::publishFail);
+        _locfLog.info("publish failed error=%d", event.error());
+        event.clear();
+
+        stateHandler = &LocationFusionRK::stateConnected;
+        endLocRequestPublish(false);
+
+        // Batched samples and offline queue records are kept and published again
+        batchInFlight = 0;
+        offlineInFlight = 0;
+
+        schedulePublish(ScheduleEvent::publishFailed);
+        nextDrainMs = nextPublishMs;
+    }
+    else {
+        // Woken by the status change callback, but also check periodically
+        waitFor(publishCheckMs);
+    }
+}
+
+void LocationFusionRK::stateLocEnhancedWait() {
+    updateStatus(Status::locEnhancedWait);
+
+    processLocRequests();
+    if (locRequestsInFlight < maxLocRequests) {
+        // Continue sampling while the remaining requests are in flight
+        stateHandler = &LocationFusionRK::stateConnected;
+        return;
+    }
+
+    // Woken by locEnhanced(), and waitFor() limits the wait to the next request timeout
+    waitFor(maxWaitMs);
+}
+
+void LocationFusionRK::initPendingLocRequest(int reqId) {
+    pendingLocRequest = LocRequest();
+    pendingLocRequest.reqId = reqId;
+    pendingLocRequest.requestMs = acquireStartMs;
+    pendingLocRequest.hasGnss = sampleHasGnss;
+    if (locCache.isEnabled() && pendingCacheKeyValid) {
+        pendingLocRequest.hasCacheKey = true;
+        pendingLocRequest.cacheKey = pendingCacheKey;
+    }
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+    // The scan is replaced by the next sample, so save the access points to learn from the response
+    if (wapListValid && wifiPositionIndex.isEnabled()) {
+        for(size_t ii = 0; ii < wapList.size() && ii < WiFiPositionIndex::MAX_SCAN_ENTRIES; ii++) {
+            pendingLocRequest.bssidKeys[pendingLocRequest.numBssids++] = wapList.getEntry(ii).bssidKey();
+        }
+    }
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+}
+
+bool LocationFusionRK::addLocRequest(const LocRequest &request) {
+    bool added = false;
+
+    // Each sample in a batch has its own request, so there is room for a full batch even if maxLocRequests is smaller
+    size_t capacity = std::max(maxLocRequests, batchMaxSamples);
+
+    lock();
+    if (locRequests.size() != capacity) {
+        locRequests.resize(capacity);
+    }
+    for(auto &entry : locRequests) {
+        if (entry.state == LocRequestState::free) {
+            entry = request;
+            entry.state = LocRequestState::publishing;
+            entry.publishUs = micros();
+            added = true;
+            break;
+        }
+    }
+    unlock();
+
+    if (!added) {
+        // Not expected, as there is room for maxLocRequests or a full batch. The response is still passed to the loc-enhanced handlers.
+        _locfLog.warn("not tracking req_id=%d, %u requests in flight", request.reqId, (unsigned)locRequestsInFlight);
+        return false;
+    }
+    if (!locRequestsInFlight) {
+        // The timeout starts when the publish completes
+        nextLocDeadlineMs = UINT64_MAX;
+    }
+    locRequestsInFlight++;
+    return true;
+}
+
+void LocationFusionRK::endLocRequestPublish(bool published) {
+    uint64_t deadlineMs = UINT64_MAX;
+    uint64_t timeoutMs = System.millis() + locEnhancedTimeout.count();
+    size_t removed = 0;
+
+    lock();
+    for(auto &entry : locRequests) {
+        if (entry.state == LocRequestState::publishing) {
+            if (published) {
+                entry.state = LocRequestState::pending;
+                entry.deadlineMs = timeoutMs;
+            }
+            else {
+                entry.state = LocRequestState::free;
+                removed++;
+            }
+        }
+        if (entry.state == LocRequestState::pending && entry.deadlineMs < deadlineMs) {
+            deadlineMs = entry.deadlineMs;
+        }
+    }
+    unlock();
+
+    locRequestsInFlight -= removed;
+    nextLocDeadlineMs = deadlineMs;
+}
+
+void LocationFusionRK::processLocRequests() {
+    while(locRequestsInFlight) {
+        LocRequest request;
+        bool found = false;
+        uint64_t now = System.millis();
+        uint64_t deadlineMs = UINT64_MAX;
+
+        // Remove one completed request at a time so the handlers are called with the mutex unlocked
+        lock();
+        for(auto &entry : locRequests) {
+            if (entry.state == LocRequestState::received || (entry.state == LocRequestState::pending && now >= entry.deadlineMs)) {
+                request = entry;
+                entry.state = LocRequestState::free;
+                found = true;
+                break;
+            }
+            if (entry.state == LocRequestState::pending && entry.deadlineMs < deadlineMs) {
+                deadlineMs = entry.deadlineMs;
+            }
+        }
+        unlock();
+
+        if (!found) {
+            nextLocDeadlineMs = deadlineMs;
+            break;
+        }
+        locRequestsInFlight--;
+        completeLocRequest(request);
+    }
+}
+
+void LocationFusionRK::completeLocRequest(const LocRequest &request) {
+    LocEnhancedResult result;
+    result.reqId = request.reqId;
+    result.requestMs = request.requestMs;
+
+    if (request.state == LocRequestState::received) {
+        uint32_t latencyUs = (uint32_t)(request.receivedUs - request.publishUs);
+        latencyHistograms[(size_t)LatencyStage::locEnhanced].add(latencyUs);
+        result.latencyMs = latencyUs / 1000;
+        result.received = true;
+
+        if (request.hAcc >= 0) {
+            result.lat = request.lat;
+            result.lon = request.lon;
+            result.hAcc = request.hAcc;
+
+            if (locCache.isEnabled() && request.hasCacheKey) {
+                locCache.insert(request.cacheKey, request.lat, request.lon, request.hAcc);
+            }
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+            if (wifiPositionIndex.isEnabled()) {
+                learnWiFiPosition(request);
+            }
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+            // When there is a GNSS lock, loc-enhanced returns the same location, which is already in the filter
+            if (!request.hasGnss) {
+                processLocation(request.lat, request.lon, (float)request.hAcc, FusionSource::locEnhanced);
+            }
+        }
+        updateStatus(Status::locEnhancedSuccess);
+    }
+    else {
+        _locfLog.info("loc-enhanced timed out req_id=%d", request.reqId);
+        result.latencyMs = (uint32_t)((micros() - request.publishUs) / 1000);
+        updateStatus(Status::locEnhancedFail);
+    }
+
+    auto handlers = locEnhancedResultHandlers.get();
+    for(const auto &handler : *handlers) {
+        handler(result);
+    }
+}
+
+
+int LocationFusionRK::functionHandler(const Variant &eventData) {
+    String cmd = eventData.get("cmd").toString();
+
+    auto handlers = commandHandlers.get();
+    std::pair<size_t, size_t> range = findCmdHandlers(*handlers, cmd.c_str(), cmd.length());
+    for(size_t ii = range.first; ii < range.second; ii++) {
+        (*handlers)[ii].handler(eventData);
+    }
+    return 0;
+}
+
+int LocationFusionRK::functionHandler(const char *json) {
+    _locfLog.trace("cmd function %s", json);
+
+    const char *cmd;
+    size_t cmdLen;
+    if (!findCmd(json, cmd, cmdLen)) {
+        // Unusual JSON, such as a cmd with escaped characters, so do a full parse 
+        return functionHandler(Variant::fromJSON(json));
+    }
+
+    auto handlers = commandHandlers.get();
+    std::pair<size_t, size_t> range = findCmdHandlers(*handlers, cmd, cmdLen);
+    if (range.first == range.second) {
+        // Not one of our commands, no need to parse it
+        return 0;
+    }
+
+    Variant eventData = Variant::fromJSON(json);
+    for(size_t ii = range.first; ii < range.second; ii++) {
+        (*handlers)[ii].handler(eventData);
+    }
+    return 0;
+}
+
+// [static]
+int LocationFusionRK::functionHandlerStatic(String cmd) {
+    return instance().functionHandler(cmd.c_str());
+}
+
+// [static]
+bool LocationFusionRK::findCmd(const char *json, const char *&value, size_t &valueLen) {
+    const char *p = json;
+    int depth = 0;
+    bool expectKey = false;
+
+    while(*p) {
+        char c = *p++;
+        if (c == '"') {
+            // Find the end of the string
+            const char *start = p;
+            bool escaped = false;
+            while(*p && *p != '"') {
+                if (*p == '\\') {
+                    escaped = true;
+                    if (!*++p) {
+                        return false;
+                    }
+                }
+                p++;
+            }
+            if (!*p) {
+                return false;
+            }
+            size_t len = p++ - start;
+
+            if (depth == 1 && expectKey) {
+                expectKey = false;
+                if (len == 3 && !escaped && memcmp(start, "cmd", 3) == 0) {
+                    // Value follows the colon
+                    while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' || *p == ':') {
+                        p++;
+                    }
+                    if (*p++ != '"') {
+                        return false;
+                    }
+                    value = p;
+                    while(*p && *p != '"') {
+                        if (*p == '\\') {
+                            return false;
+                        }
+                        p++;
+                    }
+                    if (!*p) {
+                        return false;
+                    }
+                    valueLen = p - value;
+                    return true;
+                }
+            }
+        }
+        else
+        if (c == '{' || c == '[') {
+            depth++;
+            expectKey = (c == '{' && depth == 1);
+        }
+        else
+        if (c == '}' || c == ']') {
+            depth--;
+        }
+        else
+        if (c == ',' && depth == 1) {
+            expectKey = true;
+        }
+    }
+    return false;
+}
+
+// [static]
+std::pair<size_t, size_t> LocationFusionRK::findCmdHandlers(const std::vector<CmdHandler> &handlers, const char *cmd, size_t cmdLen) {
+    // Binary search of commandHandlers, which is sorted by cmd
+    auto compare = [cmd, cmdLen](const CmdHandler &cmdHandler) {
+        int result = strncmp(cmdHandler.cmd.c_str(), cmd, cmdLen);
+        if (result == 0 && cmdHandler.cmd.length() != cmdLen) {
+            result = (cmdHandler.cmd.length() < cmdLen) ? -1 : 1;
+        }
+        return result;
+    };
+
+    size_t low = 0, high = handlers.size();
+    while(low < high) {
+        size_t mid = (low + high) / 2;
+        if (compare(handlers[mid]) < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    size_t first = low;
+    while(low < handlers.size() && compare(handlers[low]) == 0) {
+        low++;
+    }
+    return std::pair<size_t, size_t>(first, low);
+}
+
+void LocationFusionRK::locEnhanced(const Variant &eventData) {
+    unsigned long receivedUs = micros();
+    double lat = 0.0;
+    double lon = 0.0;
+    int hAcc = -1;
+    if (eventData.has("loc-enhanced")) {
+        Variant locVariant = eventData.get("loc-enhanced");
+        if (locVariant.has("lat") && locVariant.has("lon")) {
+            lat = locVariant.get("lat").asDouble();
+            lon = locVariant.get("lon").asDouble();
+            hAcc = locVariant.get("h_acc").asInt();
+        }
+    }
+
+    // A response without a req_id is matched to the oldest request
+    bool hasReqId = eventData.has("req_id");
+    int reqId = eventData.get("req_id").toInt();
+
+    lock();
+    LocRequest *match = nullptr;
+    for(auto &entry : locRequests) {
+        if (entry.state != LocRequestState::pending && entry.state != LocRequestState::publishing) {
+            continue;
+        }
+        if (hasReqId ? (entry.reqId == reqId) : (!match || entry.requestMs < match->requestMs)) {
+            match = &entry;
+            if (hasReqId) {
+                break;
+            }
+        }
+    }
+    if (match) {
+        match->lat = lat;
+        match->lon = lon;
+        match->hAcc = hAcc;
+        match->receivedUs = receivedUs;
+        match->state = LocRequestState::received;
+    }
+    unlock();
+
+    if (match) {
+        wake();
+    }
+    else {
+        _locfLog.info("loc-enhanced req_id=%d does not match a request in flight", reqId);
+    }
+    auto handlers = locEnhancedHandlers.get();
+    for(auto it = handlers->begin(); it != handlers->end(); it++) {
+        (*it)(eventData);
+    }
+}
+
+
+// [static] 
+void LocationFusionRK::locEnhancedStatic(const Variant &eventData) {
+    instance().locEnhanced(eventData);
+}
+
+
+
+#if Wiring_WiFi 
+
+//
+// WAPEntry
+//
 LocationFusionRK::WAPEntry::WAPEntry() {
 }
 
-LocationFusionRK::WAPEntry::WAPEntry(const WiFiAccessPoint *wap) {
-    fromWiFiAccessPoint(wap);
+LocationFusionRK::WAPEntry::WAPEntry(const WiFiAccessPoint *wap) {
+    fromWiFiAccessPoint(wap);
+}
+
+void LocationFusionRK::WAPEntry::fromWiFiAccessPoint(const WiFiAccessPoint *wap) {
+    memcpy(bssid, wap->bssid, sizeof(bssid));
+    channel = wap->channel;
+
+    // RSSI in dBm always fits in an int8_t in practice, but clamp to be safe
+    int value = wap->rssi;
+    if (value < INT8_MIN) {
+        value = INT8_MIN;
+    }
+    if (value > INT8_MAX) {
+        value = INT8_MAX;
+    }
+    rssi = (int8_t)value;
+}
+
+void LocationFusionRK::WAPEntry::toJsonWriter(JSONWriter &writer, bool wrapInObject) const {
+    char buf[BSSID_STRING_SIZE];
+
+    if (wrapInObject) {
+        writer.beginObject();
+    }
+
+    writer.name("bssid").value(bssidString(buf));
+    writer.name("ch").value((unsigned)channel);
+    writer.name("str").value((int)rssi);
+
+    if (wrapInObject) {
+        writer.endObject();
+    }
+}
+
+void LocationFusionRK::WAPEntry::toVariant(Variant &obj) const {
+    char buf[BSSID_STRING_SIZE];
+
+    obj.set("bssid", Variant(bssidString(buf)));
+    obj.set("ch", Variant((unsigned)channel));
+    obj.set("str", Variant((int)rssi));
+}
+
+uint64_t LocationFusionRK::WAPEntry::bssidKey() const {
+    uint64_t key = 0;
+    for(size_t ii = 0; ii < sizeof(bssid); ii++) {
+        key = (key << 8) | bssid[ii];
+    }
+    return key;
+}
+
+String LocationFusionRK::WAPEntry::bssidString() const {
+    char buf[BSSID_STRING_SIZE];
+    return String(bssidString(buf));
+}
+
+const char *LocationFusionRK::WAPEntry::bssidString(char *buf) const {
+    static const char hexDigits[] = "0123456789abcdef";
+
+    char *cp = buf;
+    for(size_t ii = 0; ii < sizeof(bssid); ii++) {
+        if (ii) {
+            *cp++ = ':';
+        }
+        *cp++ = hexDigits[bssid[ii] >> 4];
+        *cp++ = hexDigits[bssid[ii] & 0xf];
+    }
+    *cp = 0;
+
+    return buf;
+}
+#endif // Wiring_WiFi 
+
+
+
+
+
+#if Wiring_WiFi 
+//
+// WAPList
+// 
+
+void LocationFusionRK::WAPList::scan() {
+    clear();
+
+    _locfLog.trace("WAPList::scan called");
+
+    int res = WiFi.scan(scanCallbackStatic, this);
+
+    _locfLog.trace("WAPList::scan returned %d", res);
+
+}
+
+void LocationFusionRK::WAPList::copyFrom(const WAPList &other) {
+    clear();
+    for(const auto &entry : other.wapArray) {
+        appendEntry(entry);
+    }
+}
+
+LocationFusionRK::WAPList &LocationFusionRK::WAPList::withMaxEntries(size_t maxEntries) {
+    this->maxEntries = maxEntries;
+    if (maxEntries) {
+        // One extra because an entry is inserted before the weakest is removed
+        wapArray.reserve(maxEntries + 1);
+    }
+    return *this;
+}
+
+void LocationFusionRK::WAPList::appendEntry(const WAPEntry &entry) {
+    if (filterLocallyAdministered && (entry.bssid[0] & 0x02) != 0) {
+        droppedCount++;
+        return;
+    }
+
+    if (removeDuplicates) {
+        for(auto it = wapArray.begin(); it != wapArray.end(); ++it) {
+            if (memcmp((*it).bssid, entry.bssid, sizeof(entry.bssid)) == 0) {
+                droppedCount++;
+                if (entry.rssi <= (*it).rssi) {
+                    return;
+                }
+                wapArray.erase(it);
+                break;
+            }
+        }
+    }
+
+    if (maxEntries && wapArray.size() >= maxEntries && entry.rssi <= wapArray.back().rssi) {
+        // Full, and weaker than everything already kept
+        droppedCount++;
+        return;
+    }
+
+    // Sorted by RSSI, strongest first. upper_bound keeps scan order for equal RSSI.
+    auto pos = std::upper_bound(wapArray.begin(), wapArray.end(), entry, [](const WAPEntry &a, const WAPEntry &b) {
+        return a.rssi > b.rssi;
+    });
+    wapArray.insert(pos, entry);
+
+    if (maxEntries && wapArray.size() > maxEntries) {
+        wapArray.pop_back();
+        droppedCount++;
+    }
+}
+
+void LocationFusionRK::WAPList::appendEntry(const WiFiAccessPoint *wap) {
+    LocationFusionRK::WAPEntry entry(wap);
+    appendEntry(entry);
+}
+
+
+void LocationFusionRK::WAPList::toJsonWriter(JSONWriter &writer, int numToInclude) const {
+    int numAdded = 0;
+
+    writer.beginArray();
+
+    for(auto it = wapArray.begin(); it != wapArray.end(); ++it) {
+        if (numToInclude != 0 && numAdded >= numToInclude) {
+            break;
+        }
+        (*it).toJsonWriter(writer, true);
+        numAdded++;
+    }
+
+    writer.endArray();
+}
+
+void LocationFusionRK::WAPList::toVariant(Variant &obj, int numToInclude) const {
+    int numAdded = 0;
+
+    for(auto it = wapArray.begin(); it != wapArray.end(); ++it) {
+        if (numToInclude != 0 && numAdded >= numToInclude) {
+            break;
+        }
+        Variant obj2;
+        (*it).toVariant(obj2);
+        obj.append(obj2);
+        numAdded++;
+    }
+}
+
+
+void LocationFusionRK::WAPList::toCompact(String &str, int numToInclude) const {
+    size_t count = wapArray.size();
+    if (numToInclude > 0 && (size_t)numToInclude < count) {
+        count = numToInclude;
+    }
+
+    // WAPEntry is a packed structure of bytes, so it does not depend on byte order
+    appendBase64(str, (const uint8_t *)wapArray.data(), count * sizeof(WAPEntry));
+}
+
+void LocationFusionRK::WAPList::scanCallback(WiFiAccessPoint* wap) {
+    appendEntry(wap);
+}
+
+// [static] 
+void LocationFusionRK::WAPList::scanCallbackStatic(WiFiAccessPoint* wap, void *context) {
+    ((LocationFusionRK::WAPList *)context)->scanCallback(wap);
+}
+
+#endif // Wiring_WiFi 
+
+#if Wiring_Cellular
+
+int LocationFusionRK::ServingTower::get() {
+    memset(&cgi, 0, sizeof(CellularGlobalIdentity));
+    cgi.size = sizeof(CellularGlobalIdentity);
+    cgi.version = CGI_VERSION_LATEST;
+
+    cellularResult = cellular_global_identity(&cgi, NULL);
+
+    return (int)cellularResult;
+}
+
+void LocationFusionRK::ServingTower::toJsonWriter(JSONWriter &writer, bool wrapInObject) const {
+    if (wrapInObject) {
+        writer.beginObject();
+    }
+
+    writer.name("rat").value("lte");
+    writer.name("mcc").value(cgi.mobile_country_code);
+    writer.name("mnc").value(cgi.mobile_network_code);
+    writer.name("lac").value(cgi.location_area_code);
+    writer.name("cid").value(cgi.cell_id);
+
+    // str (signal strength, rssi) could be included here 
+
+    if (wrapInObject) {
+        writer.endObject();
+    }
+    
+}
+
+void LocationFusionRK::ServingTower::toVariant(Variant &obj) const {
+    obj.set("rat", Variant("lte"));
+    obj.set("mcc", cgi.mobile_country_code);
+    obj.set("mnc", cgi.mobile_network_code);
+    obj.set("cid", cgi.cell_id);
+    obj.set("lac", cgi.location_area_code);
+}
+
+int LocationFusionRK::ServingTowerProvider::getTowers(TowerList &towerList) {
+    int res = servingTower.get();
+    if (res != SYSTEM_ERROR_NONE) {
+        return res;
+    }
+
+    const CellularGlobalIdentity &cgi = servingTower.getCellularGlobalIdentity();
+
+    TowerEntry entry;
+    entry.mcc = cgi.mobile_country_code;
+    entry.mnc = cgi.mobile_network_code;
+    entry.lac = cgi.location_area_code;
+    entry.cid = cgi.cell_id;
+    entry.serving = true;
+
+    // On LTE the strength value is RSRP (dBm) and the quality value is RSRQ (dB)
+    CellularSignal sig = Cellular.RSSI();
+    float strength = sig.getStrengthValue();
+    float quality = sig.getQualityValue();
+    if (strength < 0.0f && strength > -200.0f) {
+        entry.rsrp = (int16_t)roundf(strength);
+    }
+    if (quality < 0.0f && quality > -100.0f) {
+        entry.rsrq = (int8_t)roundf(quality);
+    }
+
+    towerList.addEntry(entry);
+
+    return SYSTEM_ERROR_NONE;
+}
+
+#endif // Wiring_Cellular
+
+//
+// TowerEntry
+//
+
+bool LocationFusionRK::TowerEntry::isSameCell(const TowerEntry &other) const {
+    if (cid != 0 && other.cid != 0) {
+        return cid == other.cid && lac == other.lac && mnc == other.mnc && mcc == other.mcc;
+    }
+    return earfcn != UNKNOWN_EARFCN && pci != UNKNOWN_PCI && earfcn == other.earfcn && pci == other.pci;
+}
+
+void LocationFusionRK::TowerEntry::toJsonWriter(JSONWriter &writer, bool wrapInObject) const {
+    if (wrapInObject) {
+        writer.beginObject();
+    }
+
+    writer.name("rat").value("lte");
+    writer.name("mcc").value(mcc);
+    writer.name("mnc").value(mnc);
+    writer.name("lac").value((unsigned int)lac);
+    if (cid != 0) {
+        writer.name("cid").value((unsigned int)cid);
+    }
+    if (pci != UNKNOWN_PCI) {
+        writer.name("nid").value(pci);
+    }
+    if (earfcn != UNKNOWN_EARFCN) {
+        writer.name("ch").value((unsigned int)earfcn);
+    }
+    if (rsrp != 0) {
+        writer.name("rsrp").value(rsrp);
+    }
+    if (rsrq != 0) {
+        writer.name("rsrq").value(rsrq);
+    }
+
+    if (wrapInObject) {
+        writer.endObject();
+    }
+}
+
+void LocationFusionRK::TowerEntry::toVariant(Variant &obj) const {
+    obj.set("rat", Variant("lte"));
+    obj.set("mcc", mcc);
+    obj.set("mnc", mnc);
+    obj.set("lac", (unsigned int)lac);
+    if (cid != 0) {
+        obj.set("cid", (unsigned int)cid);
+    }
+    if (pci != UNKNOWN_PCI) {
+        obj.set("nid", pci);
+    }
+    if (earfcn != UNKNOWN_EARFCN) {
+        obj.set("ch", (unsigned int)earfcn);
+    }
+    if (rsrp != 0) {
+        obj.set("rsrp", rsrp);
+    }
+    if (rsrq != 0) {
+        obj.set("rsrq", rsrq);
+    }
+}
+
+void LocationFusionRK::TowerEntry::toCompactRecord(uint8_t *record) const {
+    putU16(&record[0], mcc);
+    putU16(&record[2], mnc);
+    putU32(&record[4], lac);
+    putU32(&record[8], cid);
+    putU32(&record[12], earfcn);
+    putU16(&record[16], pci);
+    // rsrp is stored negated so the typical -44 to -140 dBm range fits in an unsigned byte
+    record[18] = (rsrp < 0 && rsrp >= -255) ? (uint8_t)(-rsrp) : 0;
+    record[19] = (uint8_t)rsrq;
+}
+
+void LocationFusionRK::TowerEntry::fromCompactRecord(const uint8_t *record) {
+    mcc = getU16(&record[0]);
+    mnc = getU16(&record[2]);
+    lac = getU32(&record[4]);
+    cid = getU32(&record[8]);
+    earfcn = getU32(&record[12]);
+    pci = getU16(&record[16]);
+    rsrp = -(int16_t)record[18];
+    rsrq = (int8_t)record[19];
+    serving = false;
+}
+
+//
+// TowerList
+//
+
+LocationFusionRK::TowerList::TowerList() {
+    towerArray.reserve(maxEntries + 1);
+}
+
+LocationFusionRK::TowerList &LocationFusionRK::TowerList::withMaxEntries(size_t maxEntries) {
+    this->maxEntries = (maxEntries > 0) ? maxEntries : 1;
+    // One extra because an entry is inserted before the weakest is removed
+    towerArray.reserve(this->maxEntries + 1);
+    return *this;
+}
+
+void LocationFusionRK::TowerList::addEntry(const TowerEntry &entry) {
+    TowerEntry merged = entry;
+
+    for(auto it = towerArray.begin(); it != towerArray.end(); ++it) {
+        if ((*it).isSameCell(entry)) {
+            // Modems often report the serving cell in the neighbor list as well. Keep the union of what 
+            // is known about the cell and the stronger signal.
+            const TowerEntry &existing = *it;
+            if (merged.cid == 0) {
+                merged.cid = existing.cid;
+                merged.lac = existing.lac;
+            }
+            if (merged.earfcn == TowerEntry::UNKNOWN_EARFCN) {
+                merged.earfcn = existing.earfcn;
+            }
+            if (merged.pci == TowerEntry::UNKNOWN_PCI) {
+                merged.pci = existing.pci;
+            }
+            if (existing.sortRsrp() > merged.sortRsrp()) {
+                merged.rsrp = existing.rsrp;
+                merged.rsrq = existing.rsrq;
+            }
+            merged.serving = merged.serving || existing.serving;
+
+            towerArray.erase(it);
+            droppedCount++;
+            break;
+        }
+    }
+
+    auto compare = [](const TowerEntry &a, const TowerEntry &b) {
+        if (a.serving != b.serving) {
+            return a.serving;
+        }
+        return a.sortRsrp() > b.sortRsrp();
+    };
+
+    if (towerArray.size() >= maxEntries && !compare(merged, towerArray.back())) {
+        // Full, and weaker than everything already kept
+        droppedCount++;
+        return;
+    }
+
+    // Serving first, then by rsrp, strongest first. upper_bound keeps report order for equal rsrp.
+    auto pos = std::upper_bound(towerArray.begin(), towerArray.end(), merged, compare);
+    towerArray.insert(pos, merged);
+
+    if (towerArray.size() > maxEntries) {
+        towerArray.pop_back();
+        droppedCount++;
+    }
+}
+
+void LocationFusionRK::TowerList::toJsonWriter(JSONWriter &writer, int numToInclude) const {
+    int numAdded = 0;
+
+    writer.beginArray();
+
+    for(auto it = towerArray.begin(); it != towerArray.end(); ++it) {
+        if (numToInclude != 0 && numAdded >= numToInclude) {
+            break;
+        }
+        (*it).toJsonWriter(writer, true);
+        numAdded++;
+    }
+
+    writer.endArray();
+}
+
+void LocationFusionRK::TowerList::toVariant(Variant &obj, int numToInclude) const {
+    int numAdded = 0;
+
+    for(auto it = towerArray.begin(); it != towerArray.end(); ++it) {
+        if (numToInclude != 0 && numAdded >= numToInclude) {
+            break;
+        }
+        Variant obj2;
+        (*it).toVariant(obj2);
+        obj.append(obj2);
+        numAdded++;
+    }
+}
+
+void LocationFusionRK::TowerList::toCompact(String &str, int numToInclude) const {
+    size_t count = towerArray.size();
+    if (numToInclude > 0 && (size_t)numToInclude < count) {
+        count = numToInclude;
+    }
+
+    // Records are encoded three at a time (60 bytes, a multiple of 3) so base64 padding only occurs at the end
+    uint8_t records[3 * TowerEntry::COMPACT_RECORD_SIZE];
+    for(size_t ii = 0; ii < count; ii += 3) {
+        size_t numRecords = count - ii;
+        if (numRecords > 3) {
+            numRecords = 3;
+        }
+        for(size_t jj = 0; jj < numRecords; jj++) {
+            towerArray[ii + jj].toCompactRecord(&records[jj * TowerEntry::COMPACT_RECORD_SIZE]);
+        }
+        appendBase64(str, records, numRecords * TowerEntry::COMPACT_RECORD_SIZE);
+    }
+}
+
+//
+// Config
+//
+void LocationFusionRK::Config::updateFromVariant(const Variant &data) {
+    if (data.has("period")) {
+        int seconds = data.get("period").toInt();
+        if (seconds > 0) {
+            publishFrequency = PublishFrequency::periodic;
+            publishPeriod = std::chrono::milliseconds((int64_t)seconds * 1000);
+        }
+        else {
+            publishFrequency = PublishFrequency::manual;
+        }
+    }
+    if (data.has("wifi")) {
+        addWiFi = data.get("wifi").toBool();
+    }
+    if (data.has("tower")) {
+        addTower = data.get("tower").toBool();
+    }
+    if (data.has("max_aps")) {
+        int value = data.get("max_aps").toInt();
+        maxWiFiAccessPoints = (value > 0) ? (size_t)value : 0;
+    }
+    if (data.has("max_towers")) {
+        int value = data.get("max_towers").toInt();
+        if (value > 0) {
+            maxTowers = (size_t)value;
+        }
+    }
+    if (data.has("scan_age")) {
+        int seconds = data.get("scan_age").toInt();
+        scanMaxAge = std::chrono::milliseconds((seconds > 0) ? (int64_t)seconds * 1000 : 0);
+    }
+}
+
+//
+// StackMonitor
+//
+
+// Not inlined so its stack frame is directly below the thread function's
+__attribute__((noinline))
+void LocationFusionRK::StackMonitor::paint() {
+    // Sets bottom and stackSize to the stack bounds
+    bottom = nullptr;
+    stackSize = 0;
+    paintedSize = 0;
+    if (os_thread_dump(os_thread_current(nullptr), threadDumpCallback, this) != 0 || !bottom || !stackSize) {
+        _locfLog.info("stack bounds not available, not measuring stack");
+        bottom = nullptr;
+        stackSize = 0;
+        return;
+    }
+
+    // The address of a local variable is close to the current stack pointer. Painting from the lowest address
+    // of the stack up to it stays within the stack. A 64 byte gap is left for this function's own frame.
+    volatile uint8_t marker = 0;
+    uintptr_t top = (uintptr_t)&marker - 64;
+    if (top <= (uintptr_t)bottom || top > (uintptr_t)bottom + stackSize) {
+        _locfLog.info("stack pointer is not within the reported stack, not measuring stack");
+        bottom = nullptr;
+        stackSize = 0;
+        return;
+    }
+    paintedSize = top - (uintptr_t)bottom;
+
+    // Written through a volatile pointer so the compiler does not replace it with a memset call,
+    // which would use stack below this function
+    for(size_t ii = 0; ii < paintedSize; ii++) {
+        bottom[ii] = PAINT_BYTE;
+    }
+}
+
+size_t LocationFusionRK::StackMonitor::getHighWaterMark() const {
+    if (!bottom) {
+        return 0;
+    }
+
+    size_t unused = 0;
+    while(unused < paintedSize && bottom[unused] == PAINT_BYTE) {
+        unused++;
+    }
+    return stackSize - unused;
+}
+
+// [static]
+os_result_t LocationFusionRK::StackMonitor::threadDumpCallback(os_thread_dump_info_t *info, void *ptr) {
+    StackMonitor *monitor = (StackMonitor *)ptr;
+    monitor->bottom = (volatile uint8_t *)info->stack_base;
+    monitor->stackSize = info->stack_size;
+    return 0;
+}
+
+// [static]
+size_t LocationFusionRK::StackMonitor::getRecommendedSize(size_t highWaterMark) {
+    size_t size = highWaterMark + highWaterMark / 4 + 256;
+    size = (size + 255) & ~(size_t)255;
+    if (size < 2048) {
+        size = 2048;
+    }
+    return size;
+}
+
+//
+// LatencyHistogram
+//
+const uint32_t LocationFusionRK::LatencyHistogram::bucketLimits[NUM_BUCKETS - 1] = {
+    100, 200, 500,
+    1000, 2000, 5000,
+    10000, 20000, 50000,
+    100000, 200000, 500000,
+    1000000, 2000000, 5000000,
+    10000000, 20000000, 50000000
+};
+
+void LocationFusionRK::LatencyHistogram::add(uint32_t us) {
+    size_t bucket = 0;
+    while(bucket < NUM_BUCKETS - 1 && us > bucketLimits[bucket]) {
+        bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    totalUs += us;
+    if (us > maxUs) {
+        maxUs = us;
+    }
+}
+
+void LocationFusionRK::LatencyHistogram::clear() {
+    memset(buckets, 0, sizeof(buckets));
+    count = 0;
+    maxUs = 0;
+    totalUs = 0;
+}
+
+uint32_t LocationFusionRK::LatencyHistogram::percentile(float percent) const {
+    if (!count) {
+        return 0;
+    }
+
+    // Rank of the duration at this percentile, 1 to count
+    uint32_t rank = (uint32_t)((percent / 100.0) * count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    uint32_t sum = 0;
+    for(size_t bucket = 0; bucket < NUM_BUCKETS - 1; bucket++) {
+        sum += buckets[bucket];
+        if (sum >= rank) {
+            // The bucket limit can't be larger than the longest duration
+            return std::min(bucketLimits[bucket], maxUs);
+        }
+    }
+    return maxUs;
+}
+
+void LocationFusionRK::LatencyHistogram::toJsonWriter(JSONWriter &writer) const {
+    writer.beginObject();
+    writer.name("n").value((unsigned)count);
+    writer.name("p50").value((unsigned)percentile(50));
+    writer.name("p95").value((unsigned)percentile(95));
+    writer.name("max").value((unsigned)maxUs);
+    writer.name("mean").value((unsigned)getMean());
+    writer.endObject();
+}
+
+// [static]
+void LocationFusionRK::appendBase64(String &str, const uint8_t *data, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    // Encode in small chunks to avoid a concat per character
+    char chunk[65];
+    size_t chunkLen = 0;
+    for(size_t ii = 0; ii < size; ii += 3) {
+        uint32_t value = (uint32_t)data[ii] << 16;
+        if (ii + 1 < size) {
+            value |= (uint32_t)data[ii + 1] << 8;
+        }
+        if (ii + 2 < size) {
+            value |= data[ii + 2];
+        }
+        chunk[chunkLen++] = alphabet[(value >> 18) & 0x3f];
+        chunk[chunkLen++] = alphabet[(value >> 12) & 0x3f];
+        chunk[chunkLen++] = (ii + 1 < size) ? alphabet[(value >> 6) & 0x3f] : '=';
+        chunk[chunkLen++] = (ii + 2 < size) ? alphabet[value & 0x3f] : '=';
+
+        if (chunkLen == sizeof(chunk) - 1) {
+            chunk[chunkLen] = 0;
+            str += chunk;
+            chunkLen = 0;
+        }
+    }
+    if (chunkLen) {
+        chunk[chunkLen] = 0;
+        str += chunk;
+    }
+}
+
+//
+// PublishScheduler
+//
+std::chrono::milliseconds LocationFusionRK::PublishScheduler::getNextPublishDelay(const ScheduleInfo &info) {
+    if (info.event == ScheduleEvent::publishFailed) {
+        return info.publishFailureRetry;
+    }
+    return info.publishPeriod;
+}
+
+std::chrono::milliseconds LocationFusionRK::BackoffPublishScheduler::getNextPublishDelay(const ScheduleInfo &info) {
+    if (info.event == ScheduleEvent::publishFailed) {
+        return getBackoffDelay(info);
+    }
+    return info.publishPeriod;
+}
+
+std::chrono::milliseconds LocationFusionRK::BackoffPublishScheduler::getBackoffDelay(const ScheduleInfo &info) const {
+    uint64_t delay = info.publishFailureRetry.count();
+    for(uint32_t ii = 1; ii < info.consecutiveFailures && delay < (uint64_t)maxDelay.count(); ii++) {
+        delay *= 2;
+    }
+    if (delay > (uint64_t)maxDelay.count()) {
+        delay = maxDelay.count();
+    }
+
+    if (jitter > 0.0) {
+        delay -= (uint64_t)((double)delay * jitter * ((double)rand() / (double)RAND_MAX));
+    }
+    return std::chrono::milliseconds(delay);
+}
+
+std::chrono::milliseconds LocationFusionRK::MovementPublishScheduler::getNextPublishDelay(const ScheduleInfo &info) {
+    if (info.event == ScheduleEvent::publishFailed) {
+        return getBackoffDelay(info);
+    }
+    if (info.similarity >= 0.0 && info.similarity >= threshold) {
+        return stationaryInterval;
+    }
+    // Moving, or no previous sample to compare to
+    return movingInterval;
+}
+
+//
+// RadioFingerprint
+//
+void LocationFusionRK::RadioFingerprint::clear() {
+    numBssids = 0;
+    hasTower = false;
+    mcc = mnc = 0;
+    lac = cid = 0;
+}
+
+void LocationFusionRK::RadioFingerprint::addBssid(uint64_t key) {
+    if (numBssids >= MAX_BSSIDS) {
+        return;
+    }
+
+    // Insertion sort, since there are only a small number of entries
+    size_t ii = numBssids;
+    while(ii > 0 && bssids[ii - 1] > key) {
+        bssids[ii] = bssids[ii - 1];
+        ii--;
+    }
+    if (ii > 0 && bssids[ii - 1] == key) {
+        // Duplicate; undo the shift
+        for(; ii < numBssids; ii++) {
+            bssids[ii] = bssids[ii + 1];
+        }
+        return;
+    }
+    bssids[ii] = key;
+    numBssids++;
+}
+
+void LocationFusionRK::RadioFingerprint::setTower(uint16_t mcc, uint16_t mnc, uint32_t lac, uint32_t cid) {
+    this->mcc = mcc;
+    this->mnc = mnc;
+    this->lac = lac;
+    this->cid = cid;
+    hasTower = true;
+}
+
+float LocationFusionRK::RadioFingerprint::similarity(const RadioFingerprint &other) const {
+    if (numBssids && other.numBssids) {
+        // Both lists are sorted, so the intersection can be found by merging
+        size_t common = 0;
+        size_t ii = 0, jj = 0;
+        while(ii < numBssids && jj < other.numBssids) {
+            if (bssids[ii] == other.bssids[jj]) {
+                common++;
+                ii++;
+                jj++;
+            }
+            else
+            if (bssids[ii] < other.bssids[jj]) {
+                ii++;
+            }
+            else {
+                jj++;
+            }
+        }
+        return (float)common / (float)(numBssids + other.numBssids - common);
+    }
+
+    if (hasTower && other.hasTower) {
+        return (mcc == other.mcc && mnc == other.mnc && lac == other.lac && cid == other.cid) ? 1.0 : 0.0;
+    }
+    return 0.0;
+}
+
+uint32_t LocationFusionRK::RadioFingerprint::hash() const {
+    // FNV-1a
+    uint32_t h = 2166136261UL;
+    auto addByte = [&h](uint8_t b) {
+        h ^= b;
+        h *= 16777619UL;
+    };
+
+    for(size_t ii = 0; ii < numBssids; ii++) {
+        for(int shift = 40; shift >= 0; shift -= 8) {
+            addByte((uint8_t)(bssids[ii] >> shift));
+        }
+    }
+    if (hasTower) {
+        uint32_t values[4] = { mcc, mnc, lac, cid };
+        for(uint32_t value : values) {
+            for(int shift = 24; shift >= 0; shift -= 8) {
+                addByte((uint8_t)(value >> shift));
+            }
+        }
+    }
+    return h;
+}
+
+//
+// LocCache
+//
+LocationFusionRK::LocCache &LocationFusionRK::LocCache::withMaxEntries(size_t maxEntries) {
+    this->maxEntries = maxEntries;
+    entries.reserve(maxEntries);
+    return *this;
+}
+
+bool LocationFusionRK::LocCache::lookup(uint32_t key, Entry &entry) {
+    // Taken before finding the entry, as renumbering when the counter overflows reorders the entries
+    uint16_t used = nextUseCounter();
+    for(auto &e : entries) {
+        if (e.key == key) {
+            e.lastUsed = used;
+            entry = e;
+            hits++;
+            return true;
+        }
+    }
+    misses++;
+    return false;
+}
+
+void LocationFusionRK::LocCache::insert(uint32_t key, double lat, double lon, int hAcc) {
+    if (!maxEntries) {
+        return;
+    }
+
+    // Taken before finding the entry, as renumbering when the counter overflows reorders the entries
+    uint16_t used = nextUseCounter();
+    Entry *entry = nullptr;
+    for(auto &e : entries) {
+        if (e.key == key) {
+            entry = &e;
+            break;
+        }
+    }
+
+    if (!entry) {
+        if (entries.size() < maxEntries) {
+            entries.push_back(Entry());
+            entry = &entries.back();
+        }
+        else {
+            // Replace the least recently used entry
+            entry = &entries[0];
+            for(auto &e : entries) {
+                if (e.lastUsed < entry->lastUsed) {
+                    entry = &e;
+                }
+            }
+        }
+    }
+
+    entry->key = key;
+    entry->latE7 = (int32_t)(lat * 10000000.0);
+    entry->lonE7 = (int32_t)(lon * 10000000.0);
+    entry->hAcc = (hAcc > 0xffff) ? 0xffff : (uint16_t)hAcc;
+    entry->lastUsed = used;
+
+    dirty = true;
+    saveIfDirty();
+}
+
+uint16_t LocationFusionRK::LocCache::nextUseCounter() {
+    if (useCounter == 0xffff) {
+        // Renumber the entries in their current order so the counter can restart
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            return a.lastUsed < b.lastUsed;
+        });
+        useCounter = 0;
+        for(auto &e : entries) {
+            e.lastUsed = ++useCounter;
+        }
+    }
+    return ++useCounter;
+}
+
+// File format: magic (4 bytes), count (4 bytes), then count Entry structures
+static const uint32_t LOC_CACHE_MAGIC = 0x4c464331; // LFC1
+
+void LocationFusionRK::LocCache::load() {
+    if (!persistPath || !maxEntries) {
+        return;
+    }
+
+    int fd = open(persistPath, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    uint32_t header[2];
+    if (read(fd, header, sizeof(header)) == sizeof(header) && header[0] == LOC_CACHE_MAGIC) {
+        entries.clear();
+        useCounter = 0;
+        for(uint32_t ii = 0; ii < header[1] && entries.size() < maxEntries; ii++) {
+            Entry entry;
+            if (read(fd, &entry, sizeof(entry)) != sizeof(entry)) {
+                break;
+            }
+            if (entry.lastUsed > useCounter) {
+                useCounter = entry.lastUsed;
+            }
+            entries.push_back(entry);
+        }
+        _locfLog.trace("loaded %u loc cache entries", (unsigned)entries.size());
+    }
+    close(fd);
+}
+
+void LocationFusionRK::LocCache::save() const {
+    if (!persistPath) {
+        return;
+    }
+
+    // Write to a temporary file and rename so a power loss does not leave a partial file
+    char tempPath[128];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", persistPath);
+
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        _locfLog.error("could not open %s", tempPath);
+        return;
+    }
+
+    uint32_t header[2] = { LOC_CACHE_MAGIC, (uint32_t)entries.size() };
+    bool success = (write(fd, header, sizeof(header)) == sizeof(header));
+    if (success && entries.size()) {
+        size_t size = entries.size() * sizeof(Entry);
+        success = (write(fd, entries.data(), size) == (ssize_t)size);
+    }
+    close(fd);
+
+    if (success) {
+        rename(tempPath, persistPath);
+    }
+    else {
+        unlink(tempPath);
+    }
 }
 
-void LocationFusionRK::WAPEntry::fromWiFiAccessPoint(const WiFiAccessPoint *wap) {
-    memcpy(bssid, wap->bssid, sizeof(bssid));
-    channel = wap->channel;
-    rssi = wap->rssi;
+void LocationFusionRK::LocCache::saveIfDirty() {
+    if (!dirty || !persistPath) {
+        return;
+    }
+    uint64_t now = System.millis();
+    if (lastSaveMs && (now - lastSaveMs) < (uint64_t)saveInterval.count()) {
+        return;
+    }
+    save();
+    dirty = false;
+    lastSaveMs = now;
 }
 
-void LocationFusionRK::WAPEntry::toJsonWriter(JSONWriter &writer, bool wrapInObject) const {
-    if (wrapInObject) {
-        writer.beginObject();
+uint64_t LocationFusionRK::LocCache::getSaveDueMs() const {
+    if (!dirty || !persistPath) {
+        return NO_WAKE_MS;
     }
+    return lastSaveMs ? (lastSaveMs + saveInterval.count()) : 0;
+}
 
-    writer.name("bssid").value(bssidString().c_str());
-    writer.name("ch").value((unsigned)channel);
-    writer.name("str").value(rssi);
+#if LOCATIONFUSIONRK_FUSION
+//
+// FusionFilter
+//
 
-    if (wrapInObject) {
-        writer.endObject();
+void LocationFusionRK::FusionFilter::setOrigin(int32_t latE7, int32_t lonE7) {
+    originLatE7 = latE7;
+    originLonE7 = lonE7;
+    metersPerE7Lon = METERS_PER_E7 * cosf((float)latE7 * (float)(M_PI / 1800000000.0));
+    if (metersPerE7Lon < 0.0001f) {
+        // Close to a pole
+        metersPerE7Lon = 0.0001f;
     }
+    x = y = 0.0f;
 }
 
-void LocationFusionRK::WAPEntry::toVariant(Variant &obj) const {
-    obj.set("bssid", Variant(bssidString().c_str()));
-    obj.set("ch", Variant((unsigned)channel));
-    obj.set("str", Variant(rssi));
+void LocationFusionRK::FusionFilter::update(double lat, double lon, float hAcc, uint64_t ms, FusionSource source) {
+    int32_t latE7 = (int32_t)(lat * 10000000.0);
+    int32_t lonE7 = (int32_t)(lon * 10000000.0);
+    float measVariance = (hAcc < 1.0f) ? 1.0f : hAcc * hAcc;
+
+    if (valid) {
+        // Predict: the uncertainty grows with the time since the last update
+        if (ms > lastMs) {
+            float sigma = sqrtf(variance) + speed * (float)(ms - lastMs) / 1000.0f;
+            variance = sigma * sigma;
+        }
+
+        // Innovation, in meters in the local coordinates
+        float dx = (float)wrapLonE7((int64_t)lonE7 - originLonE7) * metersPerE7Lon - x;
+        float dy = (float)(latE7 - originLatE7) * METERS_PER_E7 - y;
+        float innovationVariance = variance + measVariance;
+
+        if (dx * dx + dy * dy <= resetThreshold * resetThreshold * innovationVariance) {
+            float gain = variance / innovationVariance;
+            x += gain * dx;
+            y += gain * dy;
+            variance -= gain * variance;
+
+            if (ms > lastMs) {
+                lastMs = ms;
+            }
+            lastSource = source;
+            updateCount++;
+
+            // Keep the local coordinates small so float32 stays precise
+            if (fabsf(x) > 10000.0f || fabsf(y) > 10000.0f) {
+                FusedLocation location;
+                getLocation(location);
+                setOrigin((int32_t)(location.lat * 10000000.0), (int32_t)(location.lon * 10000000.0));
+            }
+            return;
+        }
+        // Too far to be explained by the uncertainty, so the device moved or the estimate was wrong
+    }
+
+    setOrigin(latE7, lonE7);
+    variance = measVariance;
+    lastMs = ms;
+    lastSource = source;
+    updateCount = 1;
+    valid = true;
 }
 
-String LocationFusionRK::WAPEntry::bssidString() const {
-    return String::format("%02x:%02x:%02x:%02x:%02x:%02x", bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+bool LocationFusionRK::FusionFilter::getLocation(FusedLocation &location) const {
+    location = FusedLocation();
+    if (!valid) {
+        return false;
+    }
+
+    int32_t latE7 = originLatE7 + (int32_t)(y / METERS_PER_E7);
+    int32_t lonE7 = wrapLonE7((int64_t)originLonE7 + (int64_t)(x / metersPerE7Lon));
+
+    location.lat = (double)latE7 / 10000000.0;
+    location.lon = (double)lonE7 / 10000000.0;
+    location.hAcc = sqrtf(variance);
+    location.updateMs = lastMs;
+    location.updateCount = updateCount;
+    location.source = lastSource;
+    location.valid = true;
+    return true;
 }
-#endif // Wiring_WiFi 
+#endif // LOCATIONFUSIONRK_FUSION
 
+#if LOCATIONFUSIONRK_GEOFENCES
+//
+// Geofences
+//
 
+bool LocationFusionRK::Geofences::addCircle(uint32_t id, double lat, double lon, float radius) {
+    if (fences.size() >= MAX_FENCES) {
+        return false;
+    }
 
+    Fence fence = {};
+    fence.id = id;
+    fence.latE7 = (int32_t)(lat * 10000000.0);
+    fence.lonE7 = (int32_t)(lon * 10000000.0);
+    fence.radiusSq = radius * radius;
+    fence.metersPerE7Lon = METERS_PER_E7 * cosf((float)fence.latE7 * (float)(M_PI / 1800000000.0));
+    if (fence.metersPerE7Lon < 0.0001f) {
+        fence.metersPerE7Lon = 0.0001f;
+    }
 
+    int32_t dLat = (int32_t)(radius / METERS_PER_E7) + 1;
+    int32_t dLon = (int32_t)(radius / fence.metersPerE7Lon) + 1;
+    fence.minLatE7 = fence.latE7 - dLat;
+    fence.maxLatE7 = fence.latE7 + dLat;
+    fence.minLonE7 = fence.lonE7 - dLon;
+    fence.maxLonE7 = fence.lonE7 + dLon;
 
-#if Wiring_WiFi 
-//
-// WAPList
-// 
+    fences.push_back(fence);
+    indexValid = false;
+    return true;
+}
 
-void LocationFusionRK::WAPList::scan() {
-    wapArray.clear();
+bool LocationFusionRK::Geofences::addPolygon(uint32_t id, const double *latLon, size_t numPoints) {
+    if (numPoints < 3 || fences.size() >= MAX_FENCES) {
+        return false;
+    }
 
-    _locfLog.trace("WAPList::scan called");
+    Fence fence = {};
+    fence.id = id;
+    fence.firstVertex = (uint32_t)vertices.size();
+    fence.numVertices = (uint32_t)numPoints;
+    fence.minLatE7 = fence.minLonE7 = INT32_MAX;
+    fence.maxLatE7 = fence.maxLonE7 = INT32_MIN;
+
+    for(size_t ii = 0; ii < numPoints; ii++) {
+        int32_t latE7 = (int32_t)(latLon[ii * 2] * 10000000.0);
+        int32_t lonE7 = (int32_t)(latLon[ii * 2 + 1] * 10000000.0);
+        vertices.push_back(latE7);
+        vertices.push_back(lonE7);
+
+        fence.minLatE7 = std::min(fence.minLatE7, latE7);
+        fence.maxLatE7 = std::max(fence.maxLatE7, latE7);
+        fence.minLonE7 = std::min(fence.minLonE7, lonE7);
+        fence.maxLonE7 = std::max(fence.maxLonE7, lonE7);
+    }
 
-    int res = WiFi.scan(scanCallbackStatic, this);
+    fences.push_back(fence);
+    indexValid = false;
+    return true;
+}
 
-    _locfLog.trace("WAPList::scan returned %d", res);
+bool LocationFusionRK::Geofences::remove(uint32_t id) {
+    for(auto it = fences.begin(); it != fences.end(); ++it) {
+        if ((*it).id == id) {
+            uint32_t first = (*it).firstVertex;
+            uint32_t count = (*it).numVertices * 2;
+            if (count) {
+                vertices.erase(vertices.begin() + first, vertices.begin() + first + count);
+                for(auto &fence : fences) {
+                    if (fence.numVertices && fence.firstVertex > first) {
+                        fence.firstVertex -= count;
+                    }
+                }
+            }
+            fences.erase(it);
+
+            auto insideIt = std::lower_bound(inside.begin(), inside.end(), id);
+            if (insideIt != inside.end() && *insideIt == id) {
+                inside.erase(insideIt);
+            }
+            indexValid = false;
+            return true;
+        }
+    }
+    return false;
+}
 
+void LocationFusionRK::Geofences::clear() {
+    fences.clear();
+    vertices.clear();
+    inside.clear();
+    indexValid = false;
 }
 
-void LocationFusionRK::WAPList::appendEntry(const WAPEntry &entry) {
-    wapArray.push_back(entry);
+bool LocationFusionRK::Geofences::isInside(uint32_t id) const {
+    return std::binary_search(inside.begin(), inside.end(), id);
 }
 
-void LocationFusionRK::WAPList::appendEntry(const WiFiAccessPoint *wap) {
-    LocationFusionRK::WAPEntry entry(wap);
-    appendEntry(entry);
+bool LocationFusionRK::Geofences::contains(const Fence &fence, int32_t latE7, int32_t lonE7) const {
+    if (latE7 < fence.minLatE7 || latE7 > fence.maxLatE7 || lonE7 < fence.minLonE7 || lonE7 > fence.maxLonE7) {
+        return false;
+    }
+
+    if (fence.numVertices == 0) {
+        float dy = (float)(latE7 - fence.latE7) * METERS_PER_E7;
+        float dx = (float)(lonE7 - fence.lonE7) * fence.metersPerE7Lon;
+        return dx * dx + dy * dy <= fence.radiusSq;
+    }
+
+    // Ray casting, with integer math. The point is inside the bounding box, so the products fit in 64 bits.
+    const int32_t *v = &vertices[fence.firstVertex];
+    bool result = false;
+    for(uint32_t ii = 0, jj = fence.numVertices - 1; ii < fence.numVertices; jj = ii++) {
+        int32_t yi = v[ii * 2], xi = v[ii * 2 + 1];
+        int32_t yj = v[jj * 2], xj = v[jj * 2 + 1];
+        if ((yi > latE7) != (yj > latE7)) {
+            // lonE7 < xi + (latE7 - yi) * (xj - xi) / (yj - yi), without dividing
+            int64_t lhs = ((int64_t)lonE7 - xi) * ((int64_t)yj - yi);
+            int64_t rhs = ((int64_t)xj - xi) * ((int64_t)latE7 - yi);
+            if ((yj > yi) ? (lhs < rhs) : (lhs > rhs)) {
+                result = !result;
+            }
+        }
+    }
+    return result;
 }
 
+void LocationFusionRK::Geofences::buildIndex() {
+    indexValid = true;
+    cellStart.clear();
+    cellFences.clear();
+    gridRows = gridCols = 0;
+    if (fences.empty()) {
+        return;
+    }
 
-void LocationFusionRK::WAPList::toJsonWriter(JSONWriter &writer, int numToInclude) const {
-    int numAdded = 0;
+    int32_t minLat = INT32_MAX, maxLat = INT32_MIN, minLon = INT32_MAX, maxLon = INT32_MIN;
+    for(const auto &fence : fences) {
+        minLat = std::min(minLat, fence.minLatE7);
+        maxLat = std::max(maxLat, fence.maxLatE7);
+        minLon = std::min(minLon, fence.minLonE7);
+        maxLon = std::max(maxLon, fence.maxLonE7);
+    }
 
-    writer.beginArray();
+    // About 2 cells per fence, with the rows and columns in proportion to the size of the bounding box
+    size_t targetCells = std::min(fences.size() * 2, MAX_GRID_CELLS);
+    double height = (double)maxLat - minLat + 1, width = (double)maxLon - minLon + 1;
+    gridRows = (size_t)sqrt(targetCells * height / width);
+    gridRows = std::max((size_t)1, std::min(gridRows, targetCells));
+    gridCols = std::max((size_t)1, targetCells / gridRows);
+
+    gridMinLatE7 = minLat;
+    gridMinLonE7 = minLon;
+    cellHeightE7 = (int64_t)(height / gridRows) + 1;
+    cellWidthE7 = (int64_t)(width / gridCols) + 1;
+
+    // Two passes: count the fences in each cell, then fill in cellFences
+    size_t numCells = gridRows * gridCols;
+    cellStart.assign(numCells + 1, 0);
+    for(int pass = 0; pass < 2; pass++) {
+        for(size_t index = 0; index < fences.size(); index++) {
+            const Fence &fence = fences[index];
+            size_t row0 = gridIndex(fence.minLatE7, gridMinLatE7, cellHeightE7, gridRows);
+            size_t row1 = gridIndex(fence.maxLatE7, gridMinLatE7, cellHeightE7, gridRows);
+            size_t col0 = gridIndex(fence.minLonE7, gridMinLonE7, cellWidthE7, gridCols);
+            size_t col1 = gridIndex(fence.maxLonE7, gridMinLonE7, cellWidthE7, gridCols);
+            for(size_t row = row0; row <= row1; row++) {
+                for(size_t col = col0; col <= col1; col++) {
+                    size_t cell = row * gridCols + col;
+                    if (pass == 0) {
+                        cellStart[cell + 1]++;
+                    }
+                    else {
+                        // cellStart[cell] is used as the insert position, then restored below
+                        cellFences[cellStart[cell]++] = (uint16_t)index;
+                    }
+                }
+            }
+        }
+        if (pass == 0) {
+            for(size_t cell = 0; cell < numCells; cell++) {
+                cellStart[cell + 1] += cellStart[cell];
+            }
+            cellFences.resize(cellStart[numCells]);
+        }
+        else {
+            for(size_t cell = numCells; cell > 0; cell--) {
+                cellStart[cell] = cellStart[cell - 1];
+            }
+            cellStart[0] = 0;
+        }
+    }
+}
 
-    for(auto it = wapArray.begin(); it != wapArray.end(); ++it) {
-        if (numToInclude != 0 && numAdded >= numToInclude) {
-            break;
+// [static]
+size_t LocationFusionRK::Geofences::gridIndex(int32_t valueE7, int32_t minE7, int64_t cellSizeE7, size_t count) {
+    int64_t offset = (int64_t)valueE7 - minE7;
+    if (offset < 0) {
+        return 0;
+    }
+    return (size_t)std::min((uint64_t)(offset / cellSizeE7), (uint64_t)(count - 1));
+}
+
+size_t LocationFusionRK::Geofences::evaluate(double lat, double lon, std::vector<Event> &events) {
+    if (!indexValid) {
+        buildIndex();
+    }
+
+    int32_t latE7 = (int32_t)(lat * 10000000.0);
+    int32_t lonE7 = (int32_t)(lon * 10000000.0);
+
+    newInside.clear();
+    lastCandidateCount = 0;
+    if (gridRows && latE7 >= gridMinLatE7 && lonE7 >= gridMinLonE7) {
+        // In 64 bits, as the offsets can exceed the range of an int32_t
+        uint64_t row = (uint64_t)(((int64_t)latE7 - gridMinLatE7) / cellHeightE7);
+        uint64_t col = (uint64_t)(((int64_t)lonE7 - gridMinLonE7) / cellWidthE7);
+        if (row < gridRows && col < gridCols) {
+            size_t cell = row * gridCols + col;
+            for(size_t ii = cellStart[cell]; ii < cellStart[cell + 1]; ii++) {
+                const Fence &fence = fences[cellFences[ii]];
+                lastCandidateCount++;
+                if (contains(fence, latE7, lonE7)) {
+                    newInside.push_back(fence.id);
+                }
+            }
+        }
+    }
+    std::sort(newInside.begin(), newInside.end());
+
+    // Both lists are sorted, so one pass finds the enters and exits
+    size_t numEvents = 0;
+    auto oldIt = inside.begin(), newIt = newInside.begin();
+    while(oldIt != inside.end() || newIt != newInside.end()) {
+        if (newIt == newInside.end() || (oldIt != inside.end() && *oldIt < *newIt)) {
+            events.push_back(Event{*oldIt++, Transition::exit});
+            numEvents++;
+        }
+        else
+        if (oldIt == inside.end() || *newIt < *oldIt) {
+            events.push_back(Event{*newIt++, Transition::enter});
+            numEvents++;
+        }
+        else {
+            ++oldIt;
+            ++newIt;
         }
-        (*it).toJsonWriter(writer, true);
-        numAdded++;
     }
+    inside.swap(newInside);
 
-    writer.endArray();
+    return numEvents;
 }
+#endif // LOCATIONFUSIONRK_GEOFENCES
 
-void LocationFusionRK::WAPList::toVariant(Variant &obj, int numToInclude) const {
-    int numAdded = 0;
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+//
+// WiFiPositionIndex
+//
 
-    for(auto it = wapArray.begin(); it != wapArray.end(); ++it) {
-        if (numToInclude != 0 && numAdded >= numToInclude) {
-            break;
+// File format: magic (4 bytes), count (4 bytes), then count Entry structures sorted by bssid
+static const uint32_t WIFI_POSITION_MAGIC = 0x4c465731; // LFW1
+static const size_t WIFI_POSITION_HEADER_SIZE = 8;
+
+static int compareBssid(const LocationFusionRK::WiFiPositionIndex::Entry &a, const LocationFusionRK::WiFiPositionIndex::Entry &b) {
+    return memcmp(a.bssid, b.bssid, sizeof(a.bssid));
+}
+
+LocationFusionRK::WiFiPositionIndex::~WiFiPositionIndex() {
+    close();
+}
+
+void LocationFusionRK::WiFiPositionIndex::open() {
+    close();
+    fileEntries = 0;
+    if (!path) {
+        return;
+    }
+
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    uint32_t header[2];
+    if (read(fd, header, sizeof(header)) == sizeof(header) && header[0] == WIFI_POSITION_MAGIC) {
+        fileEntries = header[1];
+        _locfLog.trace("wifi position index has %u entries", (unsigned)fileEntries);
+    }
+}
+
+void LocationFusionRK::WiFiPositionIndex::close() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool LocationFusionRK::WiFiPositionIndex::readEntries(int fd, size_t index, Entry *entries, size_t count) {
+    readCount++;
+    if (lseek(fd, (off_t)(WIFI_POSITION_HEADER_SIZE + index * sizeof(Entry)), SEEK_SET) < 0) {
+        return false;
+    }
+    return read(fd, entries, count * sizeof(Entry)) == (ssize_t)(count * sizeof(Entry));
+}
+
+bool LocationFusionRK::WiFiPositionIndex::lookup(uint64_t key, Entry &entry, size_t &start) {
+    Entry target;
+    keyToBssid(key, target.bssid);
+
+    bool found = false;
+    if (fd >= 0 && start < fileEntries) {
+        size_t low = start, high = fileEntries;
+
+        // Binary search until the range fits in one block read
+        while(!found && high - low > SEARCH_BLOCK_ENTRIES) {
+            size_t mid = low + (high - low) / 2;
+            if (!readEntries(fd, mid, &entry, 1)) {
+                return false;
+            }
+            int cmp = compareBssid(entry, target);
+            if (cmp == 0) {
+                found = true;
+                low = mid + 1;
+            }
+            else
+            if (cmp < 0) {
+                low = mid + 1;
+            }
+            else {
+                high = mid;
+            }
+        }
+
+        if (!found) {
+            Entry block[SEARCH_BLOCK_ENTRIES];
+            size_t count = high - low;
+            if (count && !readEntries(fd, low, block, count)) {
+                return false;
+            }
+            size_t ii = 0;
+            for(; ii < count; ii++) {
+                int cmp = compareBssid(block[ii], target);
+                if (cmp >= 0) {
+                    if (cmp == 0) {
+                        entry = block[ii];
+                        found = true;
+                        ii++;
+                    }
+                    break;
+                }
+            }
+            low += ii;
+        }
+        start = low;
+    }
+
+    // Observations not yet merged into the file
+    auto it = std::lower_bound(pending.begin(), pending.end(), target, [](const Entry &a, const Entry &b) {
+        return compareBssid(a, b) < 0;
+    });
+    if (it != pending.end() && compareBssid(*it, target) == 0) {
+        if (found) {
+            mergeEntry(entry, *it);
+        }
+        else {
+            entry = *it;
+            found = true;
         }
-        Variant obj2;
-        (*it).toVariant(obj2);
-        obj.append(obj2);
-        numAdded++;
     }
+    return found;
 }
 
+void LocationFusionRK::WiFiPositionIndex::learn(uint64_t key, int32_t latE7, int32_t lonE7) {
+    if (!path) {
+        return;
+    }
 
-void LocationFusionRK::WAPList::scanCallback(WiFiAccessPoint* wap) {
-    appendEntry(wap);
+    Entry observation;
+    keyToBssid(key, observation.bssid);
+    observation.weight = 1;
+    observation.latE7 = latE7;
+    observation.lonE7 = lonE7;
+
+    auto it = std::lower_bound(pending.begin(), pending.end(), observation, [](const Entry &a, const Entry &b) {
+        return compareBssid(a, b) < 0;
+    });
+    if (it != pending.end() && compareBssid(*it, observation) == 0) {
+        mergeEntry(*it, observation);
+    }
+    else {
+        pending.insert(it, observation);
+    }
+
+    if (pending.size() >= maxPending) {
+        flush();
+    }
 }
 
-// [static] 
-void LocationFusionRK::WAPList::scanCallbackStatic(WiFiAccessPoint* wap, void *context) {
-    ((LocationFusionRK::WAPList *)context)->scanCallback(wap);
+bool LocationFusionRK::WiFiPositionIndex::flush() {
+    if (!path || pending.empty()) {
+        return true;
+    }
+
+    // Merge the sorted file and the sorted pending observations into a temporary file, then rename it, so
+    // a power loss leaves either the old or the new index
+    char tempPath[128];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+
+    int outFd = ::open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (outFd < 0) {
+        _locfLog.error("could not open %s", tempPath);
+        pending.clear();
+        return false;
+    }
+
+    uint32_t header[2] = { WIFI_POSITION_MAGIC, 0 };
+    bool success = (write(outFd, header, sizeof(header)) == sizeof(header));
+
+    Entry inBlock[SEARCH_BLOCK_ENTRIES];
+    Entry outBlock[SEARCH_BLOCK_ENTRIES];
+    size_t inIndex = 0, inPos = 0, inCount = 0, outPos = 0, outCount = 0;
+    size_t numEntries = fileEntries;
+    auto pendingIt = pending.begin();
+
+    while(success) {
+        if (inPos == inCount && inIndex < fileEntries) {
+            inCount = fileEntries - inIndex;
+            if (inCount > SEARCH_BLOCK_ENTRIES) {
+                inCount = SEARCH_BLOCK_ENTRIES;
+            }
+            if (fd < 0 || !readEntries(fd, inIndex, inBlock, inCount)) {
+                success = false;
+                break;
+            }
+            inIndex += inCount;
+            inPos = 0;
+        }
+        bool haveFile = (inPos < inCount);
+        bool havePending = (pendingIt != pending.end());
+        if (!haveFile && !havePending) {
+            break;
+        }
+
+        int cmp = (haveFile && havePending) ? compareBssid(inBlock[inPos], *pendingIt) : (haveFile ? -1 : 1);
+        if (cmp < 0) {
+            outBlock[outPos] = inBlock[inPos++];
+        }
+        else
+        if (cmp == 0) {
+            outBlock[outPos] = inBlock[inPos++];
+            mergeEntry(outBlock[outPos], *pendingIt++);
+        }
+        else {
+            if (maxEntries && numEntries >= maxEntries) {
+                // Full, only existing access points are updated
+                pendingIt++;
+                continue;
+            }
+            outBlock[outPos] = *pendingIt++;
+            numEntries++;
+        }
+
+        if (++outPos == SEARCH_BLOCK_ENTRIES) {
+            success = (write(outFd, outBlock, sizeof(outBlock)) == sizeof(outBlock));
+            outCount += outPos;
+            outPos = 0;
+        }
+    }
+    if (success && outPos) {
+        success = (write(outFd, outBlock, outPos * sizeof(Entry)) == (ssize_t)(outPos * sizeof(Entry)));
+        outCount += outPos;
+    }
+    if (success) {
+        header[1] = (uint32_t)outCount;
+        success = (lseek(outFd, 0, SEEK_SET) == 0) && (write(outFd, header, sizeof(header)) == sizeof(header));
+    }
+    ::close(outFd);
+
+    // Discarded even on failure so RAM usage stays bounded
+    pending.clear();
+
+    if (!success) {
+        _locfLog.error("could not write %s", tempPath);
+        unlink(tempPath);
+        return false;
+    }
+
+    close();
+    rename(tempPath, path);
+    open();
+    return true;
 }
 
-#endif // Wiring_WiFi 
+// [static]
+void LocationFusionRK::WiFiPositionIndex::keyToBssid(uint64_t key, uint8_t *bssid) {
+    for(int ii = 5; ii >= 0; ii--) {
+        bssid[ii] = (uint8_t)key;
+        key >>= 8;
+    }
+}
 
-#if Wiring_Cellular
+// [static]
+void LocationFusionRK::WiFiPositionIndex::mergeEntry(Entry &entry, const Entry &other) {
+    int32_t total = entry.weight + other.weight;
+    if (total == 0) {
+        return;
+    }
 
-int LocationFusionRK::ServingTower::get() {
-    memset(&cgi, 0, sizeof(CellularGlobalIdentity));
-    cgi.size = sizeof(CellularGlobalIdentity);
-    cgi.version = CGI_VERSION_LATEST;
+    entry.latE7 += (int32_t)((int64_t)(other.latE7 - entry.latE7) * other.weight / total);
+    entry.lonE7 = wrapLonE7((int64_t)entry.lonE7 + (int64_t)wrapLonE7((int64_t)other.lonE7 - entry.lonE7) * other.weight / total);
+    entry.weight = (total < MAX_WEIGHT) ? (uint16_t)total : MAX_WEIGHT;
+}
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
 
-    cellularResult = cellular_global_identity(&cgi, NULL);
+//
+// OfflineQueue
+//
+LocationFusionRK::OfflineQueue::~OfflineQueue() {
+    close();
+}
 
-    return (int)cellularResult;
+bool LocationFusionRK::OfflineQueue::open() {
+    if (!isEnabled() || recordSize <= sizeof(RecordHeader) || getMaxDataSize() > 0xffff) {
+        return false;
+    }
+    close();
+
+    fd = ::open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        _locfLog.error("could not open %s", path);
+        return false;
+    }
+
+    // Find the valid records. Slots are written in sequence order, so the valid records are consecutive 
+    // (wrapping around) starting with the lowest sequence number.
+    uint8_t *data = new uint8_t[getMaxDataSize()];
+    uint32_t firstSeq = 0, lastSeq = 0;
+    count = 0;
+    first = 0;
+    for(size_t slot = 0; slot < maxRecords; slot++) {
+        RecordHeader header;
+        if (lseek(fd, slot * recordSize, SEEK_SET) < 0 || ::read(fd, &header, sizeof(header)) != sizeof(header)) {
+            break;
+        }
+        if (header.seq == 0 || header.size > getMaxDataSize()) {
+            continue;
+        }
+        if (::read(fd, data, header.size) != header.size || recordCrc(header, data) != header.crc) {
+            continue;
+        }
+        count++;
+        if (firstSeq == 0 || header.seq < firstSeq) {
+            firstSeq = header.seq;
+            first = slot;
+        }
+        if (header.seq > lastSeq) {
+            lastSeq = header.seq;
+        }
+    }
+    delete[] data;
+
+    nextSeq = lastSeq + 1;
+    if (count && lastSeq - firstSeq + 1 != count) {
+        // A record in the middle was damaged; returned records skip it, but the count must cover the range
+        count = lastSeq - firstSeq + 1;
+        if (count > maxRecords) {
+            count = maxRecords;
+        }
+    }
+    return true;
 }
 
-void LocationFusionRK::ServingTower::toJsonWriter(JSONWriter &writer, bool wrapInObject) const {
-    if (wrapInObject) {
-        writer.beginObject();
+void LocationFusionRK::OfflineQueue::close() {
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
     }
+}
 
-    writer.name("rat").value("lte");
-    writer.name("mcc").value(cgi.mobile_country_code);
-    writer.name("mnc").value(cgi.mobile_network_code);
-    writer.name("lac").value(cgi.location_area_code);
-    writer.name("cid").value(cgi.cell_id);
+bool LocationFusionRK::OfflineQueue::append(const uint8_t *data, size_t size) {
+    if (fd < 0 || size > getMaxDataSize()) {
+        return false;
+    }
 
-    // str (signal strength, rssi) could be included here 
+    if (count == maxRecords) {
+        // Overwrite the oldest record
+        first = (first + 1) % maxRecords;
+        count--;
+        dropped++;
+    }
+    size_t slot = (first + count) % maxRecords;
+
+    // The header and data are written at once; if power is lost part way through, the CRC will not match
+    uint8_t *buf = new uint8_t[sizeof(RecordHeader) + size];
+    RecordHeader header = {};
+    header.seq = nextSeq;
+    header.size = (uint16_t)size;
+    header.crc = recordCrc(header, data);
+    memcpy(buf, &header, sizeof(header));
+    memcpy(&buf[sizeof(header)], data, size);
+
+    bool success = lseek(fd, slot * recordSize, SEEK_SET) >= 0 && 
+        ::write(fd, buf, sizeof(header) + size) == (ssize_t)(sizeof(header) + size);
+    delete[] buf;
+    fsync(fd);
+
+    if (success) {
+        nextSeq++;
+        count++;
+    }
+    return success;
+}
 
-    if (wrapInObject) {
-        writer.endObject();
+size_t LocationFusionRK::OfflineQueue::read(size_t index, uint8_t *data) {
+    if (fd < 0 || index >= count) {
+        return 0;
     }
-    
+    size_t slot = (first + index) % maxRecords;
+
+    RecordHeader header;
+    if (lseek(fd, slot * recordSize, SEEK_SET) < 0 || ::read(fd, &header, sizeof(header)) != sizeof(header) || 
+        header.seq == 0 || header.size > getMaxDataSize()) {
+        return 0;
+    }
+    if (::read(fd, data, header.size) != header.size || recordCrc(header, data) != header.crc) {
+        return 0;
+    }
+    return header.size;
 }
 
-void LocationFusionRK::ServingTower::toVariant(Variant &obj) const {
-    obj.set("rat", Variant("lte"));
-    obj.set("mcc", cgi.mobile_country_code);
-    obj.set("mnc", cgi.mobile_network_code);
-    obj.set("cid", cgi.cell_id);
-    obj.set("lac", cgi.location_area_code);
+void LocationFusionRK::OfflineQueue::consume(size_t count) {
+    if (count > this->count) {
+        count = this->count;
+    }
+    for(size_t ii = 0; ii < count; ii++) {
+        if (!clearSlot((first + ii) % maxRecords)) {
+            // The record is still removed from the queue, but will be found again by open()
+            _locfLog.error("could not clear offline queue record, it may be published again after a restart");
+        }
+    }
+    fsync(fd);
+
+    first = (first + count) % maxRecords;
+    this->count -= count;
 }
 
-#endif // Wiring_Cellular
+bool LocationFusionRK::OfflineQueue::clearSlot(size_t slot) {
+    if (fd < 0) {
+        return false;
+    }
+    uint32_t seq = 0;
+    return lseek(fd, slot * recordSize, SEEK_SET) >= 0 && ::write(fd, &seq, sizeof(seq)) == sizeof(seq);
+}
 
+// [static]
+uint32_t LocationFusionRK::OfflineQueue::recordCrc(const RecordHeader &header, const uint8_t *data) {
+    uint32_t crc = crc32(0, &header.seq, sizeof(header.seq));
+    crc = crc32(crc, &header.size, sizeof(header.size));
+    return crc32(crc, data, header.size);
+}
 
+// [static]
+uint32_t LocationFusionRK::OfflineQueue::crc32(uint32_t crc, const void *data, size_t size) {
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    while(size--) {
+        crc ^= *p++;
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
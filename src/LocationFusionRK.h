@@ -11,8 +11,40 @@
 #error "The LocationFusionRK library requires Device OS 6.2.0 or later because it requires Variant and CloudEvent"
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <vector>
 
+// Optional compile-time configuration. Put a LocationFusionRKConfig.h file in your application's src directory to 
+// set these, so both the library and your application are built with the same settings.
+#if defined(__has_include)
+#if __has_include("LocationFusionRKConfig.h")
+#include "LocationFusionRKConfig.h"
+#endif
+#endif
+
+#ifndef LOCATIONFUSIONRK_WIFI_POSITIONING
+/**
+ * @brief Set to 0 to leave out on-device Wi-Fi positioning (WiFiPositionIndex, withWiFiPositioning()). Added in 0.0.5.
+ */
+#define LOCATIONFUSIONRK_WIFI_POSITIONING 1
+#endif
+
+#ifndef LOCATIONFUSIONRK_FUSION
+/**
+ * @brief Set to 0 to leave out the fusion filter (FusionFilter, withFusion()). Added in 0.0.5.
+ */
+#define LOCATIONFUSIONRK_FUSION 1
+#endif
+
+#ifndef LOCATIONFUSIONRK_GEOFENCES
+/**
+ * @brief Set to 0 to leave out geofences (Geofences, withGeofences()). Added in 0.0.5.
+ */
+#define LOCATIONFUSIONRK_GEOFENCES 1
+#endif
+
 /**
  * This class is a singleton; you do not create one as a global, on the stack, or with new.
  * 
@@ -26,9 +58,16 @@ public:
     /**
      * @brief Class for holding information about a single Wi-Fi access point
      * 
+     * This is a packed 8-byte structure (48-bit BSSID, channel, and RSSI) so lists of access points
+     * use as little RAM as possible.
      */
     class WAPEntry {
     public:
+        /**
+         * @brief Size of the buffer required by bssidString(char *buf), including the null terminator
+         */
+        static const size_t BSSID_STRING_SIZE = 18;
+
         WAPEntry();
 
         WAPEntry(const WiFiAccessPoint *wap);
@@ -56,25 +95,76 @@ public:
         void toVariant(Variant &obj) const;
 
         /**
-         * @brief Convert to a string in 00-00-00-00-00-00 hex format
+         * @brief Convert to a string in 00:00:00:00:00:00 hex format
          * 
          * @return String 
+         * 
+         * This allocates a String; bssidString(char *buf) does not.
          */
         String bssidString() const;
 
+        /**
+         * @brief Convert to a string in 00:00:00:00:00:00 hex format into a buffer, without allocating. Added in 0.0.5.
+         * 
+         * @param buf Buffer to write to. Must be at least BSSID_STRING_SIZE (18) bytes.
+         * @return const char* buf, for convenience
+         */
+        const char *bssidString(char *buf) const;
+
+        /**
+         * @brief Get the BSSID as a 48-bit integer, for comparisons and lookups. Added in 0.0.5.
+         * 
+         * @return uint64_t BSSID with bssid[0] in the most significant byte of the 48 bits
+         */
+        uint64_t bssidKey() const;
+
         uint8_t bssid[6]; //!< BSSID (base station MAC address)
         uint8_t channel; //!< Wi-Fi channel number
-        uint8_t reserved; //!< reserved for future use and for structure alignment 
-        int rssi; //!< The signal strength (RSSI) 
+        int8_t rssi; //!< The signal strength (RSSI) in dBm. Prior to 0.0.5 this was an int.
     };
 #endif // Wiring_WiFi
 
 #if Wiring_WiFi 
+    static_assert(sizeof(WAPEntry) == 8, "WAPEntry should be packed into 8 bytes");
+
     /**
      * @brief Container for a list of Wi-Fi access points, along with methods for scanning and converting to JSON or Variant
+     * 
+     * Entries are kept sorted by RSSI, strongest first, so limiting the number of entries in toJsonWriter() or
+     * toVariant() includes the strongest access points. 
      */
     class WAPList {
     public:
+        /**
+         * @brief Limit the number of access points kept. Default is 0 (unlimited). Added in 0.0.5.
+         * 
+         * @param maxEntries Maximum number of entries, or 0 for unlimited
+         * @return WAPList& 
+         * 
+         * When limited, only the strongest maxEntries access points are kept during the scan, so memory usage
+         * is bounded even in environments with many access points. The storage is allocated once here.
+         */
+        WAPList &withMaxEntries(size_t maxEntries);
+
+        /**
+         * @brief Discard access points with a locally administered BSSID. Default is false. Added in 0.0.5.
+         * 
+         * @param enable 
+         * @return WAPList& 
+         * 
+         * Locally administered (randomized) MAC addresses are typically used by mobile hotspots and are not 
+         * useful for geolocation because they move with the phone.
+         */
+        WAPList &withFilterLocallyAdministered(bool enable = true) { filterLocallyAdministered = enable; return *this; };
+
+        /**
+         * @brief Discard duplicate BSSIDs, keeping the strongest. Default is true. Added in 0.0.5.
+         * 
+         * @param enable 
+         * @return WAPList& 
+         */
+        WAPList &withRemoveDuplicates(bool enable = true) { removeDuplicates = enable; return *this; };
+
         /**
          * @brief Scan for Wi-Fi access points.
          * 
@@ -84,6 +174,15 @@ public:
          */
         void scan();
 
+        /**
+         * @brief Replace the entries with the entries of another list. Added in 0.0.5.
+         * 
+         * @param other List to copy from
+         * 
+         * The filter, duplicate, and maxEntries settings of this list are applied, not those of other. 
+         */
+        void copyFrom(const WAPList &other);
+
         /**
          * @brief Return the number of access points found
          * 
@@ -91,6 +190,25 @@ public:
          */
         size_t size() const { return wapArray.size(); };
 
+        /**
+         * @brief Remove all entries. The allocated capacity is retained so the object can be reused without reallocating.
+         */
+        void clear() { wapArray.clear(); droppedCount = 0; };
+
+        /**
+         * @brief Get the number of access points that were not kept since the last scan() or clear()
+         * 
+         * @return size_t Number of entries dropped due to the filters, duplicates, or maxEntries
+         */
+        size_t getDroppedCount() const { return droppedCount; };
+
+        /**
+         * @brief Get an entry by index. Entries are sorted by RSSI, strongest first.
+         * 
+         * @param index 0 <= index < size()
+         * @return const WAPEntry& 
+         */
+        const WAPEntry &getEntry(size_t index) const { return wapArray[index]; };
 
         /**
          * @brief Convert this object to JSON
@@ -108,11 +226,23 @@ public:
          */
         void toVariant(Variant &obj, int numToInclude = 0) const;
 
+        /**
+         * @brief Append the compact encoding of the entries to a string. Added in 0.0.5.
+         * 
+         * @param str String to append to
+         * @param numToInclude Limit to this number of entries. 0 (default) is unlimited.
+         * 
+         * The compact encoding is base64 of the packed 8-byte WAPEntry structures: bssid (6), channel (1), rssi (1, signed).
+         */
+        void toCompact(String &str, int numToInclude = 0) const;
+
     protected:
         /**
          * @brief Used internally to add an entry to wapArray
          * 
          * @param entry 
+         * 
+         * The entry is inserted in RSSI order and may be discarded based on the filter, duplicate, and maxEntries settings.
          */
         void appendEntry(const WAPEntry &entry);
 
@@ -141,6 +271,11 @@ public:
          * @brief Array of access points found by Wifi.scan()
          */
         std::vector<WAPEntry> wapArray;
+
+        size_t maxEntries = 0; //!< Maximum number of entries to keep, 0 = unlimited
+        size_t droppedCount = 0; //!< Number of entries not kept since the last clear
+        bool filterLocallyAdministered = false; //!< Discard locally administered BSSIDs
+        bool removeDuplicates = true; //!< Discard duplicate BSSIDs, keeping the strongest
     };
 #endif // Wiring_WiFi
 
@@ -177,6 +312,7 @@ public:
          * @param obj Variant object to add to
          */
         void toVariant(Variant &obj) const;
+
         /**
          * @brief Return the current CellularGlobalIdentity. Only valid after get() is called.
          * 
@@ -190,527 +326,3554 @@ public:
 
     };
 #endif // Wiring_Cellular
-    /**
-     * @brief How often to publish location 
-     */
-    enum class PublishFrequency {
-        manual, //!< Only when requested
-        once, //!< Once after connecting to the cloud
-        periodic //!< Periodically (period is configurable)
-    };
 
     /**
-     * @brief Current status of this library
-     * 
-     * Note that the publishSuccess and publishFailed status codes are only useful when
-     * using the handler callback. Almost immediately after that notification, the status
-     * goes to idle, so it would be hard to catch this status by polling.
+     * @brief A serving or neighbor cellular tower, used in TowerList. Added in 0.0.5.
      * 
-     * The locEnhancedSuccess and locEnhancedFail also require the callback to be useful.
-     * Note the locEnhanced status events are only used if you have enabled a loc-enhanced
-     * callback to receive the events on-device. If you do not do this, the loc-enhanced
-     * will only exist in the cloud and not be sent back to the device.
-     * 
-     * If you are implementing sleep control, you can go go sleep if the status is idle.
+     * Fields that the modem did not report are left at their unknown values and are omitted from the JSON.
      */
-    enum class Status:int {
-        idle = 0, //!< is idle (cloud connected or not)
-        publishing = 1, //!< publishing a loc event (includes building the event)
-        publishSuccess = 2, //!< publish succeeded
-        publishFail = 3, //!< publish failed
-        locEnhancedWait = 4, //!< waiting for a loc-enhanced reply
-        locEnhancedSuccess = 5, //!< loc-enhanced reply received
-        locEnhancedFail = 6 //!< loc-enhanced reply timed out        
+    class TowerEntry {
+    public:
+        /**
+         * @brief Size of the record written by toCompactRecord() and read by fromCompactRecord()
+         */
+        static const size_t COMPACT_RECORD_SIZE = 20;
+
+        static const uint32_t UNKNOWN_EARFCN = 0xffffffff; //!< Value of earfcn when not known
+        static const uint16_t UNKNOWN_PCI = 0xffff; //!< Value of pci when not known
+
+        /**
+         * @brief Returns true if this entry and other refer to the same cell
+         * 
+         * @param other 
+         * 
+         * Cells with a known cid are compared by mcc, mnc, lac, and cid. Neighbor cells that only report a
+         * physical cell ID are compared by earfcn and pci.
+         */
+        bool isSameCell(const TowerEntry &other) const;
+
+        /**
+         * @brief Returns the rsrp for sorting. Unknown signal strength sorts after all known values.
+         */
+        int sortRsrp() const { return (rsrp != 0) ? rsrp : -1000; };
+
+        /**
+         * @brief Convert this object to JSON
+         * 
+         * @param writer JSONWriter to write the data to
+         * @param wrapInObject true (default) to surround with beginObject() and endObject()
+         */
+        void toJsonWriter(JSONWriter &writer, bool wrapInObject = true) const;
+
+        /**
+         * @brief Save this data in a Variant object. Requires Device OS 6.2.0 or later.
+         * 
+         * @param obj Variant object to add to
+         */
+        void toVariant(Variant &obj) const;
+
+        /**
+         * @brief Write the packed little endian record used by the compact encoding and the offline queue
+         * 
+         * @param record Buffer of COMPACT_RECORD_SIZE bytes
+         * 
+         * The layout is mcc (2), mnc (2), lac (4), cid (4), earfcn (4), pci (2), -rsrp (1, 0 = unknown),
+         * rsrq (1, signed, 0 = unknown). The serving flag is not stored; the serving cell is always first.
+         */
+        void toCompactRecord(uint8_t *record) const;
+
+        /**
+         * @brief Read a record written by toCompactRecord()
+         * 
+         * @param record Buffer of COMPACT_RECORD_SIZE bytes
+         */
+        void fromCompactRecord(const uint8_t *record);
+
+        uint16_t mcc = 0; //!< Mobile country code
+        uint16_t mnc = 0; //!< Mobile network code
+        uint32_t lac = 0; //!< Location area code (tracking area code on LTE)
+        uint32_t cid = 0; //!< Cell ID, 0 if not known (typical for neighbor cells)
+        uint32_t earfcn = UNKNOWN_EARFCN; //!< Channel number (EARFCN)
+        uint16_t pci = UNKNOWN_PCI; //!< Physical cell ID
+        int16_t rsrp = 0; //!< Reference signal received power in dBm, 0 if not known
+        int8_t rsrq = 0; //!< Reference signal received quality in dB, 0 if not known
+        bool serving = false; //!< true for the serving cell
     };
-     
 
     /**
-     * @brief Gets the singleton instance of this class, allocating it if necessary
+     * @brief Container for a list of serving and neighbor cellular towers. Added in 0.0.5.
      * 
-     * Use LocationFusionRK::instance() to instantiate the singleton.
+     * This is the cellular counterpart to WAPList. The serving cell is kept first, then the neighbor cells sorted
+     * by rsrp, strongest first. The capacity is fixed so memory usage is bounded regardless of how many cells the 
+     * modem reports.
      */
-    static LocationFusionRK &instance();
+    class TowerList {
+    public:
+        /**
+         * @brief Default value for withMaxEntries()
+         */
+        static const size_t DEFAULT_MAX_ENTRIES = 6;
 
-    /**
-     * @brief Perform setup operations; call this from global application setup()
-     * 
-     * You typically use LocationFusionRK::instance().setup();
-     * 
-     * Typically you use all of the withXXX() functions before setup.
-     */
-    void setup();
+        TowerList();
 
-    /**
-     * @brief Set the publish frequency to manual. Call requestPublish() to do so. This is the default.
-     * 
-     * @return LocationFusionRK& 
-     */
-    LocationFusionRK &withPublishManual() { publishFrequency = PublishFrequency::manual; return *this; };
+        /**
+         * @brief Limit the number of towers kept. Default is DEFAULT_MAX_ENTRIES (6).
+         * 
+         * @param maxEntries Maximum number of entries, must be at least 1
+         * @return TowerList& 
+         * 
+         * The serving cell and the strongest neighbors are kept. The storage is allocated once here.
+         */
+        TowerList &withMaxEntries(size_t maxEntries);
 
-    /**
-     * @brief Set the publish frequency to publish once after connecting to the cloud.
-     * 
-     * @return LocationFusionRK& 
-     */
-    LocationFusionRK &withPublishOnce() { publishFrequency = PublishFrequency::once; return *this; };
+        /**
+         * @brief Remove all entries. The allocated capacity is retained so the object can be reused without reallocating.
+         */
+        void clear() { towerArray.clear(); droppedCount = 0; };
 
-    /**
-     * @brief Set the publish frequency to publish periodically when cloud connected.
-     * 
-     * @param ms 
-     * @return LocationFusionRK& 
-     * 
-     * Even though the parameter is in milliseconds, you probably shouldn't publish more often than every few minutes. 
-     * 
-     * If you are using location fusion on a non-Tracker device it costs 50 data operations per fusion request, so doing location fusion
-     * frequently on the free plan may cause your account to be paused due to running out of data operations.
-     */
-    LocationFusionRK &withPublishPeriodic(std::chrono::milliseconds ms) { publishFrequency = PublishFrequency::periodic; publishPeriod = ms; return *this; };
+        /**
+         * @brief Add a tower, typically called from a TowerProvider
+         * 
+         * @param entry 
+         * 
+         * If the cell is already in the list the two entries are merged, keeping the stronger signal. When the list
+         * is full, the weakest neighbor is discarded.
+         */
+        void addEntry(const TowerEntry &entry);
+
+        /**
+         * @brief Return the number of towers
+         * 
+         * @return size_t 
+         */
+        size_t size() const { return towerArray.size(); };
+
+        /**
+         * @brief Get an entry by index. The serving cell is first, then neighbors by rsrp, strongest first.
+         * 
+         * @param index 0 <= index < size()
+         * @return const TowerEntry& 
+         */
+        const TowerEntry &getEntry(size_t index) const { return towerArray[index]; };
+
+        /**
+         * @brief Get the number of towers that were not kept since the last clear()
+         * 
+         * @return size_t Number of entries dropped due to duplicates or maxEntries
+         */
+        size_t getDroppedCount() const { return droppedCount; };
+
+        /**
+         * @brief Convert this object to a JSON array
+         * 
+         * @param writer JSONWriter to write the data to
+         * @param numToInclude Limit to this number of entries. 0 (default) is unlimited.
+         */
+        void toJsonWriter(JSONWriter &writer, int numToInclude = 0) const;
+
+        /**
+         * @brief Save this data in a Variant array. Requires Device OS 6.2.0 or later.
+         * 
+         * @param obj Variant object to add to
+         * @param numToInclude Limit to this number of entries. 0 (default) is unlimited.
+         */
+        void toVariant(Variant &obj, int numToInclude = 0) const;
+
+        /**
+         * @brief Append the compact encoding of the entries to a string
+         * 
+         * @param str String to append to
+         * @param numToInclude Limit to this number of entries. 0 (default) is unlimited.
+         * 
+         * The compact encoding is base64 of the 20-byte records from TowerEntry::toCompactRecord().
+         */
+        void toCompact(String &str, int numToInclude = 0) const;
+
+    protected:
+        /**
+         * @brief Towers, serving first, then by rsrp
+         */
+        std::vector<TowerEntry> towerArray;
+
+        size_t maxEntries = DEFAULT_MAX_ENTRIES; //!< Maximum number of entries to keep
+        size_t droppedCount = 0; //!< Number of entries not kept since the last clear
+    };
 
     /**
-     * @brief Get the current publish frequency. Default is manual.
+     * @brief Interface for objects that fill in a TowerList from the modem. Added in 0.0.5.
      * 
-     * @return PublishFrequency 
+     * The default provider, ServingTowerProvider, only reports the serving cell because that is all Device OS
+     * exposes in a modem-independent way. A provider that queries neighbor cells with modem-specific AT commands
+     * can be installed using withTowerProvider(). Host tests use a simulated provider.
      */
-    PublishFrequency getPublishFrequency() const { return publishFrequency; };
+    class TowerProvider {
+    public:
+        virtual ~TowerProvider() {};
+
+        /**
+         * @brief Add the current towers to towerList
+         * 
+         * @param towerList The list to add to. It has already been cleared.
+         * @return int A system error code. SYSTEM_ERROR_NONE (0) is a success code, non-zero indicates an error. 
+         * 
+         * This is called from the location fusion thread and may block.
+         */
+        virtual int getTowers(TowerList &towerList) = 0;
+    };
 
+#if Wiring_Cellular
     /**
-     * @brief Add Wi-Fi access points nearby to the loc event. Default is false.
-     * 
-     * @param enable 
-     * @return LocationFusionRK& 
+     * @brief Tower provider that reports the serving cell from cellular_global_identity(). Added in 0.0.5.
      * 
-     * This can be called on devices without Wi-Fi (B-SoM, for example) and it will be ignored.
+     * The signal strength and quality come from Cellular.RSSI().
      */
-    LocationFusionRK &withAddWiFi(bool enable = true) { addWiFi = enable; return *this; };
+    class ServingTowerProvider : public TowerProvider {
+    public:
+        /**
+         * @brief Add the serving tower to towerList
+         * 
+         * @param towerList The list to add to
+         * @return int A system error code. SYSTEM_ERROR_NONE (0) is a success code, non-zero indicates an error. 
+         */
+        virtual int getTowers(TowerList &towerList) override;
+
+        /**
+         * @brief Get the ServingTower from the last getTowers() call
+         * 
+         * @return const ServingTower& 
+         */
+        const ServingTower &getServingTower() const { return servingTower; };
+
+    protected:
+        ServingTower servingTower; //!< Serving tower from cellular_global_identity()
+    };
+#endif // Wiring_Cellular
 
     /**
-     * @brief Add serving cellular tower information to the loc event. Default is false.
-     * 
-     * @param enable 
-     * @return LocationFusionRK& 
+     * @brief Compact fingerprint of the radio environment, used to detect whether the device has moved. Added in 0.0.5.
      * 
-     * This can be called on devices without cellular (P2, for example) and it will be ignored.
+     * The fingerprint contains the BSSIDs of the strongest Wi-Fi access points (sorted by BSSID) and the serving 
+     * tower identity. 
      */
-    LocationFusionRK &withAddTower(bool enable = true) { addTower = enable; return *this; };
+    class RadioFingerprint {
+    public:
+        /**
+         * @brief Maximum number of BSSIDs kept in the fingerprint. The strongest access points are used.
+         */
+        static const size_t MAX_BSSIDS = 16;
 
-    /**
-     * @brief Add an "add to event" handler
-     * 
-     * @param handler 
+        /**
+         * @brief Clear the fingerprint
+         */
+        void clear();
+
+        /**
+         * @brief Add a BSSID to the fingerprint. Ignored if the fingerprint already contains MAX_BSSIDS.
+         * 
+         * @param key 48-bit BSSID, from WAPEntry::bssidKey()
+         */
+        void addBssid(uint64_t key);
+
+        /**
+         * @brief Set the serving tower identity
+         * 
+         * @param mcc Mobile country code
+         * @param mnc Mobile network code
+         * @param lac Location area code
+         * @param cid Cell ID
+         */
+        void setTower(uint16_t mcc, uint16_t mnc, uint32_t lac, uint32_t cid);
+
+        /**
+         * @brief Returns true if there are no BSSIDs and no tower
+         */
+        bool isEmpty() const { return numBssids == 0 && !hasTower; };
+
+        /**
+         * @brief Compare two fingerprints
+         * 
+         * @param other 
+         * @return float Similarity from 0.0 (completely different) to 1.0 (identical)
+         * 
+         * If both fingerprints contain BSSIDs, this is the Jaccard similarity of the sets of BSSIDs (the number
+         * in common divided by the number in either). Otherwise, it's 1.0 if the serving tower is the same and 0.0 if not.
+         * The Wi-Fi comparison is preferred because a stationary device may change serving towers.
+         */
+        float similarity(const RadioFingerprint &other) const;
+
+        /**
+         * @brief Get a 32-bit hash of the fingerprint
+         * 
+         * @return uint32_t 
+         */
+        uint32_t hash() const;
+
+        uint64_t bssids[MAX_BSSIDS]; //!< BSSIDs, sorted in ascending order
+        size_t numBssids = 0; //!< Number of valid entries in bssids
+        bool hasTower = false; //!< true if the tower fields are valid
+        uint16_t mcc = 0; //!< Mobile country code
+        uint16_t mnc = 0; //!< Mobile network code
+        uint32_t lac = 0; //!< Location area code
+        uint32_t cid = 0; //!< Cell ID
+    };
+
+    /**
+     * @brief Bounded LRU cache of loc-enhanced results keyed by radio fingerprint. Added in 0.0.5.
+     * 
+     * Entries map a compact key (a hash of the serving tower and strongest BSSIDs) to the latitude, longitude, and
+     * horizontal accuracy from a previous loc-enhanced response. The cache can optionally be saved to the flash file system.
+     */
+    class LocCache {
+    public:
+        /**
+         * @brief A single cache entry (16 bytes)
+         */
+        struct Entry {
+            uint32_t key; //!< Fingerprint key
+            int32_t latE7; //!< Latitude in degrees * 10^7
+            int32_t lonE7; //!< Longitude in degrees * 10^7
+            uint16_t hAcc; //!< Horizontal accuracy in meters
+            uint16_t lastUsed; //!< Used for LRU eviction; higher is more recent
+        };
+
+        /**
+         * @brief Set the maximum number of entries. 0 disables the cache. The storage is allocated here.
+         * 
+         * @param maxEntries 
+         * @return LocCache& 
+         */
+        LocCache &withMaxEntries(size_t maxEntries);
+
+        /**
+         * @brief Save the cache to a file after changes, and load it in load(). Default is not persistent.
+         * 
+         * @param path Path on the flash file system, for example "/usr/locfcache.dat". The pointer must remain valid.
+         * @return LocCache& 
+         */
+        LocCache &withPersistPath(const char *path) { persistPath = path; return *this; };
+
+        /**
+         * @brief Minimum time between saves to the persist path. Default is 10 minutes.
+         * 
+         * @param interval Time to wait after a save before saving more changes. 0 saves on the next saveIfDirty().
+         * @return LocCache& 
+         * 
+         * Each save rewrites the whole file, so changes are batched to limit flash wear. Changes made since the last
+         * save are lost on reset.
+         */
+        LocCache &withSaveInterval(std::chrono::milliseconds interval) { saveInterval = interval; return *this; };
+
+        /**
+         * @brief Returns true if the cache is enabled (max entries is non-zero)
+         */
+        bool isEnabled() const { return maxEntries > 0; };
+
+        /**
+         * @brief Look up a key. Updates the hit and miss counters.
+         * 
+         * @param key Fingerprint key
+         * @param entry Filled in if found
+         * @return true if found
+         */
+        bool lookup(uint32_t key, Entry &entry);
+
+        /**
+         * @brief Add or replace an entry. The least recently used entry is removed if the cache is full.
+         * 
+         * @param key Fingerprint key
+         * @param lat Latitude in degrees
+         * @param lon Longitude in degrees
+         * @param hAcc Horizontal accuracy in meters
+         */
+        void insert(uint32_t key, double lat, double lon, int hAcc);
+
+        /**
+         * @brief Load the cache from the persist path, if set. Call after withMaxEntries().
+         */
+        void load();
+
+        /**
+         * @brief Save the cache to the persist path, if set
+         */
+        void save() const;
+
+        /**
+         * @brief Save the cache if it has changed and the save interval has elapsed since the last save
+         */
+        void saveIfDirty();
+
+        /**
+         * @brief Get when saveIfDirty() will save, or NO_WAKE_MS if there are no changes to save
+         */
+        uint64_t getSaveDueMs() const;
+
+        /**
+         * @brief Get the number of lookups that found an entry
+         */
+        uint32_t getHits() const { return hits; };
+
+        /**
+         * @brief Get the number of lookups that did not find an entry
+         */
+        uint32_t getMisses() const { return misses; };
+
+        /**
+         * @brief Get the number of entries in the cache
+         */
+        size_t size() const { return entries.size(); };
+
+    protected:
+        /**
+         * @brief Get the next value for Entry::lastUsed, renumbering the entries if the counter would overflow
+         */
+        uint16_t nextUseCounter();
+
+        std::vector<Entry> entries; //!< Cache entries, not sorted
+        size_t maxEntries = 0; //!< Maximum number of entries, 0 = disabled
+        const char *persistPath = nullptr; //!< Path to save to, or nullptr
+        uint16_t useCounter = 0; //!< Last value assigned to Entry::lastUsed
+        bool dirty = false; //!< Entries have changed since the last save
+        uint64_t lastSaveMs = 0; //!< System.millis() value of the last save
+        std::chrono::milliseconds saveInterval = 10min; //!< Minimum time between saves
+        uint32_t hits = 0; //!< Number of lookups found
+        uint32_t misses = 0; //!< Number of lookups not found
+    };
+
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+    /**
+     * @brief Sorted index of Wi-Fi access point locations in a file on the flash file system. Added in 0.0.5.
+     * 
+     * Each entry maps a 48-bit BSSID to a latitude, longitude, and weight (the number of observations) in 16 bytes. 
+     * The entries are sorted by BSSID so a lookup is a binary search of the file. Once the search range is down to 
+     * SEARCH_BLOCK_ENTRIES, the block is read at once, so a lookup in an index of 50,000 entries takes about 
+     * 12 small reads and no RAM beyond a 256 byte stack buffer.
+     * 
+     * New observations are kept in RAM and merged into the file (a sequential rewrite to a temporary file, then 
+     * rename) when maxPending observations have accumulated or flush() is called.
+     */
+    class WiFiPositionIndex {
+    public:
+        /**
+         * @brief A single index entry (16 bytes)
+         */
+        struct Entry {
+            uint8_t bssid[6]; //!< BSSID, most significant byte first so entries sort with memcmp
+            uint16_t weight; //!< Number of observations averaged into the location, up to MAX_WEIGHT
+            int32_t latE7; //!< Latitude in degrees * 10^7
+            int32_t lonE7; //!< Longitude in degrees * 10^7
+        };
+
+        /**
+         * @brief Maximum weight of an entry. Limiting it lets the location follow an access point that has moved.
+         */
+        static const uint16_t MAX_WEIGHT = 64;
+
+        /**
+         * @brief Number of entries read at once at the end of a binary search
+         */
+        static const size_t SEARCH_BLOCK_ENTRIES = 16;
+
+        /**
+         * @brief Maximum number of access points, strongest first, used for an estimate or learned from a scan
+         */
+        static const size_t MAX_SCAN_ENTRIES = 16;
+
+        /**
+         * @brief Destructor. Closes the file.
+         */
+        ~WiFiPositionIndex();
+
+        /**
+         * @brief Set the path to the index file on the flash file system. The pointer must remain valid.
+         * 
+         * @param path Path, for example "/usr/locfwifi.dat"
+         * @return WiFiPositionIndex& 
+         */
+        WiFiPositionIndex &withPath(const char *path) { this->path = path; return *this; };
+
+        /**
+         * @brief Set the maximum number of entries in the file. Default is 0 (unlimited).
+         * 
+         * @param maxEntries 
+         * @return WiFiPositionIndex& 
+         * 
+         * Once full, observations of access points already in the index still update them, but new ones are discarded.
+         */
+        WiFiPositionIndex &withMaxEntries(size_t maxEntries) { this->maxEntries = maxEntries; return *this; };
+
+        /**
+         * @brief Set the number of observations kept in RAM before merging into the file. Default is 64.
+         * 
+         * @param maxPending Number of observations, 16 bytes each
+         * @return WiFiPositionIndex& 
+         */
+        WiFiPositionIndex &withMaxPending(size_t maxPending) { this->maxPending = maxPending; return *this; };
+
+        /**
+         * @brief Returns true if a path has been set
+         */
+        bool isEnabled() const { return path != nullptr; };
+
+        /**
+         * @brief Open the file and read the number of entries. Called from setup(). A missing or invalid file is an empty index.
+         */
+        void open();
+
+        /**
+         * @brief Close the file
+         */
+        void close();
+
+        /**
+         * @brief Look up a BSSID
+         * 
+         * @param key 48-bit BSSID, from WAPEntry::bssidKey()
+         * @param entry Filled in if found
+         * @return true if found
+         */
+        bool lookup(uint64_t key, Entry &entry) { size_t start = 0; return lookup(key, entry, start); };
+
+        /**
+         * @brief Look up a BSSID, starting the search at an entry index
+         * 
+         * @param key 48-bit BSSID
+         * @param entry Filled in if found
+         * @param start Entry index in the file to start searching at. Updated so looking up keys in increasing order
+         * only searches the remaining part of the file.
+         * @return true if found
+         */
+        bool lookup(uint64_t key, Entry &entry, size_t &start);
+
+        /**
+         * @brief Add an observation of an access point at a location
+         * 
+         * @param key 48-bit BSSID
+         * @param latE7 Latitude in degrees * 10^7
+         * @param lonE7 Longitude in degrees * 10^7
+         * 
+         * The location is averaged with earlier observations, weighted by the number of observations.
+         */
+        void learn(uint64_t key, int32_t latE7, int32_t lonE7);
+
+        /**
+         * @brief Merge the pending observations into the file
+         * 
+         * @return true on success
+         */
+        bool flush();
+
+        /**
+         * @brief Get the number of entries in the file
+         */
+        size_t size() const { return fileEntries; };
+
+        /**
+         * @brief Get the number of observations not yet merged into the file
+         */
+        size_t getPendingCount() const { return pending.size(); };
+
+        /**
+         * @brief Get the number of file reads done by lookups, for measuring lookup cost
+         */
+        uint32_t getReadCount() const { return readCount; };
+
+        /**
+         * @brief Convert a 48-bit BSSID to the big endian byte order used in Entry
+         */
+        static void keyToBssid(uint64_t key, uint8_t *bssid);
+
+        /**
+         * @brief Combine two entries for the same BSSID, weighted by their weights
+         */
+        static void mergeEntry(Entry &entry, const Entry &other);
+
+    protected:
+        /**
+         * @brief Read entries from the file
+         * 
+         * @param fd File descriptor
+         * @param index Index of the first entry
+         * @param entries Buffer to read into
+         * @param count Number of entries to read
+         * @return true if all entries were read
+         */
+        bool readEntries(int fd, size_t index, Entry *entries, size_t count);
+
+        std::vector<Entry> pending; //!< Observations not yet in the file, sorted by bssid
+        const char *path = nullptr; //!< Path to the index file
+        int fd = -1; //!< File descriptor of the index file, open for reading, or -1
+        size_t maxEntries = 0; //!< Maximum entries in the file, 0 = unlimited
+        size_t maxPending = 64; //!< Observations to keep in RAM before flushing
+        size_t fileEntries = 0; //!< Number of entries in the file
+        uint32_t readCount = 0; //!< Number of reads by lookup()
+    };
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+
+    /**
+     * @brief Result of a loc-enhanced request, passed to withLocEnhancedResultHandler() handlers. Added in 0.0.5.
+     */
+    struct LocEnhancedResult {
+        int reqId = 0; //!< req_id of the loc event
+        uint64_t requestMs = 0; //!< System.millis() value when the sample was taken
+        uint32_t latencyMs = 0; //!< Time from publish to the response, or to the timeout
+        double lat = 0.0; //!< Latitude in degrees, if hAcc >= 0
+        double lon = 0.0; //!< Longitude in degrees, if hAcc >= 0
+        int hAcc = -1; //!< Horizontal accuracy in meters, or -1 if there is no location
+        bool received = false; //!< true if a response was received, false if the request timed out
+    };
+
+    /**
+     * @brief Source of a location passed to the fusion filter. Added in 0.0.5.
+     */
+    enum class FusionSource : uint8_t {
+        gnss = 0, //!< GNSS location from an add to event handler (lck is 1 in the inner loc object)
+        locEnhanced, //!< loc-enhanced result from the cloud
+        cached, //!< Location from the loc-enhanced cache
+        local //!< On-device Wi-Fi positioning estimate
+    };
+
+    /**
+     * @brief Smoothed location from the fusion filter. Added in 0.0.5.
+     */
+    struct FusedLocation {
+        double lat = 0.0; //!< Latitude in degrees
+        double lon = 0.0; //!< Longitude in degrees
+        float hAcc = 0.0f; //!< Estimated horizontal accuracy (1 sigma) in meters, as of the last update
+        uint64_t updateMs = 0; //!< System.millis() value of the last update
+        uint32_t updateCount = 0; //!< Number of updates since the filter was reset
+        FusionSource source = FusionSource::gnss; //!< Source of the last update
+        bool valid = false; //!< true if there has been at least one update
+    };
+
+#if LOCATIONFUSIONRK_FUSION
+    /**
+     * @brief Position filter that combines locations from several sources into one smoothed position. Added in 0.0.5.
+     * 
+     * This is a Kalman filter with a 2D position state and a single (circular) variance, in float32 meters 
+     * relative to an origin near the current position. Between updates, the uncertainty grows at the configured 
+     * speed. Each update is weighted by its horizontal accuracy, so a GNSS fix with an accuracy of 5 meters 
+     * dominates a Wi-Fi location with an accuracy of 50 meters, but several Wi-Fi locations are averaged. 
+     * A location that is too far from the current estimate to be explained by its accuracy resets the filter.
+     * 
+     * An update is a few float multiplies and one square root, so it takes microseconds on a Cortex-M with an FPU.
+     */
+    class FusionFilter {
+    public:
+        /**
+         * @brief Set the expected speed of the device. Default is 2 m/sec.
+         * 
+         * @param metersPerSecond The standard deviation of the position grows by this much per second between updates
+         * @return FusionFilter& 
+         */
+        FusionFilter &withSpeed(float metersPerSecond) { speed = metersPerSecond; return *this; };
+
+        /**
+         * @brief Set the threshold for resetting the filter. Default is 4.
+         * 
+         * @param sigmas A location further from the estimate than this many standard deviations (of the combined 
+         * uncertainty) resets the filter to that location
+         * @return FusionFilter& 
+         */
+        FusionFilter &withResetThreshold(float sigmas) { resetThreshold = sigmas; return *this; };
+
+        /**
+         * @brief Add a location
+         * 
+         * @param lat Latitude in degrees
+         * @param lon Longitude in degrees
+         * @param hAcc Horizontal accuracy in meters. Values less than 1 are treated as 1.
+         * @param ms System.millis() value when the location was determined
+         * @param source Source of the location
+         */
+        void update(double lat, double lon, float hAcc, uint64_t ms, FusionSource source);
+
+        /**
+         * @brief Get the current estimate
+         * 
+         * @param location Filled in with the estimate
+         * @return true if there has been at least one update
+         */
+        bool getLocation(FusedLocation &location) const;
+
+        /**
+         * @brief Discard the current estimate
+         */
+        void reset() { valid = false; updateCount = 0; };
+
+    protected:
+        /**
+         * @brief Set the origin of the local coordinates and move the position to the origin
+         * 
+         * @param latE7 Latitude in degrees * 10^7
+         * @param lonE7 Longitude in degrees * 10^7
+         */
+        void setOrigin(int32_t latE7, int32_t lonE7);
+
+        int32_t originLatE7 = 0; //!< Origin of the local coordinates, latitude in degrees * 10^7
+        int32_t originLonE7 = 0; //!< Origin of the local coordinates, longitude in degrees * 10^7
+        float metersPerE7Lon = 0.0f; //!< Meters per 10^-7 degree of longitude at the origin
+        float x = 0.0f; //!< Position east of the origin in meters
+        float y = 0.0f; //!< Position north of the origin in meters
+        float variance = 0.0f; //!< Variance of the position in each axis, in square meters
+        float speed = 2.0f; //!< Growth of the standard deviation in meters per second
+        float resetThreshold = 4.0f; //!< Innovation in standard deviations that resets the filter
+        uint64_t lastMs = 0; //!< ms passed to the last update
+        uint32_t updateCount = 0; //!< Number of updates since reset
+        FusionSource lastSource = FusionSource::gnss; //!< Source of the last update
+        bool valid = false; //!< true if there has been at least one update
+    };
+#endif // LOCATIONFUSIONRK_FUSION
+
+#if LOCATIONFUSIONRK_GEOFENCES
+    /**
+     * @brief Set of circular and polygon geofences with a uniform grid index. Added in 0.0.5.
+     * 
+     * Fences are stored as 10^-7 degree integer coordinates. The bounding box of all fences is divided into a grid
+     * of up to MAX_GRID_CELLS cells, and each cell lists the fences whose bounding box overlaps it. Evaluating a 
+     * location only tests the fences in its cell, so the cost depends on how many fences overlap there, not on the 
+     * total number of fences. The index is rebuilt on the next evaluate() after fences are added or removed.
+     * 
+     * Polygons must not cross the 180 degree meridian.
+     */
+    class Geofences {
+    public:
+        /**
+         * @brief Maximum number of grid cells in the index
+         */
+        static const size_t MAX_GRID_CELLS = 4096;
+
+        /**
+         * @brief Maximum number of fences
+         */
+        static const size_t MAX_FENCES = 65535;
+
+        /**
+         * @brief Type of a geofence transition
+         */
+        enum class Transition : uint8_t {
+            enter = 0, //!< The location is inside the fence and the previous one was not
+            exit //!< The location is outside the fence and the previous one was inside
+        };
+
+        /**
+         * @brief A transition found by evaluate()
+         */
+        struct Event {
+            uint32_t id; //!< Fence ID passed to addCircle() or addPolygon()
+            Transition transition; //!< Enter or exit
+        };
+
+        /**
+         * @brief Add a circular fence
+         * 
+         * @param id Fence ID, returned in events. IDs should be unique.
+         * @param lat Latitude of the center in degrees
+         * @param lon Longitude of the center in degrees
+         * @param radius Radius in meters
+         * @return true if added, false if there are already MAX_FENCES fences
+         */
+        bool addCircle(uint32_t id, double lat, double lon, float radius);
+
+        /**
+         * @brief Add a polygon fence
+         * 
+         * @param id Fence ID, returned in events. IDs should be unique.
+         * @param latLon Array of latitude, longitude pairs in degrees (2 * numPoints values)
+         * @param numPoints Number of vertices, at least 3. The polygon is closed automatically.
+         * @return true if added, false if there are too few points or already MAX_FENCES fences
+         */
+        bool addPolygon(uint32_t id, const double *latLon, size_t numPoints);
+
+        /**
+         * @brief Remove a fence by ID
+         * 
+         * @param id 
+         * @return true if found
+         */
+        bool remove(uint32_t id);
+
+        /**
+         * @brief Remove all fences
+         */
+        void clear();
+
+        /**
+         * @brief Get the number of fences
+         */
+        size_t size() const { return fences.size(); };
+
+        /**
+         * @brief Returns true if the last evaluated location was inside the fence
+         * 
+         * @param id Fence ID
+         */
+        bool isInside(uint32_t id) const;
+
+        /**
+         * @brief Test a location against the fences and find the transitions from the last evaluated location
+         * 
+         * @param lat Latitude in degrees
+         * @param lon Longitude in degrees
+         * @param events Transitions are appended to this vector
+         * @return size_t Number of transitions appended
+         */
+        size_t evaluate(double lat, double lon, std::vector<Event> &events);
+
+        /**
+         * @brief Get the number of fences tested by the last evaluate(), for measuring the index
+         */
+        size_t getLastCandidateCount() const { return lastCandidateCount; };
+
+    protected:
+        /**
+         * @brief A fence. Circles have numVertices of 0.
+         */
+        struct Fence {
+            uint32_t id; //!< Fence ID
+            int32_t minLatE7; //!< Bounding box
+            int32_t maxLatE7; //!< Bounding box
+            int32_t minLonE7; //!< Bounding box
+            int32_t maxLonE7; //!< Bounding box
+            int32_t latE7; //!< Center of a circle
+            int32_t lonE7; //!< Center of a circle
+            float radiusSq; //!< Square of the radius of a circle in meters
+            float metersPerE7Lon; //!< Meters per 10^-7 degree of longitude at the center of a circle
+            uint32_t firstVertex; //!< Index into vertices of the first latitude of a polygon
+            uint32_t numVertices; //!< Number of vertices of a polygon, 0 for a circle
+        };
+
+        /**
+         * @brief Returns true if the location is inside the fence
+         */
+        bool contains(const Fence &fence, int32_t latE7, int32_t lonE7) const;
+
+        /**
+         * @brief Rebuild the grid index
+         */
+        void buildIndex();
+
+        /**
+         * @brief Get the grid row or column of a latitude or longitude, limited to 0 to count - 1
+         * 
+         * The offset from the grid minimum is calculated in 64 bits, as longitudes can span up to 360 degrees,
+         * which does not fit in an int32_t in degrees * 10^7.
+         */
+        static size_t gridIndex(int32_t valueE7, int32_t minE7, int64_t cellSizeE7, size_t count);
+
+        std::vector<Fence> fences; //!< Fences, in the order added
+        std::vector<int32_t> vertices; //!< Polygon vertices, latitude and longitude pairs in degrees * 10^7
+        std::vector<uint32_t> inside; //!< IDs of the fences the last evaluated location was inside, sorted
+        std::vector<uint32_t> newInside; //!< Used by evaluate()
+
+        std::vector<uint32_t> cellStart; //!< Index into cellFences of the first fence in each cell, plus an end entry
+        std::vector<uint16_t> cellFences; //!< Indexes into fences for each cell
+        int32_t gridMinLatE7 = 0; //!< Bounding box of all fences
+        int32_t gridMinLonE7 = 0; //!< Bounding box of all fences
+        int64_t cellHeightE7 = 1; //!< Size of a grid cell
+        int64_t cellWidthE7 = 1; //!< Size of a grid cell
+        size_t gridRows = 0; //!< Number of grid rows (latitude)
+        size_t gridCols = 0; //!< Number of grid columns (longitude)
+        bool indexValid = false; //!< false after fences are added or removed
+        size_t lastCandidateCount = 0; //!< Fences tested by the last evaluate()
+    };
+#endif // LOCATIONFUSIONRK_GEOFENCES
+
+    /**
+     * @brief Circular log of binary records in a file on the flash file system. Added in 0.0.5.
+     * 
+     * The file is divided into a fixed number of fixed-size slots, so it never grows beyond 
+     * maxRecords * recordSize bytes. Appending writes a single slot without rewriting the rest 
+     * of the file. When full, the oldest record is overwritten.
+     * 
+     * Each slot starts with a RecordHeader containing a sequence number and a CRC-32 of the record. 
+     * A record that was only partially written when power was lost fails the CRC check and is ignored 
+     * by open(). Consumed records have their sequence number set to 0. If power is lost while 
+     * consuming, a record may be returned again, but never lost.
+     */
+    class OfflineQueue {
+    public:
+        /**
+         * @brief Header at the start of each slot (12 bytes)
+         */
+        struct RecordHeader {
+            uint32_t seq; //!< Sequence number, increasing. 0 = empty or consumed.
+            uint16_t size; //!< Size of the record data following the header
+            uint16_t reserved; //!< Reserved, currently 0
+            uint32_t crc; //!< CRC-32 of seq, size, and the record data
+        };
+
+        /**
+         * @brief Destructor. Closes the file.
+         */
+        ~OfflineQueue();
+
+        /**
+         * @brief Set the path to the file on the flash file system. The pointer must remain valid.
+         * 
+         * @param path Path, for example "/usr/locfqueue.dat"
+         * @return OfflineQueue& 
+         */
+        OfflineQueue &withPath(const char *path) { this->path = path; return *this; };
+
+        /**
+         * @brief Set the number of records and the size of each including the header
+         * 
+         * @param maxRecords Maximum number of records. 0 disables the queue.
+         * @param recordSize Size of a slot, including the 12 byte header
+         * @return OfflineQueue& 
+         */
+        OfflineQueue &withRecords(size_t maxRecords, size_t recordSize) { this->maxRecords = maxRecords; this->recordSize = recordSize; return *this; };
+
+        /**
+         * @brief Returns true if a path and number of records have been set
+         */
+        bool isEnabled() const { return path != nullptr && maxRecords > 0; };
+
+        /**
+         * @brief Open the file, creating it if necessary, and find the valid records in it
+         * 
+         * @return true on success
+         */
+        bool open();
+
+        /**
+         * @brief Close the file
+         */
+        void close();
+
+        /**
+         * @brief Add a record to the end of the queue, overwriting the oldest if the queue is full
+         * 
+         * @param data Record data
+         * @param size Size of the data, at most getMaxDataSize()
+         * @return true on success
+         */
+        bool append(const uint8_t *data, size_t size);
+
+        /**
+         * @brief Read a record
+         * 
+         * @param index 0 = the oldest record, must be less than size()
+         * @param data Buffer to read into, at least getMaxDataSize() bytes
+         * @return size_t Size of the record data, or 0 if it could not be read or is corrupted
+         */
+        size_t read(size_t index, uint8_t *data);
+
+        /**
+         * @brief Remove records from the start of the queue
+         * 
+         * @param count Number of records to remove
+         */
+        void consume(size_t count);
+
+        /**
+         * @brief Get the number of records in the queue
+         */
+        size_t size() const { return count; };
+
+        /**
+         * @brief Get the maximum size of the data in a record
+         */
+        size_t getMaxDataSize() const { return (recordSize > sizeof(RecordHeader)) ? recordSize - sizeof(RecordHeader) : 0; };
+
+        /**
+         * @brief Get the number of records that were overwritten before they were consumed
+         */
+        uint32_t getDroppedCount() const { return dropped; };
+
+        /**
+         * @brief Calculate a CRC-32 (IEEE 802.3)
+         * 
+         * @param crc Initial value, 0 to start a new CRC
+         * @param data Data to add
+         * @param size Size of data in bytes
+         * @return uint32_t 
+         */
+        static uint32_t crc32(uint32_t crc, const void *data, size_t size);
+
+    protected:
+        /**
+         * @brief Calculate the CRC for a header and its data
+         */
+        static uint32_t recordCrc(const RecordHeader &header, const uint8_t *data);
+
+        /**
+         * @brief Set the sequence number of a slot to 0
+         * 
+         * @return true on success, false if the file could not be written
+         */
+        bool clearSlot(size_t slot);
+
+        const char *path = nullptr; //!< Path to the file, or nullptr
+        size_t maxRecords = 0; //!< Number of slots in the file, 0 = disabled
+        size_t recordSize = 256; //!< Size of each slot in bytes, including the header
+        int fd = -1; //!< File descriptor, or -1 if not open
+        size_t first = 0; //!< Slot containing the oldest record
+        size_t count = 0; //!< Number of records
+        uint32_t nextSeq = 1; //!< Sequence number for the next record
+        uint32_t dropped = 0; //!< Records overwritten before they were consumed
+    };
+
+    /**
+     * @brief Histogram of durations with fixed buckets. Added in 0.0.5.
+     * 
+     * The buckets follow a 1-2-5 series from 100 microseconds to 50 seconds, so the percentiles are the upper
+     * bound of the bucket containing them. The maximum is exact. Uses 92 bytes of RAM.
+     */
+    class LatencyHistogram {
+    public:
+        /**
+         * @brief Number of buckets, the last of which is for durations over 50 seconds
+         */
+        static const size_t NUM_BUCKETS = 19;
+
+        /**
+         * @brief Add a duration
+         * 
+         * @param us Duration in microseconds
+         */
+        void add(uint32_t us);
+
+        /**
+         * @brief Remove all durations
+         */
+        void clear();
+
+        /**
+         * @brief Get an approximate percentile
+         * 
+         * @param percent 0 to 100, for example 95 for the 95th percentile
+         * @return uint32_t Duration in microseconds, or 0 if there are no durations
+         */
+        uint32_t percentile(float percent) const;
+
+        /**
+         * @brief Get the number of durations added
+         */
+        uint32_t getCount() const { return count; };
+
+        /**
+         * @brief Get the longest duration in microseconds
+         */
+        uint32_t getMax() const { return maxUs; };
+
+        /**
+         * @brief Get the mean duration in microseconds, or 0 if there are no durations
+         */
+        uint32_t getMean() const { return count ? (uint32_t)(totalUs / count) : 0; };
+
+        /**
+         * @brief Write an object with n, p50, p95, max, and mean (in microseconds) to a JSON writer
+         * 
+         * @param writer 
+         */
+        void toJsonWriter(JSONWriter &writer) const;
+
+        /**
+         * @brief Upper bound of each bucket in microseconds, except the last which is unbounded
+         */
+        static const uint32_t bucketLimits[NUM_BUCKETS - 1];
+
+    protected:
+        uint32_t buckets[NUM_BUCKETS] = {0}; //!< Number of durations in each bucket
+        uint32_t count = 0; //!< Number of durations
+        uint32_t maxUs = 0; //!< Longest duration
+        uint64_t totalUs = 0; //!< Sum of durations, for the mean
+    };
+
+    /**
+     * @brief Encoding of the wps and towers sections of the loc event. Added in 0.0.5.
+     */
+    enum class PayloadEncoding {
+        json = 0, //!< JSON arrays of objects (wps and towers keys), default
+        compact = 1 //!< base64 of packed binary records (wpsb and towersb keys), with "enc":1
+    };
+
+    /**
+     * @brief Measures the maximum stack used by a thread by painting it with a pattern. Added in 0.0.5.
+     * 
+     * paint() is called first thing in the thread function. It gets the bounds of the thread's stack from 
+     * os_thread_dump() and fills the stack from the lowest address up to just below the current stack pointer with 
+     * a pattern. getHighWaterMark() finds the lowest address that no longer has the pattern. The part of the stack
+     * above the current stack pointer (used by Device OS to start the thread, and by the thread function) is not 
+     * painted and is counted as used, so the result overestimates slightly, which is the safe direction.
+     */
+    class StackMonitor {
+    public:
+        /**
+         * @brief Byte used to paint the stack. Same as the FreeRTOS stack fill byte.
+         */
+        static const uint8_t PAINT_BYTE = 0xa5;
+
+        /**
+         * @brief Paint the stack of the current thread. Must be called from the thread function.
+         * 
+         * If the OS does not report the stack bounds of the thread, the stack is not painted and getHighWaterMark()
+         * returns 0.
+         */
+        void paint();
+
+        /**
+         * @brief Get the maximum number of bytes of stack used since paint() was called
+         * 
+         * @return size_t Bytes used, or 0 if not painted
+         * 
+         * This can be called from any thread.
+         */
+        size_t getHighWaterMark() const;
+
+        /**
+         * @brief Get the stack size reported by the OS when painting, or 0 if not painted
+         */
+        size_t getStackSize() const { return stackSize; };
+
+        /**
+         * @brief Get a stack size with a safety margin from a high water mark
+         * 
+         * @param highWaterMark from getHighWaterMark()
+         * @return size_t 125% of highWaterMark plus 256 bytes, rounded up to a multiple of 256 and at least 2048
+         */
+        static size_t getRecommendedSize(size_t highWaterMark);
+
+    protected:
+        /**
+         * @brief Callback for os_thread_dump() that saves the stack bounds
+         */
+        static os_result_t threadDumpCallback(os_thread_dump_info_t *info, void *ptr);
+
+        volatile uint8_t *bottom = nullptr; //!< Lowest painted address, the lowest address of the stack
+        size_t paintedSize = 0; //!< Number of bytes painted starting at bottom
+        size_t stackSize = 0; //!< Stack size from the OS
+    };
+
+    /**
+     * @brief Stages of a location cycle that are timed. Added in 0.0.5.
+     */
+    enum class LatencyStage {
+        wifiScan = 0, //!< Wi-Fi scan
+        tower, //!< TowerProvider::getTowers()
+        addToEventHandler, //!< Each add to event handler, timed separately
+        build, //!< Building and serializing the loc event
+        publish, //!< Particle.publish() until the publish succeeds
+        locEnhanced, //!< Particle.publish() until loc-enhanced is received
+        count //!< Number of stages, not a stage
+    };
+
+    /**
+     * @brief What just happened, passed to a PublishScheduler. Added in 0.0.5.
+     */
+    enum class ScheduleEvent {
+        published, //!< loc event published successfully
+        publishFailed, //!< loc event publish failed
+        suppressed, //!< publish skipped by change detection
+        sampled //!< sample taken but not published yet (batch or offline queue)
+    };
+
+    /**
+     * @brief Information passed to a PublishScheduler. Added in 0.0.5.
+     */
+    struct ScheduleInfo {
+        ScheduleEvent event; //!< What just happened
+        std::chrono::milliseconds publishPeriod; //!< Period set using withPublishPeriodic()
+        std::chrono::milliseconds publishFailureRetry; //!< Default time to wait after a failure
+        uint32_t consecutiveFailures; //!< Number of failed publishes in a row, including this one
+        float similarity; //!< Similarity of the radio environment to the previous sample (0.0 to 1.0), or -1.0 if unknown
+    };
+
+    /**
+     * @brief Decides when to publish next. Added in 0.0.5.
+     * 
+     * The default implementation publishes every publishPeriod and waits publishFailureRetry after a failure,
+     * which is the behavior of earlier versions. Subclass this and override getNextPublishDelay() to implement
+     * your own policy, and pass it to withPublishScheduler().
+     */
+    class PublishScheduler {
+    public:
+        /**
+         * @brief Destructor
+         */
+        virtual ~PublishScheduler() {};
+
+        /**
+         * @brief Called from the worker thread after each sample or publish attempt
+         * 
+         * @param info What happened and the current configuration
+         * @return std::chrono::milliseconds How long to wait before the next sample
+         * 
+         * After a failure, this delay applies to all publish frequencies, including manual. Otherwise it is only used
+         * by withPublishPeriodic().
+         */
+        virtual std::chrono::milliseconds getNextPublishDelay(const ScheduleInfo &info);
+    };
+
+    /**
+     * @brief Publish scheduler that retries failures with exponential backoff and jitter. Added in 0.0.5.
+     * 
+     * After n consecutive failures the delay is publishFailureRetry * 2^(n-1), limited to the maximum, then reduced 
+     * by a random amount of up to the jitter fraction so a fleet of devices does not retry at the same time.
+     */
+    class BackoffPublishScheduler : public PublishScheduler {
+    public:
+        /**
+         * @brief Set the backoff parameters
+         * 
+         * @param maxDelay Longest delay after a failure. Default is 1 hour.
+         * @param jitter Fraction of the delay to randomly subtract, 0.0 to 1.0. Default is 0.5.
+         * @return BackoffPublishScheduler& 
+         */
+        BackoffPublishScheduler &withBackoff(std::chrono::milliseconds maxDelay, float jitter = 0.5) { this->maxDelay = maxDelay; this->jitter = jitter; return *this; };
+
+        virtual std::chrono::milliseconds getNextPublishDelay(const ScheduleInfo &info) override;
+
+    protected:
+        /**
+         * @brief Get the delay after a failure
+         */
+        std::chrono::milliseconds getBackoffDelay(const ScheduleInfo &info) const;
+
+        std::chrono::milliseconds maxDelay = 1h; //!< Longest delay after a failure
+        float jitter = 0.5; //!< Fraction of the delay to randomly subtract
+    };
+
+    /**
+     * @brief Publish scheduler that publishes more often while the radio environment is changing. Added in 0.0.5.
+     * 
+     * If the similarity of the Wi-Fi access points (or serving tower) to the previous sample is below the threshold
+     * the device is considered to be moving and the moving interval is used, otherwise the stationary interval. 
+     * Failures use exponential backoff from BackoffPublishScheduler.
+     */
+    class MovementPublishScheduler : public BackoffPublishScheduler {
+    public:
+        /**
+         * @brief Set the intervals
+         * 
+         * @param movingInterval Interval while moving. Default is 1 minute.
+         * @param stationaryInterval Interval while stationary. Default is 30 minutes.
+         * @param threshold Similarity below this is moving. Default is 0.5.
+         * @return MovementPublishScheduler& 
+         */
+        MovementPublishScheduler &withIntervals(std::chrono::milliseconds movingInterval, std::chrono::milliseconds stationaryInterval, float threshold = 0.5) { 
+            this->movingInterval = movingInterval; this->stationaryInterval = stationaryInterval; this->threshold = threshold; return *this; 
+        };
+
+        virtual std::chrono::milliseconds getNextPublishDelay(const ScheduleInfo &info) override;
+
+    protected:
+        std::chrono::milliseconds movingInterval = 1min; //!< Interval while moving
+        std::chrono::milliseconds stationaryInterval = 30min; //!< Interval while stationary
+        float threshold = 0.5; //!< Similarity below this is moving
+    };
+
+    /**
+     * @brief How often to publish location 
+     */
+    enum class PublishFrequency {
+        manual, //!< Only when requested
+        once, //!< Once after connecting to the cloud
+        periodic //!< Periodically (period is configurable)
+    };
+
+    /**
+     * @brief Settings that can be changed while running. Added in 0.0.5.
+     * 
+     * The with*() methods for these settings, withConfig(), and the loc-config cmd (see withConfigCmd()) update
+     * the config with the mutex locked. The worker thread takes a copy before each location sample, so a change 
+     * never affects a sample in progress and the worker thread never sees a partially updated config.
+     */
+    struct Config {
+        PublishFrequency publishFrequency = PublishFrequency::manual; //!< Set using withPublishManual(), withPublishOnce(), or withPublishPeriodic()
+        std::chrono::milliseconds publishPeriod = 5min; //!< Set using withPublishPeriodic()
+        bool addWiFi = false; //!< Set using withAddWiFi()
+        bool addTower = false; //!< Set using withAddTower()
+        size_t maxWiFiAccessPoints = 0; //!< Set using withMaxWiFiAccessPoints(), 0 = unlimited
+        bool filterLocallyAdministered = false; //!< Set using withMaxWiFiAccessPoints()
+        size_t maxTowers = TowerList::DEFAULT_MAX_ENTRIES; //!< Set using withMaxTowers()
+        std::chrono::milliseconds scanMaxAge = 0ms; //!< Set using withScanMaxAge(), 0 = always scan
+
+        /**
+         * @brief Update from the JSON of a loc-config cmd. Only the keys that are present are changed.
+         * 
+         * @param data Object with optional keys period (seconds, 0 for manual), wifi, tower, max_aps, max_towers, and scan_age (seconds)
+         */
+        void updateFromVariant(const Variant &data);
+    };
+
+    /**
+     * @brief Current status of this library
+     * 
+     * Note that the publishSuccess and publishFailed status codes are only useful when
+     * using the handler callback. Almost immediately after that notification, the status
+     * goes to idle, so it would be hard to catch this status by polling.
+     * 
+     * The locEnhancedSuccess and locEnhancedFail also require the callback to be useful.
+     * Note the locEnhanced status events are only used if you have enabled a loc-enhanced
+     * callback to receive the events on-device. If you do not do this, the loc-enhanced
+     * will only exist in the cloud and not be sent back to the device.
+     * 
+     * If you are implementing sleep control, you can go go sleep if the status is idle.
+     */
+    enum class Status:int {
+        idle = 0, //!< is idle (cloud connected or not)
+        publishing = 1, //!< publishing a loc event (includes building the event)
+        publishSuccess = 2, //!< publish succeeded
+        publishFail = 3, //!< publish failed
+        locEnhancedWait = 4, //!< waiting for a loc-enhanced reply
+        locEnhancedSuccess = 5, //!< loc-enhanced reply received
+        locEnhancedFail = 6, //!< loc-enhanced reply timed out        
+        publishSuppressed = 7, //!< periodic publish skipped because the radio environment has not changed (added in 0.0.5)
+        sampleQueued = 8 //!< sample saved to the offline queue because the cloud is not connected (added in 0.0.5)
+    };
+     
+
+    /**
+     * @brief Gets the singleton instance of this class, allocating it if necessary
+     * 
+     * Use LocationFusionRK::instance() to instantiate the singleton.
+     */
+    static LocationFusionRK &instance();
+
+    /**
+     * @brief Perform setup operations; call this from global application setup()
+     * 
+     * You typically use LocationFusionRK::instance().setup();
+     * 
+     * Typically you use all of the withXXX() functions before setup.
+     */
+    void setup();
+
+    /**
+     * @brief Set the publish frequency to manual. Call requestPublish() to do so. This is the default.
+     * 
+     * @return LocationFusionRK& 
+     */
+    LocationFusionRK &withPublishManual() { return updateConfig([](Config &config) { config.publishFrequency = PublishFrequency::manual; }); };
+
+    /**
+     * @brief Set the publish frequency to publish once after connecting to the cloud.
+     * 
+     * @return LocationFusionRK& 
+     */
+    LocationFusionRK &withPublishOnce() { return updateConfig([](Config &config) { config.publishFrequency = PublishFrequency::once; }); };
+
+    /**
+     * @brief Set the publish frequency to publish periodically when cloud connected.
+     * 
+     * @param ms 
+     * @return LocationFusionRK& 
+     * 
+     * Even though the parameter is in milliseconds, you probably shouldn't publish more often than every few minutes. 
+     * 
+     * If you are using location fusion on a non-Tracker device it costs 50 data operations per fusion request, so doing location fusion
+     * frequently on the free plan may cause your account to be paused due to running out of data operations.
+     */
+    LocationFusionRK &withPublishPeriodic(std::chrono::milliseconds ms) { return updateConfig([ms](Config &config) { config.publishFrequency = PublishFrequency::periodic; config.publishPeriod = ms; }); };
+
+    /**
+     * @brief Replace all of the settings that can be changed while running. Added in 0.0.5.
+     * 
+     * @param config The new settings, typically from getConfig() with some fields changed
+     * @return LocationFusionRK& 
+     * 
+     * This can be called from any thread, before or after setup(), but not while holding the lock. The settings 
+     * are used starting with the next location sample. If the publish period is shortened, the next publish is 
+     * moved earlier.
+     */
+    LocationFusionRK &withConfig(const Config &newConfig) { return updateConfig([&newConfig](Config &config) { config = newConfig; }); };
+
+    /**
+     * @brief Get a copy of the settings that can be changed while running. Added in 0.0.5.
+     * 
+     * This can be called from any thread, but not while holding the lock. It includes changes that the worker 
+     * thread has not applied yet.
+     */
+    Config getConfig();
+
+    /**
+     * @brief Allow the settings to be changed from the cloud using the "loc-config" cmd. Added in 0.0.5.
+     * 
+     * @param enable 
+     * @return LocationFusionRK& 
+     * 
+     * Must be called before setup()! The cmd contains any of these keys, and settings that are not included are 
+     * not changed:
+     * 
+     * - period publish period in seconds, or 0 for manual publishing
+     * - wifi true or false, see withAddWiFi()
+     * - tower true or false, see withAddTower()
+     * - max_aps maximum number of Wi-Fi access points, see withMaxWiFiAccessPoints()
+     * - max_towers maximum number of towers, see withMaxTowers()
+     * - scan_age maximum age in seconds of a Wi-Fi scan to reuse, see withScanMaxAge()
+     * 
+     * For example: `{"cmd":"loc-config","period":600,"max_aps":10}`
+     */
+    LocationFusionRK &withConfigCmd(bool enable = true) { configCmd = enable; return *this; };
+
+    /**
+     * @brief Skip periodic publishes when the radio environment has not changed. Default is disabled. Added in 0.0.5.
+     * 
+     * @param similarityThreshold Skip the publish if the similarity to the last published fingerprint is at least this value (0.0 to 1.0). 0 disables.
+     * @param maxStaleness Always publish if the last publish was at least this long ago
+     * @return LocationFusionRK& 
+     * 
+     * When it's time for a periodic publish, the Wi-Fi scan and serving tower are still acquired, but the loc event is 
+     * only published if the radio environment is sufficiently different from the last published one. This saves a 
+     * data operation and a location fusion request for devices that are stationary most of the time. See 
+     * RadioFingerprint::similarity() for how similarity is calculated. A threshold of 0.8 works well for Wi-Fi.
+     * 
+     * Manual publishes using requestPublish() are never suppressed.
+     */
+    LocationFusionRK &withChangeDetection(float similarityThreshold, std::chrono::milliseconds maxStaleness = 1h) { changeThreshold = similarityThreshold; changeMaxStaleness = maxStaleness; return *this; };
+
+    /**
+     * @brief Get the number of periodic publishes suppressed by change detection. Added in 0.0.5.
+     * 
+     * @return int 
+     */
+    int getPublishSuppressedCount() const { return publishSuppressedCount; };
+
+    /**
+     * @brief Get the similarity of the last acquired radio environment to the last published one. Added in 0.0.5.
+     * 
+     * @return float 0.0 to 1.0, or 0.0 if nothing has been published yet
+     */
+    float getLastSimilarity() const { return lastSimilarity; };
+
+    /**
+     * @brief Enable the on-device cache of loc-enhanced results. Default is disabled. Added in 0.0.5.
+     * 
+     * @param maxEntries Maximum number of locations to remember. Each uses 16 bytes of RAM. 0 disables.
+     * @param skipCloudOnHit If true, do not publish when the location is found in the cache
+     * @param persistPath Optional path on the flash file system to save the cache to, such as "/usr/locfcache.dat"
+     * @return LocationFusionRK& 
+     * 
+     * Must be called before setup()!
+     * 
+     * The cache maps a fingerprint of the serving tower and the strongest Wi-Fi access points to the location
+     * received in loc-enhanced. When the device returns to a location it has been before, the loc-enhanced
+     * handlers are called immediately with the cached location and, if skipCloudOnHit is true, the loc event
+     * is not published. The cached data has a "cached" key set to true in the outer object.
+     * 
+     * Enabling the cache requests loc-enhanced on-device, which uses an additional data operation per publish 
+     * when the location is not in the cache.
+     * 
+     * If persistPath is set, new locations are saved at most once every 10 minutes to limit flash wear. See 
+     * withLocCacheSaveInterval().
+     */
+    LocationFusionRK &withLocCache(size_t maxEntries, bool skipCloudOnHit = true, const char *persistPath = nullptr) { locCache.withMaxEntries(maxEntries).withPersistPath(persistPath); locCacheSkipCloud = skipCloudOnHit; return *this; };
+
+    /**
+     * @brief Minimum time between saves of the loc-enhanced cache to its persist path. Default is 10 minutes. 
+     * Added in 0.0.5.
+     * 
+     * @param interval Time to wait after a save before saving more changes
+     * @return LocationFusionRK& 
+     * 
+     * Locations received since the last save are lost on reset.
+     */
+    LocationFusionRK &withLocCacheSaveInterval(std::chrono::milliseconds interval) { locCache.withSaveInterval(interval); return *this; };
+
+    /**
+     * @brief Get the loc-enhanced cache, for example to get the hit and miss counts. Added in 0.0.5.
+     * 
+     * @return const LocCache& 
+     */
+    const LocCache &getLocCache() const { return locCache; };
+
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+    /**
+     * @brief Enable on-device Wi-Fi positioning. Default is disabled. Added in 0.0.5.
+     * 
+     * @param path Path on the flash file system for the access point index, such as "/usr/locfwifi.dat"
+     * @param minMatches Minimum number of access points in the current scan that must be in the index
+     * @param skipCloudOnFix If true, do not publish when a local fix is available
+     * @return LocationFusionRK& 
+     * 
+     * Must be called before setup()!
+     * 
+     * The locations of access points are learned from the loc-enhanced results for publishes that included Wi-Fi.
+     * When enough access points in a scan are in the index, the position is estimated on-device as the signal
+     * weighted centroid of the access points, and the loc-enhanced handlers are called with it (with "local":true 
+     * in the outer object). Otherwise, the loc event is published as usual.
+     * 
+     * Enabling this requests loc-enhanced on-device, which uses an additional data operation per publish.
+     */
+    LocationFusionRK &withWiFiPositioning(const char *path, size_t minMatches = 3, bool skipCloudOnFix = true) { wifiPositionIndex.withPath(path); wifiPositionMinMatches = minMatches; wifiPositionSkipCloud = skipCloudOnFix; return *this; };
+
+    /**
+     * @brief Set the accuracy limits for on-device Wi-Fi positioning. Added in 0.0.5.
+     * 
+     * @param maxFixAccuracy Local fixes with an estimated accuracy worse than this, in meters, are not used. Default is 150.
+     * @param maxLearnAccuracy loc-enhanced results with an accuracy worse than this, in meters, are not learned. Default is 100.
+     * @return LocationFusionRK& 
+     */
+    LocationFusionRK &withWiFiPositioningAccuracy(int maxFixAccuracy, int maxLearnAccuracy) { wifiPositionMaxAccuracy = maxFixAccuracy; wifiPositionLearnAccuracy = maxLearnAccuracy; return *this; };
+
+    /**
+     * @brief Get the Wi-Fi access point index, for example to get the number of entries. Added in 0.0.5.
+     * 
+     * @return WiFiPositionIndex& 
+     */
+    WiFiPositionIndex &getWiFiPositionIndex() { return wifiPositionIndex; };
+
+    /**
+     * @brief Estimate the position from the current Wi-Fi scan and the access point index. Added in 0.0.5.
+     * 
+     * @param lat Filled in with the latitude in degrees
+     * @param lon Filled in with the longitude in degrees
+     * @param hAcc Filled in with the estimated horizontal accuracy in meters
+     * @return true if enough access points are in the index and the estimated accuracy is within the limit
+     * 
+     * This is called automatically when on-device Wi-Fi positioning is enabled; it's public for testing.
+     */
+    bool estimateWiFiPosition(double &lat, double &lon, int &hAcc);
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+
+    /**
+     * @brief Set the maximum time to wait for the Wi-Fi scan when publishing. Default is 30 seconds. Added in 0.0.5.
+     * 
+     * @param timeout 
+     * @return LocationFusionRK& 
+     * 
+     * The Wi-Fi scan runs on a separate thread concurrently with getting the towers, so the time to acquire is the 
+     * slower of the two instead of the sum. The add to event handlers are called after the towers, also while the
+     * scan is running. If the scan has not completed by the timeout, the event is published without Wi-Fi access points.
+     */
+    LocationFusionRK &withAcquisitionTimeout(std::chrono::milliseconds timeout) { acquisitionTimeout = timeout; return *this; };
+
+    /**
+     * @brief Collect multiple location samples and publish them in a single loc event. Default is disabled. Added in 0.0.5.
+     * 
+     * @param maxSamples Publish when this many samples have been collected. 0 or 1 disables batching.
+     * @param maxAge Publish when the oldest sample is this old, even if there are fewer than maxSamples. 0 = no limit.
+     * @return LocationFusionRK& 
+     * 
+     * A sample is taken at each publish time (typically using withPublishPeriodic()). Each sample is the same object
+     * that would be published as a non-batched loc event, including its own time, wps, towers, loc, and req_id. The
+     * batch is published as a loc event whose data is a JSON array of these objects. 
+     * 
+     * The batch is also published if the samples would exceed the maximum event size (see withMaxEventSize()) or
+     * when requestPublish() is called. If the publish fails, the samples are kept and published again later.
+     * 
+     * When loc-enhanced is requested, each sample in the batch is a separate request matched by its req_id, so the 
+     * in-flight table (see withMaxLocRequests()) holds at least maxSamples requests. With the default of 1 request, 
+     * the next sample is taken after every sample in the batch has received loc-enhanced or timed out.
+     */
+    LocationFusionRK &withBatch(size_t maxSamples, std::chrono::milliseconds maxAge = 0ms) { batchMaxSamples = maxSamples; batchMaxAge = maxAge; return *this; };
+
+    /**
+     * @brief Maximum size of event data for batched events. Default is 16384 bytes. Added in 0.0.5.
+     * 
+     * @param size 
+     * @return LocationFusionRK& 
+     */
+    LocationFusionRK &withMaxEventSize(size_t size) { maxEventSize = size; return *this; };
+
+    /**
+     * @brief Save samples to a queue on the flash file system while not cloud connected. Default is disabled. Added in 0.0.5.
+     * 
+     * @param path Path to the queue file, such as "/usr/locfqueue.dat"
+     * @param maxRecords Maximum number of samples to save. When full, the oldest is discarded.
+     * @param recordSize Maximum size of each sample in bytes. The file is maxRecords * recordSize bytes.
+     * @return LocationFusionRK& 
+     * 
+     * Must be called before setup()! Only used with withPublishPeriodic(). 
+     * 
+     * While not connected, a sample is taken every publish period and saved in a compact binary format with
+     * the Wi-Fi access points, serving tower, and data added by add to event handlers. If the sample does not
+     * fit in recordSize, the weakest access points are left out. After connecting, the saved samples are 
+     * published oldest first, batched into loc events containing a JSON array of samples, at most one
+     * event per the drain interval (see withOfflineDrainInterval()). Queued samples do not request loc-enhanced.
+     */
+    LocationFusionRK &withOfflineQueue(const char *path, size_t maxRecords = 64, size_t recordSize = 256) { offlineQueue.withPath(path).withRecords(maxRecords, recordSize); return *this; };
+
+    /**
+     * @brief Minimum time between loc events publishing the offline queue. Default is 2 seconds. Added in 0.0.5.
+     * 
+     * @param interval 
+     * @return LocationFusionRK& 
+     */
+    LocationFusionRK &withOfflineDrainInterval(std::chrono::milliseconds interval) { offlineDrainInterval = interval; return *this; };
+
+    /**
+     * @brief Gets the offline queue. Added in 0.0.5.
+     */
+    const OfflineQueue &getOfflineQueue() const { return offlineQueue; };
+
+    /**
+     * @brief Set the policy that decides when to publish next. Added in 0.0.5.
+     * 
+     * @param scheduler The scheduler to use. This object must remain valid; it is not copied. Pass nullptr for the default.
+     * @return LocationFusionRK& 
+     * 
+     * For example, to publish every minute while moving and every 30 minutes while stationary:
+     * 
+     * ```
+     * LocationFusionRK::MovementPublishScheduler scheduler;
+     * 
+     * scheduler.withIntervals(1min, 30min);
+     * LocationFusionRK::instance()
+     *     .withPublishPeriodic(5min)
+     *     .withPublishScheduler(&scheduler)
+     *     .setup();
+     * ```
+     */
+    LocationFusionRK &withPublishScheduler(PublishScheduler *scheduler) { publishScheduler = scheduler ? scheduler : &defaultPublishScheduler; return *this; };
+
+    /**
+     * @brief Get the number of publish failures in a row. Reset to 0 on success. Added in 0.0.5.
+     */
+    uint32_t getConsecutiveFailures() const { return consecutiveFailures; };
+
+    /**
+     * @brief Set the encoding of the wps and towers sections of loc events. Default is json. Added in 0.0.5.
+     * 
+     * @param encoding 
+     * @return LocationFusionRK& 
+     * 
+     * The compact encoding replaces the wps array with a wpsb string (base64 of 8 bytes per access point) and the 
+     * towers array with a towersb string (base64 of 20 bytes per tower), and adds "enc":1. With many access points
+     * this is less than a quarter of the size of the JSON. It requires a cloud side decoder that converts it back
+     * to JSON before location fusion; a reference decoder is in more-tests/benchmark/LocDecoder.cpp.
+     * 
+     * If enabled using withEncodingCmd(), the encoding can also be changed from the cloud. Samples from the offline 
+     * queue are always published as JSON.
+     */
+    LocationFusionRK &withPayloadEncoding(PayloadEncoding encoding) { payloadEncoding = encoding; return *this; };
+
+    /**
+     * @brief Allow the payload encoding to be changed from the cloud using the "loc-enc" cmd. Added in 0.0.5.
+     * 
+     * @param enable 
+     * @return LocationFusionRK& 
+     * 
+     * Must be called before setup()! The cmd is {"cmd":"loc-enc","enc":1} for compact, or "enc":0 for JSON. Only
+     * enable this if your cloud service can decode the compact encoding, as switching to it otherwise stops location
+     * fusion from working.
+     */
+    LocationFusionRK &withEncodingCmd(bool enable = true) { encodingCmd = enable; return *this; };
+
+    /**
+     * @brief Get the encoding of the wps and towers sections of loc events. Added in 0.0.5.
+     */
+    PayloadEncoding getPayloadEncoding() const { return payloadEncoding; };
+
+    /**
+     * @brief Append base64 encoded data to a string. Added in 0.0.5.
+     * 
+     * @param str String to append to
+     * @param data Data to encode
+     * @param size Size of data in bytes
+     */
+    static void appendBase64(String &str, const uint8_t *data, size_t size);
+
+    /**
+     * @brief Get the current publish frequency. Default is manual.
+     * 
+     * @return PublishFrequency 
+     */
+    PublishFrequency getPublishFrequency() const { return config.publishFrequency; };
+
+    /**
+     * @brief Add Wi-Fi access points nearby to the loc event. Default is false.
+     * 
+     * @param enable 
+     * @return LocationFusionRK& 
+     * 
+     * This can be called on devices without Wi-Fi (B-SoM, for example) and it will be ignored.
+     */
+    LocationFusionRK &withAddWiFi(bool enable = true) { return updateConfig([enable](Config &config) { config.addWiFi = enable; }); };
+
+    /**
+     * @brief Limit the number of Wi-Fi access points in the loc event to the strongest maxEntries. Default is 0 (unlimited). Added in 0.0.5.
+     * 
+     * @param maxEntries Maximum number of access points, or 0 for unlimited
+     * @param filterLocallyAdministered true to also discard locally administered (hotspot) BSSIDs
+     * @return LocationFusionRK& 
+     * 
+     * Only the strongest access points are kept in the list used for the loc event. The last scan is also kept in 
+     * full for getRecentScan(), so callers with different limits can reuse it.
+     * 
+     * This can be called on devices without Wi-Fi and it will be ignored.
+     */
+    LocationFusionRK &withMaxWiFiAccessPoints(size_t maxEntries, bool filterLocallyAdministered = false) { 
+        return updateConfig([maxEntries, filterLocallyAdministered](Config &config) { config.maxWiFiAccessPoints = maxEntries; config.filterLocallyAdministered = filterLocallyAdministered; }); 
+    };
+
+    /**
+     * @brief Reuse a recent Wi-Fi scan for the loc event instead of scanning again. Default is 0 (always scan). Added in 0.0.5.
+     * 
+     * @param maxAge Maximum age of the scan to reuse, measured from when the scan started
+     * @return LocationFusionRK& 
+     * 
+     * Scans made by the application using getRecentScan() are reused too, so an application that also needs
+     * the access points does not turn on the radio twice.
+     * 
+     * This can be called on devices without Wi-Fi and it will be ignored.
+     */
+    LocationFusionRK &withScanMaxAge(std::chrono::milliseconds maxAge) { return updateConfig([maxAge](Config &config) { config.scanMaxAge = maxAge; }); };
+
+#if Wiring_WiFi 
+
+    /**
+     * @brief Get the access points from a recent Wi-Fi scan, scanning only if needed. Added in 0.0.5.
+     * 
+     * @param list List to fill in. Its filter and maxEntries settings are applied, whether the scan is new or reused.
+     * @param maxAge Reuse the last scan if it started at most this long ago. 0 always scans.
+     * @return true if the last scan was reused, false if a new scan was made
+     * 
+     * This can be called from any thread, and before setup(). It blocks while scanning. The last scan from this
+     * method and from the loc event is kept, and only one scan runs at a time, so a call made while another 
+     * thread is scanning waits for that scan and then reuses it if it is recent enough.
+     */
+    bool getRecentScan(WAPList &list, std::chrono::milliseconds maxAge);
+
+    /**
+     * @brief Wi-Fi scan counts and radio time. Added in 0.0.5.
+     */
+    struct ScanStats {
+        uint32_t scans = 0; //!< Number of Wi-Fi scans made
+        uint32_t reused = 0; //!< Number of times a recent scan was reused instead of scanning
+        uint32_t scanMs = 0; //!< Total time spent scanning in milliseconds
+    };
+
+    /**
+     * @brief Get the Wi-Fi scan counts and time spent scanning. Added in 0.0.5.
+     * 
+     * @return ScanStats 
+     * 
+     * The time spent scanning approximates the time the Wi-Fi radio was on for location. 
+     */
+    ScanStats getScanStats() const;
+#endif // Wiring_WiFi
+
+    /**
+     * @brief Add serving cellular tower information to the loc event. Default is false.
+     * 
+     * @param enable 
+     * @return LocationFusionRK& 
+     * 
+     * This can be called on devices without cellular (P2, for example) and it will be ignored.
+     */
+    LocationFusionRK &withAddTower(bool enable = true) { return updateConfig([enable](Config &config) { config.addTower = enable; }); };
+
+    /**
+     * @brief Set the provider used to get the serving and neighbor towers when withAddTower() is enabled. Added in 0.0.5.
+     * 
+     * @param provider The provider, or NULL to restore the default, which only reports the serving tower.
+     * @return LocationFusionRK& 
+     * 
+     * The provider object must remain valid while location fusion is running; it's typically a global variable.
+     */
+    LocationFusionRK &withTowerProvider(TowerProvider *provider) { towerProvider = provider; return *this; };
+
+    /**
+     * @brief Limit the number of towers included in the loc event. Default is 6. Added in 0.0.5.
+     * 
+     * @param maxTowers Maximum number of towers. The serving tower and the strongest neighbors are included.
+     * @return LocationFusionRK& 
+     */
+    LocationFusionRK &withMaxTowers(size_t maxTowers) { return updateConfig([maxTowers](Config &config) { config.maxTowers = maxTowers; }); };
+
+    /**
+     * @brief Get the towers from the last location sample. Added in 0.0.5.
+     * 
+     * @return const TowerList& 
+     */
+    const TowerList &getTowerList() const { return towerList; };
+
+    /**
+     * @brief Add an "add to event" handler
+     * 
+     * @param handler 
+     * @return LocationFusionRK& 
+     * 
+     * The "add to event" handler allows you to add data to the loc event. You might do this if you want to
+     * support a cellular modem that has built-in GNSS, or use an external GNSS receiver.
+     * 
+     * The handler can be a C function or C++11 lambda and has the following prototype:
+     * 
+     * void handler(Variant &eventData, Variant &locVariant)
+     * 
+     * - eventData is the whole loc event
+     * - locVariant is the Variant for the inner loc object 
+     * 
+     * The handlers are called after the towers have been acquired, while the Wi-Fi scan is still running, so a
+     * slow handler does not add to the time to publish. eventData and locVariant start out empty. The library's keys
+     * (such as "wps", "towers", "time", and "lck") are added afterwards, and a key set by a handler replaces the 
+     * library's key of the same name. A handler cannot read or remove the library's keys.
+     */
+    LocationFusionRK &withAddToEventHandler(std::function<void(Variant &eventData, Variant &locVariant)> handler) { addToEventHandlers.add(handler); return *this; };
+
+    /**
+     * @brief Add an "add to JSON writer" handler, used with the streaming encoder
+     * 
+     * @param handler 
+     * @return LocationFusionRK& 
+     * 
+     * This is the streaming encoder equivalent of withAddToEventHandler(). The handler can be a C function or 
+     * C++11 lambda and has the following prototype:
+     * 
+     * void handler(JSONWriter &writer, bool locObject)
+     * 
+     * - writer is the writer for the loc event. Write key/value pairs using writer.name() and writer.value().
+     * - locObject is false when called to add to the whole loc event, and true when called to add to the inner loc object.
+     * 
+     * Each handler is called twice per publish, once with locObject false and once with locObject true.
+     * 
+     * These handlers are only called when the streaming encoder is enabled. If the streaming encoder is not enabled,
+     * or there are handlers added using withAddToEventHandler(), the Variant encoder is used instead.
+     */
+    LocationFusionRK &withAddToJsonWriterHandler(std::function<void(JSONWriter &writer, bool locObject)> handler) { addToJsonWriterHandlers.add(handler); return *this; };
+
+    /**
+     * @brief Enable the streaming encoder for the loc event. Default is disabled. Added in 0.0.5.
+     * 
+     * @param enable 
+     * @param bufferSize Size of the buffer to serialize the loc event into. Default is 2048 bytes.
+     * @return LocationFusionRK& 
+     * 
+     * Must be called before setup()!
+     * 
+     * The streaming encoder writes the loc event JSON directly into a fixed buffer allocated once in setup(), 
+     * instead of building a Variant tree for the event. This eliminates the heap allocations per access point
+     * when publishing.
+     * 
+     * If there are handlers added using withAddToEventHandler(), or the event does not fit in the buffer, 
+     * the Variant encoder is used for that publish. Use withAddToJsonWriterHandler() for custom data with the 
+     * streaming encoder.
+     */
+    LocationFusionRK &withStreamingEncoder(bool enable = true, size_t bufferSize = 2048) { streamingEncoder = enable; streamingBufferSize = bufferSize; return *this; };
+
+
+    /**
+     * @brief Adds a handler when the Particle function "cmd" is received.
+     * 
+     * @param cmd 
+     * @param handler 
+     * @return LocationFusionRK& 
+     * 
+     * Your handler is called when the "cmd" field within the function JSON matches.
+     * 
+     * The handler can be a C function or C++11 lambda. The prototype is:
+     */
+    LocationFusionRK &withCmdHandler(const char *cmd, std::function<void(const Variant &data)> handler);
+
+
+    /**
+     * @brief Enables or disables the "cmd" function handler. Default is enabled.
+     * 
+     * @param enable 
+     * @return LocationFusionRK& 
+     * 
+     * Must be called before setup()! 
+     * 
+     * If disabled, withCmdHandler() and withLocEnhancedHandler() will not function because they require
+     * the cmd handler. 
+     * 
+     * If you need to additional custom cmd handlers instead of disabling support, use `withCmdHandler()` to
+     * hook your code into this library instead of the other direction.
+     */
+    LocationFusionRK &withEnableCmdFunction(bool enable) { enableCmdFunction = enable; return *this; };
+
+    /**
+     * @brief Adds a handler when loc-enhanced data is calculated by the cloud.
+     * 
+     * @param handler 
+     * @return LocationFusionRK& 
+     * 
+     * The handler prototype is:
+     * 
+     * void handler(const Variant &data);
+     * 
+     * Fields typically in data in the handler:
+     * - h_acc horizontal accuracy (meters)
+     * - lat latitude
+     * - lon longitude
+     * 
+     * If you do not add a handler, the loc-enhanced data is not sent to the device. Handling loc-enhanced data locally on device adds one data operation.
+     */
+    LocationFusionRK &withLocEnhancedHandler(std::function<void(const Variant &data)> handler) { locEnhancedHandlers.add(handler); return *this; };
+
+#if LOCATIONFUSIONRK_FUSION
+    /**
+     * @brief Enable the fusion filter. Default is disabled. Added in 0.0.5.
+     * 
+     * @param enable 
+     * @param metersPerSecond Expected speed of the device, see FusionFilter::withSpeed()
+     * @return LocationFusionRK& 
+     * 
+     * The fusion filter combines GNSS locations from add to event handlers (when lck is 1 in the inner loc object), 
+     * loc-enhanced results, and locations from the loc-enhanced cache and on-device Wi-Fi positioning into one
+     * smoothed position with an accuracy estimate. Get it using getLastFusedLocation() or withFusedLocationHandler().
+     * 
+     * Enabling this requests loc-enhanced on-device, which uses an additional data operation per publish.
+     */
+    LocationFusionRK &withFusion(bool enable = true, float metersPerSecond = 2.0f) { fusionEnabled = enable; fusionFilter.withSpeed(metersPerSecond); return *this; };
+
+    /**
+     * @brief Add a handler called each time the fusion filter is updated. Added in 0.0.5.
+     * 
+     * @param handler Function to call, prototype: void handler(const LocationFusionRK::FusedLocation &location)
+     * @return LocationFusionRK& 
+     * 
+     * The handler is called from the location fusion worker thread. Also enables the fusion filter.
+     */
+    LocationFusionRK &withFusedLocationHandler(std::function<void(const FusedLocation &location)> handler) { fusionEnabled = true; fusedLocationHandlers.add(handler); return *this; };
+
+    /**
+     * @brief Get the last location from the fusion filter. Added in 0.0.5.
+     * 
+     * @param location Filled in with the location
+     * @return true if the fusion filter has a location
+     * 
+     * This can be called from any thread.
+     */
+    bool getLastFusedLocation(FusedLocation &location);
+#endif // LOCATIONFUSIONRK_FUSION
+
+    /**
+     * @brief How long to wait for loc-enhanced after publishing. Default is 1 minute. Added in 0.0.5.
+     * 
+     * @param timeout 
+     * @return LocationFusionRK& 
+     * 
+     * The loc_enhanced latency histogram (see getLatencyHistogram()) shows how long it typically takes.
+     */
+    LocationFusionRK &withLocEnhancedTimeout(std::chrono::milliseconds timeout) { locEnhancedTimeout = timeout; return *this; };
+
+    /**
+     * @brief Maximum number of loc-enhanced requests in flight. Default is 1. Added in 0.0.5.
+     * 
+     * @param maxRequests Maximum number of loc events waiting for loc-enhanced (minimum 1)
+     * @return LocationFusionRK& 
+     * 
+     * With the default of 1, the library waits for loc-enhanced (or withLocEnhancedTimeout()) after each publish 
+     * before taking the next sample. With a larger value, sampling and publishing continue while earlier requests
+     * are waiting, so a slow cloud round trip does not limit the publish rate. Responses are matched to requests 
+     * using the req_id and each request has its own timeout.
+     * 
+     * A batch (see withBatch()) can have more requests in flight than this, one per sample.
+     * 
+     * Must be called before setup().
+     */
+    LocationFusionRK &withMaxLocRequests(size_t maxRequests) { maxLocRequests = (maxRequests > 0) ? maxRequests : 1; return *this; };
+
+    /**
+     * @brief Add a handler called when a loc-enhanced request completes or times out. Added in 0.0.5.
+     * 
+     * @param handler Function to call, prototype: void handler(const LocationFusionRK::LocEnhancedResult &result)
+     * @return LocationFusionRK& 
+     * 
+     * Unlike withLocEnhancedHandler(), which is called with the raw response from the system thread, this handler 
+     * is called from the worker thread once per request, including requests that time out. The result includes 
+     * the time the sample was taken, which can be much earlier than the response when requests are pipelined.
+     * Responses that do not match a request in flight (such as after a timeout) are not passed to this handler.
+     */
+    LocationFusionRK &withLocEnhancedResultHandler(std::function<void(const LocEnhancedResult &result)> handler) { locEnhancedResultHandlers.add(handler); return *this; };
+
+    /**
+     * @brief Get the number of loc-enhanced requests waiting for a response. Added in 0.0.5.
+     */
+    size_t getLocRequestsInFlight() const { return locRequestsInFlight; };
+
+    /**
+     * @brief Adds a handler when the status has changed. Added in version 0.0.3.
+     * 
+     * @param cmd 
+     * @param handler 
+     * @return LocationFusionRK& 
+     * 
+     * Your handler is called when the "cmd" field within the function JSON matches.
+     * 
+     * The handler can be a C function or C++11 lambda. The prototype is:
+     * 
+     * void handler(Status status)
+     * 
+     * - status The new status value
+     * 
+     * This method uses a callback to be notified when the status changes. It is called from the library's
+     * worker thread so you should not do anything that will block in your callback.
+     */
+    LocationFusionRK &withStatusHandler(const char *cmd, std::function<void(Status)> handler) { statusHandlers.add(handler); return *this; };
+
+    /**
+     * @brief Deliver status changes through a queue instead of calling status handlers on the worker thread. Added in 0.0.5.
+     * 
+     * @param size Number of status changes to hold. Rounded up to a power of 2. 0 = call handlers from the worker thread (default).
+     * @return LocationFusionRK& 
+     * 
+     * Must be called before setup()!
+     * 
+     * When enabled, the worker thread never calls your code for status changes. Instead, call processStatusQueue() 
+     * from loop() (or your own thread) to call the status handlers, or call getStatusEvent() to read the status changes
+     * directly. Only one thread may read from the queue. If the queue is full, the status change is discarded and 
+     * counted in getStatusQueueOverflowCount().
+     */
+    LocationFusionRK &withStatusQueue(size_t size);
+
+    /**
+     * @brief Remove the oldest status change from the status queue. Added in 0.0.5.
+     * 
+     * @param status Filled in with the status
+     * @return true if there was a status change in the queue
+     * 
+     * Only used with withStatusQueue(). Does not block.
+     */
+    bool getStatusEvent(Status &status);
+
+    /**
+     * @brief Call the status handlers for all status changes in the status queue. Added in 0.0.5.
+     * 
+     * @return size_t Number of status changes processed
+     * 
+     * Only used with withStatusQueue(). Typically called from loop().
+     */
+    size_t processStatusQueue();
+
+    /**
+     * @brief Get the latency histogram for a stage of the location cycle. Added in 0.0.5.
+     * 
+     * @param stage 
+     * @return const LatencyHistogram& 
+     * 
+     * These can be used to tune timeouts such as withLocEnhancedTimeout() from measurements.
+     */
+    const LatencyHistogram &getLatencyHistogram(LatencyStage stage) const { return latencyHistograms[(size_t)stage]; };
+
+    /**
+     * @brief Clear the latency histograms for all stages. Added in 0.0.5.
+     */
+    void clearLatencyStats();
+
+    /**
+     * @brief Write the latency histograms for all stages as a JSON object. Added in 0.0.5.
+     * 
+     * @param writer 
+     * 
+     * The keys are scan, tower, handler, build, publish, and loc_enhanced, each an object with n, p50, p95, max, 
+     * and mean in microseconds.
+     */
+    void writeLatencyStats(JSONWriter &writer) const;
+
+    /**
+     * @brief Respond to the "loc-stats" cmd by publishing a loc-stats event with the latency histograms. Added in 0.0.5.
+     * 
+     * @param enable 
+     * @return LocationFusionRK& 
+     * 
+     * Must be called before setup()! The event data is the JSON from writeLatencyStats() with an additional 
+     * "res" key containing the object from writeResourceStats(). If the cmd includes "clear":true the histograms 
+     * are cleared after publishing.
+     */
+    LocationFusionRK &withStatsCmd(bool enable = true) { statsCmd = enable; return *this; };
+
+    /**
+     * @brief Get the number of status changes discarded because the status queue was full. Added in 0.0.5.
+     */
+    uint32_t getStatusQueueOverflowCount() const { return statusQueueOverflow.load(std::memory_order_relaxed); };
+
+
+    /**
+     * @brief Sets the worker thread stack size. Must be set before setup()
+     * 
+     * @param size in bytes. The default if you do not call this is 6144
+     * @return LocationFusionRK& 
+     * 
+     * Prior to version 0.0.4 the stack was 3072 bytes, but it was increased due to SOS+13 on b5som devices. You can further
+     * customize the size by calling this method prior to setup().
+     */
+    LocationFusionRK &withThreadStackSize(size_t size) { threadStackSize = size; return *this; };
+
+    /**
+     * @brief Select the worker thread stack size from measurements saved on the flash file system. Added in 0.0.5.
+     * 
+     * @param persistPath Path to save the measurements to, such as "/usr/locfstack.dat"
+     * @return LocationFusionRK& 
+     * 
+     * Must be called before setup()! The stack high water mark is saved whenever it increases. At setup(), if 
+     * measurements were saved with the same configuration (Wi-Fi, tower, number of handlers, encoder, and queue 
+     * settings), the stack size is set to getRecommendedStackSize() from those measurements instead of the size
+     * from withThreadStackSize(). Otherwise, the size from withThreadStackSize() is used for the first run.
+     * 
+     * Nothing is saved for a configuration until a loc event has been published and, if enabled, a sample with Wi-Fi,
+     * a location from the loc-enhanced cache, and a batch have been processed. Only measured code paths are included
+     * otherwise. If your add to event handlers sometimes use much more stack, such as only when GNSS has a fix, make 
+     * sure that happens before relying on this, or use withThreadStackSize().
+     */
+    LocationFusionRK &withAutoThreadStackSize(const char *persistPath) { stackPersistPath = persistPath; return *this; };
+
+    /**
+     * @brief Get the maximum stack used by the worker thread in bytes. Added in 0.0.5.
+     */
+    size_t getStackHighWaterMark() const { return workerStackMonitor.getHighWaterMark(); };
+
+    /**
+     * @brief Get the maximum stack used by the Wi-Fi scan thread in bytes, or 0 if it is not used. Added in 0.0.5.
+     */
+    size_t getScanStackHighWaterMark() const { return scanStackMonitor.getHighWaterMark(); };
+
+    /**
+     * @brief Get the worker thread stack size in bytes. Added in 0.0.5.
+     * 
+     * This is the value passed to withThreadStackSize() unless withAutoThreadStackSize() selected a different size.
+     */
+    size_t getThreadStackSize() const { return threadStackSize; };
+
+    /**
+     * @brief Get the recommended worker thread stack size based on the high water mark. Added in 0.0.5.
+     * 
+     * @return size_t 125% of the high water mark plus 256 bytes, rounded up to a multiple of 256 and at least 2048
+     */
+    size_t getRecommendedStackSize() const { return StackMonitor::getRecommendedSize(getStackHighWaterMark()); };
+
+    /**
+     * @brief Get the change in free heap over the last publish cycle in bytes. Positive values are a decrease. Added in 0.0.5.
+     * 
+     * The cycle is from taking the sample until the worker thread returns to waiting for the next one. Other threads
+     * allocating or freeing memory during the cycle are included.
+     */
+    int32_t getLastCycleHeapGrowth() const { return lastCycleHeapGrowth; };
+
+    /**
+     * @brief Get the largest amount of heap used during a publish cycle in bytes. Added in 0.0.5.
+     * 
+     * This is the largest decrease in free memory from the start of a cycle, sampled at each state change.
+     */
+    uint32_t getMaxCycleHeapUsage() const { return maxCycleHeapUsage; };
+
+    /**
+     * @brief Write the stack and heap measurements as a JSON object. Added in 0.0.5.
+     * 
+     * @param writer 
+     * 
+     * The keys are stack (worker thread stack size), stack_hwm, stack_rec (recommended size), scan_stack_hwm, 
+     * heap_growth, and heap_max, all in bytes. On Wi-Fi devices, scans, scan_reused, and scan_ms from 
+     * getScanStats() are also included.
+     */
+    void writeResourceStats(JSONWriter &writer) const;
+
+    /**
+     * @brief Request a publish now
+     * 
+     * Works in all modes (manual, once, and periodic). Can be called when offline; it will only be calculated
+     * when connected to the cloud (breathing cyan).
+     */
+    void requestPublish() { manualPublishRequested = true; wake(); };
+
+    /**
+     * @brief Request a publish now, optionally with high priority. Added in 0.0.5.
+     * 
+     * @param highPriority If true, the publish is not delayed by the publish scheduler after a failure
+     * 
+     * Used for geofence transitions.
+     */
+    void requestPublish(bool highPriority) { if (highPriority) { priorityPublishRequested = true; } requestPublish(); };
+
+#if LOCATIONFUSIONRK_GEOFENCES
+    /**
+     * @brief Enable geofence evaluation. Default is disabled. Added in 0.0.5.
+     * 
+     * @param publishOnTransition If true, request a high priority publish on each enter or exit transition
+     * @param maxAccuracy Locations with an accuracy worse than this, in meters, are not evaluated. Default is 100.
+     * @return LocationFusionRK& 
+     * 
+     * Add fences using getGeofences(). Each GNSS location, loc-enhanced result, and location from the loc-enhanced 
+     * cache or on-device Wi-Fi positioning is evaluated. Using publishOnTransition with withPublishManual() publishes
+     * only when entering or leaving a zone.
+     * 
+     * Enabling this requests loc-enhanced on-device, which uses an additional data operation per publish.
+     */
+    LocationFusionRK &withGeofences(bool publishOnTransition = true, int maxAccuracy = 100) { geofencesEnabled = true; geofencePublish = publishOnTransition; geofenceMaxAccuracy = maxAccuracy; return *this; };
+
+    /**
+     * @brief Add a handler called on each geofence transition. Added in 0.0.5.
+     * 
+     * @param handler Function to call, prototype: void handler(const LocationFusionRK::Geofences::Event &event, double lat, double lon)
+     * @return LocationFusionRK& 
+     * 
+     * The handler is called from the location fusion worker thread.
+     */
+    LocationFusionRK &withGeofenceHandler(std::function<void(const Geofences::Event &event, double lat, double lon)> handler) { geofenceHandlers.add(handler); return *this; };
+
+    /**
+     * @brief Get the geofences. Added in 0.0.5.
+     * 
+     * @return Geofences& 
+     * 
+     * Fences are evaluated on the worker thread, so after setup() change them with the lock held, using
+     * `WITH_LOCK(LocationFusionRK::instance())`.
+     */
+    Geofences &getGeofences() { return geofences; };
+#endif // LOCATIONFUSIONRK_GEOFENCES
+
+    /**
+     * @brief Get the number of times the worker thread has woken up. Added in 0.0.5.
+     * 
+     * @return uint32_t 
+     * 
+     * The worker thread blocks until there is something to do, such as the next publish time, a requested publish, 
+     * a cloud connection change, a publish completing, or loc-enhanced being received. This counter can be used
+     * to measure how often it runs.
+     */
+    uint32_t getWakeCount() const { return wakeCount; };
+
+
+    /**
+     * @brief Get the current status of the library (idle, publishing, etc.)
+     * 
+     * @return Status 
+     * 
+     * This method is used for polling. The be called when the status changes, see withStatusHandler.
+     */
+    Status getStatus() const { return status; };
+
+    /**
+     * @brief Value returned by getNextWakeMs() when nothing is scheduled. Added in 0.0.5.
+     */
+    static const uint64_t NO_WAKE_MS = UINT64_MAX;
+
+    /**
+     * @brief Get when the library next needs to run, for sleep scheduling. Added in 0.0.5.
+     * 
+     * @return uint64_t A System.millis() value. A value at or before the current time (including 0) means 
+     * the library is busy or has something to do now. NO_WAKE_MS means nothing is scheduled, such as in 
+     * manual publish mode with no publish requested.
+     * 
+     * This is the earliest of the next periodic publish or retry, a requested publish, a loc-enhanced response
+     * timeout, a batch reaching its maximum age, and the next offline queue upload. While the cloud is disconnected,
+     * anything that needs to be published is retried after the publish failure retry time (default: 1 minute) 
+     * instead, so the device can wake up to reconnect. It is updated by the worker thread each time it blocks, 
+     * and can be called from any thread. Until the worker thread has run, it is 0.
+     */
+    uint64_t getNextWakeMs();
+
+    /**
+     * @brief Set the sleep duration to wake up when the library next needs to run. Added in 0.0.5.
+     * 
+     * @param config Sleep configuration to set the duration of. Other settings, such as the sleep mode and
+     * network standby, are not changed.
+     * @param minDuration Do not sleep if the next wake is sooner than this
+     * @return true to sleep, false if the library needs to run before minDuration
+     * 
+     * If nothing is scheduled (getNextWakeMs() returns NO_WAKE_MS), true is returned and the duration of config
+     * is not changed. This happens in manual publish mode with no publish requested, and in publish once mode
+     * after the publish. Make sure config has another wake source, such as a pin or a duration set by the application. The periodic publish happens after waking and reconnecting to the cloud, so it is 
+     * late by the connection time. Call resumeAfterSleep() after System.sleep() returns:
+     * 
+     * ```
+     * SystemSleepConfiguration config;
+     * config.mode(SystemSleepMode::ULTRA_LOW_POWER);
+     * if (LocationFusionRK::instance().prepareSleep(config)) {
+     *     System.sleep(config);
+     *     LocationFusionRK::instance().resumeAfterSleep();
+     * }
+     * ```
+     */
+    bool prepareSleep(SystemSleepConfiguration &config, std::chrono::milliseconds minDuration = 1s);
+
+    /**
+     * @brief Call after waking from a sleep mode that continues execution (STOP or ULTRA_LOW_POWER). Added in 0.0.5.
+     * 
+     * The state machine keeps its state while sleeping. This wakes the worker thread so deadlines that passed 
+     * while sleeping, such as the next publish, are handled now. HIBERNATE restarts the device, so it does not
+     * apply.
+     */
+    void resumeAfterSleep() { wake(); };
+
+    /**
+     * @brief Locks the mutex that protects shared resources
+     * 
+     * This is compatible with `WITH_LOCK(*this)`.
+     * 
+     * The mutex is not recursive so do not lock it within a locked section.
+     */
+    void lock() { os_mutex_lock(mutex); };
+
+    /**
+     * @brief Attempts to lock the mutex that protects shared resources
+     * 
+     * @return true if the mutex was locked or false if it was busy already.
+     */
+    bool tryLock() { return os_mutex_trylock(mutex); };
+
+    /**
+     * @brief Unlocks the mutex that protects shared resources
+     */
+    void unlock() { os_mutex_unlock(mutex); };
+
+protected:
+
+    /**
+     * @brief The constructor is protected because the class is a singleton
+     * 
+     * Use LocationFusionRK::instance() to instantiate the singleton.
+     */
+    LocationFusionRK();
+
+    /**
+     * @brief The destructor is protected because the class is a singleton and cannot be deleted
+     */
+    virtual ~LocationFusionRK();
+
+    /**
+     * This class is a singleton and cannot be copied
+     */
+    LocationFusionRK(const LocationFusionRK&) = delete;
+
+    /**
+     * This class is a singleton and cannot be copied
+     */
+    LocationFusionRK& operator=(const LocationFusionRK&) = delete;
+
+    /**
+     * @brief Update the status and call the status handlers. Used internally. Added in 0.0.3.
+     * 
+     * @param status 
+     * 
+     * This only calls the status handlers if the status changes.
+     */
+    void updateStatus(Status status);
+
+    /**
+     * @brief Worker thread function
+     * 
+     * This method is called to perform operations in the worker thread.
+     * 
+     * You generally will not return from this method.
+     */
+    os_thread_return_t threadFunction(void);
+
+    /**
+     * @brief Wake the worker thread so the state handler runs now. Added in 0.0.5.
+     * 
+     * Can be called from any thread, including the system thread. Does nothing if setup() has not been called.
+     */
+    void wake();
+
+    /**
+     * @brief Called from a state handler to block the worker thread for up to ms milliseconds. Added in 0.0.5.
+     * 
+     * @param ms Maximum time to wait. The thread may be woken up sooner by wake().
+     * 
+     * If a state handler does not call this, the state handler (or the new state handler) is called again immediately.
+     * The time is limited to maxWaitMs so the state is always rechecked periodically.
+     */
+    void waitFor(uint64_t ms);
+
+    /**
+     * @brief Calculate the earliest time the worker thread needs to run. Added in 0.0.5.
+     * 
+     * @return uint64_t A System.millis() value, or NO_WAKE_MS. See getNextWakeMs().
+     * 
+     * Called on the worker thread from waitFor().
+     */
+    uint64_t calculateNextWakeMs() const;
+
+    /**
+     * @brief Called from System.on(cloud_status) to wake the worker thread when the cloud connection changes
+     * 
+     * @param event 
+     * @param param 
+     */
+    static void cloudStatusHandlerStatic(system_event_t event, int param);
+
+    /**
+     * @brief Called when the status of the loc event changes to wake the worker thread. Added in 0.0.5.
+     * 
+     * A function without captures, so setting it for each publish does not allocate.
+     * 
+     * @param event 
+     */
+    static void eventStatusChangeStatic(CloudEvent event);
+
+#if Wiring_WiFi 
+    /**
+     * @brief Wi-Fi scan thread function. Added in 0.0.5.
+     * 
+     * Waits for a request on scanQueue, scans into scanThreadList, then clears scanBusy and wakes the worker thread.
+     */
+    os_thread_return_t scanThreadFunction(void);
+
+    /**
+     * @brief Scan for the loc event using getRecentScan() and record the latency if a scan was made. Added in 0.0.5.
+     * 
+     * @param list wapList when called from the worker thread, scanThreadList when called from the scan thread
+     */
+    void scanForEvent(WAPList &list);
+#endif // Wiring_WiFi 
+
+    /**
+     * @brief Internal state handler for idle and not connected to the cloud
+     * 
+     * Waits until the cloud connection status changes.
+     * 
+     * Exit conditions: 
+     * - Particle.connected() return true -> stateConnected
+     */
+    void stateIdle();
+
+    /**
+     * @brief Internal state handler for connected to the cloud
+     * 
+     * Exit conditions: 
+     * - Particle.connected() return false -> stateIdle
+     * - It's time to publish a location -> stateBuildPublish
+     */
+    void stateConnected();
+
+    /**
+     * @brief Internal state handler for starting to build a publish
+     * 
+     * Starts the Wi-Fi scan on the scan thread, then gets the towers on the worker thread while the scan runs. 
+     * 
+     * May be in this state for a while, but the state handlers are run from a worker thread so 
+     * it won't affect operation of the rest of the system typically.
+     * 
+     * Exit conditions: 
+     * - Always -> stateAcquireWait
+     */
+    void stateBuildPublish();
+
+    /**
+     * @brief Internal state handler for waiting for the Wi-Fi scan, then building and publishing the event. Added in 0.0.5.
+     * 
+     * If the scan does not complete within acquisitionTimeout, the event is built without Wi-Fi. The add to
+     * event handlers are called after the scan, with the library's data already in the event.
+     * 
+     * Exit conditions: 
+     * - When publish begins -> statePublishWait
+     * - When suppressed by change detection or found in the loc-enhanced cache -> stateConnected
+     */
+    void stateAcquireWait();
+
+    /**
+     * @brief Build the loc event using a Variant tree. Used internally from stateAcquireWait.
+     * 
+     * @param reqId The req_id for this loc event
+     * 
+     * The data is stored in eventData.
+     */
+    void buildEventVariant(int reqId);
+
+    /**
+     * @brief Add the library's keys (time, Wi-Fi, towers, and lck) to eventData and locVariant. Added in 0.0.5.
+     * 
+     * Called from buildEventVariant() before the data from the add to event handlers is merged in.
+     */
+    void addEventKeys();
+
+    /**
+     * @brief Build the loc event using the streaming encoder. Used internally from stateAcquireWait. Added in 0.0.5.
+     * 
+     * @param reqId The req_id for this loc event
+     * @return size_t The size of the JSON in streamingBuffer, or 0 if it did not fit in the buffer
+     */
+    size_t buildEventStreaming(int reqId);
+
+    /**
+     * @brief Publish event, which must already have its name and data set, and go into statePublishWait. Added in 0.0.5.
+     */
+    void publishEvent();
+
+    /**
+     * @brief Returns true if the batched samples should be published now. Added in 0.0.5.
+     */
+    bool isBatchReady() const;
+
+    /**
+     * @brief Publish as many batched samples as fit in one event. Added in 0.0.5.
+     */
+    void publishBatch();
+
+    /**
+     * @brief Save the acquired data to the offline queue. Used internally from stateAcquireWait. Added in 0.0.5.
+     */
+    void queueOfflineSample();
+
+    /**
+     * @brief Publish as many offline queue samples as fit in one event. Added in 0.0.5.
+     */
+    void publishOfflineQueue();
+
+    /**
+     * @brief Encode the acquired data as an offline queue record. Added in 0.0.5.
+     * 
+     * @param buf Buffer to write to
+     * @param bufSize Size of buf
+     * @return size_t Number of bytes used in buf
+     * 
+     * Format (little endian): version (1, currently 2), flags (1, bit 0 = time), number of access points (1), 
+     * number of towers (1), time (4), then the TowerEntry compact records (20 each), then the WAPEntry
+     * structures (8 each), then the JSON of the add to event handler outer and loc data, each preceded by a
+     * 2-byte length.
+     */
+    size_t encodeOfflineRecord(uint8_t *buf, size_t bufSize) const;
+
+    /**
+     * @brief Decode an offline queue record into a loc sample. Added in 0.0.5.
+     * 
+     * @param buf Record from encodeOfflineRecord()
+     * @param size Size of the record
+     * @param reqId req_id to put in the sample
+     * @param sample Filled in with the loc sample
+     * @return true if the record was valid
+     * 
+     * Version 1 records from earlier 0.0.5 builds, which have flag bit 1 set and a 12-byte serving tower
+     * (mcc, mnc, lac, cid) instead of TowerEntry records, are also accepted.
+     */
+    bool decodeOfflineRecord(const uint8_t *buf, size_t size, int reqId, Variant &sample) const;
+
+    /**
+     * @brief Set nextPublishMs using the publish scheduler. Added in 0.0.5.
+     * 
+     * @param event What just happened
+     */
+    void schedulePublish(ScheduleEvent event);
+
+    /**
+     * @brief Add a duration to a latency histogram. Added in 0.0.5.
+     * 
+     * @param stage 
+     * @param startUs Value of micros() at the start
+     */
+    void recordLatency(LatencyStage stage, unsigned long startUs) { latencyHistograms[(size_t)stage].add((uint32_t)(micros() - startUs)); };
+
+    /**
+     * @brief Publish the latency stats requested by the loc-stats cmd. Added in 0.0.5.
+     */
+    void publishStats();
+
+    /**
+     * @brief Write the keys for writeLatencyStats() to a writer that already has an object open. Added in 0.0.5.
+     */
+    void writeLatencyStatsKeys(JSONWriter &writer) const;
+
+    /**
+     * @brief Sample free memory for the heap statistics. Added in 0.0.5.
+     * 
+     * @param endOfCycle true at the end of the publish cycle
+     */
+    void sampleHeap(bool endOfCycle = false);
+
+    /**
+     * @brief Get a value identifying the configuration options that affect stack usage. Added in 0.0.5.
+     */
+    uint32_t getStackConfigHash() const;
+
+    /**
+     * @brief Load the stack measurements and set threadStackSize. Used internally from setup(). Added in 0.0.5.
+     */
+    void loadStackSize();
+
+    /**
+     * @brief Save the stack measurements if the high water mark increased. Added in 0.0.5.
+     * 
+     * The first measurement for a configuration is only saved after each of the code paths it enables (Wi-Fi, 
+     * the loc-enhanced cache, and batching) has run, so the stack is not sized from cycles that skipped them.
+     */
+    void saveStackSize();
+
+    /**
+     * @brief Get the STACK_PATH_* bits for the code paths the configuration enables. Added in 0.0.5.
+     */
+    uint32_t getRequiredStackPaths() const;
+
+    /**
+     * @brief Limit a wait time so the worker thread wakes up when the offline queue can be published. Added in 0.0.5.
+     * 
+     * @param ms Time to wait in milliseconds
+     * @return uint64_t ms or less
+     */
+    uint64_t limitWaitForOfflineQueue(uint64_t ms) const;
+
+    /**
+     * @brief Copy-on-write list of handlers, so handlers can be added while another thread calls them. Added in 0.0.5.
+     * 
+     * Adding a handler copies the list, adds to the copy, and swaps the pointer with the mutex locked. Callers 
+     * take a snapshot using get(), which only increments a reference count, and call the handlers without the 
+     * lock. A handler can add handlers, and a list being iterated is never modified.
+     */
+    template<class T>
+    class HandlerList {
+    public:
+        /**
+         * @brief Constructor
+         * 
+         * @param mutex Pointer to the mutex of the LocationFusionRK object, which is not created until setup()
+         */
+        explicit HandlerList(os_mutex_t *mutex) : mutex(mutex), list(std::make_shared<std::vector<T>>()) {};
+
+        /**
+         * @brief Add a handler to the end of the list
+         */
+        void add(const T &handler) { update([&handler](std::vector<T> &handlers) { handlers.push_back(handler); }); };
+
+        /**
+         * @brief Modify a copy of the list, then replace the list with the copy
+         * 
+         * @param fn Function that modifies the list
+         */
+        void update(std::function<void(std::vector<T> &handlers)> fn) {
+            lock();
+            std::shared_ptr<std::vector<T>> newList = std::make_shared<std::vector<T>>(*list);
+            fn(*newList);
+            list = newList;
+            unlock();
+        };
+
+        /**
+         * @brief Get a snapshot of the list. Keep it in a local variable while iterating.
+         */
+        std::shared_ptr<const std::vector<T>> get() const {
+            lock();
+            std::shared_ptr<const std::vector<T>> result = list;
+            unlock();
+            return result;
+        };
+
+        /**
+         * @brief Number of handlers
+         */
+        size_t size() const { return get()->size(); };
+
+        /**
+         * @brief Returns true if there are no handlers
+         */
+        bool empty() const { return size() == 0; };
+
+    protected:
+        void lock() const { if (*mutex) { os_mutex_lock(*mutex); } }; //!< Lock the mutex, if created
+        void unlock() const { if (*mutex) { os_mutex_unlock(*mutex); } }; //!< Unlock the mutex, if created
+
+        os_mutex_t *mutex; //!< Mutex of the LocationFusionRK object
+        std::shared_ptr<const std::vector<T>> list; //!< The current list, never modified after it's set
+    };
+
+    /**
+     * @brief This class is used internally for registerCommand
+     */
+    struct CmdHandler {
+        String cmd; //!< The code that matches the cmd field within the JSON body
+        std::function<void(const Variant &data)> handler; //!< Function to call if cmd matches
+    };
+
+    /**
+     * @brief Modify config with the mutex locked. Added in 0.0.5.
+     * 
+     * @param fn Function that modifies the config
      * @return LocationFusionRK& 
      * 
-     * The "add to event" handler allows you to add data to the loc event. You might do this if you want to
-     * support a cellular modem that has built-in GNSS, or use an external GNSS receiver.
+     * Sets configChanged and wakes the worker thread, which applies the change using applyConfig().
+     */
+    LocationFusionRK &updateConfig(std::function<void(Config &config)> fn);
+
+    /**
+     * @brief Copy config to activeConfig if it has changed. Called from the worker thread. Added in 0.0.5.
+     * 
+     * The change is deferred while a Wi-Fi scan from an earlier sample is running, because the scan uses the 
+     * access point limits.
+     */
+    void applyConfig();
+
+    /**
+     * @brief Returns true if tower information should be added to the current sample. Added in 0.0.5.
+     */
+    bool isTowerListValid() const { return activeConfig.addTower && towerResult == SYSTEM_ERROR_NONE && towerList.size() != 0; };
+
+    /**
+     * @brief Build a fingerprint from wapList and towerList. Added in 0.0.5.
+     * 
+     * @param fingerprint Filled in with the current radio environment
+     * @param maxBssids Maximum number of BSSIDs to include. The strongest are used.
+     */
+    void buildFingerprint(RadioFingerprint &fingerprint, size_t maxBssids = RadioFingerprint::MAX_BSSIDS) const;
+
+    /**
+     * @brief Update the state after a successful publish (or a loc-enhanced cache hit). Added in 0.0.5.
+     * 
+     * Updates manualPublishRequested, publishCount, nextPublishMs, and the published fingerprint.
+     */
+    void recordPublishSuccess();
+
+    /**
+     * @brief Returns true if change detection determines this publish can be skipped. Added in 0.0.5.
+     * 
+     * Sets lastSimilarity.
+     */
+    bool shouldSuppressPublish();
+
+    /**
+     * @brief Returns true if loc-enhanced should be sent back to the device. Added in 0.0.5.
+     * 
+     * This is the case if there are loc-enhanced or loc-enhanced result handlers, or the loc-enhanced cache, on-device Wi-Fi positioning, 
+     * the fusion filter, or geofences are enabled.
+     */
+    bool wantLocEnhanced() const;
+
+    /**
+     * @brief Returns true if locations should be passed to processLocation(). Added in 0.0.5.
+     * 
+     * This is the case if the fusion filter or geofences are enabled.
+     */
+    bool wantLocations() const;
+
+    /**
+     * @brief Check the loc-enhanced cache and call the loc-enhanced handlers if found. Added in 0.0.5.
+     * 
+     * @param reqId The req_id for this loc event
+     * @return true if found in the cache
+     */
+    bool serveFromLocCache(int reqId);
+
+    /**
+     * @brief Call the loc-enhanced handlers with a location determined on-device. Added in 0.0.5.
+     * 
+     * @param lat Latitude in degrees
+     * @param lon Longitude in degrees
+     * @param hAcc Horizontal accuracy in meters
+     * @param reqId The req_id for this loc event
+     * @param sourceKey Key set to true in the outer object to indicate where the location came from, such as "cached"
+     */
+    void callLocEnhancedHandlers(double lat, double lon, int hAcc, int reqId, const char *sourceKey);
+
+    /**
+     * @brief Process a new location: add it to the fusion filter and evaluate the geofences, if enabled. Added in 0.0.5.
+     * 
+     * @param lat Latitude in degrees
+     * @param lon Longitude in degrees
+     * @param hAcc Horizontal accuracy in meters
+     * @param source Source of the location
+     */
+    void processLocation(double lat, double lon, float hAcc, FusionSource source);
+
+    /**
+     * @brief Process the GNSS location from the add to event handlers in locVariant, if any. Added in 0.0.5.
+     */
+    void processGnssLocation();
+
+    /**
+     * @brief State of an entry in locRequests
+     */
+    enum class LocRequestState : uint8_t {
+        free = 0, //!< Entry is not in use
+        publishing, //!< The loc event is being published. A response can arrive before the publish completes.
+        pending, //!< Published, waiting for loc-enhanced
+        received //!< loc-enhanced received by locEnhanced(), not yet processed by the worker thread
+    };
+
+    /**
+     * @brief A loc event waiting for loc-enhanced. Added in 0.0.5.
+     * 
+     * Contains what the worker thread needs to process the response after later samples have replaced the
+     * Wi-Fi scan and cache key.
+     */
+    struct LocRequest {
+        int reqId = 0; //!< req_id in the loc event
+        LocRequestState state = LocRequestState::free; //!< Entry state
+        bool hasGnss = false; //!< Sample had a GNSS location, so loc-enhanced is not added to the fusion filter
+        bool hasCacheKey = false; //!< cacheKey is valid
+        uint32_t cacheKey = 0; //!< loc-enhanced cache key for the sample
+        uint64_t requestMs = 0; //!< System.millis() when the sample was taken
+        uint64_t deadlineMs = 0; //!< System.millis() when the request times out
+        unsigned long publishUs = 0; //!< micros() when the loc event was published
+        unsigned long receivedUs = 0; //!< micros() when loc-enhanced was received
+        double lat = 0.0; //!< Received latitude
+        double lon = 0.0; //!< Received longitude
+        int hAcc = -1; //!< Received horizontal accuracy, or -1 if the response did not contain a location
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+        uint8_t numBssids = 0; //!< Number of entries in bssidKeys
+        uint64_t bssidKeys[WiFiPositionIndex::MAX_SCAN_ENTRIES]; //!< Access points to learn, if Wi-Fi positioning is enabled
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+    };
+
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+    /**
+     * @brief Estimate the position on-device and call the loc-enhanced handlers if successful. Added in 0.0.5.
+     * 
+     * @param reqId The req_id for this loc event
+     * @return true if there is a local fix
+     */
+    bool serveFromWiFiPosition(int reqId);
+
+    /**
+     * @brief Add the access points from a request to the index at the received loc-enhanced location. Added in 0.0.5.
+     * 
+     * @param request Request with a received location
+     */
+    void learnWiFiPosition(const LocRequest &request);
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
+
+    /**
+     * @brief Fill in pendingLocRequest for the sample being published. Added in 0.0.5.
+     * 
+     * @param reqId The req_id for this loc event
+     */
+    void initPendingLocRequest(int reqId);
+
+    /**
+     * @brief Add a request to locRequests before its loc event is published. Added in 0.0.5.
+     * 
+     * @param request The request. The state and publish time are set by this method.
+     * @return true if added, false if there are already maxLocRequests in flight
+     * 
+     * Requests are added before calling Particle.publish() so a response that arrives before the worker thread
+     * sees the publish complete is matched. Call endLocRequestPublish() when the publish completes.
+     */
+    bool addLocRequest(const LocRequest &request);
+
+    /**
+     * @brief Start the timeouts of the requests being published, or remove them if the publish failed. Added in 0.0.5.
+     * 
+     * @param published true if the publish succeeded
+     * 
+     * Also updates nextLocDeadlineMs.
+     */
+    void endLocRequestPublish(bool published);
+
+    /**
+     * @brief Process received and timed out requests in locRequests. Called from the worker thread. Added in 0.0.5.
+     * 
+     * Also updates nextLocDeadlineMs.
+     */
+    void processLocRequests();
+
+    /**
+     * @brief Handle a completed or timed out request. Added in 0.0.5.
+     * 
+     * @param request The request, no longer in locRequests
+     * 
+     * Updates the latency histogram, loc-enhanced cache, Wi-Fi position index, and fusion filter, and calls
+     * the loc-enhanced result handlers.
+     */
+    void completeLocRequest(const LocRequest &request);
+
+    /**
+     * @brief Internal state handler for waiting for the publish to complete
+     * 
+     * Exit conditions: 
+     * - When publish completes -> stateConnected if not receiving loc-enhanced on-device
+     *                          -> stateLocEnhancedWait if receiving loc-enhanced on-device
+     * 
+     * May set
+     * - manualPublishRequested (set to false on success)
+     * - publishCount (increments on success) 
+     * - nextPublishMs set by the publish scheduler
+     */
+    void statePublishWait();
+
+    /**
+     * @brief Internal state handler for waiting for the loc-enhanced to be received
+     * 
+     * Exit conditions: 
+     * - When fewer than maxLocRequests requests are in flight (a response was received or a request timed out) -> stateConnected
+     */
+    void stateLocEnhancedWait();
+
+
+    /**
+     * @brief Called from the Particle.function handler for "cmd"
+     * 
+     * @param eventData 
+     * @return int 
      * 
-     * The handler can be a C function or C++11 lambda and has the following prototype:
+     * Calls commandHandlers, added with withCmdHandler.
+     */
+    int functionHandler(const Variant &eventData);
+
+    /**
+     * @brief Called from the Particle.function handler for "cmd" with the unparsed JSON. Added in 0.0.5.
      * 
-     * void handler(Variant &eventData, Variant &locVariant)
+     * @param json 
+     * @return int 
      * 
-     * - eventData is the whole loc event
-     * - locVariant is the Variant for the inner loc object 
+     * Finds the "cmd" value using findCmd() and only parses the JSON into a Variant if there is a handler for it.
+     */
+    int functionHandler(const char *json);
+
+    /**
+     * @brief Called from the Particle.function handler for "cmd" 
+     * 
+     * @param cmd 
+     * @return int 
+     * 
+     * Calls the non-static functionHandler with the unparsed JSON.
+     */
+    static int functionHandlerStatic(String cmd);
+
+    /**
+     * @brief Find the value of the top-level "cmd" key in a JSON object without parsing it. Added in 0.0.5.
+     * 
+     * @param json JSON object
+     * @param value Filled in with a pointer to the value within json (not null terminated)
+     * @param valueLen Filled in with the length of the value
+     * @return true if found. Returns false if not found, not a string, or contains escape sequences.
+     */
+    static bool findCmd(const char *json, const char *&value, size_t &valueLen);
+
+    /**
+     * @brief Find the range of commandHandlers matching a cmd. Added in 0.0.5.
+     * 
+     * @param handlers Snapshot of commandHandlers
+     * @param cmd cmd value, does not need to be null terminated
+     * @param cmdLen length of cmd
+     * @return std::pair<size_t, size_t> Index of the first match and one past the last match
+     */
+    static std::pair<size_t, size_t> findCmdHandlers(const std::vector<CmdHandler> &handlers, const char *cmd, size_t cmdLen);
+
+    /**
+     * @brief Called when a "loc-enhanced" cmd function is received
+     * 
+     * @param eventData 
+     * 
+     * Matches the response to a request in locRequests by req_id, wakes the worker thread, and calls locEnhancedHandlers.
+     */
+    void locEnhanced(const Variant &eventData);
+
+
+    /**
+     * @brief Called when a "loc-enhanced" cmd function is received
+     * 
+     * @param eventData 
+     * 
+     * This just calls the non-static method with the singleton instance.
+     */
+    static void locEnhancedStatic(const Variant &eventData);
+
+    /**
+     * @brief Mutex to protect shared resources
+     * 
+     * This is initialized in setup() so make sure you call the setup() method from the global application setup.
+     */
+    os_mutex_t mutex = 0;
+
+    /**
+     * @brief Worker thread instance class
+     * 
+     * This is initialized in setup() so make sure you call the setup() method from the global application setup.
+     */
+    Thread *thread = 0;
+
+#if Wiring_WiFi 
+    /**
+     * @brief Thread used to run the Wi-Fi scan concurrently with other data acquisition. Created in setup() if Wi-Fi is enabled.
+     */
+    Thread *scanThread = 0;
+
+    /**
+     * @brief Queue used to request a scan from the scan thread
+     */
+    os_queue_t scanQueue = 0;
+
+    /**
+     * @brief Size of the scan thread stack
+     */
+    static const size_t scanThreadStackSize = 3072;
+
+    /**
+     * @brief true while the scan thread is scanning. Set by the worker thread, cleared by the scan thread.
+     */
+    volatile bool scanBusy = false;
+
+    /**
+     * @brief true if wapList contains the results for the event being built
+     */
+    bool wapListValid = false;
+#endif // Wiring_WiFi 
+
+    /**
+     * @brief When data acquisition for the current publish started. Compare to System.millis().
+     */
+    uint64_t acquireStartMs = 0;
+
+    /**
+     * @brief Maximum time to wait for the Wi-Fi scan. Set using withAcquisitionTimeout().
+     */
+    std::chrono::milliseconds acquisitionTimeout = 30s;
+
+    /**
+     * @brief Queue used to wake the worker thread. Created in setup().
+     */
+    os_queue_t wakeQueue = 0;
+
+    /**
+     * @brief Time the worker thread should wait for after the state handler returns. Set using waitFor().
+     */
+    uint64_t waitMs = 0;
+
+    /**
+     * @brief Set from calculateNextWakeMs() each time the worker thread blocks. Protected by the mutex.
+     */
+    uint64_t nextWakeMs = 0;
+
+    /**
+     * @brief Maximum time the worker thread blocks, even if nothing wakes it up
+     */
+    static const uint64_t maxWaitMs = 60000;
+
+    /**
+     * @brief How often statePublishWait checks the event status, in case the status change callback is not called
+     */
+    static const uint64_t publishCheckMs = 1000;
+
+    /**
+     * @brief Number of times the worker thread has woken up
+     */
+    uint32_t wakeCount = 0;
+
+    /**
+     * @brief Size of the work thread stack. Must set before setup()
+     */
+    size_t threadStackSize = 6144;
+
+    /**
+     * @brief Stack high water mark of the worker thread
+     */
+    StackMonitor workerStackMonitor;
+
+    /**
+     * @brief Stack high water mark of the scan thread
+     */
+    StackMonitor scanStackMonitor;
+
+    /**
+     * @brief Path to save stack measurements to, or nullptr. Set using withAutoThreadStackSize().
+     */
+    const char *stackPersistPath = nullptr;
+
+    /**
+     * @brief Worker thread high water mark last saved to stackPersistPath
+     */
+    size_t savedStackHighWaterMark = 0;
+
+    static const uint32_t STACK_PATH_PUBLISH = 0x01; //!< A loc event was published
+    static const uint32_t STACK_PATH_WIFI = 0x02; //!< A sample included Wi-Fi access points
+    static const uint32_t STACK_PATH_LOC_CACHE = 0x04; //!< A location was served from the loc-enhanced cache
+    static const uint32_t STACK_PATH_BATCH = 0x08; //!< A batch of samples was published
+
+    /**
+     * @brief STACK_PATH_* bits for the code paths that have run on the worker thread since boot
+     */
+    uint32_t stackPathsRun = 0;
+
+    /**
+     * @brief Free memory at the start of the current publish cycle, or 0 if not in a cycle
+     */
+    uint32_t cycleStartFreeMemory = 0;
+
+    /**
+     * @brief Lowest free memory sampled during the current publish cycle
+     */
+    uint32_t cycleMinFreeMemory = 0;
+
+    /**
+     * @brief Change in free memory over the last publish cycle, positive is a decrease
+     */
+    int32_t lastCycleHeapGrowth = 0;
+
+    /**
+     * @brief Largest decrease in free memory from the start of a publish cycle
+     */
+    uint32_t maxCycleHeapUsage = 0;
+
+    /**
+     * @brief Settings that can be changed while running, written with the mutex locked by updateConfig()
+     */
+    Config config;
+
+    /**
+     * @brief Copy of config used by the worker thread, updated by applyConfig()
+     */
+    Config activeConfig;
+
+    /**
+     * @brief Set by updateConfig() when config has changed
+     */
+    volatile bool configChanged = true;
+
+    /**
+     * @brief Handle the "loc-config" cmd. Set using withConfigCmd().
+     */
+    bool configCmd = false;
+
+    /**
+     * @brief If publish fails, how long to wait before trying again. The location will be built again.
+     */
+    std::chrono::milliseconds publishFailureRetry = 1min;
+
+    /**
+     * @brief Scheduler used when no other scheduler is set
+     */
+    PublishScheduler defaultPublishScheduler;
+
+    /**
+     * @brief Decides when to publish next. Set using withPublishScheduler().
+     */
+    PublishScheduler *publishScheduler = &defaultPublishScheduler;
+
+    /**
+     * @brief Number of publish failures in a row
+     */
+    uint32_t consecutiveFailures = 0;
+
+    /**
+     * @brief Fingerprint of the previous sample, used to compute sampleSimilarity
+     */
+    RadioFingerprint previousFingerprint;
+
+    /**
+     * @brief Similarity of the latest sample to the previous sample, or -1.0 if unknown
+     */
+    float sampleSimilarity = -1.0;
+
+    /**
+     * @brief Amount of time to wait for loc-enhanced
+     */
+    std::chrono::milliseconds locEnhancedTimeout = 1min;
+
+    /**
+     * @brief loc-enhanced requests in flight. Accessed with the mutex locked. Sized by withMaxLocRequests() and withBatch().
+     */
+    std::vector<LocRequest> locRequests;
+
+    /**
+     * @brief Maximum number of loc-enhanced requests in flight
+     */
+    size_t maxLocRequests = 1;
+
+    /**
+     * @brief Number of entries in locRequests that are not free. Only modified by the worker thread.
+     */
+    size_t locRequestsInFlight = 0;
+
+    /**
+     * @brief System.millis() when the next request in locRequests times out, if locRequestsInFlight is not 0
+     */
+    uint64_t nextLocDeadlineMs = 0;
+
+    /**
+     * @brief Request for the sample being published
+     */
+    LocRequest pendingLocRequest;
+
+    /**
+     * @brief Handlers to call when a loc-enhanced request completes or times out
+     */
+    HandlerList<std::function<void(const LocEnhancedResult &result)>> locEnhancedResultHandlers{&mutex};
+
+    /**
+     * @brief State handler. Run from the worker thread.
+     */
+    std::function<void(LocationFusionRK &)> stateHandler = &LocationFusionRK::stateIdle;
+
+    /**
+     * @brief Vector of handlers to add more information to the location event.
+     * 
+     * Add using withAddToEventHandler(). You can add multiple handlers.
+     */
+    HandlerList<std::function<void(Variant &eventData, Variant &locVariant)>> addToEventHandlers{&mutex};
+
+    /**
+     * @brief Vector of handlers to add more information to the location event when using the streaming encoder.
      * 
+     * Add using withAddToJsonWriterHandler(). You can add multiple handlers.
+     */
+    HandlerList<std::function<void(JSONWriter &writer, bool locObject)>> addToJsonWriterHandlers{&mutex};
+
+    /**
+     * @brief Use the streaming encoder instead of Variant. Set using withStreamingEncoder().
+     */
+    bool streamingEncoder = false;
+
+    /**
+     * @brief Encoding of wps and towers. Set using withPayloadEncoding() or the loc-enc cmd.
+     */
+    volatile PayloadEncoding payloadEncoding = PayloadEncoding::json;
+
+    /**
+     * @brief Handle the "loc-enc" cmd. Set using withEncodingCmd().
+     */
+    bool encodingCmd = false;
+
+    /**
+     * @brief Buffer for the compact encoding, reused to avoid allocating each publish
+     */
+    String compactString;
+
+    /**
+     * @brief Size of streamingBuffer in bytes. Set using withStreamingEncoder().
+     */
+    size_t streamingBufferSize = 2048;
+
+    /**
+     * @brief Buffer used by the streaming encoder. Allocated in setup() if the streaming encoder is enabled.
+     */
+    char *streamingBuffer = nullptr;
+
+#if Wiring_WiFi 
+    /**
+     * @brief Access points from the last scan. This is a member so its allocation is reused across publishes.
+     */
+    WAPList wapList;
+
+    /**
+     * @brief Access points scanned by the scan thread. Only accessed by the scan thread while scanBusy is set,
+     * and by the worker thread, which copies it to wapList, when it is clear. A scan that takes longer than
+     * acquisitionTimeout therefore never changes wapList while the worker thread is using it.
+     */
+    WAPList scanThreadList;
+
+    /**
+     * @brief Serializes Wi-Fi scans and protects scanCache, scanCacheMs, and scanStats. Created in the constructor
+     * so getRecentScan() works before setup().
+     */
+    os_mutex_t scanMutex = 0;
+
+    /**
+     * @brief Entries from the last scan made by getRecentScan(), without the limits or filter of any list
+     */
+    WAPList scanCache;
+
+    /**
+     * @brief When the scan in scanCache started. Compare to System.millis(). 0 if there is no scan.
+     */
+    uint64_t scanCacheMs = 0;
+
+    /**
+     * @brief Scan counts, see getScanStats()
+     */
+    ScanStats scanStats;
+#endif // Wiring_WiFi
+
+    /**
+     * @brief Serving and neighbor towers from the last location sample. Filled in by towerProvider.
+     */
+    TowerList towerList;
+
+    /**
+     * @brief Result from the last towerProvider->getTowers() call, -1 if not called.
+     */
+    int towerResult = -1;
+
+    /**
+     * @brief Provider set using withTowerProvider(), or NULL to use the default provider.
      */
-    LocationFusionRK &withAddToEventHandler(std::function<void(Variant &eventData, Variant &locVariant)> handler) { addToEventHandlers.push_back(handler); return *this; };
-    
+    TowerProvider *towerProvider = nullptr;
 
+#if Wiring_Cellular
     /**
-     * @brief Adds a handler when the Particle function "cmd" is received.
-     * 
-     * @param cmd 
-     * @param handler 
-     * @return LocationFusionRK& 
-     * 
-     * Your handler is called when the "cmd" field within the function JSON matches.
+     * @brief Default tower provider, reports the serving tower only.
+     */
+    ServingTowerProvider servingTowerProvider;
+#endif // Wiring_Cellular
+
+    /**
+     * @brief Add a function handler for "cmd"
      * 
-     * The handler can be a C function or C++11 lambda. The prototype is:
+     * This is enabled by default and must be enabled for loc-enhanced on device to work.
      */
-    LocationFusionRK &withCmdHandler(const char *cmd, std::function<void(const Variant &data)> handler);
+    bool enableCmdFunction = true;
 
+    /**
+     * @brief Handler functions to call when a cmd Particle.function is received, sorted by cmd
+     */
+    HandlerList<CmdHandler> commandHandlers{&mutex};
 
     /**
-     * @brief Enables or disables the "cmd" function handler. Default is enabled.
-     * 
-     * @param enable 
-     * @return LocationFusionRK& 
-     * 
-     * Must be called before setup()! 
-     * 
-     * If disabled, withCmdHandler() and withLocEnhancedHandler() will not function because they require
-     * the cmd handler. 
+     * @brief Handler functions to call when loc-enhanced is received on-device.
      * 
-     * If you need to additional custom cmd handlers instead of disabling support, use `withCmdHandler()` to
-     * hook your code into this library instead of the other direction.
      */
-    LocationFusionRK &withEnableCmdFunction(bool enable) { enableCmdFunction = enable; return *this; };
+    HandlerList<std::function<void(const Variant &eventData)>> locEnhancedHandlers{&mutex};
 
+#if LOCATIONFUSIONRK_FUSION
     /**
-     * @brief Adds a handler when loc-enhanced data is calculated by the cloud.
-     * 
-     * @param handler 
-     * @return LocationFusionRK& 
-     * 
-     * The handler prototype is:
-     * 
-     * void handler(const Variant &data);
-     * 
-     * Fields typically in data in the handler:
-     * - h_acc horizontal accuracy (meters)
-     * - lat latitude
-     * - lon longitude
-     * 
-     * If you do not add a handler, the loc-enhanced data is not sent to the device. Handling loc-enhanced data locally on device adds one data operation.
+     * @brief Handler functions to call when the fusion filter is updated. Added in 0.0.5.
      */
-    LocationFusionRK &withLocEnhancedHandler(std::function<void(const Variant &data)> handler) { locEnhancedHandlers.push_back(handler); return *this; };
+    HandlerList<std::function<void(const FusedLocation &location)>> fusedLocationHandlers{&mutex};
 
     /**
-     * @brief Adds a handler when the status has changed. Added in version 0.0.3.
-     * 
-     * @param cmd 
-     * @param handler 
-     * @return LocationFusionRK& 
-     * 
-     * Your handler is called when the "cmd" field within the function JSON matches.
-     * 
-     * The handler can be a C function or C++11 lambda. The prototype is:
-     * 
-     * void handler(Status status)
-     * 
-     * - status The new status value
-     * 
-     * This method uses a callback to be notified when the status changes. It is called from the library's
-     * worker thread so you should not do anything that will block in your callback.
+     * @brief Fusion filter, updated from the worker thread. Accessed with the mutex locked.
      */
-    LocationFusionRK &withStatusHandler(const char *cmd, std::function<void(Status)> handler) { statusHandlers.push_back(handler); return *this; };
+    FusionFilter fusionFilter;
 
+    /**
+     * @brief Set using withFusion() or withFusedLocationHandler()
+     */
+    bool fusionEnabled = false;
+#endif // LOCATIONFUSIONRK_FUSION
 
     /**
-     * @brief Sets the worker thread stack size. Must be set before setup()
-     * 
-     * @param size in bytes. The default if you do not call this is 6144
-     * @return LocationFusionRK& 
-     * 
-     * Prior to version 0.0.4 the stack was 3072 bytes, but it was increased due to SOS+13 on b5som devices. You can further
-     * customize the size by calling this method prior to setup().
+     * @brief The current sample has a GNSS location from an add to event handler, set by processGnssLocation()
      */
-    LocationFusionRK &withThreadStackSize(size_t size) { threadStackSize = size; return *this; };
+    bool sampleHasGnss = false;
 
+#if LOCATIONFUSIONRK_GEOFENCES
     /**
-     * @brief Request a publish now
-     * 
-     * Works in all modes (manual, once, and periodic). Can be called when offline; it will only be calculated
-     * when connected to the cloud (breathing cyan).
+     * @brief Geofences, evaluated from the worker thread with the mutex locked
      */
-    void requestPublish() { manualPublishRequested = true; };
+    Geofences geofences;
 
+    /**
+     * @brief Transitions from the last evaluation, reused to avoid allocating
+     */
+    std::vector<Geofences::Event> geofenceEvents;
 
     /**
-     * @brief Get the current status of the library (idle, publishing, etc.)
-     * 
-     * @return Status 
-     * 
-     * This method is used for polling. The be called when the status changes, see withStatusHandler.
+     * @brief Handler functions to call on geofence transitions
      */
-    Status getStatus() const { return status; };
+    HandlerList<std::function<void(const Geofences::Event &event, double lat, double lon)>> geofenceHandlers{&mutex};
+
+    bool geofencesEnabled = false; //!< Set using withGeofences()
+    bool geofencePublish = true; //!< Request a publish on transitions
+    int geofenceMaxAccuracy = 100; //!< Maximum accuracy in meters of locations to evaluate
+#endif // LOCATIONFUSIONRK_GEOFENCES
 
     /**
-     * @brief Locks the mutex that protects shared resources
-     * 
-     * This is compatible with `WITH_LOCK(*this)`.
-     * 
-     * The mutex is not recursive so do not lock it within a locked section.
+     * @brief Set by requestPublish(true), cleared when the publish succeeds. Skips the failure backoff.
      */
-    void lock() { os_mutex_lock(mutex); };
+    volatile bool priorityPublishRequested = false;
 
     /**
-     * @brief Attempts to lock the mutex that protects shared resources
+     * @brief true when a manual publish has been requested
      * 
-     * @return true if the mutex was locked or false if it was busy already.
+     * This can be requested when offline as it will be handled when online. This can also
+     * be used in once and periodic modes to publish npw, out of schedule.
      */
-    bool tryLock() { return os_mutex_trylock(mutex); };
+    bool manualPublishRequested = false;
 
     /**
-     * @brief Unlocks the mutex that protects shared resources
+     * @brief Number of successful publishes. THis is used to handle once mode.
      */
-    void unlock() { os_mutex_unlock(mutex); };
+    int publishCount = 0;
 
-protected:
+    /**
+     * @brief Event being built or sent
+     */
+    CloudEvent event;
 
     /**
-     * @brief The constructor is protected because the class is a singleton
-     * 
-     * Use LocationFusionRK::instance() to instantiate the singleton.
+     * @brief The data payload being build for the loc event.
      */
-    LocationFusionRK();
+    Variant eventData;
 
     /**
-     * @brief The destructor is protected because the class is a singleton and cannot be deleted
+     * @brief The inner loc object being built for the loc event
      */
-    virtual ~LocationFusionRK();
+    Variant locVariant;
 
     /**
-     * This class is a singleton and cannot be copied
+     * @brief When to publish next in periodic mode. Compare to System.millis().
+     * 
+     * Since this is a uint64_t it does not roll over so comparisons are easier.
      */
-    LocationFusionRK(const LocationFusionRK&) = delete;
+    uint64_t nextPublishMs = 0;
 
     /**
-     * This class is a singleton and cannot be copied
+     * @brief When the last successful publish occurred. Compare to System.millis(). Added in 0.0.5.
      */
-    LocationFusionRK& operator=(const LocationFusionRK&) = delete;
+    uint64_t lastPublishMs = 0;
 
     /**
-     * @brief Update the status and call the status handlers. Used internally. Added in 0.0.3.
-     * 
-     * @param status 
-     * 
-     * This only calls the status handlers if the status changes.
+     * @brief Similarity threshold for change detection. 0 = disabled. Set using withChangeDetection().
      */
-    void updateStatus(Status status);
+    float changeThreshold = 0.0;
 
     /**
-     * @brief Worker thread function
-     * 
-     * This method is called to perform operations in the worker thread.
-     * 
-     * You generally will not return from this method.
+     * @brief Always publish if the last publish was at least this long ago. Set using withChangeDetection().
      */
-    os_thread_return_t threadFunction(void);
+    std::chrono::milliseconds changeMaxStaleness = 1h;
 
     /**
-     * @brief Internal state handler for idle and not connected to the cloud
-     * 
-     * Exit conditions: 
-     * - Particle.connected() return true -> stateConnected
+     * @brief Number of publishes suppressed by change detection
      */
-    void stateIdle();
+    int publishSuppressedCount = 0;
 
     /**
-     * @brief Internal state handler for connected to the cloud
-     * 
-     * Exit conditions: 
-     * - Particle.connected() return false -> stateIdle
-     * - It's time to publish a location -> stateBuildPublish
+     * @brief Similarity from the last change detection comparison
      */
-    void stateConnected();
+    float lastSimilarity = 0.0;
 
     /**
-     * @brief Internal state handler for building a publish
-     * 
-     * May be in this state for a while, but the state handlers are run from a worker thread so 
-     * it won't affect operation of the rest of the system typically.
-     * 
-     * Exit conditions: 
-     * - When publish begins -> statePublishWait
+     * @brief Fingerprint of the radio environment in the event being published
      */
-    void stateBuildPublish();
+    RadioFingerprint pendingFingerprint;
 
     /**
-     * @brief Internal state handler for waiting for the publish to complete
-     * 
-     * Exit conditions: 
-     * - When publish completes -> stateConnected if not receiving loc-enhanced on-device
-     *                          -> stateLocEnhancedWait if receiving loc-enhanced on-device
-     * 
-     * May set
-     * - manualPublishRequested (set to false on success)
-     * - publishCount (increments on success) 
-     * - nextPublishMs increased by either publishPeriod or publishFailureRetry
+     * @brief Fingerprint of the radio environment in the last successfully published event
      */
-    void statePublishWait();
+    RadioFingerprint publishedFingerprint;
 
     /**
-     * @brief Internal state handler for waiting for the loc-enhanced to be received
-     * 
-     * Exit conditions: 
-     * - When loc-enhanced is received or times out  -> stateConnected
+     * @brief Cache of loc-enhanced results
      */
-    void stateLocEnhancedWait();
+    LocCache locCache;
 
+    /**
+     * @brief Do not publish when found in the loc-enhanced cache. Set using withLocCache().
+     */
+    bool locCacheSkipCloud = true;
 
+#if Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
     /**
-     * @brief Called from the Particle.function handler for "cmd"
-     * 
-     * @param eventData 
-     * @return int 
-     * 
-     * Calls commandHandlers, added with withCmdHandler.
+     * @brief Index of access point locations for on-device Wi-Fi positioning. Enabled using withWiFiPositioning().
      */
-    int functionHandler(const Variant &eventData);
+    WiFiPositionIndex wifiPositionIndex;
+
+    size_t wifiPositionMinMatches = 3; //!< Minimum number of access points in the index for a local fix
+    bool wifiPositionSkipCloud = true; //!< Do not publish when there is a local fix
+    int wifiPositionMaxAccuracy = 150; //!< Maximum estimated accuracy in meters for a local fix
+    int wifiPositionLearnAccuracy = 100; //!< Maximum loc-enhanced accuracy in meters to learn from
+#endif // Wiring_WiFi && LOCATIONFUSIONRK_WIFI_POSITIONING
 
     /**
-     * @brief Called from the Particle.function handler for "cmd" 
-     * 
-     * @param cmd 
-     * @return int 
-     * 
-     * Parses cmd as JSON and the calls the non-static functionHandler.
+     * @brief Number of strongest BSSIDs used in the loc-enhanced cache key
      */
-    static int functionHandlerStatic(String cmd);
+    size_t locCacheKeyBssids = 4;
 
     /**
-     * @brief Called when a "loc-enhanced" cmd function is received
-     * 
-     * @param eventData 
-     * 
-     * Calls locEnhancedHandlers.
+     * @brief Cache key for the event being published
      */
-    void locEnhanced(const Variant &eventData);
+    uint32_t pendingCacheKey = 0;
 
+    /**
+     * @brief true if pendingCacheKey is valid. A sample with no Wi-Fi or tower has no key, as it would match every
+     * other such sample.
+     */
+    bool pendingCacheKeyValid = false;
 
     /**
-     * @brief Called when a "loc-enhanced" cmd function is received
-     * 
-     * @param eventData 
-     * 
-     * This just calls the non-static method with the singleton instance.
+     * @brief A location sample waiting to be published in a batch
      */
-    static void locEnhancedStatic(const Variant &eventData);
+    struct BatchSample {
+        int reqId; //!< req_id in the sample
+        uint64_t sampleMs; //!< When the sample was taken. Compare to System.millis().
+        String json; //!< The sample, as a JSON object
+        LocRequest locRequest; //!< Used to track loc-enhanced for this sample
+    };
 
     /**
-     * @brief Mutex to protect shared resources
-     * 
-     * This is initialized in setup() so make sure you call the setup() method from the global application setup.
+     * @brief Publish batches when there are this many samples. 0 or 1 = batching disabled. Set using withBatch().
      */
-    os_mutex_t mutex = 0;
+    size_t batchMaxSamples = 0;
 
     /**
-     * @brief Worker thread instance class
-     * 
-     * This is initialized in setup() so make sure you call the setup() method from the global application setup.
+     * @brief Publish batches when the oldest sample is this old. 0 = no limit. Set using withBatch().
      */
-    Thread *thread = 0;
+    std::chrono::milliseconds batchMaxAge = 0ms;
 
     /**
-     * @brief Size of the work thread stack. Must set before setup()
+     * @brief Maximum event data size for batches. Set using withMaxEventSize().
      */
-    size_t threadStackSize = 6144;
+    size_t maxEventSize = 16384;
 
     /**
-     * @brief How often to publish (manual, once, periodic)
+     * @brief Samples waiting to be published, oldest first
      */
-    PublishFrequency publishFrequency = PublishFrequency::manual;
+    std::vector<BatchSample> batchSamples;
 
     /**
-     * @brief If publishing periodic, how often to publish.
+     * @brief Number of samples from the start of batchSamples in the event being published
      */
-    std::chrono::milliseconds publishPeriod = 5min;
+    size_t batchInFlight = 0;
 
     /**
-     * @brief If publish fails, how long to wait before trying again. The location will be built again.
+     * @brief The data for the batch event being published
      */
-    std::chrono::milliseconds publishFailureRetry = 1min;
+    String batchData;
 
     /**
-     * @brief Amount of time to wait for loc-enhanced
+     * @brief Queue of samples taken while not connected. Set using withOfflineQueue().
      */
-    std::chrono::milliseconds locEnhancedTimeout = 1min;
+    OfflineQueue offlineQueue;
 
     /**
-     * @brief Used to handle loc-enhanced state changes
+     * @brief Buffer of offlineQueue.getMaxDataSize() bytes, allocated in setup()
      */
-    bool locEnhancedReceived = false;
+    uint8_t *offlineBuffer = nullptr;
 
     /**
-     * @brief Used for calculating the locEnhancedTimeout
+     * @brief Minimum time between offline queue publishes. Set using withOfflineDrainInterval().
      */
-    unsigned long stateTime = 0;
+    std::chrono::milliseconds offlineDrainInterval = 2s;
 
     /**
-     * @brief State handler. Run from the worker thread.
+     * @brief Earliest time to publish the offline queue. Compare to System.millis().
      */
-    std::function<void(LocationFusionRK &)> stateHandler = &LocationFusionRK::stateIdle;
+    uint64_t nextDrainMs = 0;
 
     /**
-     * @brief When building a location publish, add Wi-Fi access point information.
-     * 
-     * Default is false, set uskng withAddWiFi().
+     * @brief Number of records from the start of offlineQueue in the event being published
      */
-    bool addWiFi = false;
+    size_t offlineInFlight = 0;
 
     /**
-     * @brief When building a location publish, add serving tower information
-     * 
-     * Default is false, set uskng withAddTower().
+     * @brief loc events contain a request ID, this is the next one to use
      */
-    bool addTower = false;
+    int locRequestId = 1;
 
     /**
-     * @brief Vector of handlers to add more information to the location event.
-     * 
-     * Add using withAddToEventHandler(). You can add multiple handlers.
+     * @brief Current status pof the library
      */
-    std::vector<std::function<void(Variant &eventData, Variant &locVariant)>> addToEventHandlers;
+    Status status = Status::idle;
 
     /**
-     * @brief Add a function handler for "cmd"
-     * 
-     * This is enabled by default and must be enabled for loc-enhanced on device to work.
+     * @brief Handlers to call when the status changes
      */
-    bool enableCmdFunction = true;
+    HandlerList<std::function<void(Status)>> statusHandlers{&mutex};
 
     /**
-     * @brief This class is used internally for registerCommand
+     * @brief Latency histograms, indexed by LatencyStage
      */
-    struct CmdHandler {
-        String cmd; //!< The code that matches the cmd field within the JSON body
-        std::function<void(const Variant &data)> handler; //!< Function to call if cmd matches
-    };
+    LatencyHistogram latencyHistograms[(size_t)LatencyStage::count];
 
     /**
-     * @brief Handler functions to call when a cmd Particle.function is received
+     * @brief micros() when the loc event was published
      */
-    std::vector<CmdHandler> commandHandlers;
+    unsigned long publishStartUs = 0;
 
     /**
-     * @brief Handler functions to call when loc-enhanced is received on-device.
-     * 
+     * @brief Respond to the loc-stats cmd. Set using withStatsCmd().
      */
-    std::vector<std::function<void(const Variant &eventData)>> locEnhancedHandlers;
+    bool statsCmd = false;
 
     /**
-     * @brief true when a manual publish has been requested
-     * 
-     * This can be requested when offline as it will be handled when online. This can also
-     * be used in once and periodic modes to publish npw, out of schedule.
+     * @brief Set by the loc-stats cmd, handled by the worker thread
      */
-    bool manualPublishRequested = false;
+    volatile bool statsRequested = false;
 
     /**
-     * @brief Number of successful publishes. THis is used to handle once mode.
+     * @brief Clear the histograms after publishing the loc-stats event
      */
-    int publishCount = 0;
+    volatile bool statsClearRequested = false;
 
     /**
-     * @brief Event being built or sent
+     * @brief Event used to publish loc-stats, separate from the loc event
      */
-    CloudEvent event;
+    CloudEvent statsEvent;
 
     /**
-     * @brief The data payload being build for the loc event.
+     * @brief Single producer, single consumer ring buffer of status changes, or nullptr. Set using withStatusQueue().
      */
-    Variant eventData;
+    Status *statusQueue = nullptr;
 
     /**
-     * @brief When to publish next in periodic mode. Compare to System.millis().
-     * 
-     * Since this is a uint64_t it does not roll over so comparisons are easier.
+     * @brief Size of statusQueue, a power of 2
      */
-    uint64_t nextPublishMs = 0;
+    size_t statusQueueSize = 0;
 
     /**
-     * @brief loc events contain a request ID, this is the next one to use
+     * @brief Number of status changes added to statusQueue. Only written by the worker thread.
      */
-    int locRequestId = 1;
+    std::atomic<uint32_t> statusQueueHead;
 
     /**
-     * @brief Current status pof the library
+     * @brief Number of status changes removed from statusQueue. Only written by the reader.
      */
-    Status status = Status::idle;
+    std::atomic<uint32_t> statusQueueTail;
 
     /**
-     * @brief Handlers to call when the status changes
+     * @brief Number of status changes discarded because statusQueue was full
      */
-    std::vector<std::function<void(Status)>> statusHandlers;
+    std::atomic<uint32_t> statusQueueOverflow;
     
 
     /**